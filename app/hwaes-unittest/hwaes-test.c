@@ -520,10 +520,16 @@ TEST_F(hwaes, SharedMemoryHandlesNumberConflict) {
                      false, UNUSED_HWAES_ERROR_CODE);
 }
 
-TEST_F(hwaes, SharedMemoryDescriptorReservedNotZero) {
-    _state->shm_descs[0].reserved = 1U;
+TEST_F(hwaes, SharedMemoryDescriptorDuplicateId) {
+    _state->cmd_hdr.num_handles = 2;
+    _state->shm_descs[0].id = 1U;
+    _state->shm_descs[1] = _state->shm_descs[0];
+    _state->req_iov.iov[2].iov_len = 2 * sizeof(struct hwaes_shm_desc);
+    _state->req_iov.total_len += sizeof(struct hwaes_shm_desc);
+    _state->req_shm.handles[1] = _state->memref;
+    _state->req_shm.num_handles = 2;
     make_bad_request(_state->hwaes_session, &_state->req_iov, &_state->req_shm,
-                     true, HWAES_ERR_IO);
+                     true, HWAES_ERR_INVALID_ARGS);
 }
 
 TEST_F(hwaes, SharedMemoryDescriptorWrongWriteFlag) {
@@ -706,6 +712,165 @@ TEST_F(hwaes, RunEncryptMany) {
 test_abort:;
 }
 
+TEST_F(hwaes, RunEncryptManyCachedSHM) {
+    int rc;
+    _state->shm_hd.id = 1U;
+    for (size_t i = 0; i < MAX_TRY_TIMES; i++) {
+        rc = hwaes_encrypt(_state->hwaes_session, &_state->args_encrypt);
+        ASSERT_EQ(NO_ERROR, rc, "encryption - in loop");
+    }
+
+    memcpy(_state->shm_base, hwaes_cbc_plaintext, sizeof(hwaes_cbc_plaintext));
+    rc = hwaes_encrypt(_state->hwaes_session, &_state->args_encrypt);
+    EXPECT_EQ(NO_ERROR, rc, "encryption - final round");
+    rc = memcmp(_state->shm_base, hwaes_cbc_ciphertext,
+                sizeof(hwaes_cbc_ciphertext));
+    EXPECT_EQ(0, rc, "wrong encryption result");
+
+    rc = hwaes_decrypt(_state->hwaes_session, &_state->args_decrypt);
+    EXPECT_EQ(NO_ERROR, rc, "decryption - cached shm");
+    rc = memcmp(_state->shm_base, hwaes_cbc_plaintext,
+                sizeof(hwaes_cbc_plaintext));
+    EXPECT_EQ(0, rc, "wrong decryption result");
+
+    rc = hwaes_release_shm(_state->hwaes_session, _state->shm_hd.id);
+    EXPECT_EQ(NO_ERROR, rc, "release cached shm");
+
+test_abort:;
+}
+
+TEST_F(hwaes, ReleaseSharedMemoryAndReuseId) {
+    int rc;
+    void* shm_base = NULL;
+    handle_t memref = INVALID_IPC_HANDLE;
+
+    _state->shm_hd.id = 1U;
+    rc = hwaes_encrypt(_state->hwaes_session, &_state->args_encrypt);
+    ASSERT_EQ(NO_ERROR, rc, "encryption - first shm");
+
+    rc = hwaes_release_shm(_state->hwaes_session, _state->shm_hd.id);
+    ASSERT_EQ(NO_ERROR, rc, "release cached shm");
+
+    /* releasing an id that is not cached succeeds */
+    rc = hwaes_release_shm(_state->hwaes_session, _state->shm_hd.id);
+    ASSERT_EQ(NO_ERROR, rc, "release unknown shm");
+
+    shm_base = memalign(PAGE_SIZE(), _state->shm_len);
+    ASSERT_NE(NULL, shm_base, "fail to allocate shared memory");
+    rc = memref_create(shm_base, _state->shm_len, PROT_READ | PROT_WRITE);
+    ASSERT_GE(rc, 0);
+    memref = (handle_t)rc;
+    memset(shm_base, 0, _state->shm_len);
+    memcpy(shm_base, hwaes_cbc_plaintext, sizeof(hwaes_cbc_plaintext));
+
+    /* the id now refers to the new shared memory */
+    _state->shm_hd = (struct hwcrypt_shm_hd){
+            .handle = memref,
+            .base = shm_base,
+            .size = _state->shm_len,
+            .id = 1U,
+    };
+    _state->args_encrypt.text_in.data_ptr = shm_base;
+    _state->args_encrypt.text_out.data_ptr = shm_base;
+    rc = hwaes_encrypt(_state->hwaes_session, &_state->args_encrypt);
+    EXPECT_EQ(NO_ERROR, rc, "encryption - second shm");
+    rc = memcmp(shm_base, hwaes_cbc_ciphertext, sizeof(hwaes_cbc_ciphertext));
+    EXPECT_EQ(0, rc, "wrong encryption result");
+
+    rc = hwaes_release_shm(_state->hwaes_session, _state->shm_hd.id);
+    EXPECT_EQ(NO_ERROR, rc, "release second shm");
+
+test_abort:
+    if (memref != INVALID_IPC_HANDLE) {
+        close(memref);
+    }
+    free(shm_base);
+}
+
+TEST_F(hwaes, EncryptionDecryptionCBCBatch) {
+    uint8_t buf[sizeof(hwaes_cbc_plaintext)] = {0};
+    uint8_t ciphertext[sizeof(hwaes_cbc_ciphertext)] = {0};
+    uint8_t short_buf[sizeof(hwaes_cbc_plaintext) / 2] = {0};
+    struct hwcrypt_batch_op ops[4] = {0};
+    int rc;
+
+    memcpy(buf, hwaes_cbc_ciphertext, sizeof(hwaes_cbc_ciphertext));
+
+    /* encrypt in shared memory */
+    ops[0].args = _state->args_encrypt;
+    ops[0].encrypt = true;
+
+    /* encrypt in the message, using the same key */
+    ops[1].args = _state->args_encrypt;
+    ops[1].args.text_in = (struct hwcrypt_arg_in){
+            .data_ptr = hwaes_cbc_plaintext,
+            .len = sizeof(hwaes_cbc_plaintext),
+    };
+    ops[1].args.text_out = (struct hwcrypt_arg_out){
+            .data_ptr = ciphertext,
+            .len = sizeof(ciphertext),
+    };
+    ops[1].encrypt = true;
+
+    /* decrypt in the message */
+    ops[2].args = _state->args_decrypt;
+    ops[2].args.text_in = (struct hwcrypt_arg_in){
+            .data_ptr = buf,
+            .len = sizeof(buf),
+    };
+    ops[2].args.text_out = (struct hwcrypt_arg_out){
+            .data_ptr = buf,
+            .len = sizeof(buf),
+    };
+
+    /* fails on its own, input is not a multiple of the block size */
+    ops[3].args = _state->args_encrypt;
+    ops[3].args.text_in = (struct hwcrypt_arg_in){
+            .data_ptr = short_buf,
+            .len = sizeof(short_buf) - 1,
+    };
+    ops[3].args.text_out = (struct hwcrypt_arg_out){
+            .data_ptr = short_buf,
+            .len = sizeof(short_buf) - 1,
+    };
+    ops[3].encrypt = true;
+
+    rc = hwaes_crypt_batch(_state->hwaes_session, ops, countof(ops));
+    ASSERT_EQ(NO_ERROR, rc, "batch - cbc mode");
+
+    EXPECT_EQ(NO_ERROR, ops[0].result, "encryption - shm");
+    rc = memcmp(_state->shm_base, hwaes_cbc_ciphertext,
+                sizeof(hwaes_cbc_ciphertext));
+    EXPECT_EQ(0, rc, "wrong encryption result - shm");
+
+    EXPECT_EQ(NO_ERROR, ops[1].result, "encryption - no shm");
+    rc = memcmp(ciphertext, hwaes_cbc_ciphertext, sizeof(ciphertext));
+    EXPECT_EQ(0, rc, "wrong encryption result - no shm");
+
+    EXPECT_EQ(NO_ERROR, ops[2].result, "decryption - no shm");
+    rc = memcmp(buf, hwaes_cbc_plaintext, sizeof(buf));
+    EXPECT_EQ(0, rc, "wrong decryption result - no shm");
+
+    EXPECT_NE(NO_ERROR, ops[3].result, "encryption - bad length");
+
+test_abort:;
+}
+
+TEST_F(hwaes, BatchInvalidNumberOfOps) {
+    struct hwcrypt_batch_op ops[HWAES_MAX_BATCH_OPS + 1] = {0};
+
+    for (size_t i = 0; i < countof(ops); i++) {
+        ops[i].args = _state->args_encrypt;
+        ops[i].encrypt = true;
+    }
+
+    int rc = hwaes_crypt_batch(_state->hwaes_session, ops, 0);
+    EXPECT_EQ(ERR_INVALID_ARGS, rc, "batch - no operation");
+
+    rc = hwaes_crypt_batch(_state->hwaes_session, ops, countof(ops));
+    EXPECT_EQ(ERR_INVALID_ARGS, rc, "batch - too many operations");
+}
+
 TEST_F(hwaes, EncryptVectors) {
     const struct test_vector* vector = vectors;
     for (unsigned long i = 0; i < countof(vectors); ++i, ++vector) {
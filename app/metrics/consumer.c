@@ -22,7 +22,9 @@
 #include <lib/tipc/tipc.h>
 #include <lib/tipc/tipc_srv.h>
 #include <metrics_consts.h>
+#include <stdlib.h>
 #include <string.h>
+#include <trusty/uuid.h>
 #include <trusty_log.h>
 #include <uapi/err.h>
 
@@ -86,6 +88,28 @@ static int broadcast_event(handle_t chan,
     return NO_ERROR;
 }
 
+static const struct uuid kernel_uuid = UUID_KERNEL_VALUE;
+
+/* the kernel followed by metrics_storage_reporters */
+static const struct uuid** allowed_uuids;
+static size_t allowed_uuid_num;
+
+static int on_connect(const struct tipc_port* port,
+                      handle_t chan,
+                      const struct uuid* peer,
+                      void** ctx_p) {
+    size_t i;
+
+    /* the context is the peer's entry in allowed_uuids */
+    for (i = 0; i < allowed_uuid_num; i++) {
+        if (!memcmp(peer, allowed_uuids[i], sizeof(*peer))) {
+            *ctx_p = (void*)allowed_uuids[i];
+            return NO_ERROR;
+        }
+    }
+    return ERR_ACCESS_DENIED;
+}
+
 static int on_message(const struct tipc_port* port, handle_t chan, void* ctx) {
     int rc;
     struct metrics_req req;
@@ -104,13 +128,28 @@ static int on_message(const struct tipc_port* port, handle_t chan, void* ctx) {
     msg_len = rc;
     cmd = ((struct metrics_req*)msg)->cmd;
 
-    rc = broadcast_event(state->client_chan, cmd, msg, msg_len);
-    if (rc != NO_ERROR) {
-        TLOGE("failed (%d) to broadcast metrics event to NS\n", rc);
-    }
-
     resp.cmd = (cmd | METRICS_CMD_RESP_BIT);
     resp.status = METRICS_NO_ERROR;
+
+    if (ctx == &kernel_uuid) {
+        rc = msg_len;
+    } else if (cmd == METRICS_CMD_REPORT_STORAGE) {
+        /* apps may only report their own storage statistics */
+        rc = metrics_set_storage_app_id(msg, msg_len, ctx);
+    } else {
+        TLOGE("app is not allowed to report event: %d\n", cmd);
+        rc = ERR_ACCESS_DENIED;
+    }
+
+    if (rc < 0) {
+        resp.status = METRICS_ERR_UNKNOWN_CMD;
+    } else {
+        rc = broadcast_event(state->client_chan, cmd, msg, rc);
+        if (rc != NO_ERROR) {
+            TLOGE("failed (%d) to broadcast metrics event to NS\n", rc);
+        }
+    }
+
     rc = tipc_send1(chan, &resp, sizeof(resp));
     if (rc < 0) {
         TLOGE("failed (%d) to send metrics event response\n", rc);
@@ -125,15 +164,26 @@ static int on_message(const struct tipc_port* port, handle_t chan, void* ctx) {
     return NO_ERROR;
 }
 
+static int init_allowed_uuids(void) {
+    size_t reporter_num = 0;
+
+    while (metrics_storage_reporters[reporter_num]) {
+        reporter_num++;
+    }
+    allowed_uuids = calloc(reporter_num + 1, sizeof(*allowed_uuids));
+    if (!allowed_uuids) {
+        return ERR_NO_MEMORY;
+    }
+    allowed_uuids[0] = &kernel_uuid;
+    memcpy(allowed_uuids + 1, metrics_storage_reporters,
+           reporter_num * sizeof(*allowed_uuids));
+    allowed_uuid_num = reporter_num + 1;
+    return NO_ERROR;
+}
+
 int add_metrics_consumer_service(struct srv_state* state) {
-    static const struct uuid kernel_uuid = UUID_KERNEL_VALUE;
-    static const struct uuid* allowed_uuids[] = {
-            &kernel_uuid,
-    };
     static struct tipc_port_acl port_acl = {
             .flags = IPC_PORT_ALLOW_TA_CONNECT,
-            .uuids = allowed_uuids,
-            .uuid_num = countof(allowed_uuids),
     };
     static struct tipc_port port = {
             .name = METRICS_CONSUMER_PORT,
@@ -142,8 +192,17 @@ int add_metrics_consumer_service(struct srv_state* state) {
             .acl = &port_acl,
     };
     static struct tipc_srv_ops ops = {
+            .on_connect = on_connect,
             .on_message = on_message,
     };
+    int rc;
+
+    rc = init_allowed_uuids();
+    if (rc < 0) {
+        return rc;
+    }
+    port_acl.uuids = allowed_uuids;
+    port_acl.uuid_num = allowed_uuid_num;
 
     set_srv_state(&port, state);
 
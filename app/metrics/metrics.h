@@ -17,6 +17,8 @@
 #pragma once
 
 #include <lib/tipc/tipc_srv.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * struct srv_state - global state of the metrics server
@@ -52,3 +54,25 @@ int add_metrics_service(struct srv_state* state);
  * Return: 0 on success, negative error code on error
  */
 int add_metrics_consumer_service(struct srv_state* state);
+
+/*
+ * Apps allowed to report their own storage statistics, terminated by %NULL.
+ * Defined by the file METRICS_STORAGE_REPORTERS_SRC names, so that projects
+ * can list their own apps.
+ */
+extern const struct uuid* const metrics_storage_reporters[];
+
+/**
+ * metrics_set_storage_app_id() - Tag a storage event with the reporting app
+ * @msg:     a %METRICS_CMD_REPORT_STORAGE event of %METRICS_MAX_MSG_SIZE bytes
+ * @msg_len: length of the event received in @msg
+ * @peer:    UUID of the app that sent the event
+ *
+ * Replaces the app ID of the event with the UUID of @peer, so apps cannot
+ * report statistics of another one.
+ *
+ * Return: the new length of @msg, or an error code < 0 if it is malformed.
+ */
+int metrics_set_storage_app_id(uint8_t* msg,
+                               size_t msg_len,
+                               const struct uuid* peer);
@@ -20,10 +20,16 @@ MANIFEST := $(LOCAL_DIR)/manifest.json
 
 CONSTANTS :=  $(LOCAL_DIR)/metrics_consts.json
 
+# Source file defining metrics_storage_reporters, the apps allowed to report
+# their storage statistics. Projects point this at a list of their own apps.
+METRICS_STORAGE_REPORTERS_SRC ?= $(LOCAL_DIR)/storage_reporters.c
+
 MODULE_SRCS := \
 	$(LOCAL_DIR)/consumer.c \
 	$(LOCAL_DIR)/metrics.c \
 	$(LOCAL_DIR)/main.c \
+	$(LOCAL_DIR)/storage_report.c \
+	$(METRICS_STORAGE_REPORTERS_SRC) \
 
 MODULE_LIBRARY_DEPS += \
 	trusty/user/base/interface/metrics \
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TLOG_TAG "metrics-storage"
+
+#include "metrics.h"
+
+#include <interface/metrics/metrics.h>
+#include <stddef.h>
+#include <trusty/uuid.h>
+#include <trusty_log.h>
+#include <uapi/err.h>
+
+int metrics_set_storage_app_id(uint8_t* msg,
+                               size_t msg_len,
+                               const struct uuid* peer) {
+    struct metrics_report_storage_req* req =
+            (void*)(msg + sizeof(struct metrics_req));
+    size_t app_id_off = sizeof(struct metrics_req) + sizeof(*req);
+
+    if (msg_len < app_id_off) {
+        TLOGE("storage event too short: %zu\n", msg_len);
+        return ERR_BAD_LEN;
+    }
+    uuid_to_str(peer, (char*)msg + app_id_off);
+    req->app_id_len = UUID_STR_SIZE - 1;
+    return app_id_off + req->app_id_len;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Default list of the apps allowed to report their storage statistics.
+ * Projects set METRICS_STORAGE_REPORTERS_SRC to a file listing their own
+ * apps instead.
+ */
+
+#include "metrics.h"
+
+#include <stddef.h>
+
+/* the storage client tests check that reports get through */
+static const struct uuid storage_client_test_uuid = {
+        0x2c8907ce,
+        0xe69a,
+        0x4ea3,
+        {0xbe, 0xc3, 0xed, 0xa0, 0xd0, 0x66, 0x37, 0x91},
+};
+
+const struct uuid* const metrics_storage_reporters[] = {
+        &storage_client_test_uuid,
+        NULL,
+};
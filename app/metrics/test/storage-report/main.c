@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Tests of the tagging of storage statistics events with the UUID of the app
+ * that reports them.
+ */
+
+#define TLOG_TAG "metrics-storage-report-test"
+
+#include <interface/metrics/metrics.h>
+#include <lib/unittest/unittest.h>
+#include <string.h>
+#include <trusty/uuid.h>
+#include <trusty_unittest.h>
+#include <uapi/err.h>
+
+#include "metrics.h"
+
+#define APP_ID_OFF \
+    (sizeof(struct metrics_req) + sizeof(struct metrics_report_storage_req))
+
+static const struct uuid peer_uuid = {
+        0x01234567,
+        0x89ab,
+        0xcdef,
+        {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef},
+};
+
+static uint8_t msg[METRICS_MAX_MSG_SIZE];
+
+/* Build a storage event claiming to be from @app_id, and return its length */
+static size_t make_event(const char* app_id) {
+    struct metrics_req* req = (void*)msg;
+    struct metrics_report_storage_req* storage_req = (void*)(req + 1);
+    size_t app_id_len = strlen(app_id);
+
+    memset(msg, 0, sizeof(msg));
+    req->cmd = METRICS_CMD_REPORT_STORAGE;
+    storage_req->op = METRICS_STORAGE_OP_WRITE;
+    storage_req->count = 3;
+    storage_req->app_id_len = app_id_len;
+    memcpy(msg + APP_ID_OFF, app_id, app_id_len);
+    return APP_ID_OFF + app_id_len;
+}
+
+/* Check that the event in msg has the app ID of peer_uuid */
+static void expect_peer_app_id(int rc) {
+    struct metrics_report_storage_req* storage_req =
+            (void*)(msg + sizeof(struct metrics_req));
+    char expected[UUID_STR_SIZE];
+
+    uuid_to_str(&peer_uuid, expected);
+    ASSERT_EQ(rc, (int)(APP_ID_OFF + UUID_STR_SIZE - 1));
+    EXPECT_EQ(storage_req->app_id_len, UUID_STR_SIZE - 1);
+    EXPECT_EQ(memcmp(msg + APP_ID_OFF, expected, UUID_STR_SIZE - 1), 0);
+
+    /* the statistics are left alone */
+    EXPECT_EQ(storage_req->op, METRICS_STORAGE_OP_WRITE);
+    EXPECT_EQ(storage_req->count, 3);
+
+test_abort:;
+}
+
+TEST(metrics_storage_report, replaces_app_id) {
+    size_t len = make_event("com.android.trusty.victim");
+
+    expect_peer_app_id(metrics_set_storage_app_id(msg, len, &peer_uuid));
+}
+
+TEST(metrics_storage_report, replaces_long_app_id) {
+    char app_id[METRICS_MAX_APP_ID_LEN + 1];
+    size_t len;
+
+    memset(app_id, 'a', METRICS_MAX_APP_ID_LEN);
+    app_id[METRICS_MAX_APP_ID_LEN] = '\0';
+    len = make_event(app_id);
+    expect_peer_app_id(metrics_set_storage_app_id(msg, len, &peer_uuid));
+}
+
+TEST(metrics_storage_report, adds_missing_app_id) {
+    size_t len = make_event("");
+
+    expect_peer_app_id(metrics_set_storage_app_id(msg, len, &peer_uuid));
+}
+
+TEST(metrics_storage_report, rejects_short_event) {
+    int rc;
+
+    make_event("");
+    rc = metrics_set_storage_app_id(msg, APP_ID_OFF - 1, &peer_uuid);
+    EXPECT_EQ(rc, ERR_BAD_LEN);
+}
+
+PORT_TEST(metrics_storage_report,
+          "com.android.trusty.metrics.test.storage_report");
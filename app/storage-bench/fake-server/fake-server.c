@@ -0,0 +1,868 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * In-memory storage server.
+ *
+ * Implements the client side of the storage protocol with files kept in heap
+ * memory, so the storage client library can be benchmarked without the cost
+ * of the real server's block device and RPMB. Files are shared by all
+ * clients. Changes take effect immediately: committing a transaction
+ * succeeds without doing anything, and discarding one does not roll back the
+ * changes made in it. Mapped views are served from copies of the files, which
+ * are kept until the client closes its session. Files are limited to
+ * %FAKE_MAX_FILE_SIZE bytes, so clients can test a write failing part-way.
+ *
+ * The server listens on two ports. %STORAGE_FAKE_SMALL_QUEUE_PORT only queues
+ * a single request per client, so that clients sending several requests at
+ * once have to wait for room in the queue.
+ */
+
+#define TLOG_TAG "storage-fake"
+
+#include <lk/err_ptr.h>
+#include <lk/list.h>
+#include <lk/macros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <trusty/memref.h>
+#include <trusty_ipc.h>
+#include <trusty_log.h>
+#include <uapi/err.h>
+#include <uapi/mm.h>
+
+#include <interface/storage/storage.h>
+#include <lib/tipc/tipc.h>
+#include <lib/tipc/tipc_srv.h>
+
+#include <storage_fake_consts.h>
+
+#define FAKE_MAX_MSG_SIZE 4096
+/* Largest payload the client library accepts in a list response */
+#define FAKE_MAX_LIST_SIZE 4040
+#define FAKE_MAX_NAME_SIZE 160
+#define FAKE_MAX_OPEN_FILES 64
+#define FAKE_MAX_FILE_SIZE (1024 * 1024)
+
+#define PAGE_SIZE getauxval(AT_PAGESZ)
+
+/**
+ * struct fake_file - a file
+ * @node:     list node in @files, sorted by name
+ * @refs:     number of handles referring to the file
+ * @deleted:  the file has been deleted and is only kept for open handles
+ * @size:     size of the file
+ * @capacity: size of @data
+ * @data:     contents of the file
+ * @name:     name of the file
+ */
+struct fake_file {
+    struct list_node node;
+    size_t refs;
+    bool deleted;
+    size_t size;
+    size_t capacity;
+    uint8_t* data;
+    char name[FAKE_MAX_NAME_SIZE];
+};
+
+/**
+ * struct fake_map - a copy of a file shared with a client
+ * @node: list node in &struct fake_chan @maps
+ * @base: page aligned copy of the file
+ */
+struct fake_map {
+    struct list_node node;
+    void* base;
+};
+
+/**
+ * struct fake_chan - state of a client connection
+ * @files:        open files, indexed by handle
+ * @maps:         copies of files shared with the client
+ * @batch_result: first error of the current batch of commands
+ * @shm_base:     shared memory region mapped by the client, or %NULL
+ * @shm_size:     size of @shm_base
+ */
+struct fake_chan {
+    struct fake_file* files[FAKE_MAX_OPEN_FILES];
+    struct list_node maps;
+    int32_t batch_result;
+    uint8_t* shm_base;
+    size_t shm_size;
+};
+
+static struct list_node files = LIST_INITIAL_VALUE(files);
+
+static uint8_t req_buf[FAKE_MAX_MSG_SIZE] __attribute__((aligned(8)));
+static uint8_t resp_buf[FAKE_MAX_MSG_SIZE] __attribute__((aligned(8)));
+
+static struct fake_file* find_file(const char* name) {
+    struct fake_file* file;
+
+    list_for_every_entry(&files, file, struct fake_file, node) {
+        if (!strcmp(file->name, name)) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+static void insert_file(struct fake_file* file) {
+    struct fake_file* next;
+
+    list_for_every_entry(&files, next, struct fake_file, node) {
+        if (strcmp(next->name, file->name) > 0) {
+            list_add_before(&next->node, &file->node);
+            return;
+        }
+    }
+    list_add_tail(&files, &file->node);
+}
+
+static void unlink_file(struct fake_file* file) {
+    list_delete(&file->node);
+    file->deleted = true;
+    if (!file->refs) {
+        free(file->data);
+        free(file);
+    }
+}
+
+static void put_file(struct fake_file* file) {
+    file->refs--;
+    if (file->deleted && !file->refs) {
+        free(file->data);
+        free(file);
+    }
+}
+
+static int set_file_size(struct fake_file* file, size_t size) {
+    uint8_t* data;
+    size_t capacity;
+
+    if (size > FAKE_MAX_FILE_SIZE) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    if (size > file->capacity) {
+        capacity = MAX(size, file->capacity * 2);
+        data = realloc(file->data, capacity);
+        if (!data) {
+            return STORAGE_ERR_GENERIC;
+        }
+        file->data = data;
+        file->capacity = capacity;
+    }
+    if (size > file->size) {
+        memset(file->data + file->size, 0, size - file->size);
+    }
+    file->size = size;
+    return STORAGE_NO_ERROR;
+}
+
+/* Copy a name of @len bytes into a null-terminated buffer */
+static int get_name(char* buf, const char* name, size_t len) {
+    if (!len || len >= FAKE_MAX_NAME_SIZE || memchr(name, '\0', len)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    return STORAGE_NO_ERROR;
+}
+
+static struct fake_file* get_handle(struct fake_chan* chan, uint32_t handle) {
+    return handle < FAKE_MAX_OPEN_FILES ? chan->files[handle] : NULL;
+}
+
+static int handle_open(struct fake_chan* chan,
+                       const void* payload,
+                       size_t len,
+                       void* resp,
+                       size_t* resp_len) {
+    const struct storage_file_open_req* req = payload;
+    struct storage_file_open_resp* rsp = resp;
+    char name[FAKE_MAX_NAME_SIZE];
+    struct fake_file* file;
+    uint32_t handle;
+    int rc;
+
+    if (len < sizeof(*req) || (req->flags & ~STORAGE_FILE_OPEN_MASK)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    rc = get_name(name, req->name, len - sizeof(*req));
+    if (rc != STORAGE_NO_ERROR) {
+        return rc;
+    }
+    for (handle = 0; handle < FAKE_MAX_OPEN_FILES; handle++) {
+        if (!chan->files[handle]) {
+            break;
+        }
+    }
+    if (handle == FAKE_MAX_OPEN_FILES) {
+        return STORAGE_ERR_GENERIC;
+    }
+
+    file = find_file(name);
+    if (file) {
+        if ((req->flags & STORAGE_FILE_OPEN_CREATE) &&
+            (req->flags & STORAGE_FILE_OPEN_CREATE_EXCLUSIVE)) {
+            return STORAGE_ERR_EXIST;
+        }
+        if (req->flags & STORAGE_FILE_OPEN_TRUNCATE) {
+            file->size = 0;
+        }
+    } else {
+        if (!(req->flags & STORAGE_FILE_OPEN_CREATE)) {
+            return STORAGE_ERR_NOT_FOUND;
+        }
+        file = calloc(1, sizeof(*file));
+        if (!file) {
+            return STORAGE_ERR_GENERIC;
+        }
+        strcpy(file->name, name);
+        insert_file(file);
+    }
+
+    file->refs++;
+    chan->files[handle] = file;
+    rsp->handle = handle;
+    *resp_len = sizeof(*rsp);
+    return STORAGE_NO_ERROR;
+}
+
+static int handle_close(struct fake_chan* chan,
+                        const void* payload,
+                        size_t len) {
+    const struct storage_file_close_req* req = payload;
+    struct fake_file* file;
+
+    if (len < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = get_handle(chan, req->handle);
+    if (!file) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    chan->files[req->handle] = NULL;
+    put_file(file);
+    return STORAGE_NO_ERROR;
+}
+
+static int handle_read(struct fake_chan* chan,
+                       const void* payload,
+                       size_t len,
+                       void* resp,
+                       size_t* resp_len) {
+    const struct storage_file_read_req* req = payload;
+    struct fake_file* file;
+    size_t size;
+
+    if (len < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = get_handle(chan, req->handle);
+    if (!file || req->size > FAKE_MAX_MSG_SIZE - sizeof(struct storage_msg)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    if (req->offset >= file->size) {
+        size = 0;
+    } else {
+        size = MIN(req->size, file->size - req->offset);
+        memcpy(resp, file->data + req->offset, size);
+    }
+    *resp_len = size;
+    return STORAGE_NO_ERROR;
+}
+
+static int handle_write(struct fake_chan* chan,
+                        const void* payload,
+                        size_t len) {
+    const struct storage_file_write_req* req = payload;
+    struct fake_file* file;
+    size_t size;
+    int rc;
+
+    if (len < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = get_handle(chan, req->handle);
+    if (!file || req->offset > SIZE_MAX - FAKE_MAX_MSG_SIZE) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    size = len - sizeof(*req);
+    if (req->offset + size > file->size) {
+        rc = set_file_size(file, req->offset + size);
+        if (rc != STORAGE_NO_ERROR) {
+            return rc;
+        }
+    }
+    memcpy(file->data + req->offset, req->data, size);
+    return STORAGE_NO_ERROR;
+}
+
+static int handle_get_size(struct fake_chan* chan,
+                           const void* payload,
+                           size_t len,
+                           void* resp,
+                           size_t* resp_len) {
+    const struct storage_file_get_size_req* req = payload;
+    struct storage_file_get_size_resp* rsp = resp;
+    struct fake_file* file;
+
+    if (len < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = get_handle(chan, req->handle);
+    if (!file) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    rsp->size = file->size;
+    *resp_len = sizeof(*rsp);
+    return STORAGE_NO_ERROR;
+}
+
+static int handle_set_size(struct fake_chan* chan,
+                           const void* payload,
+                           size_t len) {
+    const struct storage_file_set_size_req* req = payload;
+    struct fake_file* file;
+
+    if (len < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = get_handle(chan, req->handle);
+    if (!file || req->size > SIZE_MAX) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    return set_file_size(file, req->size);
+}
+
+static int handle_delete(const void* payload, size_t len) {
+    const struct storage_file_delete_req* req = payload;
+    char name[FAKE_MAX_NAME_SIZE];
+    struct fake_file* file;
+    int rc;
+
+    if (len < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    rc = get_name(name, req->name, len - sizeof(*req));
+    if (rc != STORAGE_NO_ERROR) {
+        return rc;
+    }
+    file = find_file(name);
+    if (!file) {
+        return STORAGE_ERR_NOT_FOUND;
+    }
+    unlink_file(file);
+    return STORAGE_NO_ERROR;
+}
+
+static int handle_move(struct fake_chan* chan,
+                       const void* payload,
+                       size_t len) {
+    const struct storage_file_move_req* req = payload;
+    char old_name[FAKE_MAX_NAME_SIZE];
+    char new_name[FAKE_MAX_NAME_SIZE];
+    struct fake_file* file;
+    struct fake_file* dest;
+    int rc;
+
+    if (len < sizeof(*req) || (req->flags & ~STORAGE_FILE_MOVE_MASK) ||
+        req->old_name_len > len - sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    rc = get_name(old_name, req->old_new_name, req->old_name_len);
+    if (rc != STORAGE_NO_ERROR) {
+        return rc;
+    }
+    rc = get_name(new_name, req->old_new_name + req->old_name_len,
+                  len - sizeof(*req) - req->old_name_len);
+    if (rc != STORAGE_NO_ERROR) {
+        return rc;
+    }
+
+    file = find_file(old_name);
+    if (!file) {
+        return STORAGE_ERR_NOT_FOUND;
+    }
+    if ((req->flags & STORAGE_FILE_MOVE_OPEN_FILE) &&
+        get_handle(chan, req->handle) != file) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    dest = find_file(new_name);
+    if (dest) {
+        if ((req->flags & STORAGE_FILE_MOVE_CREATE) &&
+            (req->flags & STORAGE_FILE_MOVE_CREATE_EXCLUSIVE)) {
+            return STORAGE_ERR_EXIST;
+        }
+        if (dest != file) {
+            unlink_file(dest);
+        }
+    } else if (!(req->flags & STORAGE_FILE_MOVE_CREATE)) {
+        return STORAGE_ERR_NOT_FOUND;
+    }
+
+    list_delete(&file->node);
+    strcpy(file->name, new_name);
+    insert_file(file);
+    return STORAGE_NO_ERROR;
+}
+
+static int handle_list(uint32_t cmd,
+                       const void* payload,
+                       size_t len,
+                       void* resp,
+                       size_t* resp_len) {
+    char prefix[FAKE_MAX_NAME_SIZE] = "";
+    char last[FAKE_MAX_NAME_SIZE] = "";
+    size_t prefix_len = 0;
+    const char* last_name;
+    size_t last_len;
+    size_t max_count;
+    size_t count = 0;
+    uint8_t flags;
+    struct fake_file* file;
+    struct storage_file_list_resp* item;
+    uint8_t* out = resp;
+    size_t pos = 0;
+    size_t item_size;
+
+    if (cmd == STORAGE_FILE_LIST_PREFIX) {
+        const struct storage_file_list_prefix_req* req = payload;
+
+        if (len < sizeof(*req) || req->prefix_len > len - sizeof(*req) ||
+            req->prefix_len >= FAKE_MAX_NAME_SIZE) {
+            return STORAGE_ERR_NOT_VALID;
+        }
+        max_count = req->max_count;
+        flags = req->flags;
+        prefix_len = req->prefix_len;
+        memcpy(prefix, req->data, prefix_len);
+        last_name = req->data + prefix_len;
+        last_len = len - sizeof(*req) - prefix_len;
+    } else {
+        const struct storage_file_list_req* req = payload;
+
+        if (len < sizeof(*req)) {
+            return STORAGE_ERR_NOT_VALID;
+        }
+        max_count = req->max_count;
+        flags = req->flags;
+        last_name = req->name;
+        last_len = len - sizeof(*req);
+    }
+    if (flags != STORAGE_FILE_LIST_START) {
+        if (get_name(last, last_name, last_len) != STORAGE_NO_ERROR) {
+            return STORAGE_ERR_NOT_VALID;
+        }
+    }
+
+    list_for_every_entry(&files, file, struct fake_file, node) {
+        if (flags != STORAGE_FILE_LIST_START && strcmp(file->name, last) <= 0) {
+            continue;
+        }
+        if (strncmp(file->name, prefix, prefix_len)) {
+            continue;
+        }
+        item_size = sizeof(*item) + strlen(file->name) + 1;
+        if ((max_count && count == max_count) ||
+            pos + item_size > FAKE_MAX_LIST_SIZE) {
+            *resp_len = pos;
+            return STORAGE_NO_ERROR;
+        }
+        item = (void*)(out + pos);
+        item->flags = STORAGE_FILE_LIST_COMMITTED;
+        strcpy(item->name, file->name);
+        pos += item_size;
+        count++;
+    }
+
+    if ((!max_count || count < max_count) &&
+        pos + sizeof(*item) <= FAKE_MAX_LIST_SIZE) {
+        item = (void*)(out + pos);
+        item->flags = STORAGE_FILE_LIST_END;
+        pos += sizeof(*item);
+    }
+    *resp_len = pos;
+    return STORAGE_NO_ERROR;
+}
+
+static int handle_map(struct fake_chan* chan,
+                      const void* payload,
+                      size_t len,
+                      void* resp,
+                      size_t* resp_len,
+                      handle_t* memref_p) {
+    const struct storage_file_map_req* req = payload;
+    struct storage_file_map_resp* rsp = resp;
+    struct fake_file* file;
+    struct fake_map* map;
+    size_t map_size;
+    int rc;
+
+    if (len < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = get_handle(chan, req->handle);
+    if (!file) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    rsp->size = file->size;
+    *resp_len = sizeof(*rsp);
+    if (!file->size) {
+        return STORAGE_NO_ERROR;
+    }
+
+    map = malloc(sizeof(*map));
+    if (!map) {
+        return STORAGE_ERR_GENERIC;
+    }
+    map_size = round_up(file->size, PAGE_SIZE);
+    map->base = memalign(PAGE_SIZE, map_size);
+    if (!map->base) {
+        goto err_alloc;
+    }
+    memcpy(map->base, file->data, file->size);
+    memset((uint8_t*)map->base + file->size, 0, map_size - file->size);
+
+    rc = memref_create(map->base, map_size, MMAP_FLAG_PROT_READ);
+    if (rc < 0) {
+        TLOGE("failed (%d) to create memref\n", rc);
+        goto err_memref;
+    }
+    *memref_p = (handle_t)rc;
+    list_add_tail(&chan->maps, &map->node);
+    return STORAGE_NO_ERROR;
+
+err_memref:
+    free(map->base);
+err_alloc:
+    free(map);
+    return STORAGE_ERR_GENERIC;
+}
+
+static void unmap_shm(struct fake_chan* chan) {
+    if (chan->shm_base) {
+        munmap(chan->shm_base, chan->shm_size);
+        chan->shm_base = NULL;
+        chan->shm_size = 0;
+    }
+}
+
+static int handle_shm_map(struct fake_chan* chan,
+                          const void* payload,
+                          size_t len,
+                          handle_t memref) {
+    const struct storage_shm_map_req* req = payload;
+    void* base;
+
+    if (len < sizeof(*req) || memref == INVALID_IPC_HANDLE || !req->size ||
+        (size_t)req->size != req->size) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    base = mmap(NULL, req->size, PROT_READ | PROT_WRITE, 0, memref, 0);
+    if (base == MAP_FAILED) {
+        TLOGE("failed to map shared memory of %llu bytes\n",
+              (unsigned long long)req->size);
+        return STORAGE_ERR_NOT_VALID;
+    }
+    unmap_shm(chan);
+    chan->shm_base = base;
+    chan->shm_size = req->size;
+    return STORAGE_NO_ERROR;
+}
+
+/* Whether @size bytes at @offset lie within the client's shared memory */
+static bool shm_range_valid(struct fake_chan* chan,
+                            uint64_t offset,
+                            uint64_t size) {
+    return chan->shm_base && offset <= chan->shm_size &&
+           size <= chan->shm_size - offset;
+}
+
+static int handle_read_shm(struct fake_chan* chan,
+                           const void* payload,
+                           size_t len,
+                           void* resp,
+                           size_t* resp_len) {
+    const struct storage_file_read_shm_req* req = payload;
+    struct storage_file_read_shm_resp* rsp = resp;
+    struct fake_file* file;
+    size_t size;
+
+    if (len < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = get_handle(chan, req->handle);
+    if (!file || !shm_range_valid(chan, req->shm_offset, req->size)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    if (req->offset >= file->size) {
+        size = 0;
+    } else {
+        size = MIN(req->size, file->size - req->offset);
+        memcpy(chan->shm_base + req->shm_offset, file->data + req->offset,
+               size);
+    }
+    rsp->size = size;
+    *resp_len = sizeof(*rsp);
+    return STORAGE_NO_ERROR;
+}
+
+static int handle_write_shm(struct fake_chan* chan,
+                            const void* payload,
+                            size_t len) {
+    const struct storage_file_write_shm_req* req = payload;
+    struct fake_file* file;
+    int rc;
+
+    if (len < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = get_handle(chan, req->handle);
+    if (!file || !shm_range_valid(chan, req->shm_offset, req->size) ||
+        req->offset > SIZE_MAX - req->size) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    if (req->offset + req->size > file->size) {
+        rc = set_file_size(file, req->offset + req->size);
+        if (rc != STORAGE_NO_ERROR) {
+            return rc;
+        }
+    }
+    memcpy(file->data + req->offset, chan->shm_base + req->shm_offset,
+           req->size);
+    return STORAGE_NO_ERROR;
+}
+
+static int handle_cmd(struct fake_chan* chan,
+                      struct storage_msg* msg,
+                      size_t len,
+                      void* resp,
+                      size_t* resp_len,
+                      handle_t* memref_p,
+                      handle_t req_memref) {
+    switch (msg->cmd) {
+    case STORAGE_FILE_OPEN:
+        return handle_open(chan, msg->payload, len, resp, resp_len);
+    case STORAGE_FILE_CLOSE:
+        return handle_close(chan, msg->payload, len);
+    case STORAGE_FILE_READ:
+        return handle_read(chan, msg->payload, len, resp, resp_len);
+    case STORAGE_FILE_WRITE:
+        return handle_write(chan, msg->payload, len);
+    case STORAGE_FILE_GET_SIZE:
+        return handle_get_size(chan, msg->payload, len, resp, resp_len);
+    case STORAGE_FILE_SET_SIZE:
+        return handle_set_size(chan, msg->payload, len);
+    case STORAGE_FILE_DELETE:
+        return handle_delete(msg->payload, len);
+    case STORAGE_FILE_MOVE:
+        return handle_move(chan, msg->payload, len);
+    case STORAGE_FILE_LIST:
+    case STORAGE_FILE_LIST_PREFIX:
+        return handle_list(msg->cmd, msg->payload, len, resp, resp_len);
+    case STORAGE_FILE_MAP:
+        return handle_map(chan, msg->payload, len, resp, resp_len, memref_p);
+    case STORAGE_SHM_MAP:
+        return handle_shm_map(chan, msg->payload, len, req_memref);
+    case STORAGE_FILE_READ_SHM:
+        return handle_read_shm(chan, msg->payload, len, resp, resp_len);
+    case STORAGE_FILE_WRITE_SHM:
+        return handle_write_shm(chan, msg->payload, len);
+    case STORAGE_END_TRANSACTION:
+        return STORAGE_NO_ERROR;
+    default:
+        return STORAGE_ERR_UNIMPLEMENTED;
+    }
+}
+
+static int fake_on_connect(const struct tipc_port* port,
+                           handle_t chan,
+                           const struct uuid* peer,
+                           void** ctx_p) {
+    struct fake_chan* fake_chan = calloc(1, sizeof(*fake_chan));
+
+    if (!fake_chan) {
+        return ERR_NO_MEMORY;
+    }
+    list_initialize(&fake_chan->maps);
+    *ctx_p = fake_chan;
+    return NO_ERROR;
+}
+
+static void fake_on_channel_cleanup(void* ctx) {
+    struct fake_chan* fake_chan = ctx;
+    struct fake_map* map;
+    struct fake_map* tmp;
+    size_t i;
+
+    for (i = 0; i < FAKE_MAX_OPEN_FILES; i++) {
+        if (fake_chan->files[i]) {
+            put_file(fake_chan->files[i]);
+        }
+    }
+    list_for_every_entry_safe(&fake_chan->maps, map, tmp, struct fake_map,
+                              node) {
+        list_delete(&map->node);
+        free(map->base);
+        free(map);
+    }
+    unmap_shm(fake_chan);
+    free(fake_chan);
+}
+
+/*
+ * Receive a request, along with the memref of a shared memory region if it
+ * carries one. @memref_p is set to INVALID_IPC_HANDLE otherwise.
+ */
+static int recv_req(handle_t chan, handle_t* memref_p) {
+    struct ipc_msg_info mi;
+    struct iovec iov = {req_buf, sizeof(req_buf)};
+    struct ipc_msg msg = {
+            .iov = &iov,
+            .num_iov = 1,
+            .handles = memref_p,
+    };
+    int rc;
+
+    *memref_p = INVALID_IPC_HANDLE;
+    rc = get_msg(chan, &mi);
+    if (rc < 0) {
+        return rc;
+    }
+    if (mi.len < sizeof(struct storage_msg) || mi.len > sizeof(req_buf) ||
+        mi.num_handles > 1) {
+        rc = ERR_BAD_LEN;
+        goto out;
+    }
+    msg.num_handles = mi.num_handles;
+    rc = read_msg(chan, mi.id, 0, &msg);
+out:
+    put_msg(chan, mi.id);
+    return rc;
+}
+
+static int fake_on_message(const struct tipc_port* port,
+                           handle_t chan,
+                           void* ctx) {
+    struct fake_chan* fake_chan = ctx;
+    struct storage_msg* msg = (void*)req_buf;
+    struct storage_msg* resp = (void*)resp_buf;
+    size_t resp_len = 0;
+    handle_t memref = INVALID_IPC_HANDLE;
+    handle_t req_memref;
+    struct iovec iov;
+    struct ipc_msg resp_msg;
+    int rc;
+
+    rc = recv_req(chan, &req_memref);
+    if (rc < 0) {
+        TLOGE("failed (%d) to receive request\n", rc);
+        return rc;
+    }
+
+    /* commands following a failed one in a batch are not executed */
+    if (fake_chan->batch_result != STORAGE_NO_ERROR) {
+        rc = fake_chan->batch_result;
+    } else {
+        rc = handle_cmd(fake_chan, msg, rc - sizeof(*msg), resp->payload,
+                        &resp_len, &memref, req_memref);
+    }
+    /* a mapped region stays mapped without its handle */
+    if (req_memref != INVALID_IPC_HANDLE) {
+        close(req_memref);
+    }
+    if (msg->flags & STORAGE_MSG_FLAG_BATCH) {
+        if (memref != INVALID_IPC_HANDLE) {
+            close(memref);
+        }
+        fake_chan->batch_result = rc;
+        return NO_ERROR;
+    }
+    fake_chan->batch_result = STORAGE_NO_ERROR;
+
+    *resp = (struct storage_msg){
+            .cmd = msg->cmd | STORAGE_RESP_BIT,
+            .op_id = msg->op_id,
+            .size = sizeof(*resp) + resp_len,
+            .result = rc,
+    };
+    /* tipc_send1() cannot pass the memref of a mapped view along */
+    iov = (struct iovec){
+            .iov_base = resp,
+            .iov_len = sizeof(*resp) + resp_len,
+    };
+    resp_msg = (struct ipc_msg){
+            .num_iov = 1,
+            .iov = &iov,
+            .num_handles = memref != INVALID_IPC_HANDLE ? 1 : 0,
+            .handles = &memref,
+    };
+    rc = send_msg(chan, &resp_msg);
+    if (memref != INVALID_IPC_HANDLE) {
+        close(memref);
+    }
+    if (rc < 0) {
+        TLOGE("failed (%d) to send response\n", rc);
+        return rc;
+    }
+    return NO_ERROR;
+}
+
+int main(void) {
+    static struct tipc_port_acl acl = {
+            .flags = IPC_PORT_ALLOW_TA_CONNECT,
+    };
+    static struct tipc_port ports[] = {
+            {
+                    .name = STORAGE_FAKE_PORT,
+                    .msg_max_size = FAKE_MAX_MSG_SIZE,
+                    .msg_queue_len = 8,
+                    .acl = &acl,
+            },
+            {
+                    .name = STORAGE_FAKE_SMALL_QUEUE_PORT,
+                    .msg_max_size = FAKE_MAX_MSG_SIZE,
+                    .msg_queue_len = 1,
+                    .acl = &acl,
+            },
+    };
+    static struct tipc_srv_ops ops = {
+            .on_connect = fake_on_connect,
+            .on_message = fake_on_message,
+            .on_channel_cleanup = fake_on_channel_cleanup,
+    };
+    struct tipc_hset* hset;
+    int rc;
+
+    hset = tipc_hset_create();
+    if (IS_ERR(hset)) {
+        TLOGE("failed (%d) to create handle set\n", PTR_ERR(hset));
+        return PTR_ERR(hset);
+    }
+
+    rc = tipc_add_service(hset, ports, countof(ports), 0, &ops);
+    if (rc < 0) {
+        TLOGE("failed (%d) to add storage service\n", rc);
+        return rc;
+    }
+
+    return tipc_run_event_loop(hset);
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Storage client benchmarks.
+ *
+ * Measures the storage client library against the storage port selected by
+ * STORAGE_BENCH_PORT at build time, the in-memory fake server by default.
+ * Benchmarks with a size parameter transfer that many bytes per run, so their
+ * throughput is the parameter divided by the reported time per run.
+ */
+
+#define TLOG_TAG "storage_bench"
+
+#include <lk/macros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trusty_unittest.h>
+#include <uapi/err.h>
+
+#include <lib/storage/storage.h>
+
+#include <storage_fake_consts.h>
+
+#ifndef STORAGE_BENCH_PORT
+#define STORAGE_BENCH_PORT STORAGE_FAKE_PORT
+#endif
+
+#define BENCH_FILE_NAME "storage_bench.file"
+#define BENCH_LIST_PREFIX "storage_bench.list."
+
+/* Size of the file read and written by the throughput benchmarks */
+#define BENCH_FILE_SIZE (256 * 1024)
+
+static storage_session_t session;
+static file_handle_t file;
+static uint8_t* buf;
+static storage_off_t next_off;
+
+/* Offset of the next access, advancing through the file or at random */
+static storage_off_t bench_off(uint64_t size, bool random) {
+    storage_off_t off;
+
+    if (random) {
+        return (rand() % (BENCH_FILE_SIZE / size)) * size;
+    }
+    off = next_off;
+    next_off = (next_off + size) % BENCH_FILE_SIZE;
+    return off;
+}
+
+static int open_bench_file(uint32_t flags) {
+    int rc = storage_open_session(&session, STORAGE_BENCH_PORT);
+
+    if (rc < 0) {
+        return rc;
+    }
+    rc = storage_open_file(session, &file, BENCH_FILE_NAME, flags,
+                           STORAGE_OP_COMPLETE);
+    if (rc < 0) {
+        storage_close_session(session);
+    }
+    return rc;
+}
+
+static void close_bench_file(void) {
+    storage_close_file(file);
+    storage_delete_file(session, BENCH_FILE_NAME, STORAGE_OP_COMPLETE);
+    storage_close_session(session);
+}
+
+BENCH_SETUP(storage_file) {
+    ssize_t rc;
+
+    buf = malloc(MAX(param, 1));
+    if (!buf) {
+        return ERR_NO_MEMORY;
+    }
+    memset(buf, 0xa5, MAX(param, 1));
+
+    rc = open_bench_file(STORAGE_FILE_OPEN_CREATE |
+                         STORAGE_FILE_OPEN_TRUNCATE);
+    if (rc < 0) {
+        goto err_open;
+    }
+    rc = storage_set_file_size(file, BENCH_FILE_SIZE, STORAGE_OP_COMPLETE);
+    if (rc < 0) {
+        goto err_size;
+    }
+    next_off = 0;
+    srand(0);
+    return NO_ERROR;
+
+err_size:
+    close_bench_file();
+err_open:
+    free(buf);
+    return rc;
+}
+
+BENCH_TEARDOWN(storage_file) {
+    close_bench_file();
+    free(buf);
+    buf = NULL;
+}
+
+static int bench_read(uint64_t size, bool random) {
+    ssize_t rc = storage_read(file, bench_off(size, random), buf, size);
+
+    if (rc < 0) {
+        return rc;
+    }
+    return (uint64_t)rc == size ? NO_ERROR : ERR_IO;
+}
+
+static int bench_write(uint64_t size, bool random, uint32_t opflags) {
+    ssize_t rc = storage_write(file, bench_off(size, random), buf, size,
+                               opflags);
+
+    if (rc < 0) {
+        return rc;
+    }
+    return (uint64_t)rc == size ? NO_ERROR : ERR_IO;
+}
+
+BENCH(storage_file, seq_read, 100, 512, 4096, 16384, 65536) {
+    return bench_read(param, false);
+}
+
+BENCH(storage_file, rand_read, 100, 512, 4096, 16384, 65536) {
+    return bench_read(param, true);
+}
+
+BENCH(storage_file, seq_write, 100, 512, 4096, 16384, 65536) {
+    return bench_write(param, false, 0);
+}
+
+BENCH(storage_file, rand_write, 100, 512, 4096, 16384, 65536) {
+    return bench_write(param, true, 0);
+}
+
+/* Write and commit, the cost of a typical small transaction */
+BENCH(storage_file, write_commit, 50, 16, 4096) {
+    return bench_write(param, true, STORAGE_OP_COMPLETE);
+}
+
+/* Commit an empty transaction */
+BENCH(storage_file, commit, 50) {
+    return storage_end_transaction(session, true);
+}
+
+BENCH_SETUP(storage_open) {
+    int rc = open_bench_file(STORAGE_FILE_OPEN_CREATE);
+
+    if (rc < 0) {
+        return rc;
+    }
+    storage_close_file(file);
+    return NO_ERROR;
+}
+
+BENCH_TEARDOWN(storage_open) {
+    storage_delete_file(session, BENCH_FILE_NAME, STORAGE_OP_COMPLETE);
+    storage_close_session(session);
+}
+
+BENCH(storage_open, open_close, 100) {
+    int rc = storage_open_file(session, &file, BENCH_FILE_NAME, 0, 0);
+
+    if (rc < 0) {
+        return rc;
+    }
+    storage_close_file(file);
+    return NO_ERROR;
+}
+
+static void list_file_name(char* name, size_t size, uint64_t i) {
+    snprintf(name, size, "%s%04u", BENCH_LIST_PREFIX, (unsigned int)i);
+}
+
+static void delete_list_files(uint64_t count) {
+    char name[STORAGE_MAX_NAME_LENGTH_BYTES];
+    uint64_t i;
+
+    for (i = 0; i < count; i++) {
+        list_file_name(name, sizeof(name), i);
+        storage_delete_file(session, name, 0);
+    }
+    storage_end_transaction(session, true);
+}
+
+BENCH_SETUP(storage_list) {
+    char name[STORAGE_MAX_NAME_LENGTH_BYTES];
+    file_handle_t fh;
+    uint64_t i;
+    int rc;
+
+    rc = storage_open_session(&session, STORAGE_BENCH_PORT);
+    if (rc < 0) {
+        return rc;
+    }
+    for (i = 0; i < param; i++) {
+        list_file_name(name, sizeof(name), i);
+        rc = storage_open_file(session, &fh, name, STORAGE_FILE_OPEN_CREATE,
+                               0);
+        if (rc < 0) {
+            delete_list_files(i);
+            storage_close_session(session);
+            return rc;
+        }
+        storage_close_file(fh);
+    }
+    return storage_end_transaction(session, true);
+}
+
+BENCH_TEARDOWN(storage_list) {
+    delete_list_files(param);
+    storage_close_session(session);
+}
+
+/* List @param files, the only ones with the benchmark's name prefix */
+BENCH(storage_list, list_prefix, 20, 16, 256, 1024) {
+    struct storage_dir_entry entries[16];
+    struct storage_open_dir_state* dir;
+    uint64_t count = 0;
+    int rc;
+
+    rc = storage_open_dir_prefix(session, BENCH_LIST_PREFIX, &dir);
+    if (rc < 0) {
+        return rc;
+    }
+    do {
+        rc = storage_read_dir_entries(session, dir, entries,
+                                      countof(entries));
+        if (rc > 0) {
+            count += rc;
+        }
+    } while (rc == countof(entries));
+    storage_close_dir(session, dir);
+
+    if (rc < 0) {
+        return rc;
+    }
+    return count == param ? NO_ERROR : ERR_IO;
+}
+
+PORT_TEST(storage_bench, "com.android.trusty.storage.bench");
@@ -23,8 +23,60 @@
         _tlog(args);                    \
     } while (0)
 
+#ifdef TRUSTY_USERSPACE
+/*
+ * Every test defined with the lk test macros starts with TEST_BEGIN_FUNC()
+ * and ends with TEST_END_FUNC(). Rename the lk implementations so they can be
+ * wrapped below to let the test client select tests and collect results.
+ */
+#define TEST_BEGIN_FUNC trusty_unittest_lk_begin_func
+#define TEST_END_FUNC trusty_unittest_lk_end_func
+#endif
+
 #include <lk/trusty_unittest.h>
 
 #ifdef TRUSTY_USERSPACE
 #include <lib/unittest/unittest.h>
+#include <stdio.h>
+#include <trusty/time.h>
+
+#undef TEST_BEGIN_FUNC
+#undef TEST_END_FUNC
+
+static char _trusty_unittest_name[128];
+static int64_t _trusty_unittest_start;
+
+static inline bool trusty_unittest_begin(const char* suite_name,
+                                         const char* test_name) {
+    snprintf(_trusty_unittest_name, sizeof(_trusty_unittest_name), "%s.%s",
+             suite_name, test_name);
+    if (!unittest_should_run(_trusty_unittest_name)) {
+        return false;
+    }
+    trusty_gettime(0, &_trusty_unittest_start);
+    return true;
+}
+
+static inline void trusty_unittest_end(void) {
+    int64_t now;
+
+    trusty_gettime(0, &now);
+    unittest_report_result(_trusty_unittest_name, !HasFailure(),
+                           now - _trusty_unittest_start);
+}
+
+/* Tests the client did not select return before they are started */
+#define TEST_BEGIN_FUNC(suite_name, test_name, args...)               \
+    do {                                                              \
+        if (!trusty_unittest_begin(suite_name, test_name)) {          \
+            return;                                                   \
+        }                                                             \
+        trusty_unittest_lk_begin_func(suite_name, test_name, ##args); \
+    } while (0)
+
+#define TEST_END_FUNC()                \
+    do {                               \
+        trusty_unittest_lk_end_func(); \
+        trusty_unittest_end();         \
+    } while (0)
 #endif
@@ -25,6 +25,7 @@
 #define HWAES_MAX_NUM_HANDLES 8
 #define HWAES_MAX_MSG_SIZE 0x1000
 #define HWAES_INVALID_INDEX UINT32_MAX
+#define HWAES_MAX_BATCH_OPS 16
 
 /*
  * The number of parts on tipc request message:
@@ -96,12 +97,18 @@ enum hwaes_key_type {
  * @HWAES_RESP_BIT:   Response bit set as part of response.
  * @HWAES_REQ_SHIFT:  Number of bits used by response bit.
  * @HWAES_AES:        Command to run plain encryption.
+ * @HWAES_RELEASE_SHM: Command to drop the server's mapping of a shared memory
+ *                    identified by &struct hwaes_shm_desc @id.
+ * @HWAES_AES_BATCH:  Command to run several encryption operations in one
+ *                    request.
  */
 enum hwaes_cmd {
     HWAES_RESP_BIT = 1,
     HWAES_REQ_SHIFT = 1,
 
     HWAES_AES = (1 << HWAES_REQ_SHIFT),
+    HWAES_RELEASE_SHM = (2 << HWAES_REQ_SHIFT),
+    HWAES_AES_BATCH = (3 << HWAES_REQ_SHIFT),
 };
 
 /**
@@ -157,12 +164,19 @@ STATIC_ASSERT(sizeof(struct hwaes_data_desc) == 8 + 8 + 4 + 4);
  * @size:  The size of the shared memory.
  * @write: Flag to indicate whether the shared memory is writeable (value 1)
  *         or not (value 0).
- * @reserved: Reserved to make 64 bit alignment, must be 0.
+ * @id:    Identifier of the shared memory chosen by the client, or 0.
+ *         If not 0, the server keeps the shared memory mapped after the
+ *         request, and serves later requests on the same channel that carry
+ *         the same id and size from that mapping instead of mapping the
+ *         handle sent with them. The mapping is kept until the channel is
+ *         closed or the client sends HWAES_RELEASE_SHM for the id, which it
+ *         must do before using the id for other memory. Ids must be unique
+ *         within a request.
  */
 struct hwaes_shm_desc {
     uint64_t size;
     uint32_t write;
-    uint32_t reserved;
+    uint32_t id;
 };
 STATIC_ASSERT(sizeof(struct hwaes_shm_desc) == 8 + 4 + 4);
 
@@ -227,3 +241,43 @@ struct hwaes_aes_req {
 };
 STATIC_ASSERT(sizeof(struct hwaes_aes_req) ==
               sizeof(struct hwaes_data_desc) * 7 + 4 * 6);
+
+/**
+ * struct hwaes_release_shm_req - request header for HWAES_RELEASE_SHM command
+ * @id:       The id of the shared memory to release, as sent in
+ *            &struct hwaes_shm_desc. Releasing an id the server has no
+ *            mapping for succeeds.
+ * @reserved: Reserved to make 64 bit alignment, must be 0.
+ */
+struct hwaes_release_shm_req {
+    uint32_t id;
+    uint32_t reserved;
+};
+STATIC_ASSERT(sizeof(struct hwaes_release_shm_req) == 4 + 4);
+
+/**
+ * struct hwaes_aes_batch_req - request header for HWAES_AES_BATCH command
+ * @num_ops:     The number of operations, between 1 and HWAES_MAX_BATCH_OPS.
+ * @num_handles: The number of handles to shared memory, shared by all
+ *               operations. These handles are transferred from the client to
+ *               the server.
+ *
+ * An array of num_handles shared memory descriptors follows this header in
+ * tipc message, then an array of num_ops &struct hwaes_aes_req, one per
+ * operation, whose num_handles must be 0, and then the data transferred
+ * through the tipc message. Unlike for HWAES_AES, data descriptors of input
+ * arguments may refer to any data following the headers, so operations can
+ * share input data such as a key.
+ *
+ * The response starts with a &struct hwaes_resp and an array of num_ops
+ * uint32_t results, one of &enum hwaes_err per operation, followed by the
+ * output data transferred through the tipc message, in the order of the
+ * operations, which is only valid for operations that succeeded. If the
+ * result in &struct hwaes_resp is not HWAES_NO_ERROR, the request could not
+ * be parsed, no operation was run, and the response is only that header.
+ */
+struct hwaes_aes_batch_req {
+    uint32_t num_ops;
+    uint32_t num_handles;
+};
+STATIC_ASSERT(sizeof(struct hwaes_aes_batch_req) == 4 + 4);
@@ -28,7 +28,11 @@
  *
  * Metrics event reporters, e.g. kernel, are expected to connect to this service
  * and report events via TIPC. The service acknowledges each event with a
- * TIPC response.
+ * TIPC response. Apps listed when the metrics service is built, see
+ * METRICS_STORAGE_REPORTERS_SRC in its rules.mk, may connect as well, but
+ * only to report their own storage statistics with
+ * %METRICS_CMD_REPORT_STORAGE; other events are only accepted from the kernel.
+ * The service sets the app ID of those events to the UUID of the app.
  *
  * Format of the event messages are the same as the one defined by metrics
  * interface exposed to non-secure.
@@ -47,6 +47,7 @@
  * @METRICS_CMD_REQ_SHIFT:         number of bits used by @METRICS_CMD_RESP_BIT
  * @METRICS_CMD_REPORT_EVENT_DROP: report gaps in the event stream
  * @METRICS_CMD_REPORT_CRASH:      report an app crash event
+ * @METRICS_CMD_REPORT_STORAGE:    report storage operation statistics of an app
  */
 enum metrics_cmd {
     METRICS_CMD_RESP_BIT = 1,
@@ -54,6 +55,7 @@ enum metrics_cmd {
 
     METRICS_CMD_REPORT_EVENT_DROP = (1 << METRICS_CMD_REQ_SHIFT),
     METRICS_CMD_REPORT_CRASH = (2 << METRICS_CMD_REQ_SHIFT),
+    METRICS_CMD_REPORT_STORAGE = (3 << METRICS_CMD_REQ_SHIFT),
 };
 
 /**
@@ -96,8 +98,61 @@ struct metrics_report_crash_req {
     uint32_t app_id_len;
 } __attribute__((__packed__));
 
+/**
+ * enum metrics_storage_op - storage operations statistics are reported for
+ * @METRICS_STORAGE_OP_OPEN:   opening a file
+ * @METRICS_STORAGE_OP_READ:   reading from a file
+ * @METRICS_STORAGE_OP_WRITE:  writing to a file without committing
+ * @METRICS_STORAGE_OP_COMMIT: committing a transaction, including any write
+ *                             that commits it
+ * @METRICS_STORAGE_OP_LIST:   listing files
+ */
+enum metrics_storage_op {
+    METRICS_STORAGE_OP_OPEN = 0,
+    METRICS_STORAGE_OP_READ = 1,
+    METRICS_STORAGE_OP_WRITE = 2,
+    METRICS_STORAGE_OP_COMMIT = 3,
+    METRICS_STORAGE_OP_LIST = 4,
+};
+
+/*
+ * Number of latency histogram buckets. Bucket 0 counts operations that took
+ * less than METRICS_STORAGE_BUCKET0_USEC microseconds, and each following
+ * bucket covers twice the latency of the previous one. The last bucket
+ * counts all slower operations.
+ */
+#define METRICS_STORAGE_BUCKETS 16
+#define METRICS_STORAGE_BUCKET0_USEC 64
+
+/**
+ * struct metrics_report_storage_req - arguments of %METRICS_CMD_REPORT_STORAGE
+ *                                     requests
+ * @op:         the operation reported, one of &enum metrics_storage_op
+ * @count:      number of operations
+ * @errors:     number of operations that failed
+ * @app_id_len: length of app ID that follows this structure, the UUID of the
+ *              reporting app
+ * @bytes:      number of bytes transferred by successful operations
+ * @total_usec: total latency of all operations in microseconds
+ * @max_usec:   latency of the slowest operation in microseconds
+ * @hist:       latency histogram, see %METRICS_STORAGE_BUCKETS
+ *
+ * Counts accumulate from the time the app started, or last reset them.
+ */
+struct metrics_report_storage_req {
+    uint32_t op;
+    uint32_t count;
+    uint32_t errors;
+    uint32_t app_id_len;
+    uint64_t bytes;
+    uint64_t total_usec;
+    uint64_t max_usec;
+    uint32_t hist[METRICS_STORAGE_BUCKETS];
+} __attribute__((__packed__));
+
 #define METRICS_MAX_APP_ID_LEN 256
 
-#define METRICS_MAX_MSG_SIZE                                                \
-    (sizeof(struct metrics_req) + sizeof(struct metrics_report_crash_req) + \
+/* %METRICS_CMD_REPORT_STORAGE requests are the largest ones */
+#define METRICS_MAX_MSG_SIZE                                                  \
+    (sizeof(struct metrics_req) + sizeof(struct metrics_report_storage_req) + \
      METRICS_MAX_APP_ID_LEN)
@@ -60,6 +60,17 @@ enum storage_cmd {
 
     STORAGE_FILE_MOVE = 10 << STORAGE_REQ_SHIFT,
     STORAGE_FILE_LIST = 11 << STORAGE_REQ_SHIFT,
+
+    /* shared memory data path */
+    STORAGE_SHM_MAP = 12 << STORAGE_REQ_SHIFT,
+    STORAGE_FILE_READ_SHM = 13 << STORAGE_REQ_SHIFT,
+    STORAGE_FILE_WRITE_SHM = 14 << STORAGE_REQ_SHIFT,
+
+    /* listing of files with a common name prefix */
+    STORAGE_FILE_LIST_PREFIX = 15 << STORAGE_REQ_SHIFT,
+
+    /* read-only mapping of a whole file */
+    STORAGE_FILE_MAP = 16 << STORAGE_REQ_SHIFT,
 };
 
 /**
@@ -174,8 +185,11 @@ enum storage_file_list_flag {
  *                                          with this flag unset, at which point a
  *                                          cumulative result for all messages sent
  *                                          with STORAGE_MSG_FLAG_BATCH will be
- *                                          sent. This is only supported by the
- *                                          non-secure disk proxy server.
+ *                                          sent. This is supported by the
+ *                                          non-secure disk proxy server. Client
+ *                                          ports may support it for consecutive
+ *                                          STORAGE_FILE_WRITE commands, which
+ *                                          clients have to detect, see below.
  * @STORAGE_MSG_FLAG_PRE_COMMIT:            if set, indicates that server need to
  *                                          commit pending changes before processing
  *                                          this message.
@@ -199,6 +213,27 @@ enum storage_msg_flag {
     STORAGE_MSG_FLAG_PRE_COMMIT_CHECKPOINT = 0x8,
 };
 
+/*
+ * Batched writes on client ports
+ *
+ * Batching is optional on client ports, and there is no command to query it.
+ * A client may split a large write into several STORAGE_FILE_WRITE commands
+ * and set STORAGE_MSG_FLAG_BATCH on all but the last one. A server that
+ * supports batching processes batched commands without responding. The
+ * command terminating the batch gets the only response: its @result is the
+ * first error hit by any command in the batch, or STORAGE_NO_ERROR, and its
+ * @op_id is that of the terminating command. Commands that follow a failed one
+ * in the same batch are not executed. Transaction flags are only honored on
+ * the terminating command.
+ *
+ * Servers that do not support batching ignore STORAGE_MSG_FLAG_BATCH and
+ * respond to every command. Clients must therefore accept a response for each
+ * command of a batch, matching them using @op_id, and must not have more
+ * commands in flight than fit into their receive queue until a server has
+ * answered a batch of several commands with a single response. A server
+ * answers all batches on a connection the same way.
+ */
+
 /*
  * The following declarations are the message-specific contents of
  * the 'payload' element inside struct storage_msg.
@@ -296,6 +331,81 @@ struct storage_file_write_req {
     uint8_t data[0];
 };
 
+/**
+ * struct storage_shm_map_req - request format for STORAGE_SHM_MAP
+ * @size: size of the shared memory region in bytes
+ *
+ * The message carries a memref handle for the region, which must be readable
+ * and writable. A session has at most one region mapped, mapping a new one
+ * replaces it. The server unmaps the region when the session is closed.
+ */
+struct storage_shm_map_req {
+    uint64_t size;
+};
+
+/**
+ * struct storage_file_read_shm_req - request format for STORAGE_FILE_READ_SHM
+ * @offset:     the offset in the file from whence to read
+ * @shm_offset: the offset in the session's shared memory region to read into
+ * @handle:     the handle for the file from which to read
+ * @size:       the quantity of bytes to read from the file
+ */
+struct storage_file_read_shm_req {
+    uint64_t offset;
+    uint64_t shm_offset;
+    uint32_t handle;
+    uint32_t size;
+};
+
+/**
+ * struct storage_file_read_shm_resp - response format for
+ * STORAGE_FILE_READ_SHM
+ * @size: the number of bytes read into shared memory. Less than the requested
+ *        size only if the end of the file was reached.
+ */
+struct storage_file_read_shm_resp {
+    uint32_t size;
+};
+
+/**
+ * struct storage_file_write_shm_req - request format for
+ * STORAGE_FILE_WRITE_SHM
+ * @offset:     the offset in the file from whence to write
+ * @shm_offset: the offset in the session's shared memory region of the data
+ * @handle:     the handle for the file to write to
+ * @size:       the quantity of bytes to write
+ */
+struct storage_file_write_shm_req {
+    uint64_t offset;
+    uint64_t shm_offset;
+    uint32_t handle;
+    uint32_t size;
+};
+
+/**
+ * struct storage_file_map_req - request format for STORAGE_FILE_MAP
+ * @handle:     the handle for the file to map
+ * @__reserved: must be 0
+ *
+ * Asks the server for a read-only copy of the whole file, verified as for a
+ * read. On success, the response carries a memref handle for the copy, which
+ * covers the file size rounded up to whole pages and stays valid when the
+ * file is changed or closed. Servers that do not support this command return
+ * STORAGE_ERR_UNIMPLEMENTED.
+ */
+struct storage_file_map_req {
+    uint32_t handle;
+    uint32_t __reserved;
+};
+
+/**
+ * struct storage_file_map_resp - response format for STORAGE_FILE_MAP
+ * @size: the size of the file, and of the data at the start of the memref
+ */
+struct storage_file_map_resp {
+    uint64_t size;
+};
+
 /**
  * struct storage_file_list_req - request format for STORAGE_FILE_LIST
  * @max_count:  Max number of files to return, or 0 for no limit.
@@ -310,6 +420,30 @@ struct storage_file_list_req {
     char name[0];
 };
 
+/**
+ * struct storage_file_list_prefix_req - request format for
+ * STORAGE_FILE_LIST_PREFIX
+ * @max_count:  Max number of files to return, or 0 for no limit.
+ * @flags:      STORAGE_FILE_LIST_START or a copy of @flags last returned in
+ *              storage_file_list_resp.
+ * @prefix_len: Length of the name prefix at the start of @data.
+ * @__reserved: Must be 0.
+ * @data:       @prefix_len bytes of name prefix, followed by the file name last
+ *              returned in storage_file_list_resp unless @flags is
+ *              STORAGE_FILE_LIST_START.
+ *
+ * Behaves like STORAGE_FILE_LIST, but only lists files whose names start with
+ * the prefix. The response has the same format as for STORAGE_FILE_LIST.
+ * Servers that do not support this command return STORAGE_ERR_UNIMPLEMENTED.
+ */
+struct storage_file_list_prefix_req {
+    uint8_t max_count;
+    uint8_t flags;
+    uint8_t prefix_len;
+    uint8_t __reserved;
+    char data[0];
+};
+
 /**
  * struct storage_file_list_resp - response format for STORAGE_FILE_LIST
  * @flags:      Any of the flags in storage_file_list_flag.
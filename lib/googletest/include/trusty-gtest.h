@@ -19,10 +19,61 @@
 #include <gtest/gtest.h>
 #include <lib/unittest/unittest.h>
 #include <lk/compiler.h>
+#include <trusty/time.h>
+
+#include <string>
+
+namespace trusty_gtest {
+
+/* Reports the result and duration of each test to the test client */
+class ResultReporter : public testing::EmptyTestEventListener {
+public:
+    void OnTestStart(const testing::TestInfo&) override {
+        trusty_gettime(0, &start_);
+    }
+
+    void OnTestEnd(const testing::TestInfo& info) override {
+        int64_t end;
+        trusty_gettime(0, &end);
+        std::string name =
+                std::string(info.test_suite_name()) + "." + info.name();
+        unittest_report_result(name.c_str(), info.result()->Passed(),
+                               end - start_);
+    }
+
+private:
+    int64_t start_ = 0;
+};
+
+static inline void InstallResultReporter() {
+    testing::UnitTest::GetInstance()->listeners().Append(new ResultReporter);
+}
+
+/* Restrict the next run to the tests selected by the test client */
+static inline void SelectTests() {
+    testing::UnitTest* unit_test = testing::UnitTest::GetInstance();
+    std::string filter;
+
+    for (int i = 0; i < unit_test->total_test_suite_count(); i++) {
+        const testing::TestSuite* suite = unit_test->GetTestSuite(i);
+        for (int j = 0; j < suite->total_test_count(); j++) {
+            const testing::TestInfo* info = suite->GetTestInfo(j);
+            std::string name = std::string(suite->name()) + "." + info->name();
+            if (unittest_should_run(name.c_str())) {
+                filter += name + ":";
+            }
+        }
+    }
+    /* "-*" runs nothing */
+    testing::GTEST_FLAG(filter) = filter.empty() ? "-*" : filter;
+}
+
+}  // namespace trusty_gtest
 
 #define PORT_GTEST(suite_name, port_name_string)          \
     __BEGIN_CDECLS                                        \
     static bool run_##suite_name(struct unittest* test) { \
+        trusty_gtest::SelectTests();                      \
         return RUN_ALL_TESTS();                           \
     }                                                     \
                                                           \
@@ -36,6 +87,7 @@
         int fake_argc = 1;                                \
         char* fake_argv[] = {(char*)"test", NULL};        \
         testing::InitGoogleTest(&fake_argc, fake_argv);   \
+        trusty_gtest::InstallResultReporter();            \
         return unittest_main(&tests, 1);                  \
     }                                                     \
     __END_CDECLS
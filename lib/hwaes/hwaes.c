@@ -16,6 +16,7 @@
 
 #include <assert.h>
 #include <lib/tipc/tipc.h>
+#include <lk/macros.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -108,6 +109,7 @@ static void hwaes_set_shm_arg_helper(const uint8_t* data_ptr,
 
         if (i == shm_num) {
             shm_descs[i].size = shm_hd_ptr->size;
+            shm_descs[i].id = shm_hd_ptr->id;
             shm_wrapper_ptr->handles[i] = shm_hd_ptr->handle;
             shm_wrapper_ptr->num_handles = shm_num + 1;
         }
@@ -411,6 +413,114 @@ static int hwaes_crypt(hwaes_session_t session,
     return hwaes_err_to_tipc_err(resp.result);
 }
 
+/**
+ * struct hwaes_batch_buf - buffers for a HWAES_AES_BATCH request.
+ * @ops:  the operation headers of the request.
+ * @data: the data of the request not in shared memory, and then the one of
+ *        the response.
+ */
+struct hwaes_batch_buf {
+    struct hwaes_aes_req ops[HWAES_MAX_BATCH_OPS];
+    uint8_t data[HWAES_MAX_MSG_SIZE];
+};
+
+/**
+ * hwaes_check_batch_shm() - check the shared memories of a batch operation.
+ * @args:            arguments of the operation.
+ * @shm_wrapper_ptr: pointer to the wrapper of shared memmory array holding
+ *                   the shared memories of the earlier operations.
+ *
+ * Returns: NO_ERROR on success, ERR_TOO_BIG if the batch would use more than
+ * HWAES_MAX_NUM_HANDLES shared memories.
+ */
+static int hwaes_check_batch_shm(const struct hwcrypt_args* args,
+                                 const struct hwaes_shm* shm_wrapper_ptr) {
+    const struct hwcrypt_shm_hd* shm_hds[] = {
+            args->key.shm_hd_ptr,    args->iv.shm_hd_ptr,
+            args->aad.shm_hd_ptr,    args->text_in.shm_hd_ptr,
+            args->tag_in.shm_hd_ptr, args->text_out.shm_hd_ptr,
+            args->tag_out.shm_hd_ptr,
+    };
+    struct hwaes_shm shm = *shm_wrapper_ptr;
+
+    for (size_t i = 0; i < countof(shm_hds); i++) {
+        size_t j;
+
+        if (!shm_hds[i]) {
+            continue;
+        }
+        for (j = 0; j < shm.num_handles; j++) {
+            if (shm.handles[j] == shm_hds[i]->handle) {
+                break;
+            }
+        }
+        if (j < shm.num_handles) {
+            continue;
+        }
+        if (shm.num_handles == HWAES_MAX_NUM_HANDLES) {
+            return ERR_TOO_BIG;
+        }
+        shm.handles[shm.num_handles++] = shm_hds[i]->handle;
+    }
+    return NO_ERROR;
+}
+
+/**
+ * hwaes_copy_batch_arg_in() - copy an input argument into a batch request.
+ * @arg_ptr:         pointer to the input arg.
+ * @data_desc_ptr:   pointer to data descriptor.
+ * @req_header_size: the size of the request headers preceding @data.
+ * @data:            the data of the request following the headers.
+ * @data_len_ptr:    pointer to the length of @data used so far.
+ *
+ * Returns: NO_ERROR on success, ERR_TOO_BIG if the argument does not fit in
+ * the request message.
+ */
+static int hwaes_copy_batch_arg_in(const struct hwcrypt_arg_in* arg_ptr,
+                                   struct hwaes_data_desc* data_desc_ptr,
+                                   size_t req_header_size,
+                                   uint8_t* data,
+                                   size_t* data_len_ptr) {
+    size_t data_len = *data_len_ptr;
+
+    if (data_desc_ptr->shm_idx != HWAES_INVALID_INDEX || !arg_ptr->len) {
+        return NO_ERROR;
+    }
+    if (arg_ptr->len > HWAES_MAX_MSG_SIZE - req_header_size - data_len) {
+        return ERR_TOO_BIG;
+    }
+    memcpy(data + data_len, arg_ptr->data_ptr, arg_ptr->len);
+    data_desc_ptr->offset = req_header_size + data_len;
+    data_desc_ptr->len = arg_ptr->len;
+    *data_len_ptr = data_len + arg_ptr->len;
+    return NO_ERROR;
+}
+
+/**
+ * hwaes_find_batch_key() - find a key already in a batch request.
+ * @ops:     the operations of the batch.
+ * @cmd_ops: the operation headers of the request.
+ * @i:       the index of the operation whose key to look up.
+ *
+ * Returns: the data descriptor of an earlier operation's key sent in the
+ * request message with the same data, or NULL.
+ */
+static struct hwaes_data_desc* hwaes_find_batch_key(
+        const struct hwcrypt_batch_op* ops,
+        struct hwaes_aes_req* cmd_ops,
+        size_t i) {
+    const struct hwcrypt_arg_in* key = &ops[i].args.key;
+
+    for (size_t j = 0; j < i; j++) {
+        if (cmd_ops[j].key.shm_idx == HWAES_INVALID_INDEX &&
+            ops[j].args.key.data_ptr == key->data_ptr &&
+            ops[j].args.key.len == key->len) {
+            return &cmd_ops[j].key;
+        }
+    }
+    return NULL;
+}
+
 int hwaes_open(hwaes_session_t* session) {
     int rc = tipc_connect(session, HWAES_PORT);
     if (rc < 0) {
@@ -427,6 +537,255 @@ int hwaes_decrypt(hwaes_session_t session, const struct hwcrypt_args* args) {
     return hwaes_crypt(session, args, false);
 }
 
+int hwaes_release_shm(hwaes_session_t session, uint32_t id) {
+    int rc;
+
+    if (session == INVALID_IPC_HANDLE) {
+        TLOGE("invalid session handle\n");
+        return ERR_BAD_HANDLE;
+    }
+
+    struct hwaes_req req = {
+            .cmd = HWAES_RELEASE_SHM,
+    };
+    struct hwaes_release_shm_req cmd_header = {
+            .id = id,
+    };
+    struct hwaes_resp resp = {0};
+
+    struct hwaes_iov req_iov = {0};
+    struct hwaes_iov resp_iov = {0};
+    struct hwaes_shm shm = {0};
+
+    hwaes_set_iov_helper(&req, sizeof(req), &req_iov);
+    hwaes_set_iov_helper(&cmd_header, sizeof(cmd_header), &req_iov);
+    hwaes_set_iov_helper(&resp, sizeof(resp), &resp_iov);
+
+    rc = hwaes_send_req(session, &req_iov, &shm);
+    if (rc != NO_ERROR) {
+        TLOGE("failed to hwaes_send_req (%d)\n", rc);
+        return rc;
+    }
+
+    size_t resp_msg_size;
+    rc = hwaes_recv_resp(session, &resp_iov, &resp_msg_size);
+    if (rc != NO_ERROR) {
+        TLOGE("failed to hwaes_recv_resp (%d)\n", rc);
+        return rc;
+    }
+
+    if (resp.cmd != (req.cmd | HWAES_RESP_BIT)) {
+        TLOGE("invalid response cmd (0x%x) for request cmd (0x%x)\n", resp.cmd,
+              req.cmd);
+        return ERR_NOT_VALID;
+    }
+
+    return hwaes_err_to_tipc_err(resp.result);
+}
+
+int hwaes_crypt_batch(hwaes_session_t session,
+                      struct hwcrypt_batch_op* ops,
+                      size_t num_ops) {
+    int rc;
+
+    if (session == INVALID_IPC_HANDLE) {
+        TLOGE("invalid session handle\n");
+        return ERR_BAD_HANDLE;
+    }
+
+    if (!num_ops || num_ops > HWAES_MAX_BATCH_OPS) {
+        TLOGE("invalid number of batch operations (%zu)\n", num_ops);
+        return ERR_INVALID_ARGS;
+    }
+
+    struct hwaes_req req = {
+            .cmd = HWAES_AES_BATCH,
+    };
+    struct hwaes_aes_batch_req batch_header = {
+            .num_ops = num_ops,
+    };
+    struct hwaes_resp resp = {0};
+    uint32_t results[HWAES_MAX_BATCH_OPS] = {0};
+
+    struct hwaes_iov req_iov = {0};
+    struct hwaes_iov resp_iov = {0};
+    struct hwaes_shm shm = {0};
+    struct hwaes_shm_desc shm_descs[HWAES_MAX_NUM_HANDLES] = {0};
+
+    /* too big for the stack of most clients */
+    struct hwaes_batch_buf* buf = calloc(1, sizeof(*buf));
+    if (!buf) {
+        TLOGE("failed to allocate batch buffers\n");
+        return ERR_NO_MEMORY;
+    }
+
+    for (size_t i = 0; i < num_ops; i++) {
+        const struct hwcrypt_args* args = &ops[i].args;
+        struct hwaes_aes_req* cmd_op = &buf->ops[i];
+
+        rc = hwaes_check_batch_shm(args, &shm);
+        if (rc != NO_ERROR) {
+            TLOGE("batch uses too many shared memories\n");
+            goto out;
+        }
+
+        cmd_op->key_type = args->key_type;
+        cmd_op->padding = args->padding;
+        cmd_op->mode = args->mode;
+        cmd_op->encrypt = ops[i].encrypt ? 1 : 0;
+
+        hwaes_set_shm_arg_in(&args->key, &cmd_op->key, shm_descs, &shm);
+        hwaes_set_shm_arg_in(&args->iv, &cmd_op->iv, shm_descs, &shm);
+        hwaes_set_shm_arg_in(&args->aad, &cmd_op->aad, shm_descs, &shm);
+        hwaes_set_shm_arg_in(&args->text_in, &cmd_op->text_in, shm_descs,
+                             &shm);
+        hwaes_set_shm_arg_in(&args->tag_in, &cmd_op->tag_in, shm_descs, &shm);
+        hwaes_set_shm_arg_out(&args->text_out, &cmd_op->text_out, shm_descs,
+                              &shm);
+        hwaes_set_shm_arg_out(&args->tag_out, &cmd_op->tag_out, shm_descs,
+                              &shm);
+    }
+    batch_header.num_handles = shm.num_handles;
+
+    hwaes_set_iov_helper(&req, sizeof(req), &req_iov);
+    hwaes_set_iov_helper(&batch_header, sizeof(batch_header), &req_iov);
+    hwaes_set_iov_helper(shm_descs,
+                         shm.num_handles * sizeof(struct hwaes_shm_desc),
+                         &req_iov);
+    hwaes_set_iov_helper(buf->ops, num_ops * sizeof(struct hwaes_aes_req),
+                         &req_iov);
+
+    size_t req_header_size = req_iov.total_len;
+    size_t data_len = 0;
+
+    rc = NO_ERROR;
+    for (size_t i = 0; i < num_ops && rc == NO_ERROR; i++) {
+        const struct hwcrypt_args* args = &ops[i].args;
+        struct hwaes_aes_req* cmd_op = &buf->ops[i];
+        struct hwaes_data_desc* key = hwaes_find_batch_key(ops, buf->ops, i);
+        struct {
+            const struct hwcrypt_arg_in* arg;
+            struct hwaes_data_desc* desc;
+        } ins[] = {
+                {&args->key, &cmd_op->key},
+                {&args->iv, &cmd_op->iv},
+                {&args->aad, &cmd_op->aad},
+                {&args->text_in, &cmd_op->text_in},
+                {&args->tag_in, &cmd_op->tag_in},
+        };
+
+        /* send a key several operations use only once */
+        if (key) {
+            cmd_op->key = *key;
+        }
+        for (size_t j = key ? 1 : 0; j < countof(ins) && rc == NO_ERROR;
+             j++) {
+            rc = hwaes_copy_batch_arg_in(ins[j].arg, ins[j].desc,
+                                         req_header_size, buf->data,
+                                         &data_len);
+        }
+    }
+    if (rc != NO_ERROR) {
+        TLOGE("batch input data exceeds the maximum message size\n");
+        goto out;
+    }
+    hwaes_set_iov_helper(buf->data, data_len, &req_iov);
+
+    hwaes_set_iov_helper(&resp, sizeof(resp), &resp_iov);
+    hwaes_set_iov_helper(results, num_ops * sizeof(results[0]), &resp_iov);
+
+    /* the response data reuses buf->data, which is sent by then */
+    size_t resp_header_size = resp_iov.total_len;
+    size_t resp_data_len = 0;
+
+    for (size_t i = 0; i < num_ops; i++) {
+        const struct hwcrypt_arg_out* outs[] = {
+                &ops[i].args.text_out,
+                &ops[i].args.tag_out,
+        };
+        struct hwaes_data_desc* descs[] = {
+                &buf->ops[i].text_out,
+                &buf->ops[i].tag_out,
+        };
+
+        for (size_t j = 0; j < countof(outs); j++) {
+            if (descs[j]->shm_idx != HWAES_INVALID_INDEX || !outs[j]->len) {
+                continue;
+            }
+            if (outs[j]->len >
+                HWAES_MAX_MSG_SIZE - resp_header_size - resp_data_len) {
+                TLOGE("batch output data exceeds the maximum message size\n");
+                rc = ERR_TOO_BIG;
+                goto out;
+            }
+            descs[j]->offset = resp_header_size + resp_data_len;
+            descs[j]->len = outs[j]->len;
+            resp_data_len += outs[j]->len;
+        }
+    }
+    hwaes_set_iov_helper(buf->data, resp_data_len, &resp_iov);
+
+    rc = hwaes_send_req(session, &req_iov, &shm);
+    if (rc != NO_ERROR) {
+        TLOGE("failed to hwaes_send_req (%d)\n", rc);
+        goto out;
+    }
+
+    size_t resp_msg_size;
+    rc = hwaes_recv_resp(session, &resp_iov, &resp_msg_size);
+    if (rc != NO_ERROR) {
+        TLOGE("failed to hwaes_recv_resp (%d)\n", rc);
+        goto out;
+    }
+
+    if (resp.cmd != (req.cmd | HWAES_RESP_BIT)) {
+        TLOGE("invalid response cmd (0x%x) for request cmd (0x%x)\n", resp.cmd,
+              req.cmd);
+        rc = ERR_NOT_VALID;
+        goto out;
+    }
+
+    if (resp.result != HWAES_NO_ERROR) {
+        rc = hwaes_err_to_tipc_err(resp.result);
+        goto out;
+    }
+
+    if (resp_msg_size != resp_iov.total_len) {
+        TLOGE("wrong response message length (%zu)\n", resp_msg_size);
+        rc = ERR_BAD_LEN;
+        goto out;
+    }
+
+    for (size_t i = 0; i < num_ops; i++) {
+        struct hwcrypt_arg_out* outs[] = {
+                &ops[i].args.text_out,
+                &ops[i].args.tag_out,
+        };
+        struct hwaes_data_desc* descs[] = {
+                &buf->ops[i].text_out,
+                &buf->ops[i].tag_out,
+        };
+
+        ops[i].result = hwaes_err_to_tipc_err(results[i]);
+        if (ops[i].result != NO_ERROR) {
+            continue;
+        }
+        for (size_t j = 0; j < countof(outs); j++) {
+            if (descs[j]->shm_idx != HWAES_INVALID_INDEX || !outs[j]->len) {
+                continue;
+            }
+            memcpy(outs[j]->data_ptr,
+                   buf->data + descs[j]->offset - resp_header_size,
+                   outs[j]->len);
+        }
+    }
+    rc = NO_ERROR;
+
+out:
+    free(buf);
+    return rc;
+}
+
 void hwaes_close(hwaes_session_t session) {
     close(session);
 }
@@ -40,11 +40,18 @@ int hwaes_open(hwaes_session_t* session);
  * @handle: handle to the shared memory.
  * @base:   base address (on client virtual address space) of the shared memory.
  * @size:   size of the shared memory region.
+ * @id:     optional identifier of the shared memory, unique among the shared
+ *          memories used on the session, or 0.
+ *
+ * If @id is not 0, the server keeps the shared memory mapped between
+ * operations instead of mapping it for each one. Call hwaes_release_shm()
+ * before closing @handle or using @id for another shared memory.
  */
 struct hwcrypt_shm_hd {
     handle_t handle;
     const void* base;
     size_t size;
+    uint32_t id;
 };
 
 /**
@@ -126,6 +133,49 @@ int hwaes_encrypt(hwaes_session_t session, const struct hwcrypt_args* args);
  */
 int hwaes_decrypt(hwaes_session_t session, const struct hwcrypt_args* args);
 
+/**
+ * struct hwcrypt_batch_op - One operation of a batch.
+ * @args:    arguments for the AES operation.
+ * @encrypt: flag to indicate encrypt (true) or decrypt (false).
+ * @result:  set by hwaes_crypt_batch() to NO_ERROR if the operation succeeded,
+ *           or to an error code less than 0.
+ */
+struct hwcrypt_batch_op {
+    struct hwcrypt_args args;
+    bool encrypt;
+    int result;
+};
+
+/**
+ * hwaes_crypt_batch() - Perform several AES operations in one request.
+ * @session: session handle retrieved from hwaes_open.
+ * @ops:     array of operations, run in order.
+ * @num_ops: number of operations, between 1 and HWAES_MAX_BATCH_OPS.
+ *
+ * Shared memories used by several operations are sent once, and so are keys
+ * not in shared memory that several operations pass by the same pointer. The
+ * data of all operations not in shared memory must fit in one message.
+ *
+ * Return: NO_ERROR if the operations were run, in which case the result of
+ * each operation is in its @result, or an error code less than 0 if none was.
+ *
+ */
+int hwaes_crypt_batch(hwaes_session_t session,
+                      struct hwcrypt_batch_op* ops,
+                      size_t num_ops);
+
+/**
+ * hwaes_release_shm() - Drop the server's mapping of a shared memory.
+ * @session: session handle retrieved from hwaes_open.
+ * @id:      the id of the shared memory, as set in &struct hwcrypt_shm_hd.
+ *
+ * Closing the session also drops all mappings.
+ *
+ * Return: NO_ERROR on success, error code less than 0 on error.
+ *
+ */
+int hwaes_release_shm(hwaes_session_t session, uint32_t id);
+
 /**
  * hwaes_close() - Closes the session.
  */
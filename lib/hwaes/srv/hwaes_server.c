@@ -19,6 +19,7 @@
 #include <assert.h>
 #include <lib/hwaes_server/hwaes_server.h>
 #include <lib/tipc/tipc_srv.h>
+#include <lk/macros.h>
 #include <stdlib.h>
 #include <sys/auxv.h>
 #include <sys/mman.h>
@@ -29,10 +30,42 @@
 
 #define PAGE_SIZE() getauxval(AT_PAGESZ)
 
+/*
+ * Number of shared memories a channel can keep mapped. At least
+ * HWAES_MAX_NUM_HANDLES, so mapping the shared memories of one request never
+ * evicts another one of the same request.
+ */
+#define HWAES_SHM_CACHE_SIZE HWAES_MAX_NUM_HANDLES
+
 struct shm {
     void* base;
     size_t size;
     int mmap_prot;
+    bool cached;
+};
+
+/**
+ * struct hwaes_cached_shm - a shared memory kept mapped across requests
+ * @id:       the id the client gave the shared memory, or 0 if the entry is
+ *            unused
+ * @last_use: value of &struct hwaes_chan_ctx @use_count when the entry was
+ *            last used
+ * @shm:      the mapping
+ */
+struct hwaes_cached_shm {
+    uint32_t id;
+    uint64_t last_use;
+    struct shm shm;
+};
+
+/**
+ * struct hwaes_chan_ctx - state of a client channel
+ * @use_count: number of times a cached shared memory has been used
+ * @shms:      shared memories kept mapped for the client
+ */
+struct hwaes_chan_ctx {
+    uint64_t use_count;
+    struct hwaes_cached_shm shms[HWAES_SHM_CACHE_SIZE];
 };
 
 /**
@@ -82,24 +115,92 @@ static int hwaes_send_resp(handle_t chan, void* buf, size_t buf_sz) {
     return NO_ERROR;
 }
 
+/**
+ * void hwaes_release_cached_shm() - unmap a cached shared memory.
+ * @entry: the cache entry to release.
+ *
+ */
+static void hwaes_release_cached_shm(struct hwaes_cached_shm* entry) {
+    munmap(entry->shm.base, entry->shm.size);
+    entry->id = 0;
+}
+
+/**
+ * hwaes_find_cached_shm() - look up a cached shared memory.
+ * @ctx: the channel context.
+ * @id:  the id of the shared memory, not 0.
+ *
+ * Returns: the cache entry, or NULL if @id is not cached.
+ */
+static struct hwaes_cached_shm* hwaes_find_cached_shm(
+        struct hwaes_chan_ctx* ctx,
+        uint32_t id) {
+    for (size_t i = 0; i < HWAES_SHM_CACHE_SIZE; i++) {
+        if (ctx->shms[i].id == id) {
+            return &ctx->shms[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * void hwaes_cache_shm() - keep a shared memory mapped across requests.
+ * @ctx: the channel context.
+ * @id:  the id of the shared memory, not 0 and not cached.
+ * @shm: the new mapping, marked as cached on return.
+ *
+ * If the cache is full, the least recently used entry is unmapped.
+ */
+static void hwaes_cache_shm(struct hwaes_chan_ctx* ctx,
+                            uint32_t id,
+                            struct shm* shm) {
+    struct hwaes_cached_shm* entry = &ctx->shms[0];
+
+    for (size_t i = 0; i < HWAES_SHM_CACHE_SIZE; i++) {
+        if (!ctx->shms[i].id) {
+            entry = &ctx->shms[i];
+            break;
+        }
+        if (ctx->shms[i].last_use < entry->last_use) {
+            entry = &ctx->shms[i];
+        }
+    }
+    if (entry->id) {
+        hwaes_release_cached_shm(entry);
+    }
+
+    shm->cached = true;
+    entry->id = id;
+    entry->last_use = ++ctx->use_count;
+    entry->shm = *shm;
+}
+
 /**
  * int hwaes_map_shm() - map the shared memories.
+ * @ctx:       the channel context.
  * @num:       the number of shared memories.
  * @handles:   the array of shared memory handles.
  * @shm_descs: the array of shared memory descriptors.
  * @shms:      the array of shared memories.
  *
+ * Shared memories with an id are served from, or added to, the mappings
+ * cached for the channel.
+ *
  * Returns: NO_ERROR on success, negative error code on failure
  */
-static int hwaes_map_shm(size_t num,
+static int hwaes_map_shm(struct hwaes_chan_ctx* ctx,
+                         size_t num,
                          handle_t* handles,
                          struct hwaes_shm_desc* shm_descs,
                          struct shm* shms) {
     for (size_t i = 0; i < num; i++) {
-        if (shm_descs[i].reserved) {
-            TLOGE("bad shared memory descriptor, reserved not 0, (%d)\n",
-                  shm_descs[i].reserved);
-            return ERR_IO;
+        uint32_t id = shm_descs[i].id;
+
+        for (size_t j = 0; id && j < i; j++) {
+            if (shm_descs[j].id == id) {
+                TLOGE("shared memory id (%u) is used twice.\n", id);
+                return ERR_INVALID_ARGS;
+            }
         }
 
         if (~1U & shm_descs[i].write) {
@@ -124,6 +225,20 @@ static int hwaes_map_shm(size_t num,
             return ERR_INVALID_ARGS;
         }
 
+        struct hwaes_cached_shm* entry =
+                id ? hwaes_find_cached_shm(ctx, id) : NULL;
+        if (entry) {
+            if (entry->shm.size == size &&
+                !(~entry->shm.mmap_prot & mmap_prot)) {
+                /* the mapping may allow more than this request does */
+                shms[i] = entry->shm;
+                shms[i].mmap_prot = mmap_prot;
+                entry->last_use = ++ctx->use_count;
+                continue;
+            }
+            hwaes_release_cached_shm(entry);
+        }
+
         shms[i].base = mmap(0, shm_descs[i].size, mmap_prot, 0, handles[i], 0);
         if (shms[i].base == MAP_FAILED) {
             TLOGE("failed to mmap() shared memory for handle (%zu).\n", i);
@@ -131,6 +246,9 @@ static int hwaes_map_shm(size_t num,
         }
         shms[i].size = shm_descs[i].size;
         shms[i].mmap_prot = mmap_prot;
+        if (id) {
+            hwaes_cache_shm(ctx, id, &shms[i]);
+        }
     }
     return NO_ERROR;
 }
@@ -143,7 +261,7 @@ static int hwaes_map_shm(size_t num,
  */
 static void hwaes_unmap_shm(size_t num, struct shm* shms) {
     for (size_t i = 0; i < num; i++) {
-        if (shms[i].size) {
+        if (shms[i].size && !shms[i].cached) {
             munmap(shms[i].base, shms[i].size);
         }
     }
@@ -247,9 +365,61 @@ static int hwaes_set_arg_in(struct hwaes_data_desc* data_desc_ptr,
     return NO_ERROR;
 }
 
+/**
+ * int hwaes_set_batch_arg_in() - set an input argument of a batch operation
+ * @data_desc_ptr: pointer to a data_desc.
+ * @shms:          the array of shared memories.
+ * @num_shms:      the number of shared memories.
+ * @req_msg_buf:   the request message buffer.
+ * @data_start:    the offset of the data following the request headers.
+ * @req_msg_size:  the size of request message.
+ * @arg:           pointer to the input argument.
+ *
+ * Unlike for a single operation, data in the tipc message may be anywhere
+ * after the request headers, so operations can share it.
+ *
+ * Returns: NO_ERROR on success, negative error code on failure
+ */
+static int hwaes_set_batch_arg_in(struct hwaes_data_desc* data_desc_ptr,
+                                  struct shm* shms,
+                                  size_t num_shms,
+                                  uint8_t* req_msg_buf,
+                                  size_t data_start,
+                                  size_t req_msg_size,
+                                  struct hwaes_arg_in* arg) {
+    if (!data_desc_ptr->len ||
+        HWAES_INVALID_INDEX != data_desc_ptr->shm_idx) {
+        size_t unused_offset = 0;
+        return hwaes_set_arg_in(data_desc_ptr, PROT_READ, shms, num_shms,
+                                req_msg_buf, req_msg_size, &unused_offset,
+                                arg);
+    }
+
+    if (data_desc_ptr->reserved) {
+        TLOGE("bad data descriptor, reserved not 0, (%d)\n",
+              data_desc_ptr->reserved);
+        return ERR_IO;
+    }
+
+    uint64_t end_offset;
+    if (__builtin_add_overflow(data_desc_ptr->offset, data_desc_ptr->len,
+                               &end_offset)) {
+        TLOGE("the calculation of end_offset overflows\n");
+        return ERR_INVALID_ARGS;
+    }
+    if (data_desc_ptr->offset < data_start || end_offset > req_msg_size) {
+        TLOGE("data is outside of the request data\n");
+        return ERR_INVALID_ARGS;
+    }
+    arg->data_ptr = req_msg_buf + data_desc_ptr->offset;
+    arg->len = data_desc_ptr->len;
+    return NO_ERROR;
+}
+
 /**
  * int hwaes_handle_aes_cmd() - handle request with HWAES_AES command
  * @chan:         the channel handle.
+ * @ctx:          the channel context.
  * @req_msg_buf:  the request message buffer.
  * @req_msg_size: the size of request message.
  * @resp_msg_buf: the response message buffer.
@@ -259,6 +429,7 @@ static int hwaes_set_arg_in(struct hwaes_data_desc* data_desc_ptr,
  * Returns: NO_ERROR on success, negative error code on failure
  */
 static int hwaes_handle_aes_cmd(handle_t chan,
+                                struct hwaes_chan_ctx* ctx,
                                 uint8_t* req_msg_buf,
                                 size_t req_msg_size,
                                 uint8_t* resp_msg_buf,
@@ -301,7 +472,7 @@ static int hwaes_handle_aes_cmd(handle_t chan,
             (struct hwaes_shm_desc*)(req_msg_buf + sizeof(*req_header) +
                                      sizeof(*cmd_header));
 
-    rc = hwaes_map_shm(num_handles, shm_handles, shm_descs, shms);
+    rc = hwaes_map_shm(ctx, num_handles, shm_handles, shm_descs, shms);
     if (rc != NO_ERROR) {
         TLOGE("failed to hwaes_map_shm()\n");
         resp_header->result = tipc_err_to_hwaes_err(rc);
@@ -388,6 +559,206 @@ out:
     return rc;
 }
 
+/**
+ * int hwaes_set_batch_op_args() - set the arguments of a batch operation
+ * @op:           the operation header.
+ * @shms:         the array of shared memories.
+ * @num_shms:     the number of shared memories.
+ * @req_msg_buf:  the request message buffer.
+ * @data_start:   the offset of the data following the request headers.
+ * @req_msg_size: the size of request message.
+ * @resp_msg_buf: the response message buffer.
+ * @resp_offset:  pointer to the offset of the next output data in the
+ *                response.
+ * @args:         the arguments to set.
+ *
+ * Returns: NO_ERROR on success, negative error code on failure
+ */
+static int hwaes_set_batch_op_args(struct hwaes_aes_req* op,
+                                   struct shm* shms,
+                                   size_t num_shms,
+                                   uint8_t* req_msg_buf,
+                                   size_t data_start,
+                                   size_t req_msg_size,
+                                   uint8_t* resp_msg_buf,
+                                   size_t* resp_offset,
+                                   struct hwaes_aes_op_args* args) {
+    struct {
+        struct hwaes_data_desc* desc;
+        struct hwaes_arg_in* arg;
+    } ins[] = {
+            {&op->key, &args->key},         {&op->iv, &args->iv},
+            {&op->aad, &args->aad},         {&op->text_in, &args->text_in},
+            {&op->tag_in, &args->tag_in},
+    };
+    int rc;
+
+    if (op->reserved || op->num_handles) {
+        TLOGE("bad batch operation header\n");
+        return ERR_IO;
+    }
+
+    args->key_type = op->key_type;
+    args->padding = op->padding;
+    args->mode = op->mode;
+    args->encrypt = !!op->encrypt;
+
+    for (size_t i = 0; i < countof(ins); i++) {
+        rc = hwaes_set_batch_arg_in(ins[i].desc, shms, num_shms, req_msg_buf,
+                                    data_start, req_msg_size, ins[i].arg);
+        if (rc != NO_ERROR) {
+            return rc;
+        }
+    }
+
+    rc = hwaes_set_arg_out(&op->text_out, PROT_READ | PROT_WRITE, shms,
+                           num_shms, resp_msg_buf, HWAES_MAX_MSG_SIZE,
+                           resp_offset, &args->text_out);
+    if (rc != NO_ERROR) {
+        return rc;
+    }
+    return hwaes_set_arg_out(&op->tag_out, PROT_READ | PROT_WRITE, shms,
+                             num_shms, resp_msg_buf, HWAES_MAX_MSG_SIZE,
+                             resp_offset, &args->tag_out);
+}
+
+/**
+ * int hwaes_handle_aes_batch_cmd() - handle request with HWAES_AES_BATCH
+ *                                    command
+ * @chan:         the channel handle.
+ * @ctx:          the channel context.
+ * @req_msg_buf:  the request message buffer.
+ * @req_msg_size: the size of request message.
+ * @resp_msg_buf: the response message buffer.
+ * @shm_handles:  the array of shared memory handles.
+ * @num_handles:  the number of shared memory handles.
+ *
+ * The arguments of all operations are checked before any of them is run, so
+ * either all operations run and have a result, or none does.
+ *
+ * Returns: NO_ERROR on success, negative error code on failure
+ */
+static int hwaes_handle_aes_batch_cmd(handle_t chan,
+                                      struct hwaes_chan_ctx* ctx,
+                                      uint8_t* req_msg_buf,
+                                      size_t req_msg_size,
+                                      uint8_t* resp_msg_buf,
+                                      handle_t* shm_handles,
+                                      size_t num_handles) {
+    int rc;
+    struct shm shms[HWAES_MAX_NUM_HANDLES] = {0};
+    struct hwaes_aes_op_args args[HWAES_MAX_BATCH_OPS] = {0};
+
+    struct hwaes_resp* resp_header = (struct hwaes_resp*)resp_msg_buf;
+    size_t resp_msg_size = sizeof(*resp_header);
+
+    struct hwaes_aes_batch_req* batch_header =
+            (struct hwaes_aes_batch_req*)(req_msg_buf +
+                                          sizeof(struct hwaes_req));
+    size_t num_ops = batch_header->num_ops;
+
+    if (batch_header->num_handles != num_handles) {
+        TLOGE("header specified num_handles(%u) is not equal to the num_handles(%zu)\n",
+              batch_header->num_handles, num_handles);
+        return ERR_NOT_VALID;
+    }
+
+    if (!num_ops || num_ops > HWAES_MAX_BATCH_OPS) {
+        TLOGE("invalid number of batch operations (%zu)\n", num_ops);
+        resp_header->result = HWAES_ERR_INVALID_ARGS;
+        goto out;
+    }
+
+    size_t req_header_size = sizeof(struct hwaes_req) + sizeof(*batch_header) +
+                             num_handles * sizeof(struct hwaes_shm_desc) +
+                             num_ops * sizeof(struct hwaes_aes_req);
+
+    if (req_header_size > req_msg_size) {
+        TLOGE("request header size (%zu) exceeds the message size\n",
+              req_header_size);
+        return ERR_NOT_VALID;
+    }
+
+    struct hwaes_shm_desc* shm_descs =
+            (struct hwaes_shm_desc*)(batch_header + 1);
+    struct hwaes_aes_req* ops = (struct hwaes_aes_req*)(shm_descs +
+                                                        num_handles);
+
+    rc = hwaes_map_shm(ctx, num_handles, shm_handles, shm_descs, shms);
+    if (rc != NO_ERROR) {
+        TLOGE("failed to hwaes_map_shm()\n");
+        resp_header->result = tipc_err_to_hwaes_err(rc);
+        goto out;
+    }
+
+    uint32_t* results = (uint32_t*)(resp_header + 1);
+    size_t resp_offset = sizeof(*resp_header) + num_ops * sizeof(*results);
+
+    for (size_t i = 0; i < num_ops; i++) {
+        rc = hwaes_set_batch_op_args(&ops[i], shms, num_handles, req_msg_buf,
+                                     req_header_size, req_msg_size,
+                                     resp_msg_buf, &resp_offset, &args[i]);
+        if (rc != NO_ERROR) {
+            TLOGE("failed to set arguments of batch operation (%zu)\n", i);
+            resp_header->result = tipc_err_to_hwaes_err(rc);
+            goto out;
+        }
+    }
+
+    for (size_t i = 0; i < num_ops; i++) {
+        results[i] = hwaes_aes_op(&args[i]);
+    }
+    resp_header->result = HWAES_NO_ERROR;
+    resp_msg_size = resp_offset;
+
+out:
+    rc = hwaes_send_resp(chan, resp_msg_buf, resp_msg_size);
+    hwaes_unmap_shm(num_handles, shms);
+    return rc;
+}
+
+/**
+ * int hwaes_handle_release_shm_cmd() - handle request with HWAES_RELEASE_SHM
+ *                                      command
+ * @chan:         the channel handle.
+ * @ctx:          the channel context.
+ * @req_msg_buf:  the request message buffer.
+ * @req_msg_size: the size of request message.
+ * @resp_msg_buf: the response message buffer.
+ * @num_handles:  the number of shared memory handles.
+ *
+ * Returns: NO_ERROR on success, negative error code on failure
+ */
+static int hwaes_handle_release_shm_cmd(handle_t chan,
+                                        struct hwaes_chan_ctx* ctx,
+                                        uint8_t* req_msg_buf,
+                                        size_t req_msg_size,
+                                        uint8_t* resp_msg_buf,
+                                        size_t num_handles) {
+    struct hwaes_resp* resp_header = (struct hwaes_resp*)resp_msg_buf;
+    struct hwaes_release_shm_req* cmd_header =
+            (struct hwaes_release_shm_req*)(req_msg_buf +
+                                            sizeof(struct hwaes_req));
+
+    if (req_msg_size != sizeof(struct hwaes_req) + sizeof(*cmd_header) ||
+        num_handles || cmd_header->reserved) {
+        TLOGE("bad release shared memory request\n");
+        resp_header->result = HWAES_ERR_IO;
+        goto out;
+    }
+
+    struct hwaes_cached_shm* entry =
+            cmd_header->id ? hwaes_find_cached_shm(ctx, cmd_header->id)
+                           : NULL;
+    if (entry) {
+        hwaes_release_cached_shm(entry);
+    }
+    resp_header->result = HWAES_NO_ERROR;
+
+out:
+    return hwaes_send_resp(chan, resp_msg_buf, sizeof(*resp_header));
+}
+
 /**
  * int hwaes_read_req() - read the request from the client
  * @chan:             the channel handle.
@@ -452,9 +823,35 @@ free_msg:
     return rc;
 }
 
+static int hwaes_on_connect(const struct tipc_port* port,
+                            handle_t chan,
+                            const struct uuid* peer,
+                            void** ctx_p) {
+    struct hwaes_chan_ctx* ctx = calloc(1, sizeof(*ctx));
+
+    if (!ctx) {
+        TLOGE("failed to allocate channel context\n");
+        return ERR_NO_MEMORY;
+    }
+    *ctx_p = ctx;
+    return NO_ERROR;
+}
+
+static void hwaes_on_channel_cleanup(void* _ctx) {
+    struct hwaes_chan_ctx* ctx = _ctx;
+
+    for (size_t i = 0; i < HWAES_SHM_CACHE_SIZE; i++) {
+        if (ctx->shms[i].id) {
+            hwaes_release_cached_shm(&ctx->shms[i]);
+        }
+    }
+    free(ctx);
+}
+
 static int hwaes_on_message(const struct tipc_port* port,
                             handle_t chan,
-                            void* ctx) {
+                            void* _ctx) {
+    struct hwaes_chan_ctx* ctx = _ctx;
     int rc;
 
     uint8_t req_msg_buf[HWAES_MAX_MSG_SIZE] = {0};
@@ -486,8 +883,19 @@ static int hwaes_on_message(const struct tipc_port* port,
     /* handle it */
     switch (req_header->cmd) {
     case HWAES_AES:
-        rc = hwaes_handle_aes_cmd(chan, req_msg_buf, req_msg_size, resp_msg_buf,
-                                  shm_handles, num_handles);
+        rc = hwaes_handle_aes_cmd(chan, ctx, req_msg_buf, req_msg_size,
+                                  resp_msg_buf, shm_handles, num_handles);
+        break;
+
+    case HWAES_AES_BATCH:
+        rc = hwaes_handle_aes_batch_cmd(chan, ctx, req_msg_buf, req_msg_size,
+                                        resp_msg_buf, shm_handles,
+                                        num_handles);
+        break;
+
+    case HWAES_RELEASE_SHM:
+        rc = hwaes_handle_release_shm_cmd(chan, ctx, req_msg_buf, req_msg_size,
+                                          resp_msg_buf, num_handles);
         break;
 
     default:
@@ -497,7 +905,7 @@ static int hwaes_on_message(const struct tipc_port* port,
     }
 
 free_handles:
-    for (size_t i = 0; i <= num_handles; i++) {
+    for (size_t i = 0; i < num_handles; i++) {
         close(shm_handles[i]);
     }
 
@@ -520,7 +928,9 @@ int add_hwaes_service(struct tipc_hset* hset,
             .acl = &acl,
     };
     static struct tipc_srv_ops ops = {
+            .on_connect = hwaes_on_connect,
             .on_message = hwaes_on_message,
+            .on_channel_cleanup = hwaes_on_channel_cleanup,
     };
     return tipc_add_service(hset, &port, 1, 1, &ops);
 }
@@ -26,6 +26,7 @@
 #include <trusty/time.h>
 #include <trusty/uuid.h>
 #include <trusty_unittest.h>
+#include <uapi/err.h>
 #include <unistd.h>
 
 #define CHECK_ERRNO(e)       \
@@ -517,4 +518,30 @@ test_abort:
     CLEAR_ERRNO();
 }
 
+static uint8_t* bench_buf;
+
+BENCH_SETUP(libc) {
+    bench_buf = malloc(2 * param);
+    return bench_buf ? NO_ERROR : ERR_NO_MEMORY;
+}
+
+BENCH_TEARDOWN(libc) {
+    free(bench_buf);
+    bench_buf = NULL;
+}
+
+BENCH(libc, memcpy, 100, 16, 256, 4096, 65536) {
+    memcpy(bench_buf, bench_buf + param, param);
+    return NO_ERROR;
+}
+
+BENCH(libc, malloc_free, 100, 16, 256, 4096) {
+    void* volatile p = malloc(param);
+    if (!p) {
+        return ERR_NO_MEMORY;
+    }
+    free(p);
+    return NO_ERROR;
+}
+
 PORT_TEST(libc, "com.android.libctest");
@@ -0,0 +1,562 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Non-blocking storage client.
+ *
+ * Operations are kept in submission order. Each one is sent as one or more
+ * request messages, and requests are sent strictly in order as long as the
+ * channel accepts them and fewer than STORAGE_QUEUE_DEPTH are waiting for a
+ * response. The server answers requests in the order it receives them, so
+ * every response belongs to the oldest operation with requests in flight; the
+ * operation's token is carried in @op_id to check this.
+ */
+
+#define TLOG_TAG "storage_async"
+
+#include <lib/storage/async.h>
+
+#include <lk/list.h>
+#include <lk/macros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trusty_ipc.h>
+#include <trusty_log.h>
+#include <uapi/err.h>
+
+#include "storage_priv.h"
+
+/**
+ * struct storage_async_op - a submitted operation
+ * @node:        list node in &storage_async_session->ops
+ * @token:       token identifying the operation to the caller
+ * @cmd:         the storage command of the requests
+ * @msg_flags:   flags of the last request
+ * @open_flags:  STORAGE_FILE_OPEN_* flags of a %STORAGE_FILE_OPEN operation
+ * @handle:      server file handle the operation applies to
+ * @off:         file offset of a read or write
+ * @buf:         buffer to read into or write from
+ * @size:        number of bytes to read or write
+ * @out:         where to store the handle or size an operation returns
+ * @cb:          completion callback, or %NULL
+ * @priv:        value to pass to @cb
+ * @req_count:   number of requests the operation is split into
+ * @sent:        number of requests sent
+ * @done:        number of responses received
+ * @stop:        no further requests are sent, because one failed or a read
+ *               reached the end of the file
+ * @result:      result to complete the operation with
+ * @name:        file name of a %STORAGE_FILE_OPEN operation
+ */
+struct storage_async_op {
+    struct list_node node;
+    uint32_t token;
+    uint32_t cmd;
+    uint32_t msg_flags;
+    uint32_t open_flags;
+    uint32_t handle;
+    storage_off_t off;
+    uint8_t* buf;
+    size_t size;
+    void* out;
+    storage_async_cb_t cb;
+    void* priv;
+    uint32_t req_count;
+    uint32_t sent;
+    uint32_t done;
+    bool stop;
+    ssize_t result;
+    char name[];
+};
+
+/**
+ * struct storage_async_session - an async storage session
+ * @chan:        channel to the storage server
+ * @hset:        handle set @chan is registered with
+ * @evt_handler: event handler of @chan
+ * @ops:         submitted operations that have not completed, oldest first
+ * @in_flight:   number of requests waiting for a response
+ * @next_token:  token of the next operation
+ * @blocked:     the channel's send queue is full
+ */
+struct storage_async_session {
+    handle_t chan;
+    struct tipc_hset* hset;
+    struct tipc_event_handler evt_handler;
+    struct list_node ops;
+    uint32_t in_flight;
+    uint32_t next_token;
+    bool blocked;
+};
+
+static size_t req_size(struct storage_async_op* op, uint32_t idx) {
+    return MIN(op->size - (size_t)idx * MAX_CHUNK_SIZE,
+               (size_t)MAX_CHUNK_SIZE);
+}
+
+static int send_req(struct storage_async_session* s,
+                    struct storage_async_op* op) {
+    uint32_t idx = op->sent;
+    storage_off_t off = op->off + (storage_off_t)idx * MAX_CHUNK_SIZE;
+    struct storage_msg msg = {
+            .cmd = op->cmd,
+            .op_id = op->token,
+            .flags = idx + 1 == op->req_count ? op->msg_flags : 0,
+    };
+    union {
+        struct storage_file_open_req open;
+        struct storage_file_close_req close;
+        struct storage_file_read_req read;
+        struct storage_file_write_req write;
+        struct storage_file_get_size_req get_size;
+    } req;
+    struct iovec tx[3] = {{&msg, sizeof(msg)}, {&req, 0}};
+    struct ipc_msg tx_msg = {.iov = tx, .num_iov = 2};
+
+    memset(&req, 0, sizeof(req));
+    switch (op->cmd) {
+    case STORAGE_FILE_OPEN:
+        req.open.flags = op->open_flags;
+        tx[1].iov_len = sizeof(req.open);
+        tx[2] = (struct iovec){op->name, strlen(op->name)};
+        tx_msg.num_iov = 3;
+        break;
+    case STORAGE_FILE_CLOSE:
+        req.close.handle = op->handle;
+        tx[1].iov_len = sizeof(req.close);
+        break;
+    case STORAGE_FILE_READ:
+        req.read.handle = op->handle;
+        req.read.size = req_size(op, idx);
+        req.read.offset = off;
+        tx[1].iov_len = sizeof(req.read);
+        break;
+    case STORAGE_FILE_WRITE:
+        req.write.handle = op->handle;
+        req.write.offset = off;
+        tx[1].iov_len = sizeof(req.write);
+        tx[2] = (struct iovec){op->buf + (size_t)idx * MAX_CHUNK_SIZE,
+                               req_size(op, idx)};
+        tx_msg.num_iov = 3;
+        break;
+    case STORAGE_FILE_GET_SIZE:
+        req.get_size.handle = op->handle;
+        tx[1].iov_len = sizeof(req.get_size);
+        break;
+    default:
+        tx_msg.num_iov = 1;
+        break;
+    }
+
+    return send_msg(s->chan, &tx_msg);
+}
+
+/* send queued requests, oldest first, as long as the channel takes them */
+static void pump(struct storage_async_session* s) {
+    struct storage_async_op* op;
+    int rc;
+
+    list_for_every_entry(&s->ops, op, struct storage_async_op, node) {
+        while (!op->stop && op->sent < op->req_count) {
+            if (s->blocked || s->in_flight >= STORAGE_QUEUE_DEPTH) {
+                return;
+            }
+            rc = send_req(s, op);
+            if (rc == ERR_NOT_ENOUGH_BUFFER) {
+                /* resumed on IPC_HANDLE_POLL_SEND_UNBLOCKED */
+                s->blocked = true;
+                return;
+            }
+            if (rc < 0) {
+                TLOGE("failed (%d) to send request\n", rc);
+                op->result = rc;
+                op->stop = true;
+                break;
+            }
+            op->sent++;
+            s->in_flight++;
+        }
+    }
+}
+
+/* complete the oldest operations that have no more responses to wait for */
+static void complete_done(struct storage_async_session* s) {
+    struct storage_async_op* op;
+
+    while ((op = list_peek_head_type(&s->ops, struct storage_async_op,
+                                     node))) {
+        if (op->done < op->sent || (!op->stop && op->sent < op->req_count)) {
+            break;
+        }
+        list_delete(&op->node);
+        if (op->cb) {
+            op->cb(op->priv, op->token, op->result);
+        }
+        free(op);
+    }
+}
+
+static void fail_all(struct storage_async_session* s, int rc) {
+    struct storage_async_op* op;
+
+    while ((op = list_remove_head_type(&s->ops, struct storage_async_op,
+                                       node))) {
+        if (op->cb) {
+            op->cb(op->priv, op->token, rc);
+        }
+        free(op);
+    }
+    s->in_flight = 0;
+}
+
+/*
+ * Receive the response @mi for the oldest operation with requests in flight.
+ *
+ * Return: NO_ERROR if the response was handled, or an error code < 0 if the
+ * channel is in an unusable state.
+ */
+static int handle_resp(struct storage_async_session* s,
+                       struct ipc_msg_info* mi) {
+    struct storage_async_op* op = NULL;
+    struct storage_async_op* entry;
+    struct storage_msg msg;
+    union {
+        struct storage_file_open_resp open;
+        struct storage_file_get_size_resp get_size;
+    } rsp;
+    struct iovec iov[2] = {{&msg, sizeof(msg)}, {&rsp, sizeof(rsp)}};
+    struct ipc_msg rx_msg = {.iov = iov, .num_iov = 2};
+    size_t expected = 0;
+    ssize_t rc;
+
+    list_for_every_entry(&s->ops, entry, struct storage_async_op, node) {
+        if (entry->done < entry->sent) {
+            op = entry;
+            break;
+        }
+    }
+    if (!op) {
+        TLOGE("unexpected response\n");
+        return ERR_IO;
+    }
+
+    if (op->cmd == STORAGE_FILE_READ) {
+        /* the payload goes straight into the caller's buffer */
+        iov[1].iov_base = op->buf + (size_t)op->done * MAX_CHUNK_SIZE;
+        iov[1].iov_len = req_size(op, op->done);
+    }
+    rc = read_msg(s->chan, mi->id, 0, &rx_msg);
+    if (rc < 0) {
+        return rc;
+    }
+    if (rc >= (ssize_t)sizeof(msg) && msg.op_id != op->token) {
+        TLOGE("response for op %u while expecting %u\n", msg.op_id, op->token);
+        return ERR_IO;
+    }
+    if ((size_t)rc != mi->len) {
+        rc = ERR_IO;
+    }
+    rc = storage_check_response(&msg, rc);
+
+    op->done++;
+    s->in_flight--;
+    if (op->stop) {
+        /* a read past the end of the file or a request after a failure */
+        return NO_ERROR;
+    }
+
+    switch (op->cmd) {
+    case STORAGE_FILE_OPEN:
+        expected = sizeof(rsp.open);
+        break;
+    case STORAGE_FILE_GET_SIZE:
+        expected = sizeof(rsp.get_size);
+        break;
+    case STORAGE_FILE_READ:
+        expected = MIN((size_t)rc, req_size(op, op->done - 1));
+        break;
+    default:
+        break;
+    }
+    if (rc >= 0 && (size_t)rc != expected) {
+        TLOGE("invalid response length (%zd != %zd)\n", rc, expected);
+        rc = ERR_IO;
+    }
+
+    if (rc < 0) {
+        op->result = rc;
+        op->stop = true;
+        return NO_ERROR;
+    }
+
+    switch (op->cmd) {
+    case STORAGE_FILE_OPEN:
+        *(file_handle_t*)op->out = make_file_handle(s->chan, rsp.open.handle);
+        break;
+    case STORAGE_FILE_GET_SIZE:
+        *(storage_off_t*)op->out = rsp.get_size.size;
+        break;
+    case STORAGE_FILE_READ:
+        op->result += rc;
+        if ((size_t)rc < req_size(op, op->done - 1)) {
+            op->stop = true;
+        }
+        break;
+    case STORAGE_FILE_WRITE:
+        op->result += req_size(op, op->done - 1);
+        break;
+    default:
+        break;
+    }
+    return NO_ERROR;
+}
+
+static void handle_event(const struct uevent* ev, void* priv) {
+    struct storage_async_session* s = priv;
+    struct ipc_msg_info mi;
+    int rc;
+
+    if (ev->event & IPC_HANDLE_POLL_MSG) {
+        while (get_msg(s->chan, &mi) == NO_ERROR) {
+            rc = handle_resp(s, &mi);
+            put_msg(s->chan, mi.id);
+            if (rc < 0) {
+                TLOGE("failed (%d) to handle response\n", rc);
+                fail_all(s, rc);
+                return;
+            }
+        }
+    }
+    if (ev->event & IPC_HANDLE_POLL_HUP) {
+        fail_all(s, ERR_CHANNEL_CLOSED);
+        return;
+    }
+    if (ev->event & IPC_HANDLE_POLL_SEND_UNBLOCKED) {
+        s->blocked = false;
+    }
+
+    pump(s);
+    complete_done(s);
+}
+
+int storage_async_open_session(struct tipc_hset* hset,
+                               const char* type,
+                               struct storage_async_session** session_p) {
+    struct storage_async_session* s;
+    long rc;
+
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        return ERR_NO_MEMORY;
+    }
+
+    rc = connect(type, IPC_CONNECT_WAIT_FOR_PORT);
+    if (rc < 0) {
+        free(s);
+        return rc;
+    }
+    s->chan = (handle_t)rc;
+    s->hset = hset;
+    s->evt_handler.proc = handle_event;
+    s->evt_handler.priv = s;
+    list_initialize(&s->ops);
+
+    rc = tipc_hset_add_entry(hset, s->chan, ~0U, &s->evt_handler);
+    if (rc < 0) {
+        close(s->chan);
+        free(s);
+        return rc;
+    }
+
+    *session_p = s;
+    return NO_ERROR;
+}
+
+void storage_async_close_session(struct storage_async_session* s) {
+    tipc_hset_remove_entry(s->hset, s->chan);
+    close(s->chan);
+    fail_all(s, ERR_CHANNEL_CLOSED);
+    free(s);
+}
+
+static struct storage_async_op* new_op(uint32_t cmd,
+                                       size_t name_size,
+                                       storage_async_cb_t cb,
+                                       void* priv) {
+    struct storage_async_op* op = calloc(1, sizeof(*op) + name_size);
+
+    if (!op) {
+        return NULL;
+    }
+    op->cmd = cmd;
+    op->req_count = 1;
+    op->cb = cb;
+    op->priv = priv;
+    return op;
+}
+
+static int submit(struct storage_async_session* s,
+                  struct storage_async_op* op,
+                  uint32_t* token_p) {
+    int rc;
+
+    op->token = s->next_token++;
+    if (token_p) {
+        *token_p = op->token;
+    }
+    list_add_tail(&s->ops, &op->node);
+
+    /*
+     * Older operations are either fully sent or waiting for room, so this only
+     * ever sends requests of @op. Failing to send later requests of @op is
+     * reported through its callback.
+     */
+    pump(s);
+    if (op->stop && !op->sent) {
+        list_delete(&op->node);
+        rc = op->result;
+        free(op);
+        return rc;
+    }
+    return NO_ERROR;
+}
+
+static uint32_t to_msg_flags(uint32_t opflags) {
+    return opflags & STORAGE_OP_COMPLETE ? STORAGE_MSG_FLAG_TRANSACT_COMPLETE
+                                         : 0;
+}
+
+int storage_async_open_file(struct storage_async_session* s,
+                            file_handle_t* handle_p,
+                            const char* name,
+                            uint32_t flags,
+                            uint32_t opflags,
+                            storage_async_cb_t cb,
+                            void* priv,
+                            uint32_t* token_p) {
+    size_t name_size = strlen(name) + 1;
+    struct storage_async_op* op;
+
+    if (name_size > STORAGE_MAX_NAME_LENGTH_BYTES + 1) {
+        return ERR_INVALID_ARGS;
+    }
+    op = new_op(STORAGE_FILE_OPEN, name_size, cb, priv);
+    if (!op) {
+        return ERR_NO_MEMORY;
+    }
+    memcpy(op->name, name, name_size);
+    op->open_flags = flags;
+    op->msg_flags = to_msg_flags(opflags);
+    op->out = handle_p;
+    return submit(s, op, token_p);
+}
+
+int storage_async_close_file(struct storage_async_session* s,
+                             file_handle_t fh,
+                             storage_async_cb_t cb,
+                             void* priv,
+                             uint32_t* token_p) {
+    struct storage_async_op* op = new_op(STORAGE_FILE_CLOSE, 0, cb, priv);
+
+    if (!op) {
+        return ERR_NO_MEMORY;
+    }
+    op->handle = _to_handle(fh);
+    return submit(s, op, token_p);
+}
+
+int storage_async_read(struct storage_async_session* s,
+                       file_handle_t fh,
+                       storage_off_t off,
+                       void* buf,
+                       size_t size,
+                       storage_async_cb_t cb,
+                       void* priv,
+                       uint32_t* token_p) {
+    struct storage_async_op* op;
+
+    if (size / MAX_CHUNK_SIZE >= UINT32_MAX) {
+        return ERR_TOO_BIG;
+    }
+    op = new_op(STORAGE_FILE_READ, 0, cb, priv);
+    if (!op) {
+        return ERR_NO_MEMORY;
+    }
+    op->handle = _to_handle(fh);
+    op->off = off;
+    op->buf = buf;
+    op->size = size;
+    op->req_count = MAX((size + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE, 1U);
+    return submit(s, op, token_p);
+}
+
+int storage_async_write(struct storage_async_session* s,
+                        file_handle_t fh,
+                        storage_off_t off,
+                        const void* buf,
+                        size_t size,
+                        uint32_t opflags,
+                        storage_async_cb_t cb,
+                        void* priv,
+                        uint32_t* token_p) {
+    struct storage_async_op* op;
+
+    if (size / MAX_CHUNK_SIZE >= UINT32_MAX) {
+        return ERR_TOO_BIG;
+    }
+    op = new_op(STORAGE_FILE_WRITE, 0, cb, priv);
+    if (!op) {
+        return ERR_NO_MEMORY;
+    }
+    op->handle = _to_handle(fh);
+    op->off = off;
+    op->buf = (uint8_t*)buf;
+    op->size = size;
+    op->msg_flags = to_msg_flags(opflags);
+    /* an empty write still carries @opflags */
+    op->req_count = MAX((size + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE, 1U);
+    return submit(s, op, token_p);
+}
+
+int storage_async_get_file_size(struct storage_async_session* s,
+                                file_handle_t fh,
+                                storage_off_t* size_p,
+                                storage_async_cb_t cb,
+                                void* priv,
+                                uint32_t* token_p) {
+    struct storage_async_op* op = new_op(STORAGE_FILE_GET_SIZE, 0, cb, priv);
+
+    if (!op) {
+        return ERR_NO_MEMORY;
+    }
+    op->handle = _to_handle(fh);
+    op->out = size_p;
+    return submit(s, op, token_p);
+}
+
+int storage_async_end_transaction(struct storage_async_session* s,
+                                  bool complete,
+                                  storage_async_cb_t cb,
+                                  void* priv,
+                                  uint32_t* token_p) {
+    struct storage_async_op* op = new_op(STORAGE_END_TRANSACTION, 0, cb, priv);
+
+    if (!op) {
+        return ERR_NO_MEMORY;
+    }
+    op->msg_flags = complete ? STORAGE_MSG_FLAG_TRANSACT_COMPLETE : 0;
+    return submit(s, op, token_p);
+}
@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Client-side read cache.
+ *
+ * File data is cached in STORAGE_CACHE_BLOCK_SIZE blocks keyed by file handle
+ * and block offset, and evicted in least recently used order once the cache
+ * holds its maximum number of blocks. A miss reads the missing block together
+ * with the rest of the request in a single storage_read_direct() call. Reads
+ * that continue where the previous one on the same file ended are treated as
+ * sequential and also read ahead, doubling the read-ahead window on each
+ * sequential miss up to STORAGE_CACHE_MAX_READAHEAD blocks.
+ */
+
+#include <lk/list.h>
+#include <lk/macros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uapi/err.h>
+
+#include "storage_priv.h"
+
+#define STORAGE_CACHE_BLOCK_SIZE 2048U
+#define STORAGE_CACHE_HASH_SIZE 64U
+#define STORAGE_CACHE_MAX_READAHEAD 8U
+
+/**
+ * struct storage_cache_block - a cached block of file data
+ * @lru_node:  list node in &storage_cache->lru
+ * @hash_node: list node in the &storage_cache->hash bucket of the block
+ * @fh:        the file the data belongs to
+ * @off:       offset of the block in the file
+ * @len:       number of valid bytes in @data. Less than
+ *             %STORAGE_CACHE_BLOCK_SIZE only if the block holds the end of
+ *             the file.
+ * @data:      the cached file data
+ */
+struct storage_cache_block {
+    struct list_node lru_node;
+    struct list_node hash_node;
+    file_handle_t fh;
+    storage_off_t off;
+    size_t len;
+    uint8_t data[STORAGE_CACHE_BLOCK_SIZE];
+};
+
+/**
+ * struct storage_cache - read cache of a session
+ * @max_blocks:  maximum number of blocks in the cache
+ * @block_count: number of blocks in the cache
+ * @lru:         all blocks, most recently used first
+ * @hash:        blocks hashed by file handle and offset
+ * @ra_fh:       file of the previous read
+ * @ra_next:     offset right after the previous read
+ * @ra_blocks:   current read-ahead window in blocks
+ */
+struct storage_cache {
+    size_t max_blocks;
+    size_t block_count;
+    struct list_node lru;
+    struct list_node hash[STORAGE_CACHE_HASH_SIZE];
+    file_handle_t ra_fh;
+    storage_off_t ra_next;
+    size_t ra_blocks;
+};
+
+static struct list_node* bucket(struct storage_cache* cache,
+                                file_handle_t fh,
+                                storage_off_t off) {
+    uint64_t key = fh ^ (fh >> 32);
+
+    key = key * 31 + off / STORAGE_CACHE_BLOCK_SIZE;
+    return &cache->hash[key % STORAGE_CACHE_HASH_SIZE];
+}
+
+struct storage_cache* storage_cache_create(size_t max_bytes) {
+    struct storage_cache* cache;
+
+    if (max_bytes < STORAGE_CACHE_BLOCK_SIZE) {
+        return NULL;
+    }
+    cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->max_blocks = max_bytes / STORAGE_CACHE_BLOCK_SIZE;
+    list_initialize(&cache->lru);
+    for (size_t i = 0; i < countof(cache->hash); i++) {
+        list_initialize(&cache->hash[i]);
+    }
+    cache->ra_blocks = 1;
+    return cache;
+}
+
+static void remove_block(struct storage_cache* cache,
+                         struct storage_cache_block* block) {
+    list_delete(&block->lru_node);
+    list_delete(&block->hash_node);
+    cache->block_count--;
+}
+
+void storage_cache_clear(struct storage_cache* cache) {
+    struct storage_cache_block* block;
+
+    if (!cache) {
+        return;
+    }
+    while ((block = list_remove_head_type(&cache->lru,
+                                          struct storage_cache_block,
+                                          lru_node))) {
+        list_delete(&block->hash_node);
+        free(block);
+    }
+    cache->block_count = 0;
+}
+
+void storage_cache_destroy(struct storage_cache* cache) {
+    storage_cache_clear(cache);
+    free(cache);
+}
+
+static void invalidate(struct storage_cache* cache,
+                       file_handle_t fh,
+                       storage_off_t start,
+                       storage_off_t end) {
+    struct storage_cache_block* block;
+    struct storage_cache_block* tmp;
+
+    if (!cache) {
+        return;
+    }
+    list_for_every_entry_safe(&cache->lru, block, tmp,
+                              struct storage_cache_block, lru_node) {
+        if (block->fh != fh) {
+            continue;
+        }
+        if ((block->off < end && block->off + STORAGE_CACHE_BLOCK_SIZE > start) ||
+            block->len < STORAGE_CACHE_BLOCK_SIZE) {
+            remove_block(cache, block);
+            free(block);
+        }
+    }
+}
+
+void storage_cache_invalidate_range(struct storage_cache* cache,
+                                    file_handle_t fh,
+                                    storage_off_t off,
+                                    size_t size) {
+    invalidate(cache, fh, off, off + size);
+}
+
+void storage_cache_invalidate_file(struct storage_cache* cache,
+                                   file_handle_t fh) {
+    invalidate(cache, fh, 0, UINT64_MAX);
+}
+
+static struct storage_cache_block* lookup(struct storage_cache* cache,
+                                          file_handle_t fh,
+                                          storage_off_t off) {
+    struct storage_cache_block* block;
+    struct list_node* head = bucket(cache, fh, off);
+
+    list_for_every_entry(head, block, struct storage_cache_block, hash_node) {
+        if (block->fh == fh && block->off == off) {
+            list_delete(&block->lru_node);
+            list_add_head(&cache->lru, &block->lru_node);
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static struct storage_cache_block* insert(struct storage_cache* cache,
+                                          file_handle_t fh,
+                                          storage_off_t off,
+                                          const uint8_t* data,
+                                          size_t len) {
+    struct storage_cache_block* block = lookup(cache, fh, off);
+
+    if (!block) {
+        if (cache->block_count < cache->max_blocks) {
+            block = malloc(sizeof(*block));
+            if (!block) {
+                return NULL;
+            }
+        } else {
+            block = list_peek_tail_type(&cache->lru, struct storage_cache_block,
+                                        lru_node);
+            remove_block(cache, block);
+        }
+        block->fh = fh;
+        block->off = off;
+        list_add_head(&cache->lru, &block->lru_node);
+        list_add_head(bucket(cache, fh, off), &block->hash_node);
+        cache->block_count++;
+    }
+
+    memcpy(block->data, data, len);
+    block->len = len;
+    return block;
+}
+
+/*
+ * Read the block at @off and as many of the following ones as the request or
+ * the read-ahead window cover, and add them to the cache.
+ *
+ * Return: the block at @off, or %NULL with an error code stored in @rc_p.
+ */
+static struct storage_cache_block* fill(struct storage_cache* cache,
+                                        file_handle_t fh,
+                                        storage_off_t off,
+                                        size_t needed,
+                                        ssize_t* rc_p) {
+    struct storage_cache_block* first = NULL;
+    struct storage_cache_block* block;
+    size_t count;
+    uint8_t* buf;
+    ssize_t rc;
+
+    count = (needed + STORAGE_CACHE_BLOCK_SIZE - 1) / STORAGE_CACHE_BLOCK_SIZE;
+    count = MAX(count, cache->ra_blocks);
+    /* leave room for older blocks so one read cannot flush the whole cache */
+    count = MIN(count, MAX(cache->max_blocks / 2, 1U));
+
+    buf = malloc(count * STORAGE_CACHE_BLOCK_SIZE);
+    if (!buf) {
+        *rc_p = ERR_NO_MEMORY;
+        return NULL;
+    }
+
+    rc = storage_read_direct(fh, off, buf, count * STORAGE_CACHE_BLOCK_SIZE);
+    if (rc < 0) {
+        *rc_p = rc;
+        goto out;
+    }
+
+    /* cache blocks up to and including the one holding the end of the file */
+    for (size_t i = 0; i < count && i * STORAGE_CACHE_BLOCK_SIZE <= (size_t)rc;
+         i++) {
+        size_t pos = i * STORAGE_CACHE_BLOCK_SIZE;
+        block = insert(cache, fh, off + pos, buf + pos,
+                       MIN((size_t)rc - pos, STORAGE_CACHE_BLOCK_SIZE));
+        if (!block) {
+            break;
+        }
+        if (!first) {
+            first = block;
+        }
+    }
+    if (!first) {
+        *rc_p = ERR_NO_MEMORY;
+    }
+
+out:
+    free(buf);
+    return first;
+}
+
+void storage_cache_add(struct storage_cache* cache,
+                       file_handle_t fh,
+                       storage_off_t off,
+                       const void* buf,
+                       size_t len,
+                       bool eof) {
+    const uint8_t* data = buf;
+    size_t pos;
+
+    for (pos = 0; pos + STORAGE_CACHE_BLOCK_SIZE <= len;
+         pos += STORAGE_CACHE_BLOCK_SIZE) {
+        if (!insert(cache, fh, off + pos, data + pos,
+                    STORAGE_CACHE_BLOCK_SIZE)) {
+            return;
+        }
+    }
+    if (eof) {
+        insert(cache, fh, off + pos, data + pos, len - pos);
+    }
+}
+
+ssize_t storage_cache_read(struct storage_cache* cache,
+                           file_handle_t fh,
+                           storage_off_t off,
+                           void* buf,
+                           size_t size) {
+    struct storage_cache_block* block;
+    storage_off_t block_off;
+    size_t bytes_read = 0;
+    uint8_t* ptr = buf;
+    size_t pos;
+    size_t len;
+    ssize_t rc;
+    bool sequential;
+
+    /* large reads would only evict everything else */
+    if (size > cache->max_blocks * STORAGE_CACHE_BLOCK_SIZE / 2) {
+        return storage_read_direct(fh, off, buf, size);
+    }
+
+    sequential = fh == cache->ra_fh && off == cache->ra_next;
+    if (!sequential) {
+        cache->ra_blocks = 1;
+    }
+
+    while (size) {
+        pos = off % STORAGE_CACHE_BLOCK_SIZE;
+        block_off = off - pos;
+        block = lookup(cache, fh, block_off);
+        if (!block) {
+            if (sequential) {
+                cache->ra_blocks = MIN(cache->ra_blocks * 2,
+                                       STORAGE_CACHE_MAX_READAHEAD);
+            }
+            block = fill(cache, fh, block_off, pos + size, &rc);
+            if (!block) {
+                /* report the data copied so far, the error comes up again */
+                if (!bytes_read) {
+                    return rc;
+                }
+                break;
+            }
+        }
+        if (pos >= block->len) {
+            /* end of file */
+            break;
+        }
+
+        len = MIN(block->len - pos, size);
+        memcpy(ptr, block->data + pos, len);
+        off += len;
+        ptr += len;
+        bytes_read += len;
+        size -= len;
+    }
+
+    cache->ra_fh = fh;
+    cache->ra_next = off;
+    return bytes_read;
+}
@@ -0,0 +1,566 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compressed storage files.
+ *
+ * A compressed file starts with a &struct storage_cfile_header, followed by
+ * the index, one 32-bit end offset per block relative to the end of the
+ * index, and then the stored blocks. A block stored with the size of its
+ * uncompressed data is not compressed. Compressed blocks use the LZ4 block
+ * format, produced here by a greedy single-pass matcher that favors speed
+ * over ratio.
+ */
+
+#include <lk/compiler.h>
+#include <lk/macros.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uapi/err.h>
+
+#include <lib/storage/compress.h>
+
+#define STORAGE_CFILE_MAGIC 0x46435453 /* "STCF" */
+#define STORAGE_CFILE_VERSION 1
+
+#define STORAGE_CFILE_MIN_BLOCK_SHIFT 9
+#define STORAGE_CFILE_MAX_BLOCK_SHIFT 16
+
+STATIC_ASSERT(STORAGE_CFILE_BLOCK_SIZE >=
+                      (1U << STORAGE_CFILE_MIN_BLOCK_SHIFT) &&
+              STORAGE_CFILE_BLOCK_SIZE <=
+                      (1U << STORAGE_CFILE_MAX_BLOCK_SHIFT) &&
+              !(STORAGE_CFILE_BLOCK_SIZE & (STORAGE_CFILE_BLOCK_SIZE - 1)));
+
+/* LZ4 block format parameters */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+/**
+ * struct storage_cfile_header - header of a compressed file
+ * @magic:       %STORAGE_CFILE_MAGIC
+ * @version:     %STORAGE_CFILE_VERSION
+ * @block_shift: log2 of the uncompressed size of each block but the last
+ * @block_count: number of blocks, and of entries in the following index
+ * @reserved:    must be 0
+ * @size:        uncompressed size of the file
+ */
+struct storage_cfile_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t block_shift;
+    uint32_t block_count;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+/**
+ * struct storage_cfile - an open compressed file
+ * @fh:           the open file handle
+ * @size:         uncompressed size of the file
+ * @block_shift:  log2 of the uncompressed block size
+ * @block_count:  number of blocks
+ * @data_off:     offset of the first stored block in the file
+ * @ends:         end offset of each stored block, relative to @data_off
+ * @stored:       buffer for reading a compressed block
+ * @block:        the last block read, uncompressed
+ * @cached_block: index of the block in @block, or @block_count if none
+ */
+struct storage_cfile {
+    file_handle_t fh;
+    storage_off_t size;
+    uint32_t block_shift;
+    uint32_t block_count;
+    storage_off_t data_off;
+    uint32_t* ends;
+    uint8_t* stored;
+    uint8_t* block;
+    uint32_t cached_block;
+};
+
+static uint32_t lz_hash(const uint8_t* p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* lz_put_len(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Emit a sequence, or only literals if @match_len is 0 */
+static uint8_t* lz_put_seq(uint8_t* op,
+                           uint8_t* oend,
+                           const uint8_t* lit,
+                           size_t lit_len,
+                           size_t offset,
+                           size_t match_len) {
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    uint8_t* token = op;
+
+    /* token, literal and match lengths, literals and offset */
+    if ((size_t)(oend - op) < 1 + lit_len / 255 + 1 + lit_len + 2 +
+                                      ml / 255 + 1) {
+        return NULL;
+    }
+    op++;
+    *token = MIN(lit_len, 15U) << 4;
+    if (lit_len >= 15) {
+        op = lz_put_len(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (!match_len) {
+        return op;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    *token |= MIN(ml, 15U);
+    if (ml >= 15) {
+        op = lz_put_len(op, ml - 15);
+    }
+    return op;
+}
+
+/**
+ * lz_compress() - Compress a block into LZ4 block format
+ * @src:     the data to compress
+ * @src_len: the size of @src, at most 64 KiB
+ * @dst:     the buffer in which to write the compressed data
+ * @dst_len: the size of @dst
+ * @table:   scratch space for 1 << %LZ_HASH_BITS positions
+ *
+ * Return: the compressed size, or 0 if it would not fit in @dst.
+ */
+static size_t lz_compress(const uint8_t* src,
+                          size_t src_len,
+                          uint8_t* dst,
+                          size_t dst_len,
+                          uint16_t* table) {
+    uint8_t* oend = dst + dst_len;
+    uint8_t* op = dst;
+    size_t anchor = 0;
+    size_t ip = 0;
+    size_t ref;
+    size_t len;
+    uint32_t h;
+
+    memset(table, 0, sizeof(*table) << LZ_HASH_BITS);
+    while (src_len > LZ_MATCH_LIMIT && ip < src_len - LZ_MATCH_LIMIT) {
+        h = lz_hash(src + ip);
+        ref = table[h];
+        table[h] = ip;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+            memcmp(src + ref, src + ip, LZ_MIN_MATCH)) {
+            ip++;
+            continue;
+        }
+        len = LZ_MIN_MATCH;
+        while (ip + len < src_len - LZ_LAST_LITERALS &&
+               src[ref + len] == src[ip + len]) {
+            len++;
+        }
+        op = lz_put_seq(op, oend, src + anchor, ip - anchor, ip - ref, len);
+        if (!op) {
+            return 0;
+        }
+        ip += len;
+        anchor = ip;
+    }
+    op = lz_put_seq(op, oend, src + anchor, src_len - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+static bool lz_get_len(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+    uint8_t b;
+
+    do {
+        if (*ip == iend) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/**
+ * lz_decompress() - Decompress a block in LZ4 block format
+ * @src:     the compressed data
+ * @src_len: the size of @src
+ * @dst:     the buffer in which to write the decompressed data
+ * @dst_len: the expected decompressed size
+ *
+ * Return: NO_ERROR if @src decompressed to exactly @dst_len bytes, or
+ * ERR_NOT_VALID if it is corrupt.
+ */
+static int lz_decompress(const uint8_t* src,
+                         size_t src_len,
+                         uint8_t* dst,
+                         size_t dst_len) {
+    const uint8_t* iend = src + src_len;
+    const uint8_t* ip = src;
+    uint8_t* oend = dst + dst_len;
+    uint8_t* op = dst;
+    size_t offset;
+    size_t len;
+    uint8_t token;
+
+    while (ip < iend) {
+        token = *ip++;
+        len = token >> 4;
+        if (len == 15 && !lz_get_len(&ip, iend, &len)) {
+            return ERR_NOT_VALID;
+        }
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op)) {
+            return ERR_NOT_VALID;
+        }
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return ERR_NOT_VALID;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        len = token & 15;
+        if (len == 15 && !lz_get_len(&ip, iend, &len)) {
+            return ERR_NOT_VALID;
+        }
+        len += LZ_MIN_MATCH;
+        if (!offset || offset > (size_t)(op - dst) ||
+            len > (size_t)(oend - op)) {
+            return ERR_NOT_VALID;
+        }
+        /* byte by byte, as the match may overlap the data it produces */
+        while (len--) {
+            *op = *(op - offset);
+            op++;
+        }
+    }
+    return op == oend ? NO_ERROR : ERR_NOT_VALID;
+}
+
+static uint64_t block_count_of(storage_off_t size, uint32_t block_shift) {
+    return (size >> block_shift) + !!(size & ((1U << block_shift) - 1));
+}
+
+static size_t block_len(storage_off_t size,
+                        uint32_t block_shift,
+                        uint32_t idx) {
+    storage_off_t start = (storage_off_t)idx << block_shift;
+
+    return MIN(size - start, (storage_off_t)1 << block_shift);
+}
+
+static int write_blocks(file_handle_t fh,
+                        const uint8_t* src,
+                        size_t size,
+                        uint32_t block_count,
+                        storage_off_t data_off,
+                        uint32_t* ends) {
+    const uint32_t block_shift = __builtin_ctz(STORAGE_CFILE_BLOCK_SIZE);
+    uint8_t* stored = malloc(STORAGE_CFILE_BLOCK_SIZE);
+    uint16_t* table = malloc(sizeof(*table) << LZ_HASH_BITS);
+    uint64_t pos = 0;
+    const uint8_t* out;
+    size_t raw_len;
+    size_t len;
+    ssize_t rc = NO_ERROR;
+    uint32_t i;
+
+    if (!stored || !table) {
+        rc = ERR_NO_MEMORY;
+        goto out;
+    }
+    for (i = 0; i < block_count; i++) {
+        raw_len = block_len(size, block_shift, i);
+        len = lz_compress(src, raw_len, stored, raw_len - 1, table);
+        out = stored;
+        if (!len) {
+            out = src;
+            len = raw_len;
+        }
+        if (pos + len > UINT32_MAX) {
+            rc = ERR_TOO_BIG;
+            goto out;
+        }
+        rc = storage_write(fh, data_off + pos, out, len, 0);
+        if (rc < 0) {
+            goto out;
+        }
+        if ((size_t)rc != len) {
+            rc = ERR_IO;
+            goto out;
+        }
+        pos += len;
+        ends[i] = pos;
+        src += raw_len;
+    }
+    rc = NO_ERROR;
+
+out:
+    free(table);
+    free(stored);
+    return rc;
+}
+
+int storage_cfile_write(storage_session_t session,
+                        const char* name,
+                        const void* buf,
+                        size_t size,
+                        uint32_t opflags) {
+    struct storage_cfile_header header = {
+            .magic = STORAGE_CFILE_MAGIC,
+            .version = STORAGE_CFILE_VERSION,
+            .block_shift = __builtin_ctz(STORAGE_CFILE_BLOCK_SIZE),
+            .size = size,
+    };
+    uint64_t block_count = block_count_of(size, header.block_shift);
+    uint32_t* ends;
+    file_handle_t fh;
+    ssize_t rc;
+
+    if (block_count > UINT32_MAX / sizeof(*ends)) {
+        return ERR_TOO_BIG;
+    }
+    header.block_count = block_count;
+    ends = malloc(MAX(block_count, 1) * sizeof(*ends));
+    if (!ends) {
+        return ERR_NO_MEMORY;
+    }
+
+    rc = storage_open_file(session, &fh, name,
+                           STORAGE_FILE_OPEN_CREATE |
+                                   STORAGE_FILE_OPEN_TRUNCATE,
+                           0);
+    if (rc < 0) {
+        goto err_open;
+    }
+
+    /* the blocks go first, as the index needs their sizes */
+    rc = write_blocks(fh, buf, size, block_count,
+                      sizeof(header) + block_count * sizeof(*ends), ends);
+    if (rc == NO_ERROR) {
+        struct iovec iov[] = {
+                {.iov_base = &header, .iov_len = sizeof(header)},
+                {.iov_base = ends, .iov_len = block_count * sizeof(*ends)},
+        };
+
+        rc = storage_writev(fh, 0, iov, countof(iov), opflags);
+        if (rc >= 0) {
+            rc = (size_t)rc == iov[0].iov_len + iov[1].iov_len ? NO_ERROR
+                                                                : ERR_IO;
+        }
+    }
+
+    storage_close_file(fh);
+    if (rc < 0 && (opflags & STORAGE_OP_COMPLETE)) {
+        storage_end_transaction(session, false);
+    }
+err_open:
+    free(ends);
+    return rc;
+}
+
+static int read_exact(file_handle_t fh,
+                      storage_off_t off,
+                      void* buf,
+                      size_t size) {
+    ssize_t rc = storage_read(fh, off, buf, size);
+
+    if (rc < 0) {
+        return rc;
+    }
+    return (size_t)rc == size ? NO_ERROR : ERR_NOT_VALID;
+}
+
+static int read_index(struct storage_cfile* cfile) {
+    struct storage_cfile_header header;
+    storage_off_t file_size;
+    uint32_t start = 0;
+    uint32_t i;
+    int rc;
+
+    rc = read_exact(cfile->fh, 0, &header, sizeof(header));
+    if (rc < 0) {
+        return rc;
+    }
+    if (header.magic != STORAGE_CFILE_MAGIC ||
+        header.version != STORAGE_CFILE_VERSION || header.reserved ||
+        header.block_shift < STORAGE_CFILE_MIN_BLOCK_SHIFT ||
+        header.block_shift > STORAGE_CFILE_MAX_BLOCK_SHIFT ||
+        header.block_count > UINT32_MAX / sizeof(*cfile->ends) ||
+        header.block_count !=
+                block_count_of(header.size, header.block_shift)) {
+        return ERR_NOT_VALID;
+    }
+    cfile->size = header.size;
+    cfile->block_shift = header.block_shift;
+    cfile->block_count = header.block_count;
+    cfile->cached_block = header.block_count;
+    cfile->data_off = sizeof(header) + header.block_count * sizeof(uint32_t);
+
+    rc = storage_get_file_size(cfile->fh, &file_size);
+    if (rc < 0) {
+        return rc;
+    }
+    if (file_size < cfile->data_off) {
+        return ERR_NOT_VALID;
+    }
+
+    cfile->ends = malloc(MAX(cfile->block_count, 1U) * sizeof(*cfile->ends));
+    cfile->stored = malloc(1U << cfile->block_shift);
+    cfile->block = malloc(1U << cfile->block_shift);
+    if (!cfile->ends || !cfile->stored || !cfile->block) {
+        return ERR_NO_MEMORY;
+    }
+    rc = read_exact(cfile->fh, sizeof(header), cfile->ends,
+                    cfile->block_count * sizeof(*cfile->ends));
+    if (rc < 0) {
+        return rc;
+    }
+
+    for (i = 0; i < cfile->block_count; i++) {
+        if (cfile->ends[i] < start ||
+            cfile->ends[i] - start >
+                    block_len(cfile->size, cfile->block_shift, i)) {
+            return ERR_NOT_VALID;
+        }
+        start = cfile->ends[i];
+    }
+    if (start > file_size - cfile->data_off) {
+        return ERR_NOT_VALID;
+    }
+    return NO_ERROR;
+}
+
+int storage_cfile_open(storage_session_t session,
+                       const char* name,
+                       struct storage_cfile** cfile_p) {
+    struct storage_cfile* cfile = calloc(1, sizeof(*cfile));
+    int rc;
+
+    if (!cfile) {
+        return ERR_NO_MEMORY;
+    }
+    rc = storage_open_file(session, &cfile->fh, name, 0, 0);
+    if (rc < 0) {
+        free(cfile);
+        return rc;
+    }
+    rc = read_index(cfile);
+    if (rc < 0) {
+        storage_cfile_close(cfile);
+        return rc;
+    }
+    *cfile_p = cfile;
+    return NO_ERROR;
+}
+
+void storage_cfile_close(struct storage_cfile* cfile) {
+    if (!cfile) {
+        return;
+    }
+    storage_close_file(cfile->fh);
+    free(cfile->block);
+    free(cfile->stored);
+    free(cfile->ends);
+    free(cfile);
+}
+
+void storage_cfile_get_size(struct storage_cfile* cfile,
+                            storage_off_t* size_p) {
+    *size_p = cfile->size;
+}
+
+/* Read block @idx into @dst, which holds its uncompressed size */
+static int read_block(struct storage_cfile* cfile, uint32_t idx, uint8_t* dst) {
+    size_t raw_len = block_len(cfile->size, cfile->block_shift, idx);
+    uint32_t start = idx ? cfile->ends[idx - 1] : 0;
+    size_t len = cfile->ends[idx] - start;
+    int rc;
+
+    if (len == raw_len) {
+        return read_exact(cfile->fh, cfile->data_off + start, dst, len);
+    }
+    rc = read_exact(cfile->fh, cfile->data_off + start, cfile->stored, len);
+    if (rc < 0) {
+        return rc;
+    }
+    return lz_decompress(cfile->stored, len, dst, raw_len);
+}
+
+ssize_t storage_cfile_read(struct storage_cfile* cfile,
+                           storage_off_t off,
+                           void* buf,
+                           size_t size) {
+    uint8_t* dst = buf;
+    size_t block_off;
+    size_t raw_len;
+    size_t len;
+    uint32_t idx;
+    int rc;
+
+    if (off >= cfile->size) {
+        return 0;
+    }
+    size = MIN(size, cfile->size - off);
+
+    while (size) {
+        idx = off >> cfile->block_shift;
+        block_off = off & ((1U << cfile->block_shift) - 1);
+        raw_len = block_len(cfile->size, cfile->block_shift, idx);
+        len = MIN(size, raw_len - block_off);
+
+        if (idx == cfile->cached_block) {
+            memcpy(dst, cfile->block + block_off, len);
+        } else if (len == raw_len) {
+            /* whole blocks go straight to the caller's buffer */
+            rc = read_block(cfile, idx, dst);
+            if (rc < 0) {
+                return rc;
+            }
+        } else {
+            cfile->cached_block = cfile->block_count;
+            rc = read_block(cfile, idx, cfile->block);
+            if (rc < 0) {
+                return rc;
+            }
+            cfile->cached_block = idx;
+            memcpy(dst, cfile->block + block_off, len);
+        }
+        dst += len;
+        off += len;
+        size -= len;
+    }
+    return dst - (uint8_t*)buf;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <lib/storage/storage.h>
+
+/*
+ * Compressed storage files.
+ *
+ * A compressed file holds its contents as independently compressed blocks of
+ * STORAGE_CFILE_BLOCK_SIZE bytes, preceded by an index of where each block
+ * is stored. Reading at an offset only transfers and decompresses the blocks
+ * holding the requested range, so compressed files still support random
+ * reads. Blocks that do not shrink are stored as they are.
+ *
+ * Compressed files are written in one go with storage_cfile_write(), which
+ * suits the large blobs worth compressing, and must only be read through
+ * this interface.
+ */
+
+__BEGIN_CDECLS
+
+/* Size of the blocks written by storage_cfile_write(), at most 64 KiB */
+#ifndef STORAGE_CFILE_BLOCK_SIZE
+#define STORAGE_CFILE_BLOCK_SIZE 16384
+#endif
+
+struct storage_cfile;
+
+/**
+ * storage_cfile_write() - Replace the contents of a compressed file
+ * @session: the storage_session_t returned from a call to storage_open_session
+ * @name:    the name of the file, which is created if it does not exist
+ * @buf:     the new uncompressed contents of the file
+ * @size:    the number of bytes in @buf
+ * @opflags: a combination of @storage_op_flags
+ *
+ * If this fails after changing the file and @opflags contains
+ * %STORAGE_OP_COMPLETE, the transaction of @session is discarded. Otherwise
+ * the contents of the file are undefined until it is written again or the
+ * transaction is discarded by the caller.
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure.
+ */
+int storage_cfile_write(storage_session_t session,
+                        const char* name,
+                        const void* buf,
+                        size_t size,
+                        uint32_t opflags);
+
+/**
+ * storage_cfile_open() - Open a compressed file for reading
+ * @session: the storage_session_t returned from a call to storage_open_session
+ * @name:    the name of the file, written by storage_cfile_write()
+ * @cfile_p: pointer to location in which to store the open file
+ *
+ * Return: NO_ERROR on success, ERR_NOT_VALID if the file is not a compressed
+ * file, or another error code < 0 on failure.
+ */
+int storage_cfile_open(storage_session_t session,
+                       const char* name,
+                       struct storage_cfile** cfile_p);
+
+/**
+ * storage_cfile_close() - Close a compressed file
+ * @cfile: the file returned by storage_cfile_open(), may be %NULL
+ */
+void storage_cfile_close(struct storage_cfile* cfile);
+
+/**
+ * storage_cfile_get_size() - Get the uncompressed size of a compressed file
+ * @cfile:  the file returned by storage_cfile_open()
+ * @size_p: pointer to location in which to store the size
+ */
+void storage_cfile_get_size(struct storage_cfile* cfile,
+                            storage_off_t* size_p);
+
+/**
+ * storage_cfile_read() - Read uncompressed data from a compressed file
+ * @cfile: the file returned by storage_cfile_open()
+ * @off:   the uncompressed offset from whence to read
+ * @buf:   the buffer in which to write the data read
+ * @size:  the size of @buf and number of bytes to read
+ *
+ * The last block read is kept decompressed, so small sequential reads
+ * decompress each block once.
+ *
+ * Return: the number of bytes read, less than @size only at the end of the
+ * file, ERR_NOT_VALID if the file is corrupt, or another error code < 0 on
+ * failure.
+ */
+ssize_t storage_cfile_read(struct storage_cfile* cfile,
+                           storage_off_t off,
+                           void* buf,
+                           size_t size);
+
+__END_CDECLS
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Cache of open file handles.
+ *
+ * Files opened while the cache is enabled stay open on the server after the
+ * app closes them, so opening the same name again needs no round-trip. A
+ * handle may be handed out to several openers at once, as every operation on
+ * it carries its own offset. Idle handles are closed in least recently used
+ * order once more than the configured number of files are cached. Handles
+ * whose name no longer refers to the same file are detached from their name
+ * and closed as soon as they become idle.
+ *
+ * Resizing the cache keeps the handles that are in use, so each of them is
+ * closed once, by its last user. A cache resized to zero files hands out no
+ * handles, but keeps tracking the ones still in use.
+ */
+
+#include <lk/list.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uapi/err.h>
+
+#include "storage_priv.h"
+
+/**
+ * struct storage_fh_entry - a cached file handle
+ * @node:     list node in &storage_fh_cache->entries
+ * @fh:       the open file handle
+ * @refs:     number of openers that have not closed the handle yet
+ * @detached: the handle may no longer be returned for @name
+ * @name:     the name the file was opened by
+ */
+struct storage_fh_entry {
+    struct list_node node;
+    file_handle_t fh;
+    size_t refs;
+    bool detached;
+    char name[];
+};
+
+/**
+ * struct storage_fh_cache - open file handle cache of a session
+ * @max_files: number of cached handles above which idle ones are closed, no
+ *             new handles are cached if it is zero
+ * @count:     number of entries that are not detached
+ * @entries:   all entries, most recently used first
+ */
+struct storage_fh_cache {
+    size_t max_files;
+    size_t count;
+    struct list_node entries;
+};
+
+struct storage_fh_cache* storage_fhc_create(size_t max_files) {
+    struct storage_fh_cache* fhc = calloc(1, sizeof(*fhc));
+
+    if (!fhc) {
+        return NULL;
+    }
+    fhc->max_files = max_files;
+    list_initialize(&fhc->entries);
+    return fhc;
+}
+
+void storage_fhc_destroy(struct storage_fh_cache* fhc) {
+    struct storage_fh_entry* entry;
+
+    if (!fhc) {
+        return;
+    }
+    while ((entry = list_remove_head_type(&fhc->entries,
+                                          struct storage_fh_entry, node))) {
+        free(entry);
+    }
+    free(fhc);
+}
+
+static void drop(struct storage_fh_cache* fhc, struct storage_fh_entry* entry) {
+    if (!entry->detached) {
+        fhc->count--;
+    }
+    list_delete(&entry->node);
+    free(entry);
+}
+
+/* close the handle of @entry once nobody uses it, else close it on release */
+static void detach(struct storage_fh_cache* fhc,
+                   struct storage_fh_entry* entry) {
+    if (!entry->refs) {
+        file_handle_t fh = entry->fh;
+
+        drop(fhc, entry);
+        storage_close_file_direct(fh);
+        return;
+    }
+    if (!entry->detached) {
+        entry->detached = true;
+        fhc->count--;
+    }
+}
+
+static void evict(struct storage_fh_cache* fhc) {
+    struct storage_fh_entry* entry;
+    struct storage_fh_entry* prev;
+
+    entry = list_peek_tail_type(&fhc->entries, struct storage_fh_entry, node);
+    while (entry && fhc->count > fhc->max_files) {
+        prev = list_prev_type(&fhc->entries, &entry->node,
+                              struct storage_fh_entry, node);
+        if (!entry->refs) {
+            detach(fhc, entry);
+        }
+        entry = prev;
+    }
+}
+
+static struct storage_fh_entry* find_name(struct storage_fh_cache* fhc,
+                                          const char* name) {
+    struct storage_fh_entry* entry;
+
+    list_for_every_entry(&fhc->entries, entry, struct storage_fh_entry, node) {
+        if (!entry->detached && !strcmp(entry->name, name)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+int storage_fhc_get(struct storage_fh_cache* fhc,
+                    const char* name,
+                    file_handle_t* fh_p) {
+    struct storage_fh_entry* entry = find_name(fhc, name);
+
+    if (!entry) {
+        return ERR_NOT_FOUND;
+    }
+    entry->refs++;
+    list_delete(&entry->node);
+    list_add_head(&fhc->entries, &entry->node);
+    *fh_p = entry->fh;
+    return NO_ERROR;
+}
+
+void storage_fhc_add(struct storage_fh_cache* fhc,
+                     const char* name,
+                     file_handle_t fh) {
+    size_t name_size = strlen(name) + 1;
+    struct storage_fh_entry* entry;
+
+    if (!fhc->max_files) {
+        /* the handle is closed normally */
+        return;
+    }
+    entry = malloc(sizeof(*entry) + name_size);
+    if (!entry) {
+        /* the handle is closed normally */
+        return;
+    }
+    entry->fh = fh;
+    entry->refs = 1;
+    entry->detached = false;
+    memcpy(entry->name, name, name_size);
+    list_add_head(&fhc->entries, &entry->node);
+    fhc->count++;
+    evict(fhc);
+}
+
+bool storage_fhc_put(struct storage_fh_cache* fhc, file_handle_t fh) {
+    struct storage_fh_entry* entry;
+
+    if (!fhc) {
+        return false;
+    }
+    list_for_every_entry(&fhc->entries, entry, struct storage_fh_entry, node) {
+        if (entry->fh == fh && entry->refs) {
+            entry->refs--;
+            if (entry->detached) {
+                detach(fhc, entry);
+            } else {
+                evict(fhc);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void storage_fhc_forget(struct storage_fh_cache* fhc, const char* name) {
+    struct storage_fh_entry* entry;
+
+    if (!fhc) {
+        return;
+    }
+    entry = find_name(fhc, name);
+    if (entry) {
+        detach(fhc, entry);
+    }
+}
+
+void storage_fhc_clear(struct storage_fh_cache* fhc) {
+    struct storage_fh_entry* entry;
+    struct storage_fh_entry* tmp;
+
+    if (!fhc) {
+        return;
+    }
+    list_for_every_entry_safe(&fhc->entries, entry, tmp,
+                              struct storage_fh_entry, node) {
+        if (!entry->detached) {
+            detach(fhc, entry);
+        }
+    }
+}
+
+void storage_fhc_resize(struct storage_fh_cache* fhc, size_t max_files) {
+    fhc->max_files = max_files;
+    if (!max_files) {
+        storage_fhc_clear(fhc);
+    } else {
+        evict(fhc);
+    }
+}
+
+bool storage_fhc_enabled(const struct storage_fh_cache* fhc) {
+    return fhc && fhc->max_files;
+}
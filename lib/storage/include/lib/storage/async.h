@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <lib/storage/storage.h>
+#include <lib/tipc/tipc.h>
+
+/*
+ * Non-blocking storage client.
+ *
+ * An async session owns its own channel to the storage server and registers
+ * it with the app's &struct tipc_hset. Submitting an operation sends its
+ * request, or queues it if the channel is busy, and returns immediately. When
+ * the response arrives, the event loop running on the handle set invokes the
+ * operation's completion callback. Operations complete in the order they were
+ * submitted.
+ *
+ * File handles opened on an async session may only be used with the
+ * storage_async_*() functions of that session. Buffers passed to read and
+ * write operations, and the locations passed to store results in, must remain
+ * valid until the operation completes.
+ */
+
+__BEGIN_CDECLS
+
+struct storage_async_session;
+
+/**
+ * typedef storage_async_cb_t - completion callback of an async operation
+ * @priv:   the value passed when the operation was submitted
+ * @token:  the token returned when the operation was submitted
+ * @result: for reads and writes, the number of bytes transferred, otherwise
+ *          NO_ERROR; or a negative error code on failure
+ *
+ * Callbacks may submit new operations, but must not close the session.
+ */
+typedef void (*storage_async_cb_t)(void* priv, uint32_t token, ssize_t result);
+
+/**
+ * storage_async_open_session() - Open an async storage session
+ * @hset:       the handle set the app's event loop runs on
+ * @type:       one of the STORAGE_CLIENT_*_PORT names
+ * @session_p:  pointer to location in which to store the session
+ *
+ * Connecting waits for the storage port to become available, so this should
+ * be called during app initialization.
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure.
+ */
+int storage_async_open_session(struct tipc_hset* hset,
+                               const char* type,
+                               struct storage_async_session** session_p);
+
+/**
+ * storage_async_close_session() - Close an async storage session
+ * @session: the session to close
+ *
+ * Operations that have not completed yet are completed with
+ * ERR_CHANNEL_CLOSED before this returns.
+ */
+void storage_async_close_session(struct storage_async_session* session);
+
+/**
+ * storage_async_open_file() - Submit opening a file
+ * @session:  the async session to use
+ * @handle_p: pointer to location in which to store the file handle
+ * @name:     a null-terminated string identifier of the file
+ * @flags:    a combination of STORAGE_FILE_OPEN_* flags
+ * @opflags:  a combination of @storage_op_flags
+ * @cb:       completion callback, may be %NULL
+ * @priv:     value to pass to @cb
+ * @token_p:  pointer to location in which to store the operation token, may be
+ *            %NULL
+ *
+ * Return: NO_ERROR if the operation was submitted, or an error code < 0 if it
+ * was not, in which case @cb is not called.
+ */
+int storage_async_open_file(struct storage_async_session* session,
+                            file_handle_t* handle_p,
+                            const char* name,
+                            uint32_t flags,
+                            uint32_t opflags,
+                            storage_async_cb_t cb,
+                            void* priv,
+                            uint32_t* token_p);
+
+/**
+ * storage_async_close_file() - Submit closing a file
+ * @session: the async session @fh was opened on
+ * @fh:      the file handle to close
+ * @cb:      completion callback, may be %NULL
+ * @priv:    value to pass to @cb
+ * @token_p: pointer to location in which to store the operation token, may be
+ *           %NULL
+ *
+ * Return: NO_ERROR if the operation was submitted, or an error code < 0 if it
+ * was not, in which case @cb is not called.
+ */
+int storage_async_close_file(struct storage_async_session* session,
+                             file_handle_t fh,
+                             storage_async_cb_t cb,
+                             void* priv,
+                             uint32_t* token_p);
+
+/**
+ * storage_async_read() - Submit reading from a file
+ * @session: the async session @fh was opened on
+ * @fh:      the file handle to read from
+ * @off:     the start offset from whence to read in the file
+ * @buf:     the buffer in which to write the data read
+ * @size:    the size of buf and number of bytes to read
+ * @cb:      completion callback, may be %NULL
+ * @priv:    value to pass to @cb
+ * @token_p: pointer to location in which to store the operation token, may be
+ *           %NULL
+ *
+ * Reads larger than a single IPC message are split into several requests
+ * that are kept in flight together. The operation completes with fewer than
+ * @size bytes if the end of the file is reached.
+ *
+ * Return: NO_ERROR if the operation was submitted, or an error code < 0 if it
+ * was not, in which case @cb is not called.
+ */
+int storage_async_read(struct storage_async_session* session,
+                       file_handle_t fh,
+                       storage_off_t off,
+                       void* buf,
+                       size_t size,
+                       storage_async_cb_t cb,
+                       void* priv,
+                       uint32_t* token_p);
+
+/**
+ * storage_async_write() - Submit writing to a file
+ * @session: the async session @fh was opened on
+ * @fh:      the file handle to write to
+ * @off:     the start offset from whence to write in the file
+ * @buf:     the buffer containing the data to write
+ * @size:    the size of buf and number of bytes to write
+ * @opflags: a combination of @storage_op_flags, applied to the request
+ *           carrying the last part of the data
+ * @cb:      completion callback, may be %NULL
+ * @priv:    value to pass to @cb
+ * @token_p: pointer to location in which to store the operation token, may be
+ *           %NULL
+ *
+ * Return: NO_ERROR if the operation was submitted, or an error code < 0 if it
+ * was not, in which case @cb is not called.
+ */
+int storage_async_write(struct storage_async_session* session,
+                        file_handle_t fh,
+                        storage_off_t off,
+                        const void* buf,
+                        size_t size,
+                        uint32_t opflags,
+                        storage_async_cb_t cb,
+                        void* priv,
+                        uint32_t* token_p);
+
+/**
+ * storage_async_get_file_size() - Submit getting the size of a file
+ * @session: the async session @fh was opened on
+ * @fh:      the file handle to query
+ * @size_p:  pointer to location in which to store the file size
+ * @cb:      completion callback, may be %NULL
+ * @priv:    value to pass to @cb
+ * @token_p: pointer to location in which to store the operation token, may be
+ *           %NULL
+ *
+ * Return: NO_ERROR if the operation was submitted, or an error code < 0 if it
+ * was not, in which case @cb is not called.
+ */
+int storage_async_get_file_size(struct storage_async_session* session,
+                                file_handle_t fh,
+                                storage_off_t* size_p,
+                                storage_async_cb_t cb,
+                                void* priv,
+                                uint32_t* token_p);
+
+/**
+ * storage_async_end_transaction() - Submit ending the current transaction
+ * @session:  the async session to use
+ * @complete: if true, commit the current transaction, otherwise discard it
+ * @cb:       completion callback, may be %NULL
+ * @priv:     value to pass to @cb
+ * @token_p:  pointer to location in which to store the operation token, may
+ *            be %NULL
+ *
+ * Return: NO_ERROR if the operation was submitted, or an error code < 0 if it
+ * was not, in which case @cb is not called.
+ */
+int storage_async_end_transaction(struct storage_async_session* session,
+                                  bool complete,
+                                  storage_async_cb_t cb,
+                                  void* priv,
+                                  uint32_t* token_p);
+
+__END_CDECLS
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <stdint.h>
+
+#include <interface/metrics/metrics.h>
+
+/*
+ * Storage operation statistics.
+ *
+ * The storage client library counts the operations of the app on all of its
+ * sessions, with a latency histogram per operation type. Latency is measured
+ * from the app's call to its return, so it includes time spent waiting for
+ * the storage server and any data served from the session's caches.
+ */
+
+__BEGIN_CDECLS
+
+/**
+ * enum storage_stats_op - types of operations statistics are kept for
+ * @STORAGE_STATS_OP_OPEN:   storage_open_file()
+ * @STORAGE_STATS_OP_READ:   storage_read() and storage_readv()
+ * @STORAGE_STATS_OP_WRITE:  storage_write() and storage_writev() without
+ *                           %STORAGE_OP_COMPLETE
+ * @STORAGE_STATS_OP_COMMIT: storage_end_transaction() committing changes,
+ *                           and writes with %STORAGE_OP_COMPLETE
+ * @STORAGE_STATS_OP_LIST:   requests for more directory entries sent by
+ *                           storage_read_dir() and storage_read_dir_entries()
+ * @STORAGE_STATS_OP_COUNT:  number of operation types
+ */
+enum storage_stats_op {
+    STORAGE_STATS_OP_OPEN = METRICS_STORAGE_OP_OPEN,
+    STORAGE_STATS_OP_READ = METRICS_STORAGE_OP_READ,
+    STORAGE_STATS_OP_WRITE = METRICS_STORAGE_OP_WRITE,
+    STORAGE_STATS_OP_COMMIT = METRICS_STORAGE_OP_COMMIT,
+    STORAGE_STATS_OP_LIST = METRICS_STORAGE_OP_LIST,
+    STORAGE_STATS_OP_COUNT,
+};
+
+/*
+ * Bucket 0 of a latency histogram counts operations that took less than
+ * STORAGE_STATS_BUCKET0_USEC microseconds, and each following bucket covers
+ * twice the latency of the previous one. The last bucket counts all slower
+ * operations.
+ */
+#define STORAGE_STATS_BUCKETS METRICS_STORAGE_BUCKETS
+#define STORAGE_STATS_BUCKET0_USEC METRICS_STORAGE_BUCKET0_USEC
+
+/**
+ * struct storage_op_stats - statistics of one type of operation
+ * @count:      number of operations
+ * @errors:     number of operations that failed
+ * @bytes:      number of bytes transferred by successful operations
+ * @total_usec: total latency of all operations in microseconds
+ * @max_usec:   latency of the slowest operation in microseconds
+ * @hist:       latency histogram, see %STORAGE_STATS_BUCKETS
+ */
+struct storage_op_stats {
+    uint32_t count;
+    uint32_t errors;
+    uint64_t bytes;
+    uint64_t total_usec;
+    uint64_t max_usec;
+    uint32_t hist[STORAGE_STATS_BUCKETS];
+};
+
+/**
+ * struct storage_stats - statistics of all storage operations of the app
+ * @ops: statistics per operation, indexed by &enum storage_stats_op
+ */
+struct storage_stats {
+    struct storage_op_stats ops[STORAGE_STATS_OP_COUNT];
+};
+
+/**
+ * storage_get_stats() - Take a snapshot of the storage operation statistics
+ * @stats: pointer to location in which to store the statistics
+ */
+void storage_get_stats(struct storage_stats* stats);
+
+/**
+ * storage_reset_stats() - Reset all storage operation statistics to zero
+ */
+void storage_reset_stats(void);
+
+/**
+ * storage_set_slow_op_threshold() - Log storage operations that take too long
+ * @msec: latency in milliseconds above which each operation is logged, or 0
+ *        to log none
+ */
+void storage_set_slow_op_threshold(uint32_t msec);
+
+/**
+ * storage_report_stats() - Forward storage operation statistics to the metrics
+ * service
+ *
+ * Sends a %METRICS_CMD_REPORT_STORAGE event for every type of operation the
+ * app performed, which the metrics service tags with the app's UUID. Only apps
+ * the metrics service lists may report. The statistics are not reset, so
+ * apps reporting periodically should call storage_reset_stats() after this
+ * returns successfully. Reporting waits for the metrics service to forward
+ * each event to Android, so it should not be done on latency critical paths.
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure.
+ */
+int storage_report_stats(void);
+
+__END_CDECLS
@@ -60,6 +60,101 @@ int storage_open_session(storage_session_t* session_p, const char* type);
  */
 void storage_close_session(storage_session_t session);
 
+/**
+ * storage_set_cache_size() - Enables, resizes or disables the read cache of a
+ * session.
+ * @session:   the storage_session_t returned from a call to storage_open_session
+ * @max_bytes: maximum number of bytes of file data to cache, or 0 to disable
+ *             the cache.
+ *
+ * Reads through a session with a cache are served from fixed-size cached
+ * blocks where possible, and sequential reads are read ahead. Cached data is
+ * dropped when it is modified or a transaction is discarded through the same
+ * session, but changes made through other sessions are not seen, so the cache
+ * must only be enabled if the files accessed through @session are not modified
+ * through any other session. Resizing the cache drops its contents.
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure.
+ */
+int storage_set_cache_size(storage_session_t session, size_t max_bytes);
+
+/**
+ * storage_set_write_back() - Enables, resizes or disables write-back buffering
+ * of a session.
+ * @session:   the storage_session_t returned from a call to storage_open_session
+ * @max_bytes: maximum number of bytes of uncommitted writes to buffer, or 0 to
+ *             disable write-back buffering.
+ *
+ * With write-back buffering, storage_write() calls without
+ * STORAGE_OP_COMPLETE only buffer their data, merging adjacent and overlapping
+ * writes to the same file. Buffered data is written out as few large writes
+ * when the transaction is committed with STORAGE_OP_COMPLETE or
+ * storage_end_transaction(), before any other operation that reads or changes
+ * a file through any handle of the session, when the handle it was written
+ * through is closed, and whenever more than @max_bytes are buffered. Buffered
+ * data is dropped if the transaction is discarded.
+ *
+ * Transactional semantics are unchanged, but errors are deferred: a buffered
+ * storage_write() returns the number of bytes passed to it before any data is
+ * sent to the server, and an error writing the data out is returned by the
+ * call that triggered it instead, which may be an operation on another file.
+ * That call fails without having been carried out, and all data buffered in
+ * the session is dropped, so the transaction has to be discarded. Errors
+ * writing out data when closing a file are only logged. Callers that need to
+ * know whether a write succeeded must commit it or disable write-back.
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure, including
+ * failure to write out data buffered before this call.
+ */
+int storage_set_write_back(storage_session_t session, size_t max_bytes);
+
+/**
+ * storage_set_file_cache_size() - Enables, resizes or disables the open file
+ * handle cache of a session.
+ * @session:   the storage_session_t returned from a call to storage_open_session
+ * @max_files: number of cached files above which files no longer in use are
+ *             closed, or 0 to disable the cache.
+ *
+ * With the cache enabled, storage_close_file() leaves files open on the
+ * server, and opening a file by the same name again returns the same handle
+ * without a round-trip, even while it is still open elsewhere. Opening with
+ * STORAGE_FILE_OPEN_TRUNCATE or STORAGE_FILE_OPEN_CREATE_EXCLUSIVE always
+ * reaches the server. Cached handles are not reused for a name after the file
+ * is moved or deleted through the same session, or a transaction is discarded,
+ * and the least recently used ones are closed when more than @max_files are
+ * cached. As with the read cache, files deleted or replaced through other
+ * sessions are not seen. Shrinking or disabling the cache closes the files
+ * it no longer holds once they are not in use anymore.
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure.
+ */
+int storage_set_file_cache_size(storage_session_t session, size_t max_files);
+
+/**
+ * storage_prefetch() - Opens and starts reading files about to be used
+ * @session: the storage_session_t returned from a call to storage_open_session
+ * @names:   null-terminated names of the files to prefetch
+ * @count:   number of entries in @names
+ *
+ * Opens all files in @names that are not open yet and reads the start of
+ * each into the read cache, keeping several requests in flight instead of
+ * waiting for each response, so that apps reading a known set of files at
+ * startup pay for about one round-trip instead of two per file. The files
+ * are left open in the open file handle cache, so that cache must be enabled
+ * with storage_set_file_cache_size(), and only as many of them stay open as
+ * it holds. Data is only read if the read cache is enabled with
+ * storage_set_cache_size(). Files that cannot be opened, for example because
+ * they do not exist, are skipped.
+ *
+ * Return: NO_ERROR on success, ERR_NOT_SUPPORTED if the open file handle
+ * cache is disabled, or another error code < 0 if communicating with the
+ * server failed. If the channel itself failed, the session can no longer be
+ * used and must be closed.
+ */
+int storage_prefetch(storage_session_t session,
+                     const char* const* names,
+                     size_t count);
+
 /**
  * storage_open_file() - Opens a file
  * @session:  the storage_session_t returned from a call to storage_open_session
@@ -146,6 +241,22 @@ int storage_open_dir(storage_session_t session,
                      const char* path,
                      struct storage_open_dir_state** state);
 
+/**
+ * storage_open_dir_prefix() - Open an iterator over files with a name prefix.
+ * @session: the storage_session_t returned from a call to storage_open_session
+ * @prefix:  only files whose names start with this are listed. %NULL or ""
+ *           lists all files.
+ * @state:   Pointer to return state object in.
+ *
+ * The server filters the names if it supports it, so only matching names are
+ * transferred. Otherwise all names are fetched and filtered on the client.
+ *
+ * Return: 0 on success, or an error code < 0 on failure.
+ */
+int storage_open_dir_prefix(storage_session_t session,
+                            const char* prefix,
+                            struct storage_open_dir_state** state);
+
 /**
  * storage_close_dir() - Close open directory iterator.
  * @session: the storage_session_t returned from a call to storage_open_session
@@ -172,6 +283,37 @@ int storage_read_dir(storage_session_t session,
                      char* name,
                      size_t name_size);
 
+/**
+ * struct storage_dir_entry - a file returned by storage_read_dir_entries()
+ * @flags: STORAGE_FILE_LIST_COMMITTED, STORAGE_FILE_LIST_ADDED or
+ *         STORAGE_FILE_LIST_REMOVED
+ * @name:  null-terminated file name
+ */
+struct storage_dir_entry {
+    uint8_t flags;
+    char name[STORAGE_MAX_NAME_LENGTH_BYTES + 1];
+};
+
+/**
+ * storage_read_dir_entries() - Read several file names from directory.
+ * @session:     the storage_session_t returned from a call to
+ *               storage_open_session
+ * @state:       directory state object retrieved from storage_open_dir or
+ *               storage_open_dir_prefix
+ * @entries:     array to store the files in
+ * @max_entries: number of entries in @entries
+ *
+ * Each response from the server holds as many names as fit in a message, so
+ * listing many files takes few round-trips.
+ *
+ * Return: the number of entries stored, which is less than @max_entries only
+ * once all files have been listed, or a negative error code on failure.
+ */
+int storage_read_dir_entries(storage_session_t session,
+                             struct storage_open_dir_state* state,
+                             struct storage_dir_entry* entries,
+                             size_t max_entries);
+
 /**
  * storage_read() - Reads a file at a given offset.
  * @handle: the file_handle_t retrieved from storage_open_file
@@ -196,6 +338,10 @@ ssize_t storage_read(file_handle_t handle,
  * @size: the size of buf and number of bytes to write
  * @opflags: a combination of @storage_op_flags
  *
+ * If write-back buffering is enabled for the session and @opflags does not
+ * include STORAGE_OP_COMPLETE, success only means that the data was buffered,
+ * see storage_set_write_back().
+ *
  * Return: the number of bytes written on success, negative error code on
  * failure
  */
@@ -205,6 +351,45 @@ ssize_t storage_write(file_handle_t handle,
                       size_t size,
                       uint32_t opflags);
 
+/**
+ * storage_readv() - Reads a file at a given offset into several buffers.
+ * @handle: the file_handle_t retrieved from storage_open_file
+ * @off: the start offset from whence to read in the file
+ * @iov: the buffers to fill, in order
+ * @iovcnt: the number of entries in @iov
+ *
+ * The buffers are used as the receive buffers of the IPC messages, so the data
+ * is not copied through an intermediate buffer.
+ *
+ * Return: the total number of bytes read on success, negative error code on
+ * failure
+ */
+ssize_t storage_readv(file_handle_t handle,
+                      storage_off_t off,
+                      const struct iovec* iov,
+                      size_t iovcnt);
+
+/**
+ * storage_writev() - Writes the contents of several buffers to a file at a
+ * given offset. Grows the file if necessary.
+ * @handle: the file_handle_t retrieved from storage_open_file
+ * @off: the start offset from whence to write in the file
+ * @iov: the buffers containing the data to write, in order
+ * @iovcnt: the number of entries in @iov
+ * @opflags: a combination of @storage_op_flags
+ *
+ * The buffers are sent as part of the IPC messages, so the data is not copied
+ * through an intermediate buffer. The write bypasses write-back buffering.
+ *
+ * Return: the total number of bytes written on success, negative error code on
+ * failure
+ */
+ssize_t storage_writev(file_handle_t handle,
+                       storage_off_t off,
+                       const struct iovec* iov,
+                       size_t iovcnt,
+                       uint32_t opflags);
+
 /**
  * storage_set_file_size() - Sets the size of the file.
  * @handle: the file_handle_t retrieved from storage_open_file
@@ -226,6 +411,39 @@ int storage_set_file_size(file_handle_t handle,
  */
 int storage_get_file_size(file_handle_t handle, storage_off_t* size);
 
+/**
+ * struct storage_file_map - a read-only view of a whole file
+ * @addr:     the contents of the file
+ * @size:     the size of the file
+ * @map_size: the size of the mapping at @addr, or 0 if @addr is a heap copy
+ */
+struct storage_file_map {
+    const void* addr;
+    size_t size;
+    size_t map_size;
+};
+
+/**
+ * storage_map_file() - Get a read-only view of a whole file
+ * @handle: the file_handle_t retrieved from storage_open_file
+ * @map:    pointer to location in which to store the view
+ *
+ * Maps a read-only copy of the file made by the storage server, so large
+ * files can be used in place without being copied through IPC messages. If
+ * the server does not support mapping files, the file is read into a heap
+ * buffer instead. The view does not change when the file does, and stays
+ * valid after the file is closed.
+ *
+ * Return: NO_ERROR on success, negative error code on failure.
+ */
+int storage_map_file(file_handle_t handle, struct storage_file_map* map);
+
+/**
+ * storage_unmap_file() - Release a view returned by storage_map_file()
+ * @map: the view to release
+ */
+void storage_unmap_file(struct storage_file_map* map);
+
 /**
  * storage_end_transaction: End current transaction
  * @session: the storage_session_t returned from a call to storage_open_session
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lib/storage/storage.h>
+
+/*
+ * Log-structured key-value store on top of secure storage.
+ *
+ * Records are appended to a small number of segment files named
+ * "<name>.<n>", and a "<name>.meta" file records which segments are live. An
+ * in-memory hash index mapping each key to the location of its latest record
+ * is rebuilt from the segments when the store is opened, so lookups of
+ * committed keys cost a single read.
+ *
+ * storage_kv_put() and storage_kv_delete() only stage changes in memory.
+ * storage_kv_commit() appends all staged records at once and commits them in
+ * a single storage transaction, usually a single write. Superseded records
+ * are reclaimed by storage_kv_compact(), which apps should call when idle.
+ *
+ * The store commits and discards transactions on the session it is opened on,
+ * so that session must not be used for anything else.
+ */
+
+#define STORAGE_KV_MAX_KEY_SIZE 256U
+
+__BEGIN_CDECLS
+
+struct storage_kv;
+
+/**
+ * storage_kv_open() - Open a key-value store, creating it if needed
+ * @session: the storage_session_t returned from a call to
+ *           storage_open_session, for exclusive use by the store
+ * @name:    name of the store, used as a prefix for its file names
+ * @kv_p:    pointer to location in which to store the opened store
+ *
+ * Return: NO_ERROR on success, ERR_NOT_VALID if the store is corrupt, or
+ * another error code < 0 on failure.
+ */
+int storage_kv_open(storage_session_t session,
+                    const char* name,
+                    struct storage_kv** kv_p);
+
+/**
+ * storage_kv_close() - Close a key-value store
+ * @kv: the store to close
+ *
+ * Uncommitted changes are discarded.
+ */
+void storage_kv_close(struct storage_kv* kv);
+
+/**
+ * storage_kv_get() - Look up a key
+ * @kv:          the store to read from
+ * @key:         the key to look up
+ * @key_len:     length of @key, at most %STORAGE_KV_MAX_KEY_SIZE
+ * @buf:         buffer to store the value in
+ * @buf_size:    size of @buf
+ * @value_len_p: pointer to location in which to store the size of the value
+ *
+ * Uncommitted changes are visible to lookups.
+ *
+ * Return: NO_ERROR on success, ERR_NOT_FOUND if the key does not exist,
+ * ERR_NOT_ENOUGH_BUFFER if the value does not fit in @buf, in which case only
+ * @value_len_p is updated, or another error code < 0 on failure.
+ */
+int storage_kv_get(struct storage_kv* kv,
+                   const void* key,
+                   size_t key_len,
+                   void* buf,
+                   size_t buf_size,
+                   size_t* value_len_p);
+
+/**
+ * storage_kv_put() - Stage setting a key to a value
+ * @kv:        the store to update
+ * @key:       the key to set
+ * @key_len:   length of @key, at most %STORAGE_KV_MAX_KEY_SIZE
+ * @value:     the value to store
+ * @value_len: length of @value, at most 32 KiB
+ *
+ * Return: NO_ERROR on success, ERR_TOO_BIG if @value_len is too large, or
+ * another error code < 0 on failure.
+ */
+int storage_kv_put(struct storage_kv* kv,
+                   const void* key,
+                   size_t key_len,
+                   const void* value,
+                   size_t value_len);
+
+/**
+ * storage_kv_delete() - Stage deleting a key
+ * @kv:      the store to update
+ * @key:     the key to delete
+ * @key_len: length of @key, at most %STORAGE_KV_MAX_KEY_SIZE
+ *
+ * Return: NO_ERROR on success, ERR_NOT_FOUND if the key does not exist, or
+ * another error code < 0 on failure.
+ */
+int storage_kv_delete(struct storage_kv* kv, const void* key, size_t key_len);
+
+/**
+ * storage_kv_commit() - Atomically commit all staged changes
+ * @kv: the store to commit
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure, in which case
+ * none of the staged changes have been applied and they are discarded.
+ */
+int storage_kv_commit(struct storage_kv* kv);
+
+/**
+ * storage_kv_abort() - Discard all staged changes
+ * @kv: the store to roll back
+ */
+void storage_kv_abort(struct storage_kv* kv);
+
+/**
+ * storage_kv_compact() - Reclaim space used by superseded records
+ * @kv: the store to compact
+ *
+ * Each call moves the live records of the oldest segment to the newest one
+ * and deletes the oldest segment in a single transaction. Call this while
+ * storage_kv_garbage() reports a significant amount of garbage, when nothing
+ * else needs to be done.
+ *
+ * Return: NO_ERROR on success, ERR_BUSY if there are staged changes, or
+ * another error code < 0 on failure.
+ */
+int storage_kv_compact(struct storage_kv* kv);
+
+/**
+ * storage_kv_garbage() - Get the number of bytes used by superseded records
+ * @kv: the store to check
+ *
+ * Return: the number of bytes that storage_kv_compact() can reclaim.
+ */
+size_t storage_kv_garbage(struct storage_kv* kv);
+
+__END_CDECLS
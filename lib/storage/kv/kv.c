@@ -0,0 +1,913 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TLOG_TAG "storage_kv"
+
+#include <lib/storage/kv.h>
+
+#include <lk/macros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trusty_log.h>
+#include <uapi/err.h>
+
+/*
+ * Segments past this size are not appended to, so compaction never has to
+ * copy more than about this much data at once. A single commit larger than
+ * this still goes into one segment.
+ */
+#define KV_SEGMENT_SIZE (32U * 1024U)
+#define KV_HASH_SIZE 128U
+
+#define KV_META_MAGIC 0x4d564b53U /* "SKVM" */
+#define KV_META_VERSION 1U
+#define KV_RECORD_MAGIC 0x52564b53U /* "SKVR" */
+
+#define KV_RECORD_FLAG_TOMBSTONE 0x1U
+
+/**
+ * struct kv_meta - contents of the "<name>.meta" file
+ * @magic:     %KV_META_MAGIC
+ * @version:   %KV_META_VERSION
+ * @first_seg: number of the oldest live segment
+ * @next_seg:  number of the segment to create next. Segments @first_seg up to
+ *             but not including @next_seg are live.
+ */
+struct kv_meta {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t first_seg;
+    uint32_t next_seg;
+};
+
+/**
+ * struct kv_record - header of a record in a segment file
+ * @magic:     %KV_RECORD_MAGIC
+ * @key_len:   length of the key following the header
+ * @flags:     %KV_RECORD_FLAG_TOMBSTONE if the record deletes the key
+ * @value_len: length of the value following the key
+ */
+struct kv_record {
+    uint32_t magic;
+    uint16_t key_len;
+    uint16_t flags;
+    uint32_t value_len;
+};
+
+/**
+ * struct kv_entry - index entry for the latest record of a key
+ * @next:      next entry in the same hash bucket
+ * @seg:       number of the segment holding the record
+ * @off:       offset of the record in the segment
+ * @value_len: length of the value
+ * @key_len:   length of @key
+ * @key:       the key
+ */
+struct kv_entry {
+    struct kv_entry* next;
+    uint32_t seg;
+    uint32_t off;
+    uint32_t value_len;
+    uint16_t key_len;
+    uint8_t key[];
+};
+
+/**
+ * struct kv_segment - an open segment file
+ * @fh:   file handle of the segment
+ * @size: size of the segment file
+ * @live: number of bytes in the segment used by records that are still current
+ */
+struct kv_segment {
+    file_handle_t fh;
+    uint32_t size;
+    uint32_t live;
+};
+
+/**
+ * struct storage_kv - an open key-value store
+ * @session:     session the store was opened on
+ * @name:        name of the store
+ * @meta_fh:     handle of the meta file, valid if @has_meta is set
+ * @has_meta:    whether the meta file exists
+ * @first_seg:   number of the oldest live segment
+ * @seg_count:   number of live segments
+ * @segs:        the live segments, oldest first
+ * @pending:     serialized records staged for the next commit
+ * @pending_len: number of bytes in @pending
+ * @pending_cap: allocated size of @pending
+ * @index:       hash table of entries for all committed keys
+ */
+struct storage_kv {
+    storage_session_t session;
+    char name[STORAGE_MAX_NAME_LENGTH_BYTES];
+    file_handle_t meta_fh;
+    bool has_meta;
+    uint32_t first_seg;
+    uint32_t seg_count;
+    struct kv_segment* segs;
+    uint8_t* pending;
+    size_t pending_len;
+    size_t pending_cap;
+    struct kv_entry* index[KV_HASH_SIZE];
+};
+
+/* records are padded so that every header in a segment is aligned */
+static size_t record_size(size_t key_len, size_t value_len) {
+    return ROUNDUP(sizeof(struct kv_record) + key_len + value_len,
+                   sizeof(uint32_t));
+}
+
+/* FNV-1a */
+static struct kv_entry** bucket(struct storage_kv* kv,
+                                const void* key,
+                                size_t key_len) {
+    const uint8_t* p = key;
+    uint32_t hash = 2166136261U;
+
+    for (size_t i = 0; i < key_len; i++) {
+        hash = (hash ^ p[i]) * 16777619U;
+    }
+    return &kv->index[hash % KV_HASH_SIZE];
+}
+
+static struct kv_entry** find_entry(struct storage_kv* kv,
+                                    const void* key,
+                                    size_t key_len) {
+    struct kv_entry** ep = bucket(kv, key, key_len);
+
+    for (; *ep; ep = &(*ep)->next) {
+        if ((*ep)->key_len == key_len && !memcmp((*ep)->key, key, key_len)) {
+            return ep;
+        }
+    }
+    return NULL;
+}
+
+static struct kv_segment* get_segment(struct storage_kv* kv, uint32_t seg) {
+    return &kv->segs[seg - kv->first_seg];
+}
+
+static void remove_entry(struct storage_kv* kv, struct kv_entry** ep) {
+    struct kv_entry* entry = *ep;
+
+    get_segment(kv, entry->seg)->live -=
+            record_size(entry->key_len, entry->value_len);
+    *ep = entry->next;
+    free(entry);
+}
+
+/*
+ * Make @entry, or a tombstone for @key if @entry is %NULL, the latest record
+ * of the key, replacing the previous one.
+ */
+static void update_index(struct storage_kv* kv,
+                         const uint8_t* key,
+                         size_t key_len,
+                         struct kv_entry* entry) {
+    struct kv_entry** ep = find_entry(kv, key, key_len);
+
+    if (ep) {
+        remove_entry(kv, ep);
+    }
+    if (entry) {
+        ep = bucket(kv, key, key_len);
+        entry->next = *ep;
+        *ep = entry;
+        get_segment(kv, entry->seg)->live +=
+                record_size(entry->key_len, entry->value_len);
+    }
+}
+
+static struct kv_entry* new_entry(const struct kv_record* rec,
+                                  const uint8_t* key,
+                                  uint32_t seg,
+                                  uint32_t off) {
+    struct kv_entry* entry = malloc(sizeof(*entry) + rec->key_len);
+
+    if (!entry) {
+        return NULL;
+    }
+    entry->next = NULL;
+    entry->seg = seg;
+    entry->off = off;
+    entry->value_len = rec->value_len;
+    entry->key_len = rec->key_len;
+    memcpy(entry->key, key, rec->key_len);
+    return entry;
+}
+
+/*
+ * Validate the record at @off in the @size bytes of records at @buf.
+ *
+ * Return: a pointer to the record header, or %NULL if it is corrupt.
+ */
+static const struct kv_record* get_record(const uint8_t* buf,
+                                          size_t size,
+                                          size_t off) {
+    const struct kv_record* rec = (const void*)(buf + off);
+
+    if (size - off < sizeof(*rec) || rec->magic != KV_RECORD_MAGIC ||
+        !rec->key_len || rec->key_len > STORAGE_KV_MAX_KEY_SIZE ||
+        rec->value_len > KV_SEGMENT_SIZE ||
+        record_size(rec->key_len, rec->value_len) > size - off) {
+        return NULL;
+    }
+    return rec;
+}
+
+/*
+ * Add the entries for records appended to segment @seg at @off to the index.
+ * @entries holds the preallocated entries of the non-tombstone records, in
+ * order.
+ */
+static void apply_records(struct storage_kv* kv,
+                          const uint8_t* buf,
+                          size_t size,
+                          uint32_t seg,
+                          uint32_t off,
+                          struct kv_entry* entries) {
+    const struct kv_record* rec;
+    struct kv_entry* entry;
+
+    for (size_t pos = 0; pos < size;
+         pos += record_size(rec->key_len, rec->value_len)) {
+        rec = (const void*)(buf + pos);
+        entry = NULL;
+        if (!(rec->flags & KV_RECORD_FLAG_TOMBSTONE)) {
+            entry = entries;
+            entries = entry->next;
+            entry->seg = seg;
+            entry->off = off + pos;
+        }
+        update_index(kv, (const uint8_t*)(rec + 1), rec->key_len, entry);
+    }
+}
+
+static void free_entries(struct kv_entry* entries) {
+    struct kv_entry* entry;
+
+    while ((entry = entries)) {
+        entries = entry->next;
+        free(entry);
+    }
+}
+
+/*
+ * Allocate index entries for the non-tombstone records in @buf, so that the
+ * index can be updated after a successful commit without failing.
+ */
+static int alloc_entries(const uint8_t* buf,
+                         size_t size,
+                         struct kv_entry** entries_p) {
+    const struct kv_record* rec;
+    struct kv_entry** tail = entries_p;
+
+    *entries_p = NULL;
+    for (size_t pos = 0; pos < size;
+         pos += record_size(rec->key_len, rec->value_len)) {
+        rec = (const void*)(buf + pos);
+        if (rec->flags & KV_RECORD_FLAG_TOMBSTONE) {
+            continue;
+        }
+        *tail = new_entry(rec, (const uint8_t*)(rec + 1), 0, 0);
+        if (!*tail) {
+            free_entries(*entries_p);
+            *entries_p = NULL;
+            return ERR_NO_MEMORY;
+        }
+        tail = &(*tail)->next;
+    }
+    return NO_ERROR;
+}
+
+static int segment_name(struct storage_kv* kv,
+                        uint32_t seg,
+                        char* buf,
+                        size_t size) {
+    int len = snprintf(buf, size, "%s.%u", kv->name, seg);
+
+    return len < 0 || (size_t)len >= size ? ERR_INVALID_ARGS : NO_ERROR;
+}
+
+static int meta_name(struct storage_kv* kv, char* buf, size_t size) {
+    int len = snprintf(buf, size, "%s.meta", kv->name);
+
+    return len < 0 || (size_t)len >= size ? ERR_INVALID_ARGS : NO_ERROR;
+}
+
+static int open_segment(struct storage_kv* kv,
+                        uint32_t seg,
+                        uint32_t flags,
+                        file_handle_t* fh_p) {
+    char name[STORAGE_MAX_NAME_LENGTH_BYTES];
+    int rc;
+
+    rc = segment_name(kv, seg, name, sizeof(name));
+    if (rc < 0) {
+        return rc;
+    }
+    return storage_open_file(kv->session, fh_p, name, flags, 0);
+}
+
+static int write_meta(struct storage_kv* kv,
+                      uint32_t first_seg,
+                      uint32_t next_seg) {
+    struct kv_meta meta = {
+            .magic = KV_META_MAGIC,
+            .version = KV_META_VERSION,
+            .first_seg = first_seg,
+            .next_seg = next_seg,
+    };
+    char name[STORAGE_MAX_NAME_LENGTH_BYTES];
+    bool created = false;
+    ssize_t rc;
+
+    if (!kv->has_meta) {
+        rc = meta_name(kv, name, sizeof(name));
+        if (rc < 0) {
+            return rc;
+        }
+        rc = storage_open_file(kv->session, &kv->meta_fh, name,
+                               STORAGE_FILE_OPEN_CREATE, 0);
+        if (rc < 0) {
+            return rc;
+        }
+        kv->has_meta = true;
+        created = true;
+    }
+
+    rc = storage_write(kv->meta_fh, 0, &meta, sizeof(meta),
+                       STORAGE_OP_COMPLETE);
+    if (rc >= 0 && rc != sizeof(meta)) {
+        rc = ERR_IO;
+    }
+    if (rc < 0 && created) {
+        /* the file is gone again once the caller discards the transaction */
+        storage_close_file(kv->meta_fh);
+        kv->has_meta = false;
+    }
+    return rc < 0 ? rc : NO_ERROR;
+}
+
+/*
+ * Append @size bytes of records to the store and, if @drop_first is set,
+ * delete the oldest segment, all in one transaction. The records go into a new
+ * segment if there is no segment to append to or the newest one is full.
+ * Committing normally takes a single write, plus a write of the meta file if
+ * the set of segments changes.
+ *
+ * On success the segment number and offset the records were written at are
+ * stored in @seg_p and @off_p. On failure the transaction is discarded and
+ * the store is left unchanged.
+ */
+static int append(struct storage_kv* kv,
+                  const uint8_t* buf,
+                  size_t size,
+                  bool drop_first,
+                  uint32_t* seg_p,
+                  uint32_t* off_p) {
+    struct kv_segment* segs = kv->segs;
+    struct kv_segment* last = NULL;
+    struct kv_segment* target;
+    uint32_t next_seg = kv->first_seg + kv->seg_count;
+    uint32_t first_seg = kv->first_seg + !!drop_first;
+    char name[STORAGE_MAX_NAME_LENGTH_BYTES];
+    bool new_seg;
+    ssize_t rc;
+
+    if (size > UINT32_MAX - KV_SEGMENT_SIZE) {
+        return ERR_TOO_BIG;
+    }
+
+    if (kv->seg_count > (uint32_t)!!drop_first) {
+        last = &kv->segs[kv->seg_count - 1];
+    }
+    new_seg = size && (!last || (last->size && last->size + size >
+                                                       KV_SEGMENT_SIZE));
+    if (new_seg) {
+        segs = realloc(kv->segs, (kv->seg_count + 1) * sizeof(*segs));
+        if (!segs) {
+            return ERR_NO_MEMORY;
+        }
+        kv->segs = segs;
+        last = &segs[kv->seg_count];
+        rc = open_segment(kv, next_seg,
+                          STORAGE_FILE_OPEN_CREATE |
+                                  STORAGE_FILE_OPEN_TRUNCATE,
+                          &last->fh);
+        if (rc < 0) {
+            return rc;
+        }
+        last->size = 0;
+        last->live = 0;
+        next_seg++;
+    }
+    target = last;
+
+    if (size) {
+        rc = storage_write(target->fh, target->size, buf, size,
+                           new_seg || drop_first ? 0 : STORAGE_OP_COMPLETE);
+        if (rc >= 0 && (size_t)rc != size) {
+            rc = ERR_IO;
+        }
+        if (rc < 0) {
+            goto err;
+        }
+    }
+
+    if (drop_first) {
+        rc = segment_name(kv, kv->first_seg, name, sizeof(name));
+        if (rc < 0) {
+            goto err;
+        }
+        rc = storage_delete_file(kv->session, name, 0);
+        if (rc < 0) {
+            goto err;
+        }
+    }
+
+    if (new_seg || drop_first) {
+        rc = write_meta(kv, first_seg, next_seg);
+        if (rc < 0) {
+            goto err;
+        }
+    }
+
+    if (seg_p && target) {
+        *seg_p = kv->first_seg + (target - kv->segs);
+        *off_p = target->size;
+    }
+    if (target) {
+        target->size += size;
+    }
+    if (new_seg) {
+        kv->seg_count++;
+    }
+    return NO_ERROR;
+
+err:
+    storage_end_transaction(kv->session, false);
+    if (new_seg) {
+        storage_close_file(last->fh);
+    }
+    return rc;
+}
+
+/*
+ * Forget the oldest segment after it has been deleted. Its entries must have
+ * been moved to other segments already.
+ */
+static void drop_first_segment(struct storage_kv* kv) {
+    storage_close_file(kv->segs[0].fh);
+    memmove(&kv->segs[0], &kv->segs[1],
+            (kv->seg_count - 1) * sizeof(kv->segs[0]));
+    kv->seg_count--;
+    kv->first_seg++;
+}
+
+static int load_segment(struct storage_kv* kv, uint32_t seg) {
+    struct kv_segment* segment = get_segment(kv, seg);
+    const struct kv_record* rec;
+    struct kv_entry* entry;
+    storage_off_t file_size;
+    uint8_t* buf = NULL;
+    ssize_t rc;
+
+    rc = open_segment(kv, seg, 0, &segment->fh);
+    if (rc < 0) {
+        TLOGE("failed (%zd) to open segment %u of %s\n", rc, seg, kv->name);
+        return rc == ERR_NOT_FOUND ? ERR_NOT_VALID : rc;
+    }
+    segment->size = 0;
+    segment->live = 0;
+    kv->seg_count++;
+
+    rc = storage_get_file_size(segment->fh, &file_size);
+    if (rc < 0) {
+        return rc;
+    }
+    if (file_size > UINT32_MAX) {
+        return ERR_NOT_VALID;
+    }
+    if (!file_size) {
+        return NO_ERROR;
+    }
+
+    buf = malloc(file_size);
+    if (!buf) {
+        return ERR_NO_MEMORY;
+    }
+    rc = storage_read(segment->fh, 0, buf, file_size);
+    if (rc < 0) {
+        goto out;
+    }
+    if ((storage_off_t)rc != file_size) {
+        rc = ERR_IO;
+        goto out;
+    }
+    segment->size = file_size;
+
+    for (size_t pos = 0; pos < file_size;
+         pos += record_size(rec->key_len, rec->value_len)) {
+        rec = get_record(buf, file_size, pos);
+        if (!rec) {
+            TLOGE("corrupt record at %zu in segment %u of %s\n", pos, seg,
+                  kv->name);
+            rc = ERR_NOT_VALID;
+            goto out;
+        }
+        entry = NULL;
+        if (!(rec->flags & KV_RECORD_FLAG_TOMBSTONE)) {
+            entry = new_entry(rec, (const uint8_t*)(rec + 1), seg, pos);
+            if (!entry) {
+                rc = ERR_NO_MEMORY;
+                goto out;
+            }
+        }
+        update_index(kv, (const uint8_t*)(rec + 1), rec->key_len, entry);
+    }
+    rc = NO_ERROR;
+
+out:
+    free(buf);
+    return rc;
+}
+
+static int load(struct storage_kv* kv) {
+    struct kv_meta meta;
+    char name[STORAGE_MAX_NAME_LENGTH_BYTES];
+    ssize_t rc;
+
+    rc = meta_name(kv, name, sizeof(name));
+    if (rc < 0) {
+        return rc;
+    }
+    rc = storage_open_file(kv->session, &kv->meta_fh, name, 0, 0);
+    if (rc == ERR_NOT_FOUND) {
+        /* new store, the meta file is created by the first commit */
+        return NO_ERROR;
+    }
+    if (rc < 0) {
+        return rc;
+    }
+    kv->has_meta = true;
+
+    rc = storage_read(kv->meta_fh, 0, &meta, sizeof(meta));
+    if (rc < 0) {
+        return rc;
+    }
+    if (rc != sizeof(meta) || meta.magic != KV_META_MAGIC ||
+        meta.version != KV_META_VERSION || meta.next_seg < meta.first_seg) {
+        TLOGE("invalid meta file for %s\n", kv->name);
+        return ERR_NOT_VALID;
+    }
+
+    kv->first_seg = meta.first_seg;
+    if (meta.next_seg == meta.first_seg) {
+        return NO_ERROR;
+    }
+    kv->segs = calloc(meta.next_seg - meta.first_seg, sizeof(*kv->segs));
+    if (!kv->segs) {
+        return ERR_NO_MEMORY;
+    }
+    for (uint32_t seg = meta.first_seg; seg < meta.next_seg; seg++) {
+        rc = load_segment(kv, seg);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return NO_ERROR;
+}
+
+int storage_kv_open(storage_session_t session,
+                    const char* name,
+                    struct storage_kv** kv_p) {
+    struct storage_kv* kv;
+    char seg_name[STORAGE_MAX_NAME_LENGTH_BYTES];
+    int rc;
+
+    kv = calloc(1, sizeof(*kv));
+    if (!kv) {
+        return ERR_NO_MEMORY;
+    }
+    kv->session = session;
+
+    /* the longest file name is that of segment UINT32_MAX */
+    if (strlen(name) >= sizeof(kv->name)) {
+        rc = ERR_INVALID_ARGS;
+        goto err;
+    }
+    strcpy(kv->name, name);
+    rc = segment_name(kv, UINT32_MAX, seg_name, sizeof(seg_name));
+    if (rc < 0) {
+        goto err;
+    }
+
+    rc = load(kv);
+    if (rc < 0) {
+        goto err;
+    }
+    *kv_p = kv;
+    return NO_ERROR;
+
+err:
+    storage_kv_close(kv);
+    return rc;
+}
+
+void storage_kv_close(struct storage_kv* kv) {
+    if (!kv) {
+        return;
+    }
+    for (size_t i = 0; i < countof(kv->index); i++) {
+        free_entries(kv->index[i]);
+    }
+    for (uint32_t i = 0; i < kv->seg_count; i++) {
+        storage_close_file(kv->segs[i].fh);
+    }
+    if (kv->has_meta) {
+        storage_close_file(kv->meta_fh);
+    }
+    free(kv->segs);
+    free(kv->pending);
+    free(kv);
+}
+
+/*
+ * Find the latest staged record for @key.
+ *
+ * Return: the record, or %NULL if the key has no staged changes.
+ */
+static const struct kv_record* find_pending(struct storage_kv* kv,
+                                            const void* key,
+                                            size_t key_len) {
+    const struct kv_record* found = NULL;
+    const struct kv_record* rec;
+
+    for (size_t pos = 0; pos < kv->pending_len;
+         pos += record_size(rec->key_len, rec->value_len)) {
+        rec = (const void*)(kv->pending + pos);
+        if (rec->key_len == key_len && !memcmp(rec + 1, key, key_len)) {
+            found = rec;
+        }
+    }
+    return found;
+}
+
+static bool key_valid(const void* key, size_t key_len) {
+    return key && key_len && key_len <= STORAGE_KV_MAX_KEY_SIZE;
+}
+
+int storage_kv_get(struct storage_kv* kv,
+                   const void* key,
+                   size_t key_len,
+                   void* buf,
+                   size_t buf_size,
+                   size_t* value_len_p) {
+    const struct kv_record* rec;
+    struct kv_entry** ep;
+    struct kv_entry* entry;
+    ssize_t rc;
+
+    if (!key_valid(key, key_len)) {
+        return ERR_INVALID_ARGS;
+    }
+
+    rec = find_pending(kv, key, key_len);
+    if (rec) {
+        if (rec->flags & KV_RECORD_FLAG_TOMBSTONE) {
+            return ERR_NOT_FOUND;
+        }
+        *value_len_p = rec->value_len;
+        if (buf_size < rec->value_len) {
+            return ERR_NOT_ENOUGH_BUFFER;
+        }
+        memcpy(buf, (const uint8_t*)(rec + 1) + key_len, rec->value_len);
+        return NO_ERROR;
+    }
+
+    ep = find_entry(kv, key, key_len);
+    if (!ep) {
+        return ERR_NOT_FOUND;
+    }
+    entry = *ep;
+    *value_len_p = entry->value_len;
+    if (buf_size < entry->value_len) {
+        return ERR_NOT_ENOUGH_BUFFER;
+    }
+    if (!entry->value_len) {
+        return NO_ERROR;
+    }
+
+    rc = storage_read(get_segment(kv, entry->seg)->fh,
+                      entry->off + sizeof(struct kv_record) + key_len, buf,
+                      entry->value_len);
+    if (rc < 0) {
+        return rc;
+    }
+    return (size_t)rc == entry->value_len ? NO_ERROR : ERR_IO;
+}
+
+static int stage(struct storage_kv* kv,
+                 const void* key,
+                 size_t key_len,
+                 const void* value,
+                 size_t value_len,
+                 uint16_t flags) {
+    struct kv_record rec = {
+            .magic = KV_RECORD_MAGIC,
+            .key_len = key_len,
+            .flags = flags,
+            .value_len = value_len,
+    };
+    size_t size = record_size(key_len, value_len);
+    size_t cap;
+    uint8_t* pending;
+    uint8_t* p;
+
+    if (value_len > KV_SEGMENT_SIZE ||
+        kv->pending_len + size > UINT32_MAX - KV_SEGMENT_SIZE) {
+        return ERR_TOO_BIG;
+    }
+
+    if (kv->pending_len + size > kv->pending_cap) {
+        cap = MAX(kv->pending_cap * 2, kv->pending_len + size);
+        pending = realloc(kv->pending, cap);
+        if (!pending) {
+            return ERR_NO_MEMORY;
+        }
+        kv->pending = pending;
+        kv->pending_cap = cap;
+    }
+
+    p = kv->pending + kv->pending_len;
+    memset(p, 0, size);
+    memcpy(p, &rec, sizeof(rec));
+    memcpy(p + sizeof(rec), key, key_len);
+    if (value_len) {
+        memcpy(p + sizeof(rec) + key_len, value, value_len);
+    }
+    kv->pending_len += size;
+    return NO_ERROR;
+}
+
+int storage_kv_put(struct storage_kv* kv,
+                   const void* key,
+                   size_t key_len,
+                   const void* value,
+                   size_t value_len) {
+    if (!key_valid(key, key_len) || (value_len && !value)) {
+        return ERR_INVALID_ARGS;
+    }
+    return stage(kv, key, key_len, value, value_len, 0);
+}
+
+int storage_kv_delete(struct storage_kv* kv, const void* key, size_t key_len) {
+    const struct kv_record* rec;
+
+    if (!key_valid(key, key_len)) {
+        return ERR_INVALID_ARGS;
+    }
+
+    rec = find_pending(kv, key, key_len);
+    if (rec ? (rec->flags & KV_RECORD_FLAG_TOMBSTONE)
+            : !find_entry(kv, key, key_len)) {
+        return ERR_NOT_FOUND;
+    }
+    return stage(kv, key, key_len, NULL, 0, KV_RECORD_FLAG_TOMBSTONE);
+}
+
+void storage_kv_abort(struct storage_kv* kv) {
+    free(kv->pending);
+    kv->pending = NULL;
+    kv->pending_len = 0;
+    kv->pending_cap = 0;
+}
+
+int storage_kv_commit(struct storage_kv* kv) {
+    struct kv_entry* entries;
+    uint32_t seg;
+    uint32_t off;
+    int rc;
+
+    if (!kv->pending_len) {
+        return NO_ERROR;
+    }
+
+    rc = alloc_entries(kv->pending, kv->pending_len, &entries);
+    if (rc < 0) {
+        goto out;
+    }
+    rc = append(kv, kv->pending, kv->pending_len, false, &seg, &off);
+    if (rc < 0) {
+        free_entries(entries);
+        goto out;
+    }
+    apply_records(kv, kv->pending, kv->pending_len, seg, off, entries);
+
+out:
+    storage_kv_abort(kv);
+    return rc;
+}
+
+size_t storage_kv_garbage(struct storage_kv* kv) {
+    size_t garbage = 0;
+
+    for (uint32_t i = 0; i < kv->seg_count; i++) {
+        garbage += kv->segs[i].size - kv->segs[i].live;
+    }
+    return garbage;
+}
+
+int storage_kv_compact(struct storage_kv* kv) {
+    struct kv_segment* oldest;
+    struct kv_entry* entry;
+    uint8_t* buf = NULL;
+    uint8_t* data;
+    size_t pos = 0;
+    size_t size;
+    uint32_t seg = 0;
+    uint32_t off = 0;
+    ssize_t rc;
+
+    if (kv->pending_len) {
+        return ERR_BUSY;
+    }
+    if (!kv->seg_count) {
+        return NO_ERROR;
+    }
+    oldest = &kv->segs[0];
+    if (oldest->live == oldest->size) {
+        return NO_ERROR;
+    }
+
+    /*
+     * Read the whole segment into the end of the buffer and copy its live
+     * records to the front, in index order. Tombstones are not kept: every
+     * older segment is already gone, so there is nothing left for them to
+     * hide.
+     */
+    if (oldest->live) {
+        buf = malloc(oldest->live + oldest->size);
+        if (!buf) {
+            return ERR_NO_MEMORY;
+        }
+        data = buf + oldest->live;
+        rc = storage_read(oldest->fh, 0, data, oldest->size);
+        if (rc >= 0 && (size_t)rc != oldest->size) {
+            rc = ERR_IO;
+        }
+        if (rc < 0) {
+            goto out;
+        }
+        for (size_t i = 0; i < countof(kv->index); i++) {
+            for (entry = kv->index[i]; entry; entry = entry->next) {
+                if (entry->seg != kv->first_seg) {
+                    continue;
+                }
+                size = record_size(entry->key_len, entry->value_len);
+                memcpy(buf + pos, data + entry->off, size);
+                pos += size;
+            }
+        }
+    }
+
+    rc = append(kv, buf, pos, true, &seg, &off);
+    if (rc < 0) {
+        goto out;
+    }
+
+    /* walk the index in the same order to point the entries at the copies */
+    for (size_t i = 0; i < countof(kv->index); i++) {
+        for (entry = kv->index[i]; entry; entry = entry->next) {
+            if (entry->seg != kv->first_seg) {
+                continue;
+            }
+            size = record_size(entry->key_len, entry->value_len);
+            entry->seg = seg;
+            entry->off = off;
+            get_segment(kv, seg)->live += size;
+            off += size;
+        }
+    }
+    drop_first_segment(kv);
+
+out:
+    free(buf);
+    return rc;
+}
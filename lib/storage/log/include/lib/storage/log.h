@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <trusty_ipc.h>
+
+#include <lib/storage/storage.h>
+
+/*
+ * Append-only log files with group commit.
+ *
+ * A &struct storage_log tracks the end of a log file itself, so appending a
+ * record costs no round trip to the storage server. Records are buffered and
+ * written and committed together, in a single write, once
+ * @max_batch_bytes are buffered, once the oldest buffered record has waited
+ * @max_delay_msec, or when the caller flushes the log.
+ *
+ * Trusty apps have no timers, so the delay is enforced by the caller's event
+ * loop: use storage_log_timeout() as the timeout of wait() and call
+ * storage_log_poll() whenever it returns. Appends also commit the batch if
+ * its delay has passed.
+ *
+ * Each append returns a durability token, which storage_log_is_durable()
+ * reports as durable once the record has been committed.
+ *
+ * The log commits transactions on the session it is opened on, so that
+ * session must not have uncommitted changes of its own, and the file must
+ * not be written through anything else while the log is open.
+ */
+
+__BEGIN_CDECLS
+
+struct storage_log;
+
+/**
+ * typedef storage_log_token_t - identifies an appended record
+ *
+ * Tokens of later records compare greater than those of earlier ones.
+ */
+typedef uint64_t storage_log_token_t;
+
+/**
+ * storage_log_open() - Open a log file for appending, creating it if needed
+ * @session:         the storage_session_t returned from a call to
+ *                   storage_open_session
+ * @name:            the name of the log file
+ * @max_batch_bytes: number of buffered bytes that triggers a commit, > 0
+ * @max_delay_msec:  longest time a record stays buffered, or 0 to only
+ *                   commit on size or when flushed
+ * @log_p:           pointer to location in which to store the open log
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure.
+ */
+int storage_log_open(storage_session_t session,
+                     const char* name,
+                     size_t max_batch_bytes,
+                     uint32_t max_delay_msec,
+                     struct storage_log** log_p);
+
+/**
+ * storage_log_close() - Commit buffered records and close a log
+ * @log: the log to close, may be %NULL
+ *
+ * Records that cannot be committed are dropped. Call storage_log_flush()
+ * first to find out whether that happened.
+ */
+void storage_log_close(struct storage_log* log);
+
+/**
+ * storage_log_append() - Append a record to a log
+ * @log:     the log to append to
+ * @buf:     the record
+ * @size:    the size of the record
+ * @token_p: pointer to location in which to store the durability token of
+ *           the record, may be %NULL
+ *
+ * The record is copied, and only written once its batch is committed. A
+ * record larger than @max_batch_bytes is committed immediately, after the
+ * records buffered before it. If the record fills its batch or the batch is
+ * due, the batch is committed before returning. When that fails the record
+ * is not appended, and the records buffered before it stay buffered as they
+ * do when storage_log_flush() fails, so the append can be retried.
+ *
+ * Return: NO_ERROR if the record was appended, or an error code < 0 if
+ * making room for it or committing its batch failed.
+ */
+int storage_log_append(struct storage_log* log,
+                       const void* buf,
+                       size_t size,
+                       storage_log_token_t* token_p);
+
+/**
+ * storage_log_flush() - Commit all buffered records
+ * @log: the log to flush
+ *
+ * Records stay buffered if committing them fails, so flushing again retries.
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure.
+ */
+int storage_log_flush(struct storage_log* log);
+
+/**
+ * storage_log_timeout() - Get the time left until buffered records are due
+ * @log: the log to check
+ *
+ * Return: the number of milliseconds until storage_log_poll() commits the
+ * buffered records, 0 if they are due, or %INFINITE_TIME if none are
+ * waiting for a timed commit.
+ */
+uint32_t storage_log_timeout(struct storage_log* log);
+
+/**
+ * storage_log_poll() - Commit buffered records if they are due
+ * @log: the log to check
+ *
+ * Return: NO_ERROR if nothing was due or committing succeeded, or an error
+ * code < 0 on failure.
+ */
+int storage_log_poll(struct storage_log* log);
+
+/**
+ * storage_log_is_durable() - Check whether a record has been committed
+ * @log:   the log the record was appended to
+ * @token: the durability token returned by storage_log_append()
+ *
+ * Return: %true if the record has been committed.
+ */
+bool storage_log_is_durable(struct storage_log* log,
+                            storage_log_token_t token);
+
+/**
+ * storage_log_get_size() - Get the size of a log, including buffered records
+ * @log:    the log to check
+ * @size_p: pointer to location in which to store the size
+ */
+void storage_log_get_size(struct storage_log* log, storage_off_t* size_p);
+
+__END_CDECLS
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <lk/macros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trusty/time.h>
+#include <uapi/err.h>
+
+#include <lib/storage/log.h>
+
+/**
+ * struct storage_log - an open log file
+ * @session:         the session the log commits through
+ * @fh:              the open log file
+ * @committed:       committed size of the file, where the next batch goes
+ * @max_batch_bytes: size of @buf, and the number of bytes that triggers a
+ *                   commit
+ * @max_delay_msec:  longest time a record stays buffered, or 0 for no limit
+ * @batch_start:     time the oldest buffered record was appended
+ * @buffered:        number of bytes in @buf
+ * @buf:             records appended since the last commit
+ */
+struct storage_log {
+    storage_session_t session;
+    file_handle_t fh;
+    storage_off_t committed;
+    size_t max_batch_bytes;
+    uint32_t max_delay_msec;
+    int64_t batch_start;
+    size_t buffered;
+    uint8_t buf[];
+};
+
+static int64_t now_msec(void) {
+    int64_t now = 0;
+
+    trusty_gettime(0, &now);
+    return now / (1000 * 1000);
+}
+
+int storage_log_open(storage_session_t session,
+                     const char* name,
+                     size_t max_batch_bytes,
+                     uint32_t max_delay_msec,
+                     struct storage_log** log_p) {
+    struct storage_log* log;
+    int rc;
+
+    if (!max_batch_bytes || max_batch_bytes > SIZE_MAX - sizeof(*log)) {
+        return ERR_INVALID_ARGS;
+    }
+    log = malloc(sizeof(*log) + max_batch_bytes);
+    if (!log) {
+        return ERR_NO_MEMORY;
+    }
+    log->session = session;
+    log->max_batch_bytes = max_batch_bytes;
+    log->max_delay_msec = max_delay_msec;
+    log->batch_start = 0;
+    log->buffered = 0;
+
+    rc = storage_open_file(session, &log->fh, name, STORAGE_FILE_OPEN_CREATE,
+                           STORAGE_OP_COMPLETE);
+    if (rc < 0) {
+        goto err_open;
+    }
+    /* the only time the server is asked where the log ends */
+    rc = storage_get_file_size(log->fh, &log->committed);
+    if (rc < 0) {
+        goto err_get_size;
+    }
+    *log_p = log;
+    return NO_ERROR;
+
+err_get_size:
+    storage_close_file(log->fh);
+err_open:
+    free(log);
+    return rc;
+}
+
+void storage_log_close(struct storage_log* log) {
+    if (!log) {
+        return;
+    }
+    storage_log_flush(log);
+    storage_close_file(log->fh);
+    free(log);
+}
+
+/* Write @size bytes at the end of the log and commit them */
+static int commit(struct storage_log* log, const void* buf, size_t size) {
+    ssize_t rc = storage_write(log->fh, log->committed, buf, size,
+                               STORAGE_OP_COMPLETE);
+
+    if (rc >= 0 && (size_t)rc != size) {
+        rc = ERR_IO;
+    }
+    if (rc < 0) {
+        storage_end_transaction(log->session, false);
+        return rc;
+    }
+    log->committed += size;
+    return NO_ERROR;
+}
+
+int storage_log_flush(struct storage_log* log) {
+    int rc;
+
+    if (!log->buffered) {
+        return NO_ERROR;
+    }
+    rc = commit(log, log->buf, log->buffered);
+    if (rc < 0) {
+        return rc;
+    }
+    log->buffered = 0;
+    return NO_ERROR;
+}
+
+int storage_log_append(struct storage_log* log,
+                       const void* buf,
+                       size_t size,
+                       storage_log_token_t* token_p) {
+    int rc;
+
+    if (size > log->max_batch_bytes - log->buffered) {
+        rc = storage_log_flush(log);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    if (size > log->max_batch_bytes) {
+        rc = commit(log, buf, size);
+        if (rc < 0) {
+            return rc;
+        }
+        if (token_p) {
+            *token_p = log->committed;
+        }
+        return NO_ERROR;
+    }
+
+    if (!log->buffered) {
+        log->batch_start = now_msec();
+    }
+    memcpy(log->buf + log->buffered, buf, size);
+    log->buffered += size;
+
+    if (log->buffered == log->max_batch_bytes) {
+        rc = storage_log_flush(log);
+    } else {
+        rc = storage_log_poll(log);
+    }
+    if (rc < 0) {
+        /* drop the record again, the rest of the batch stays buffered */
+        log->buffered -= size;
+        return rc;
+    }
+    if (token_p) {
+        *token_p = log->committed + log->buffered;
+    }
+    return NO_ERROR;
+}
+
+uint32_t storage_log_timeout(struct storage_log* log) {
+    int64_t elapsed;
+
+    if (!log->buffered || !log->max_delay_msec) {
+        return INFINITE_TIME;
+    }
+    elapsed = now_msec() - log->batch_start;
+    if (elapsed >= log->max_delay_msec) {
+        return 0;
+    }
+    return log->max_delay_msec - elapsed;
+}
+
+int storage_log_poll(struct storage_log* log) {
+    if (storage_log_timeout(log)) {
+        return NO_ERROR;
+    }
+    return storage_log_flush(log);
+}
+
+bool storage_log_is_durable(struct storage_log* log,
+                            storage_log_token_t token) {
+    return token <= log->committed;
+}
+
+void storage_log_get_size(struct storage_log* log, storage_off_t* size_p) {
+    *size_p = log->committed + log->buffered;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <lib/storage/storage.h>
+
+/*
+ * Hash-tree verified storage files.
+ *
+ * The contents of a file "<name>" are split into chunks of
+ * %STORAGE_MERKLE_CHUNK_SIZE bytes, and a SHA-256 hash tree over the chunks
+ * is kept in the sidecar file "<name>.mt". The whole tree is summarized by a
+ * root digest, which also covers the size of the file. Callers authenticate
+ * the root digest instead of the file, for example by keeping it in a MACed
+ * record of their own.
+ *
+ * A verified read only transfers and hashes the chunks it touches, plus one
+ * small run of sibling hashes per tree level, so its cost grows with the size
+ * of the range read and the log of the file size.
+ */
+
+#define STORAGE_MERKLE_DIGEST_SIZE 32U
+#define STORAGE_MERKLE_SIDECAR_SUFFIX ".mt"
+
+/* Size of the chunks written by storage_merkle_write() */
+#ifndef STORAGE_MERKLE_CHUNK_SIZE
+#define STORAGE_MERKLE_CHUNK_SIZE 4096U
+#endif
+
+__BEGIN_CDECLS
+
+struct storage_merkle_file;
+
+/**
+ * storage_merkle_write() - Replace a file and its hash tree
+ * @session: the storage_session_t returned from a call to storage_open_session
+ * @name:    the name of the file, which is created if it does not exist. Must
+ *           leave room for %STORAGE_MERKLE_SIDECAR_SUFFIX.
+ * @buf:     the new contents of the file
+ * @size:    the number of bytes in @buf
+ * @opflags: a combination of @storage_op_flags, applied to the write of the
+ *           sidecar file, which is the last change made
+ * @root:    buffer of %STORAGE_MERKLE_DIGEST_SIZE bytes in which to store
+ *           the root digest of the new contents
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure.
+ */
+int storage_merkle_write(storage_session_t session,
+                         const char* name,
+                         const void* buf,
+                         size_t size,
+                         uint32_t opflags,
+                         uint8_t* root);
+
+/**
+ * storage_merkle_open() - Open a file with a hash tree for verified reads
+ * @session: the storage_session_t returned from a call to storage_open_session
+ * @name:    the name of the file, written by storage_merkle_write()
+ * @root:    the trusted root digest of the file, %STORAGE_MERKLE_DIGEST_SIZE
+ *           bytes
+ * @mfile_p: pointer to location in which to store the open file
+ *
+ * Return: NO_ERROR on success, ERR_NOT_VALID if the hash tree does not match
+ * @root, or another error code < 0 on failure.
+ */
+int storage_merkle_open(storage_session_t session,
+                        const char* name,
+                        const uint8_t* root,
+                        struct storage_merkle_file** mfile_p);
+
+/**
+ * storage_merkle_close() - Close a file opened by storage_merkle_open()
+ * @mfile: the file to close, may be %NULL
+ */
+void storage_merkle_close(struct storage_merkle_file* mfile);
+
+/**
+ * storage_merkle_get_size() - Get the verified size of a file
+ * @mfile:  the file returned by storage_merkle_open()
+ * @size_p: pointer to location in which to store the size
+ */
+void storage_merkle_get_size(struct storage_merkle_file* mfile,
+                             storage_off_t* size_p);
+
+/**
+ * storage_merkle_read() - Read and verify part of a file
+ * @mfile: the file returned by storage_merkle_open()
+ * @off:   the start offset from whence to read in the file
+ * @buf:   the buffer in which to write the data read
+ * @size:  the size of @buf and number of bytes to read
+ *
+ * If the data read does not match the root digest, @buf is cleared.
+ *
+ * Return: the number of bytes read, less than @size only at the end of the
+ * file, ERR_NOT_VALID if the data or the hash tree has been modified, or
+ * another error code < 0 on failure.
+ */
+ssize_t storage_merkle_read(struct storage_merkle_file* mfile,
+                            storage_off_t off,
+                            void* buf,
+                            size_t size);
+
+__END_CDECLS
@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <lib/storage/merkle.h>
+
+#include <lk/macros.h>
+#include <openssl/mem.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uapi/err.h>
+
+/*
+ * The sidecar file holds a &struct merkle_header followed by the nodes of
+ * the tree, level by level from the leaves up to the single top node. A leaf
+ * is the hash of a chunk and every other node the hash of its one or two
+ * children, each with a distinct tag byte. The root digest is the hash of
+ * the header and the top node, so it also covers the file and chunk sizes.
+ */
+
+#define MERKLE_MAGIC 0x544b4d53U /* "SMKT" */
+#define MERKLE_VERSION 1U
+
+#define MERKLE_MIN_CHUNK_SHIFT 9U
+#define MERKLE_MAX_CHUNK_SHIFT 20U
+#define MERKLE_MAX_LEVELS 64U
+
+STATIC_ASSERT(STORAGE_MERKLE_DIGEST_SIZE == SHA256_DIGEST_LENGTH);
+STATIC_ASSERT(STORAGE_MERKLE_CHUNK_SIZE >= (1U << MERKLE_MIN_CHUNK_SHIFT) &&
+              STORAGE_MERKLE_CHUNK_SIZE <= (1U << MERKLE_MAX_CHUNK_SHIFT) &&
+              !(STORAGE_MERKLE_CHUNK_SIZE & (STORAGE_MERKLE_CHUNK_SIZE - 1)));
+
+enum merkle_tag {
+    MERKLE_TAG_LEAF,
+    MERKLE_TAG_NODE,
+    MERKLE_TAG_ROOT,
+};
+
+/**
+ * struct merkle_header - header of a sidecar file
+ * @magic:       %MERKLE_MAGIC
+ * @version:     %MERKLE_VERSION
+ * @chunk_shift: log2 of the size of each chunk but the last
+ * @size:        size of the file
+ */
+struct merkle_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t chunk_shift;
+    uint64_t size;
+};
+
+/**
+ * struct merkle_shape - layout of a tree
+ * @levels: number of levels, the last holding only the top node
+ * @count:  number of nodes in each level
+ * @first:  index in the sidecar of the first node of each level
+ */
+struct merkle_shape {
+    uint32_t levels;
+    uint64_t count[MERKLE_MAX_LEVELS];
+    uint64_t first[MERKLE_MAX_LEVELS];
+};
+
+/**
+ * struct storage_merkle_file - a file open for verified reads
+ * @data:        the file handle of the file
+ * @tree:        the file handle of the sidecar file
+ * @size:        the verified size of the file
+ * @chunk_shift: log2 of the chunk size
+ * @shape:       layout of the tree
+ * @top:         the verified top node
+ * @chunk:       buffer for chunks read only partially
+ */
+struct storage_merkle_file {
+    file_handle_t data;
+    file_handle_t tree;
+    storage_off_t size;
+    uint32_t chunk_shift;
+    struct merkle_shape shape;
+    uint8_t top[STORAGE_MERKLE_DIGEST_SIZE];
+    uint8_t* chunk;
+};
+
+static void merkle_shape_init(struct merkle_shape* shape,
+                              storage_off_t size,
+                              uint32_t chunk_shift) {
+    uint64_t mask = (1ULL << chunk_shift) - 1;
+    uint64_t count = MAX((size >> chunk_shift) + !!(size & mask), 1ULL);
+    uint64_t pos = 0;
+    uint32_t level = 0;
+
+    for (;;) {
+        shape->count[level] = count;
+        shape->first[level] = pos;
+        pos += count;
+        level++;
+        if (count == 1) {
+            break;
+        }
+        count = (count + 1) / 2;
+    }
+    shape->levels = level;
+}
+
+static uint64_t merkle_shape_nodes(const struct merkle_shape* shape) {
+    return shape->first[shape->levels - 1] + 1;
+}
+
+static size_t chunk_len(storage_off_t size, uint32_t chunk_shift, uint64_t i) {
+    storage_off_t start = i << chunk_shift;
+
+    return MIN(size - start, 1ULL << chunk_shift);
+}
+
+static void hash_leaf(const void* data, size_t len, uint8_t* out) {
+    uint8_t tag = MERKLE_TAG_LEAF;
+    SHA256_CTX ctx;
+
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &tag, sizeof(tag));
+    SHA256_Update(&ctx, data, len);
+    SHA256_Final(out, &ctx);
+}
+
+/* @out may alias @left */
+static void hash_node(const uint8_t* left, const uint8_t* right, uint8_t* out) {
+    uint8_t tag = MERKLE_TAG_NODE;
+    SHA256_CTX ctx;
+
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &tag, sizeof(tag));
+    SHA256_Update(&ctx, left, STORAGE_MERKLE_DIGEST_SIZE);
+    if (right) {
+        SHA256_Update(&ctx, right, STORAGE_MERKLE_DIGEST_SIZE);
+    }
+    SHA256_Final(out, &ctx);
+}
+
+static void hash_root(const struct merkle_header* header,
+                      const uint8_t* top,
+                      uint8_t* out) {
+    uint8_t tag = MERKLE_TAG_ROOT;
+    SHA256_CTX ctx;
+
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &tag, sizeof(tag));
+    SHA256_Update(&ctx, header, sizeof(*header));
+    SHA256_Update(&ctx, top, STORAGE_MERKLE_DIGEST_SIZE);
+    SHA256_Final(out, &ctx);
+}
+
+/*
+ * Hash a run of @count nodes starting at an even index into their parents,
+ * stored from the start of @nodes.
+ */
+static void hash_run(uint8_t* nodes, uint64_t count) {
+    uint64_t i;
+
+    for (i = 0; 2 * i < count; i++) {
+        hash_node(nodes + 2 * i * STORAGE_MERKLE_DIGEST_SIZE,
+                  2 * i + 1 < count
+                          ? nodes + (2 * i + 1) * STORAGE_MERKLE_DIGEST_SIZE
+                          : NULL,
+                  nodes + i * STORAGE_MERKLE_DIGEST_SIZE);
+    }
+}
+
+static int sidecar_name(char* buf, size_t size, const char* name) {
+    int len = snprintf(buf, size, "%s%s", name, STORAGE_MERKLE_SIDECAR_SUFFIX);
+
+    if (len < 0 || (size_t)len >= size) {
+        return ERR_INVALID_ARGS;
+    }
+    return NO_ERROR;
+}
+
+static int read_exact(file_handle_t fh,
+                      storage_off_t off,
+                      void* buf,
+                      size_t size) {
+    ssize_t rc = storage_read(fh, off, buf, size);
+
+    if (rc < 0) {
+        return rc;
+    }
+    return (size_t)rc == size ? NO_ERROR : ERR_NOT_VALID;
+}
+
+static int write_file(storage_session_t session,
+                      const char* name,
+                      const struct iovec* iov,
+                      size_t iovcnt,
+                      uint32_t opflags) {
+    size_t size = 0;
+    file_handle_t fh;
+    ssize_t rc;
+    size_t i;
+
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    rc = storage_open_file(session, &fh, name,
+                           STORAGE_FILE_OPEN_CREATE |
+                                   STORAGE_FILE_OPEN_TRUNCATE,
+                           0);
+    if (rc < 0) {
+        return rc;
+    }
+    rc = size ? storage_writev(fh, 0, iov, iovcnt, opflags) : 0;
+    storage_close_file(fh);
+    if (rc < 0) {
+        return rc;
+    }
+    return (size_t)rc == size ? NO_ERROR : ERR_IO;
+}
+
+int storage_merkle_write(storage_session_t session,
+                         const char* name,
+                         const void* buf,
+                         size_t size,
+                         uint32_t opflags,
+                         uint8_t* root) {
+    char tree_name[STORAGE_MAX_NAME_LENGTH_BYTES + 1];
+    struct merkle_header header = {
+            .magic = MERKLE_MAGIC,
+            .version = MERKLE_VERSION,
+            .chunk_shift = __builtin_ctz(STORAGE_MERKLE_CHUNK_SIZE),
+            .size = size,
+    };
+    struct merkle_shape shape;
+    uint8_t* nodes;
+    uint64_t total;
+    uint64_t i;
+    uint32_t level;
+    int rc;
+
+    rc = sidecar_name(tree_name, sizeof(tree_name), name);
+    if (rc < 0) {
+        return rc;
+    }
+    merkle_shape_init(&shape, size, header.chunk_shift);
+    total = merkle_shape_nodes(&shape);
+    nodes = malloc(total * STORAGE_MERKLE_DIGEST_SIZE);
+    if (!nodes) {
+        return ERR_NO_MEMORY;
+    }
+
+    for (i = 0; i < shape.count[0]; i++) {
+        hash_leaf((const uint8_t*)buf + (i << header.chunk_shift),
+                  chunk_len(size, header.chunk_shift, i),
+                  nodes + i * STORAGE_MERKLE_DIGEST_SIZE);
+    }
+    for (level = 1; level < shape.levels; level++) {
+        uint8_t* parents =
+                nodes + shape.first[level] * STORAGE_MERKLE_DIGEST_SIZE;
+        uint8_t* children =
+                nodes + shape.first[level - 1] * STORAGE_MERKLE_DIGEST_SIZE;
+
+        for (i = 0; i < shape.count[level]; i++) {
+            hash_node(children + 2 * i * STORAGE_MERKLE_DIGEST_SIZE,
+                      2 * i + 1 < shape.count[level - 1]
+                              ? children + (2 * i + 1) *
+                                                   STORAGE_MERKLE_DIGEST_SIZE
+                              : NULL,
+                      parents + i * STORAGE_MERKLE_DIGEST_SIZE);
+        }
+    }
+    hash_root(&header, nodes + (total - 1) * STORAGE_MERKLE_DIGEST_SIZE, root);
+
+    /* the sidecar goes last, so committing it commits both files */
+    {
+        struct iovec data_iov = {.iov_base = (void*)buf, .iov_len = size};
+        struct iovec tree_iov[] = {
+                {.iov_base = &header, .iov_len = sizeof(header)},
+                {.iov_base = nodes,
+                 .iov_len = total * STORAGE_MERKLE_DIGEST_SIZE},
+        };
+
+        rc = write_file(session, name, &data_iov, size ? 1 : 0, 0);
+        if (rc == NO_ERROR) {
+            rc = write_file(session, tree_name, tree_iov, countof(tree_iov),
+                            opflags);
+        }
+    }
+
+    free(nodes);
+    if (rc < 0 && (opflags & STORAGE_OP_COMPLETE)) {
+        storage_end_transaction(session, false);
+    }
+    return rc;
+}
+
+static int read_node(struct storage_merkle_file* mfile,
+                     uint32_t level,
+                     uint64_t idx,
+                     uint8_t* out) {
+    uint64_t pos = mfile->shape.first[level] + idx;
+
+    return read_exact(mfile->tree,
+                      sizeof(struct merkle_header) +
+                              pos * STORAGE_MERKLE_DIGEST_SIZE,
+                      out, STORAGE_MERKLE_DIGEST_SIZE);
+}
+
+int storage_merkle_open(storage_session_t session,
+                        const char* name,
+                        const uint8_t* root,
+                        struct storage_merkle_file** mfile_p) {
+    char tree_name[STORAGE_MAX_NAME_LENGTH_BYTES + 1];
+    uint8_t digest[STORAGE_MERKLE_DIGEST_SIZE];
+    struct storage_merkle_file* mfile;
+    struct merkle_header header;
+    int rc;
+
+    rc = sidecar_name(tree_name, sizeof(tree_name), name);
+    if (rc < 0) {
+        return rc;
+    }
+    mfile = calloc(1, sizeof(*mfile));
+    if (!mfile) {
+        return ERR_NO_MEMORY;
+    }
+    rc = storage_open_file(session, &mfile->data, name, 0, 0);
+    if (rc < 0) {
+        goto err_open_data;
+    }
+    rc = storage_open_file(session, &mfile->tree, tree_name, 0, 0);
+    if (rc < 0) {
+        goto err_open_tree;
+    }
+
+    rc = read_exact(mfile->tree, 0, &header, sizeof(header));
+    if (rc < 0) {
+        goto err_verify;
+    }
+    if (header.magic != MERKLE_MAGIC || header.version != MERKLE_VERSION ||
+        header.chunk_shift < MERKLE_MIN_CHUNK_SHIFT ||
+        header.chunk_shift > MERKLE_MAX_CHUNK_SHIFT) {
+        rc = ERR_NOT_VALID;
+        goto err_verify;
+    }
+    mfile->size = header.size;
+    mfile->chunk_shift = header.chunk_shift;
+    merkle_shape_init(&mfile->shape, header.size, header.chunk_shift);
+
+    rc = read_node(mfile, mfile->shape.levels - 1, 0, mfile->top);
+    if (rc < 0) {
+        goto err_verify;
+    }
+    hash_root(&header, mfile->top, digest);
+    if (CRYPTO_memcmp(digest, root, sizeof(digest))) {
+        rc = ERR_NOT_VALID;
+        goto err_verify;
+    }
+
+    mfile->chunk = malloc(1U << mfile->chunk_shift);
+    if (!mfile->chunk) {
+        rc = ERR_NO_MEMORY;
+        goto err_verify;
+    }
+    *mfile_p = mfile;
+    return NO_ERROR;
+
+err_verify:
+    storage_close_file(mfile->tree);
+err_open_tree:
+    storage_close_file(mfile->data);
+err_open_data:
+    free(mfile);
+    return rc;
+}
+
+void storage_merkle_close(struct storage_merkle_file* mfile) {
+    if (!mfile) {
+        return;
+    }
+    storage_close_file(mfile->tree);
+    storage_close_file(mfile->data);
+    free(mfile->chunk);
+    free(mfile);
+}
+
+void storage_merkle_get_size(struct storage_merkle_file* mfile,
+                             storage_off_t* size_p) {
+    *size_p = mfile->size;
+}
+
+/*
+ * Read chunks @first to @last, storing the part from @off to @end in @buf and
+ * the hashes of the chunks in @leaves. Whole chunks are read straight into
+ * @buf, in one read per run.
+ */
+static int read_leaves(struct storage_merkle_file* mfile,
+                       storage_off_t off,
+                       storage_off_t end,
+                       uint64_t first,
+                       uint64_t last,
+                       uint8_t* buf,
+                       uint8_t* leaves) {
+    const uint32_t shift = mfile->chunk_shift;
+    storage_off_t start;
+    storage_off_t run_end;
+    uint64_t i = first;
+    uint64_t j;
+    size_t len;
+    int rc;
+
+    while (i <= last) {
+        start = i << shift;
+        len = chunk_len(mfile->size, shift, i);
+        if (start < off || start + len > end) {
+            rc = read_exact(mfile->data, start, mfile->chunk, len);
+            if (rc < 0) {
+                return rc;
+            }
+            hash_leaf(mfile->chunk, len,
+                      leaves + (i - first) * STORAGE_MERKLE_DIGEST_SIZE);
+            run_end = MIN(start + len, end);
+            start = MAX(start, off);
+            memcpy(buf + (start - off), mfile->chunk + (start - (i << shift)),
+                   run_end - start);
+            i++;
+            continue;
+        }
+
+        /* only the last chunk can end past @end */
+        j = i + 1;
+        while (j <= last && (j << shift) + chunk_len(mfile->size, shift, j) <=
+                                    end) {
+            j++;
+        }
+        run_end = ((j - 1) << shift) + chunk_len(mfile->size, shift, j - 1);
+        rc = read_exact(mfile->data, start, buf + (start - off),
+                        run_end - start);
+        if (rc < 0) {
+            return rc;
+        }
+        for (; i < j; i++) {
+            hash_leaf(buf + ((i << shift) - off),
+                      chunk_len(mfile->size, shift, i),
+                      leaves + (i - first) * STORAGE_MERKLE_DIGEST_SIZE);
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ * Check the leaves @lo to @hi, hashed into @run at the position of @lo
+ * relative to the even index before it, against the verified top node.
+ */
+static int verify_run(struct storage_merkle_file* mfile,
+                      uint64_t lo,
+                      uint64_t hi,
+                      uint8_t* run) {
+    const struct merkle_shape* shape = &mfile->shape;
+    uint64_t start;
+    uint64_t end;
+    uint32_t level;
+    int rc;
+
+    for (level = 0; level + 1 < shape->levels; level++) {
+        start = lo & ~1ULL;
+        end = MIN(hi | 1, shape->count[level] - 1);
+        if (start < lo) {
+            rc = read_node(mfile, level, start, run);
+            if (rc < 0) {
+                return rc;
+            }
+        }
+        if (end > hi) {
+            rc = read_node(mfile, level, end,
+                           run + (end - start) * STORAGE_MERKLE_DIGEST_SIZE);
+            if (rc < 0) {
+                return rc;
+            }
+        }
+        hash_run(run, end - start + 1);
+        lo = start / 2;
+        hi = end / 2;
+        if (lo & 1) {
+            memmove(run + STORAGE_MERKLE_DIGEST_SIZE, run,
+                    (hi - lo + 1) * STORAGE_MERKLE_DIGEST_SIZE);
+        }
+    }
+    return CRYPTO_memcmp(run, mfile->top, STORAGE_MERKLE_DIGEST_SIZE)
+                   ? ERR_NOT_VALID
+                   : NO_ERROR;
+}
+
+ssize_t storage_merkle_read(struct storage_merkle_file* mfile,
+                            storage_off_t off,
+                            void* buf,
+                            size_t size) {
+    storage_off_t end;
+    uint64_t first;
+    uint64_t last;
+    uint8_t* run;
+    int rc;
+
+    if (off >= mfile->size) {
+        return 0;
+    }
+    size = MIN(size, mfile->size - off);
+    if (!size) {
+        return 0;
+    }
+    end = off + size;
+    first = off >> mfile->chunk_shift;
+    last = (end - 1) >> mfile->chunk_shift;
+
+    /* room for the leaves read and a sibling on either side */
+    run = calloc(last - first + 3, STORAGE_MERKLE_DIGEST_SIZE);
+    if (!run) {
+        return ERR_NO_MEMORY;
+    }
+    rc = read_leaves(mfile, off, end, first, last, buf,
+                     run + (first & 1) * STORAGE_MERKLE_DIGEST_SIZE);
+    if (rc == NO_ERROR) {
+        rc = verify_run(mfile, first, last, run);
+    }
+    free(run);
+
+    if (rc < 0) {
+        memset(buf, 0, size);
+        return rc;
+    }
+    return size;
+}
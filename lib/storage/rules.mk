@@ -18,12 +18,19 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS := \
-	$(LOCAL_DIR)/storage.c
+	$(LOCAL_DIR)/async.c \
+	$(LOCAL_DIR)/cache.c \
+	$(LOCAL_DIR)/fhcache.c \
+	$(LOCAL_DIR)/stats.c \
+	$(LOCAL_DIR)/storage.c \
+	$(LOCAL_DIR)/writeback.c
 
 MODULE_EXPORT_INCLUDES += $(LOCAL_DIR)/include/
 
 MODULE_LIBRARY_EXPORTED_DEPS += \
-	trusty/user/base/interface/storage
+	trusty/user/base/interface/metrics \
+	trusty/user/base/interface/storage \
+	trusty/user/base/lib/tipc
 
 include make/library.mk
 
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <interface/metrics/consumer.h>
+#include <interface/metrics/metrics.h>
+#include <lib/tipc/tipc.h>
+#include <lk/macros.h>
+#include <stdio.h>
+#include <string.h>
+#include <trusty/time.h>
+#include <trusty_ipc.h>
+#include <uapi/err.h>
+
+#include <lib/storage/stats.h>
+
+#include "storage_priv.h"
+
+#define LOG_TAG "storage_client"
+
+#define TLOGE(fmt, ...) \
+    fprintf(stderr, "%s: %d: " fmt, LOG_TAG, __LINE__, ##__VA_ARGS__)
+
+#define TLOGE_APP_NAME(fmt, ...)                                       \
+    fprintf(stderr, "%s: %d: %s: " fmt, LOG_TAG, __LINE__, __progname, \
+            ##__VA_ARGS__)
+
+/* Initialized by __init_libc in ./trusty/musl/src/env/__libc_start_main.c */
+extern char* __progname;
+
+static struct storage_stats stats;
+static uint64_t slow_op_threshold_usec;
+
+static const char* const op_names[STORAGE_STATS_OP_COUNT] = {
+        [STORAGE_STATS_OP_OPEN] = "open",
+        [STORAGE_STATS_OP_READ] = "read",
+        [STORAGE_STATS_OP_WRITE] = "write",
+        [STORAGE_STATS_OP_COMMIT] = "commit",
+        [STORAGE_STATS_OP_LIST] = "list",
+};
+
+/* otherwise storage_priv.h provides stubs that keep no statistics */
+#if STORAGE_STATS_ENABLED
+int64_t storage_stats_start(void) {
+    int64_t now = 0;
+
+    trusty_gettime(0, &now);
+    return now;
+}
+
+static size_t hist_bucket(uint64_t usec) {
+    uint64_t limit = STORAGE_STATS_BUCKET0_USEC;
+    size_t bucket = 0;
+
+    while (usec >= limit && bucket < STORAGE_STATS_BUCKETS - 1) {
+        limit <<= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void storage_stats_record(enum storage_stats_op op,
+                          int64_t start,
+                          ssize_t rc) {
+    struct storage_op_stats* op_stats = &stats.ops[op];
+    int64_t now = storage_stats_start();
+    uint64_t usec = now > start ? (now - start) / 1000 : 0;
+
+    op_stats->count++;
+    if (rc < 0) {
+        op_stats->errors++;
+    } else {
+        op_stats->bytes += rc;
+    }
+    op_stats->total_usec += usec;
+    op_stats->max_usec = MAX(op_stats->max_usec, usec);
+    op_stats->hist[hist_bucket(usec)]++;
+
+    if (slow_op_threshold_usec && usec > slow_op_threshold_usec) {
+        TLOGE_APP_NAME("slow %s took %llu usec, returned %zd\n",
+                       op_names[op], (unsigned long long)usec, rc);
+    }
+}
+#endif
+
+void storage_get_stats(struct storage_stats* stats_p) {
+    *stats_p = stats;
+}
+
+void storage_reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+void storage_set_slow_op_threshold(uint32_t msec) {
+    slow_op_threshold_usec = (uint64_t)msec * 1000;
+}
+
+/**
+ * struct storage_stats_report - a %METRICS_CMD_REPORT_STORAGE event
+ * @hdr: the common request header
+ * @req: the statistics of one operation type
+ *
+ * The metrics service fills in the app ID.
+ */
+struct storage_stats_report {
+    struct metrics_req hdr;
+    struct metrics_report_storage_req req;
+} __attribute__((__packed__));
+
+static int report_op(handle_t chan,
+                     enum storage_stats_op op,
+                     const struct storage_op_stats* op_stats) {
+    struct storage_stats_report msg = {
+            .hdr.cmd = METRICS_CMD_REPORT_STORAGE,
+            .req.op = op,
+            .req.count = op_stats->count,
+            .req.errors = op_stats->errors,
+            .req.bytes = op_stats->bytes,
+            .req.total_usec = op_stats->total_usec,
+            .req.max_usec = op_stats->max_usec,
+    };
+    struct metrics_resp resp;
+    uevent_t evt;
+    int rc;
+
+    memcpy(msg.req.hist, op_stats->hist, sizeof(msg.req.hist));
+
+    rc = tipc_send1(chan, &msg, sizeof(msg));
+    if (rc < 0) {
+        return rc;
+    }
+    if ((size_t)rc != sizeof(msg)) {
+        return ERR_BAD_LEN;
+    }
+
+    rc = wait(chan, &evt, INFINITE_TIME);
+    if (rc != NO_ERROR) {
+        return rc;
+    }
+
+    rc = tipc_recv1(chan, sizeof(resp), &resp, sizeof(resp));
+    if (rc < 0) {
+        return rc;
+    }
+    if (resp.cmd != (METRICS_CMD_REPORT_STORAGE | METRICS_CMD_RESP_BIT)) {
+        return ERR_CMD_UNKNOWN;
+    }
+    if (resp.status != METRICS_NO_ERROR) {
+        return ERR_NOT_SUPPORTED;
+    }
+    return NO_ERROR;
+}
+
+int storage_report_stats(void) {
+    struct storage_stats snapshot = stats;
+    handle_t chan;
+    size_t op;
+    int rc;
+
+    rc = tipc_connect(&chan, METRICS_CONSUMER_PORT);
+    if (rc < 0) {
+        TLOGE("failed (%d) to connect to metrics service\n", rc);
+        return rc;
+    }
+
+    for (op = 0; op < STORAGE_STATS_OP_COUNT; op++) {
+        if (!snapshot.ops[op].count) {
+            continue;
+        }
+        rc = report_op(chan, op, &snapshot.ops[op]);
+        if (rc < 0) {
+            TLOGE("failed (%d) to report %s statistics\n", rc, op_names[op]);
+            break;
+        }
+    }
+
+    close(chan);
+    return rc;
+}
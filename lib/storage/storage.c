@@ -14,14 +14,21 @@
  * limitations under the License.
  */
 
+#include <lk/macros.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <trusty/memref.h>
 #include <trusty_ipc.h>
 #include <uapi/err.h>
+#include <uapi/mm.h>
 
 #include <lib/storage/storage.h>
 
+#include "storage_priv.h"
+
 #define LOCAL_TRACE 0
 
 #define LOG_TAG "storage_client"
@@ -40,7 +47,22 @@
 #define TLOGI(fmt, ...)
 #endif
 
-#define MAX_CHUNK_SIZE 4040
+/*
+ * Reads and writes of at least STORAGE_SHM_THRESHOLD bytes go through a
+ * STORAGE_SHM_SIZE byte shared memory region registered with the session, if
+ * the server supports it, instead of being split into IPC messages. The data
+ * is still copied between the caller's buffer and the region, one region's
+ * worth per request.
+ */
+#ifndef STORAGE_SHM_THRESHOLD
+#define STORAGE_SHM_THRESHOLD (4 * MAX_CHUNK_SIZE)
+#endif
+
+#ifndef STORAGE_SHM_SIZE
+#define STORAGE_SHM_SIZE (64 * 1024)
+#endif
+
+#define PAGE_SIZE getauxval(AT_PAGESZ)
 
 /* At what delay threshold should wait_infinite_logged() start logging? */
 #define WAIT_INFINITE_LOG_THRESHOLD_MSEC 1000
@@ -48,19 +70,6 @@
 /* Initialized by __init_libc in ./trusty/musl/src/env/__libc_start_main.c */
 extern char* __progname;
 
-static inline file_handle_t make_file_handle(storage_session_t s,
-                                             uint32_t fid) {
-    return ((uint64_t)s << 32) | fid;
-}
-
-static inline storage_session_t _to_session(file_handle_t fh) {
-    return (storage_session_t)(fh >> 32);
-}
-
-static inline uint32_t _to_handle(file_handle_t fh) {
-    return (uint32_t)fh;
-}
-
 static inline uint32_t _to_msg_flags(uint32_t opflags) {
     uint32_t msg_flags = 0;
 
@@ -70,7 +79,7 @@ static inline uint32_t _to_msg_flags(uint32_t opflags) {
     return msg_flags;
 }
 
-static ssize_t check_response(struct storage_msg* msg, ssize_t res) {
+ssize_t storage_check_response(struct storage_msg* msg, ssize_t res) {
     if (res < 0)
         return res;
 
@@ -144,9 +153,15 @@ int wait_infinite_logged(storage_session_t session,
     return rc;
 }
 
+/*
+ * Receive a response into @rx_iovs. If @handle_p is not %NULL, it is set to
+ * the handle carried by the response, or to INVALID_IPC_HANDLE if there is
+ * none, and the caller must close it.
+ */
 static ssize_t get_response(storage_session_t session,
                             struct iovec* rx_iovs,
-                            uint32_t rx_iovcnt)
+                            uint32_t rx_iovcnt,
+                            handle_t* handle_p)
 
 {
     uevent_t ev;
@@ -154,8 +169,13 @@ static ssize_t get_response(storage_session_t session,
     struct ipc_msg rx_msg = {
             .iov = rx_iovs,
             .num_iov = rx_iovcnt,
+            .handles = handle_p,
+            .num_handles = handle_p ? 1 : 0,
     };
 
+    if (handle_p)
+        *handle_p = INVALID_IPC_HANDLE;
+
     if (!rx_iovcnt)
         return 0;
 
@@ -172,6 +192,9 @@ static ssize_t get_response(storage_session_t session,
         return rc;
     }
 
+    if (!mi.num_handles)
+        rx_msg.num_handles = 0;
+
     rc = read_msg(session, mi.id, 0, &rx_msg);
     put_msg(session, mi.id);
     if (rc < 0) {
@@ -235,7 +258,7 @@ ssize_t send_reqv(storage_session_t session,
         return rc;
     }
 
-    rc = get_response(session, rx_iovs, rx_iovcnt);
+    rc = get_response(session, rx_iovs, rx_iovcnt, NULL);
     if (rc < 0) {
         TLOGI("%s: failed (%d) to get response\n", __func__, (int)rc);
         return rc;
@@ -244,6 +267,198 @@ ssize_t send_reqv(storage_session_t session,
     return rc;
 }
 
+/* What is known about a server's support for batched writes */
+enum storage_batching {
+    STORAGE_BATCHING_UNKNOWN,
+    STORAGE_BATCHING_SUPPORTED,
+    STORAGE_BATCHING_UNSUPPORTED,
+};
+
+/**
+ * struct storage_session_state - client-side state of a session
+ * @session:    the session this state belongs to
+ * @shm_tried:  whether mapping a shared memory region has been attempted
+ * @shm_base:   start of the shared memory region, or %NULL if the session has
+ *              none because the server does not support it or mapping it
+ *              failed
+ * @shm_size:   size of the shared memory region in bytes
+ * @cache:      read cache of the session, or %NULL if it is disabled
+ * @wb:         write-back state of the session, or %NULL if it is disabled
+ * @fhc:        open file handle cache of the session, or %NULL if it was
+ *              never enabled. Once created it is kept until the session is
+ *              closed, as it owns the handles still in use.
+ * @batching:   whether the server answers a batch of write chunks with a
+ *              single response, as far as is known
+ * @next:       next entry in @session_list
+ */
+struct storage_session_state {
+    storage_session_t session;
+    bool shm_tried;
+    void* shm_base;
+    size_t shm_size;
+    struct storage_cache* cache;
+    struct storage_write_back* wb;
+    struct storage_fh_cache* fhc;
+    enum storage_batching batching;
+    struct storage_session_state* next;
+};
+
+static struct storage_session_state* session_list;
+
+static struct storage_session_state* _find_session(storage_session_t session) {
+    struct storage_session_state* state;
+
+    for (state = session_list; state; state = state->next) {
+        if (state->session == session) {
+            return state;
+        }
+    }
+    return NULL;
+}
+
+static struct storage_session_state* _get_session(storage_session_t session) {
+    struct storage_session_state* state = _find_session(session);
+
+    if (state) {
+        return state;
+    }
+    state = calloc(1, sizeof(*state));
+    if (!state) {
+        return NULL;
+    }
+    state->session = session;
+    state->next = session_list;
+    session_list = state;
+    return state;
+}
+
+static void _put_session(storage_session_t session) {
+    struct storage_session_state** prev;
+    struct storage_session_state* state;
+
+    for (prev = &session_list; *prev; prev = &(*prev)->next) {
+        state = *prev;
+        if (state->session == session) {
+            *prev = state->next;
+            /* the server unmaps the region when the session is closed */
+            free(state->shm_base);
+            storage_cache_destroy(state->cache);
+            /* uncommitted changes are discarded with the session */
+            storage_wb_destroy(state->wb);
+            /* the server closes all files of the session */
+            storage_fhc_destroy(state->fhc);
+            free(state);
+            return;
+        }
+    }
+}
+
+static struct storage_cache* _get_cache(storage_session_t session) {
+    struct storage_session_state* state = _find_session(session);
+
+    return state ? state->cache : NULL;
+}
+
+static struct storage_write_back* _get_wb(storage_session_t session) {
+    struct storage_session_state* state = _find_session(session);
+
+    return state ? state->wb : NULL;
+}
+
+/* the open file handle cache of @session, or %NULL if it is disabled */
+static struct storage_fh_cache* _get_fhc(storage_session_t session) {
+    struct storage_session_state* state = _find_session(session);
+
+    return state && storage_fhc_enabled(state->fhc) ? state->fhc : NULL;
+}
+
+/*
+ * Register @base with the server as the shared memory region of @session.
+ * @leaked_p is set if the server may have mapped the region even though
+ * mapping failed, in which case the memory must never be reused.
+ */
+static int _map_shm(storage_session_t session,
+                    void* base,
+                    size_t size,
+                    bool* leaked_p) {
+    struct storage_msg msg = {.cmd = STORAGE_SHM_MAP};
+    struct storage_shm_map_req req = {.size = size};
+    struct iovec tx[2] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}};
+    struct iovec rx[1] = {{&msg, sizeof(msg)}};
+    handle_t memref;
+    ssize_t rc;
+
+    *leaked_p = false;
+    rc = memref_create(base, size, MMAP_FLAG_PROT_READ | MMAP_FLAG_PROT_WRITE);
+    if (rc < 0) {
+        TLOGE("%s: failed (%d) to create memref\n", __func__, (int)rc);
+        return rc;
+    }
+    memref = (handle_t)rc;
+
+    struct ipc_msg tx_msg = {
+            .iov = tx,
+            .num_iov = 2,
+            .handles = &memref,
+            .num_handles = 1,
+    };
+    rc = send_msg(session, &tx_msg);
+    if (rc == ERR_NOT_ENOUGH_BUFFER) {
+        rc = wait_to_send(session, &tx_msg);
+    }
+    /* the server holds its own reference to the region once it is sent */
+    close(memref);
+    if (rc < 0) {
+        TLOGE("%s: failed (%d) to send_msg\n", __func__, (int)rc);
+        return rc;
+    }
+
+    rc = get_response(session, rx, 1, NULL);
+    if (rc < 0) {
+        *leaked_p = true;
+        return rc;
+    }
+    return (int)storage_check_response(&msg, rc);
+}
+
+/*
+ * Look up the session state of @session, mapping a shared memory region the
+ * first time this is called for the session.
+ *
+ * Return: the session state, or %NULL if the session has no shared memory.
+ */
+static struct storage_session_state* _get_shm(storage_session_t session) {
+    struct storage_session_state* state = _get_session(session);
+    bool leaked;
+    int rc;
+
+    if (!state || state->shm_tried) {
+        return state && state->shm_base ? state : NULL;
+    }
+    state->shm_tried = true;
+
+    state->shm_base = memalign(PAGE_SIZE, STORAGE_SHM_SIZE);
+    if (!state->shm_base) {
+        return NULL;
+    }
+
+    rc = _map_shm(session, state->shm_base, STORAGE_SHM_SIZE, &leaked);
+    if (rc == NO_ERROR) {
+        state->shm_size = STORAGE_SHM_SIZE;
+        return state;
+    }
+
+    /* servers without shared memory support keep using plain messages */
+    if (rc != ERR_NOT_IMPLEMENTED) {
+        TLOGE("%s: failed (%d) to map shared memory\n", __func__, rc);
+    }
+    if (!leaked) {
+        free(state->shm_base);
+    }
+    state->shm_base = NULL;
+    return NULL;
+}
+
 int storage_open_session(storage_session_t* session_p, const char* type) {
     long rc = connect(type, IPC_CONNECT_WAIT_FOR_PORT);
     if (rc < 0) {
@@ -256,9 +471,70 @@ int storage_open_session(storage_session_t* session_p, const char* type) {
 
 void storage_close_session(storage_session_t session) {
     close(session);
+    _put_session(session);
 }
 
-int storage_open_file(storage_session_t session,
+int storage_set_cache_size(storage_session_t session, size_t max_bytes) {
+    struct storage_session_state* state = _get_session(session);
+    struct storage_cache* cache = NULL;
+
+    if (!state) {
+        return ERR_NO_MEMORY;
+    }
+    if (max_bytes) {
+        cache = storage_cache_create(max_bytes);
+        if (!cache) {
+            return ERR_NO_MEMORY;
+        }
+    }
+
+    storage_cache_destroy(state->cache);
+    state->cache = cache;
+    return NO_ERROR;
+}
+
+int storage_set_write_back(storage_session_t session, size_t max_bytes) {
+    struct storage_session_state* state = _get_session(session);
+    struct storage_write_back* wb = NULL;
+    int rc;
+
+    if (!state) {
+        return ERR_NO_MEMORY;
+    }
+    if (max_bytes) {
+        wb = storage_wb_create(max_bytes);
+        if (!wb) {
+            return ERR_NO_MEMORY;
+        }
+    }
+
+    rc = storage_wb_flush_all(state->wb, 0);
+    storage_wb_destroy(state->wb);
+    state->wb = wb;
+    return rc;
+}
+
+int storage_set_file_cache_size(storage_session_t session, size_t max_files) {
+    struct storage_session_state* state = _get_session(session);
+
+    if (!state) {
+        return ERR_NO_MEMORY;
+    }
+    if (state->fhc) {
+        /* handles still in use stay cached until their last user closes */
+        storage_fhc_resize(state->fhc, max_files);
+        return NO_ERROR;
+    }
+    if (max_files) {
+        state->fhc = storage_fhc_create(max_files);
+        if (!state->fhc) {
+            return ERR_NO_MEMORY;
+        }
+    }
+    return NO_ERROR;
+}
+
+static int _open_file(storage_session_t session,
                       file_handle_t* handle_p,
                       const char* name,
                       uint32_t flags,
@@ -271,9 +547,40 @@ int storage_open_file(storage_session_t session,
                           {(void*)name, strlen(name)}};
     struct storage_file_open_resp rsp = {0};
     struct iovec rx[2] = {{&msg, sizeof(msg)}, {&rsp, sizeof(rsp)}};
+    struct storage_fh_cache* fhc = _get_fhc(session);
+
+    ssize_t rc;
+
+    if (fhc && !(flags & (STORAGE_FILE_OPEN_TRUNCATE |
+                          STORAGE_FILE_OPEN_CREATE_EXCLUSIVE))) {
+        if (storage_fhc_get(fhc, name, handle_p) == NO_ERROR) {
+            if (!(opflags & STORAGE_OP_COMPLETE)) {
+                return NO_ERROR;
+            }
+            rc = storage_end_transaction(session, true);
+            if (rc < 0) {
+                storage_close_file(*handle_p);
+            }
+            return (int)rc;
+        }
+    } else if (fhc) {
+        /* the file is replaced or must not exist yet */
+        storage_fhc_forget(fhc, name);
+    }
+
+    if (flags & STORAGE_FILE_OPEN_TRUNCATE) {
+        /* the file may already be open under another handle */
+        storage_cache_clear(_get_cache(session));
+    }
+    if ((flags & STORAGE_FILE_OPEN_TRUNCATE) ||
+        (opflags & STORAGE_OP_COMPLETE)) {
+        rc = storage_wb_flush_all(_get_wb(session), 0);
+        if (rc < 0)
+            return rc;
+    }
 
-    ssize_t rc = send_reqv(session, tx, 3, rx, 2);
-    rc = check_response(&msg, rc);
+    rc = send_reqv(session, tx, 3, rx, 2);
+    rc = storage_check_response(&msg, rc);
     if (rc < 0)
         return rc;
 
@@ -283,22 +590,378 @@ int storage_open_file(storage_session_t session,
         return ERR_IO;
     }
     *handle_p = make_file_handle(session, rsp.handle);
+    if (fhc) {
+        storage_fhc_add(fhc, name, *handle_p);
+    }
     return NO_ERROR;
 }
 
+int storage_open_file(storage_session_t session,
+                      file_handle_t* handle_p,
+                      const char* name,
+                      uint32_t flags,
+                      uint32_t opflags) {
+    int64_t start = storage_stats_start();
+    int rc = _open_file(session, handle_p, name, flags, opflags);
+
+    storage_stats_record(STORAGE_STATS_OP_OPEN, start, MIN(rc, 0));
+    return rc;
+}
+
 void storage_close_file(file_handle_t fh) {
+    struct storage_session_state* state = _find_session(_to_session(fh));
+
+    /* the cache may own @fh even if it has been disabled since */
+    if (storage_fhc_put(state ? state->fhc : NULL, fh)) {
+        /* the handle stays open, but its data must reach the server now */
+        ssize_t rc = storage_wb_flush(_get_wb(_to_session(fh)), fh);
+        if (rc < 0) {
+            TLOGE("failed (%d) to write back file before closing it\n",
+                  (int)rc);
+        }
+        return;
+    }
+    storage_close_file_direct(fh);
+}
+
+void storage_close_file_direct(file_handle_t fh) {
     struct storage_msg msg = {.cmd = STORAGE_FILE_CLOSE};
     struct storage_file_close_req req = {.handle = _to_handle(fh)};
     struct iovec tx[2] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}};
     struct iovec rx[1] = {{&msg, sizeof(msg)}};
 
-    ssize_t rc = send_reqv(_to_session(fh), tx, 2, rx, 1);
-    rc = check_response(&msg, rc);
+    ssize_t rc = storage_wb_flush(_get_wb(_to_session(fh)), fh);
+    if (rc < 0) {
+        TLOGE("failed (%d) to write back file before closing it\n", (int)rc);
+    }
+
+    /* the handle may be reused for another file */
+    storage_cache_invalidate_file(_get_cache(_to_session(fh)), fh);
+
+    rc = send_reqv(_to_session(fh), tx, 2, rx, 1);
+    rc = storage_check_response(&msg, rc);
     if (rc < 0) {
         TLOGE("close file failed (%d)\n", (int)rc);
     }
 }
 
+/**
+ * enum storage_prefetch_state - progress of a file being prefetched
+ * @PREFETCH_IDLE:    the file has not been opened yet
+ * @PREFETCH_OPENING: an open request is in flight
+ * @PREFETCH_OPEN:    the file is open and its read has not been sent yet
+ * @PREFETCH_READING: a read request is in flight
+ * @PREFETCH_DONE:    nothing more to do for the file
+ */
+enum storage_prefetch_state {
+    PREFETCH_IDLE,
+    PREFETCH_OPENING,
+    PREFETCH_OPEN,
+    PREFETCH_READING,
+    PREFETCH_DONE,
+};
+
+/**
+ * struct storage_prefetch_file - a file being prefetched
+ * @state:      progress of the file
+ * @open:       whether @fh is valid
+ * @from_cache: whether @fh was already in the open file handle cache
+ * @fh:         the open file handle
+ */
+struct storage_prefetch_file {
+    enum storage_prefetch_state state;
+    bool open;
+    bool from_cache;
+    file_handle_t fh;
+};
+
+static int _send_prefetch_req(storage_session_t session,
+                              struct iovec* tx,
+                              uint32_t tx_iovcnt,
+                              bool may_block) {
+    struct ipc_msg tx_msg = {
+            .iov = tx,
+            .num_iov = tx_iovcnt,
+    };
+
+    int rc = send_msg(session, &tx_msg);
+    if (rc == ERR_NOT_ENOUGH_BUFFER && may_block) {
+        rc = wait_to_send(session, &tx_msg);
+    }
+    return rc < 0 ? rc : NO_ERROR;
+}
+
+static size_t _find_prefetch_file(struct storage_prefetch_file* files,
+                                  size_t count,
+                                  enum storage_prefetch_state state) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (files[i].state == state) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Send the next open or read request of a prefetch. Reads of open files go
+ * first, so their data arrives while later files are still being opened.
+ *
+ * Return: NO_ERROR if a request was sent, ERR_NOT_FOUND if there is nothing
+ * left to send, ERR_NOT_ENOUGH_BUFFER if @may_block is false and the server's
+ * queue is full, or another error code < 0 on failure.
+ */
+static int _send_prefetch_next(storage_session_t session,
+                               const char* const* names,
+                               struct storage_prefetch_file* files,
+                               size_t count,
+                               bool may_block) {
+    struct storage_msg msg = {0};
+    struct storage_file_open_req open_req = {0};
+    struct storage_file_read_req read_req = {.size = MAX_CHUNK_SIZE};
+    struct iovec tx[3] = {{&msg, sizeof(msg)}};
+    uint32_t tx_iovcnt;
+    size_t i;
+    int rc;
+
+    i = _find_prefetch_file(files, count, PREFETCH_OPEN);
+    if (i < count) {
+        msg.cmd = STORAGE_FILE_READ;
+        read_req.handle = _to_handle(files[i].fh);
+        tx[1] = (struct iovec){&read_req, sizeof(read_req)};
+        tx_iovcnt = 2;
+    } else {
+        i = _find_prefetch_file(files, count, PREFETCH_IDLE);
+        if (i == count) {
+            return ERR_NOT_FOUND;
+        }
+        msg.cmd = STORAGE_FILE_OPEN;
+        tx[1] = (struct iovec){&open_req, sizeof(open_req)};
+        tx[2] = (struct iovec){(void*)names[i], strlen(names[i])};
+        tx_iovcnt = 3;
+    }
+
+    msg.op_id = i;
+    rc = _send_prefetch_req(session, tx, tx_iovcnt, may_block);
+    if (rc < 0) {
+        return rc;
+    }
+    files[i].state = msg.cmd == STORAGE_FILE_READ ? PREFETCH_READING
+                                                  : PREFETCH_OPENING;
+    return NO_ERROR;
+}
+
+/*
+ * Handle the response to one request of a prefetch, received into @msg and
+ * @buf with result @rc, and cache the handle of an opened file or the data
+ * read from it.
+ */
+static int _handle_prefetch_resp(storage_session_t session,
+                                 struct storage_prefetch_file* files,
+                                 size_t count,
+                                 struct storage_msg* msg,
+                                 uint8_t* buf,
+                                 ssize_t rc) {
+    struct storage_file_open_resp rsp;
+    struct storage_prefetch_file* file;
+
+    if (rc < 0) {
+        return rc;
+    }
+    if ((size_t)rc < sizeof(*msg) || msg->op_id >= count) {
+        TLOGE("%s: unexpected response (%zd, %u)\n", __func__, (size_t)rc,
+              msg->op_id);
+        return ERR_IO;
+    }
+    file = &files[msg->op_id];
+
+    if (msg->cmd == (STORAGE_FILE_OPEN | STORAGE_RESP_BIT) &&
+        file->state == PREFETCH_OPENING) {
+        rc = storage_check_response(msg, rc);
+        if (rc < 0) {
+            /* skipped, the app finds out when it opens the file itself */
+            file->state = PREFETCH_DONE;
+            return NO_ERROR;
+        }
+        if ((size_t)rc != sizeof(rsp)) {
+            TLOGE("%s: invalid response length (%zd != %zd)\n", __func__,
+                  (size_t)rc, sizeof(rsp));
+            file->state = PREFETCH_DONE;
+            return ERR_IO;
+        }
+        memcpy(&rsp, buf, sizeof(rsp));
+        file->fh = make_file_handle(session, rsp.handle);
+        file->open = true;
+        file->state = _get_cache(session) ? PREFETCH_OPEN : PREFETCH_DONE;
+        return NO_ERROR;
+    }
+
+    if (msg->cmd == (STORAGE_FILE_READ | STORAGE_RESP_BIT) &&
+        file->state == PREFETCH_READING) {
+        rc = storage_check_response(msg, rc);
+        if (rc >= 0) {
+            storage_cache_add(_get_cache(session), file->fh, 0, buf, rc,
+                              rc < MAX_CHUNK_SIZE);
+        }
+        file->state = PREFETCH_DONE;
+        return NO_ERROR;
+    }
+
+    TLOGE("%s: unexpected response to cmd 0x%x\n", __func__, msg->cmd);
+    return ERR_IO;
+}
+
+/*
+ * Receive the response to one request of a prefetch and handle it.
+ *
+ * Return: NO_ERROR if a response was received, in which case the result of
+ * handling it is stored in @result_p. A malformed response is consumed as
+ * well and reported with @result_p set to an error code. An error code < 0 is
+ * returned if no response could be received because the channel failed.
+ */
+static int _get_prefetch_resp(storage_session_t session,
+                              struct storage_prefetch_file* files,
+                              size_t count,
+                              uint8_t* buf,
+                              int* result_p) {
+    uevent_t ev;
+    struct ipc_msg_info mi;
+    struct storage_msg msg;
+    struct iovec rx[2] = {{&msg, sizeof(msg)}, {buf, MAX_CHUNK_SIZE}};
+    struct ipc_msg rx_msg = {
+            .iov = rx,
+            .num_iov = 2,
+    };
+    ssize_t rc;
+
+    /* a send-unblocked event for an earlier request is not a response */
+    do {
+        rc = wait_infinite_logged(session, &ev, __func__);
+        if (rc != NO_ERROR) {
+            TLOGE("%s: interrupted waiting for response", __func__);
+            return rc;
+        }
+    } while (!(ev.event & (IPC_HANDLE_POLL_MSG | IPC_HANDLE_POLL_HUP)));
+
+    rc = get_msg(session, &mi);
+    if (rc != NO_ERROR) {
+        TLOGE("%s: failed to get_msg (%d)\n", __func__, (int)rc);
+        return rc;
+    }
+
+    rc = read_msg(session, mi.id, 0, &rx_msg);
+    put_msg(session, mi.id);
+    if (rc < 0) {
+        TLOGE("%s: failed to read msg (%d)\n", __func__, (int)rc);
+    } else if ((size_t)rc != mi.len) {
+        TLOGE("%s: partial message read (%zd vs. %zd)\n", __func__,
+              (size_t)rc, mi.len);
+        rc = ERR_IO;
+    }
+
+    *result_p = _handle_prefetch_resp(session, files, count, &msg, buf, rc);
+    return NO_ERROR;
+}
+
+int storage_prefetch(storage_session_t session,
+                     const char* const* names,
+                     size_t count) {
+    struct storage_fh_cache* fhc = _get_fhc(session);
+    struct storage_prefetch_file* files;
+    uint8_t* buf;
+    size_t in_flight = 0;
+    size_t i;
+    size_t j;
+    int result;
+    int err = NO_ERROR;
+    int rc = NO_ERROR;
+
+    if (!fhc) {
+        return ERR_NOT_SUPPORTED;
+    }
+    if (!count) {
+        return NO_ERROR;
+    }
+    files = calloc(count, sizeof(*files));
+    buf = malloc(MAX_CHUNK_SIZE);
+    if (!files || !buf) {
+        rc = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < i; j++) {
+            if (!strcmp(names[j], names[i])) {
+                break;
+            }
+        }
+        if (j < i || strlen(names[i]) > STORAGE_MAX_NAME_LENGTH_BYTES) {
+            files[i].state = PREFETCH_DONE;
+        } else if (storage_fhc_get(fhc, names[i], &files[i].fh) == NO_ERROR) {
+            /* assume whoever opened it has read it as well */
+            files[i].open = true;
+            files[i].from_cache = true;
+            files[i].state = PREFETCH_DONE;
+        }
+    }
+
+    for (;;) {
+        while (!err && in_flight < STORAGE_QUEUE_DEPTH) {
+            rc = _send_prefetch_next(session, names, files, count,
+                                     !in_flight);
+            if (rc == ERR_NOT_FOUND || rc == ERR_NOT_ENOUGH_BUFFER) {
+                break;
+            }
+            if (rc < 0) {
+                TLOGE("%s: failed (%d) to send_msg\n", __func__, rc);
+                err = rc;
+                break;
+            }
+            in_flight++;
+        }
+        if (!in_flight) {
+            break;
+        }
+
+        /* responses are collected even after an error to keep in sync */
+        rc = _get_prefetch_resp(session, files, count, buf, &result);
+        if (rc < 0) {
+            /*
+             * The remaining responses cannot be drained, so the session is
+             * unusable. Closing files would pick up stale responses, so they
+             * are left to be closed with the session.
+             */
+            goto out;
+        }
+        in_flight--;
+        if (result < 0 && !err) {
+            err = result;
+        }
+    }
+    rc = err;
+
+    /*
+     * Caching a handle may close others, which needs the channel, so handles
+     * are only cached once no responses are outstanding.
+     */
+    for (i = 0; i < count; i++) {
+        if (files[i].open && !files[i].from_cache) {
+            storage_fhc_add(fhc, names[i], files[i].fh);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (files[i].open && !storage_fhc_put(fhc, files[i].fh)) {
+            storage_close_file_direct(files[i].fh);
+        }
+    }
+
+out:
+    free(buf);
+    free(files);
+    return rc;
+}
+
 int storage_move_file(storage_session_t session,
                       file_handle_t handle,
                       const char* old_name,
@@ -324,8 +987,16 @@ int storage_move_file(storage_session_t session,
     };
     struct iovec rx[1] = {{&msg, sizeof(msg)}};
 
-    ssize_t rc = send_reqv(session, tx, 4, rx, 1);
-    return (int)check_response(&msg, rc);
+    ssize_t rc = storage_wb_flush_all(_get_wb(session), 0);
+    if (rc < 0)
+        return rc;
+
+    storage_cache_clear(_get_cache(session));
+    storage_fhc_forget(_get_fhc(session), old_name);
+    storage_fhc_forget(_get_fhc(session), new_name);
+
+    rc = send_reqv(session, tx, 4, rx, 1);
+    return (int)storage_check_response(&msg, rc);
 }
 
 int storage_delete_file(storage_session_t session,
@@ -341,8 +1012,15 @@ int storage_delete_file(storage_session_t session,
                           {(void*)name, strlen(name)}};
     struct iovec rx[1] = {{&msg, sizeof(msg)}};
 
-    ssize_t rc = send_reqv(session, tx, 3, rx, 1);
-    return (int)check_response(&msg, rc);
+    ssize_t rc = storage_wb_flush_all(_get_wb(session), 0);
+    if (rc < 0)
+        return rc;
+
+    storage_cache_clear(_get_cache(session));
+    storage_fhc_forget(_get_fhc(session), name);
+
+    rc = send_reqv(session, tx, 3, rx, 1);
+    return (int)storage_check_response(&msg, rc);
 }
 
 struct storage_open_dir_state {
@@ -350,15 +1028,19 @@ struct storage_open_dir_state {
     size_t buf_size;
     size_t buf_last_read;
     size_t buf_read;
+    bool prefix_unsupported;
+    size_t prefix_len;
+    char prefix[STORAGE_MAX_NAME_LENGTH_BYTES + 1];
 };
 
-int storage_open_dir(storage_session_t session,
-                     const char* path,
-                     struct storage_open_dir_state** state) {
+int storage_open_dir_prefix(storage_session_t session,
+                            const char* prefix,
+                            struct storage_open_dir_state** state) {
     struct storage_file_list_resp* resp;
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
 
-    if (path && strlen(path)) {
-        return ERR_NOT_FOUND; /* current server does not support directories */
+    if (prefix_len > STORAGE_MAX_NAME_LENGTH_BYTES) {
+        return ERR_INVALID_ARGS;
     }
     *state = malloc(sizeof(**state));
     if (*state == NULL) {
@@ -369,15 +1051,63 @@ int storage_open_dir(storage_session_t session,
     (*state)->buf_size = sizeof(*resp);
     (*state)->buf_last_read = 0;
     (*state)->buf_read = (*state)->buf_size;
+    (*state)->prefix_unsupported = false;
+    (*state)->prefix_len = prefix_len;
+    if (prefix_len) {
+        memcpy((*state)->prefix, prefix, prefix_len);
+    }
+    (*state)->prefix[prefix_len] = '\0';
 
     return 0;
 }
 
+int storage_open_dir(storage_session_t session,
+                     const char* path,
+                     struct storage_open_dir_state** state) {
+    if (path && strlen(path)) {
+        return ERR_NOT_FOUND; /* current server does not support directories */
+    }
+    return storage_open_dir_prefix(session, NULL, state);
+}
+
 void storage_close_dir(storage_session_t session,
                        struct storage_open_dir_state* state) {
     free(state);
 }
 
+/*
+ * Ask the server to list only names starting with the prefix of @state. The
+ * response is received into @state->buf, which still holds the last item
+ * returned, so its name is sent from there.
+ */
+static ssize_t _send_list_prefix(storage_session_t session,
+                                 struct storage_open_dir_state* state,
+                                 struct storage_file_list_resp* last_item) {
+    struct storage_msg msg = {.cmd = STORAGE_FILE_LIST_PREFIX};
+    struct storage_file_list_prefix_req req = {
+            .flags = last_item->flags,
+            .prefix_len = state->prefix_len,
+    };
+    struct iovec tx[4] = {
+            {&msg, sizeof(msg)},
+            {&req, sizeof(req)},
+            {state->prefix, state->prefix_len},
+    };
+    uint32_t tx_count = 3;
+    struct iovec rx[2] = {{&msg, sizeof(msg)},
+                          {state->buf, sizeof(state->buf)}};
+    ssize_t rc;
+
+    if (last_item->flags != STORAGE_FILE_LIST_START) {
+        tx[3].iov_base = last_item->name;
+        tx[3].iov_len = strlen(last_item->name);
+        tx_count = 4;
+    }
+
+    rc = send_reqv(session, tx, tx_count, rx, 2);
+    return storage_check_response(&msg, rc);
+}
+
 static int storage_read_dir_send_message(storage_session_t session,
                                          struct storage_open_dir_state* state) {
     struct storage_file_list_resp* last_item =
@@ -391,16 +1121,26 @@ static int storage_read_dir_send_message(storage_session_t session,
     uint32_t tx_count = 2;
     struct iovec rx[2] = {{&msg, sizeof(msg)},
                           {state->buf, sizeof(state->buf)}};
-    ssize_t rc;
+    int64_t start = storage_stats_start();
+    ssize_t rc = ERR_NOT_IMPLEMENTED;
 
-    if (last_item->flags != STORAGE_FILE_LIST_START) {
-        tx[2].iov_base = last_item->name;
-        tx[2].iov_len = strlen(last_item->name);
-        tx_count = 3;
+    if (state->prefix_len && !state->prefix_unsupported) {
+        rc = _send_list_prefix(session, state, last_item);
+        /* older servers only list everything, filter on this side instead */
+        state->prefix_unsupported = rc == ERR_NOT_IMPLEMENTED;
     }
 
-    rc = send_reqv(session, tx, tx_count, rx, 2);
-    rc = check_response(&msg, rc);
+    if (rc == ERR_NOT_IMPLEMENTED) {
+        if (last_item->flags != STORAGE_FILE_LIST_START) {
+            tx[2].iov_base = last_item->name;
+            tx[2].iov_len = strlen(last_item->name);
+            tx_count = 3;
+        }
+
+        rc = send_reqv(session, tx, tx_count, rx, 2);
+        rc = storage_check_response(&msg, rc);
+    }
+    storage_stats_record(STORAGE_STATS_OP_LIST, start, rc);
 
     state->buf_size = (rc > 0) ? rc : 0;
     state->buf_last_read = 0;
@@ -412,56 +1152,127 @@ static int storage_read_dir_send_message(storage_session_t session,
     return 0;
 }
 
-int storage_read_dir(storage_session_t session,
-                     struct storage_open_dir_state* state,
-                     uint8_t* flags,
-                     char* name,
-                     size_t name_out_size) {
+/*
+ * Find the next listed item whose name starts with the prefix of @state, or
+ * the final STORAGE_FILE_LIST_END item, fetching more items from the server
+ * as needed. The item is not consumed.
+ */
+static int _peek_dir_item(storage_session_t session,
+                          struct storage_open_dir_state* state,
+                          struct storage_file_list_resp** item_p,
+                          size_t* name_size_p) {
     int ret;
     size_t rem;
     size_t name_size;
     struct storage_file_list_resp* item;
 
-    if (state->buf_size == 0) {
-        return ERR_IO;
-    }
+    for (;;) {
+        if (state->buf_size == 0) {
+            return ERR_IO;
+        }
 
-    if (state->buf_read >= state->buf_size) {
-        ret = storage_read_dir_send_message(session, state);
-        if (ret) {
-            return ret;
+        if (state->buf_read >= state->buf_size) {
+            ret = storage_read_dir_send_message(session, state);
+            if (ret) {
+                return ret;
+            }
         }
-    }
-    rem = state->buf_size - state->buf_read;
-    if (rem < sizeof(*item)) {
-        TLOGE("got short response\n");
-        return ERR_IO;
-    }
-    item = (void*)(state->buf + state->buf_read);
-    rem -= sizeof(*item);
+        rem = state->buf_size - state->buf_read;
+        if (rem < sizeof(*item)) {
+            TLOGE("got short response\n");
+            return ERR_IO;
+        }
+        item = (void*)(state->buf + state->buf_read);
+        rem -= sizeof(*item);
 
-    *flags = item->flags;
-    if ((item->flags & STORAGE_FILE_LIST_STATE_MASK) == STORAGE_FILE_LIST_END) {
-        state->buf_size = 0;
-        name_size = 0;
-    } else {
+        if ((item->flags & STORAGE_FILE_LIST_STATE_MASK) ==
+            STORAGE_FILE_LIST_END) {
+            name_size = 0;
+            break;
+        }
         name_size = strnlen(item->name, rem) + 1;
         if (name_size > rem) {
             TLOGE("got invalid filename size %zd >= %zd\n", name_size, rem);
             return ERR_IO;
         }
-        if (name_size >= name_out_size) {
-            return ERR_NOT_ENOUGH_BUFFER;
+        if (!strncmp(item->name, state->prefix, state->prefix_len)) {
+            break;
         }
-        strcpy(name, item->name);
+
+        state->buf_last_read = state->buf_read;
+        state->buf_read += sizeof(*item) + name_size;
     }
 
+    *item_p = item;
+    *name_size_p = name_size;
+    return 0;
+}
+
+static void _consume_dir_item(struct storage_open_dir_state* state,
+                              struct storage_file_list_resp* item,
+                              size_t name_size) {
+    if ((item->flags & STORAGE_FILE_LIST_STATE_MASK) == STORAGE_FILE_LIST_END) {
+        state->buf_size = 0;
+    }
     state->buf_last_read = state->buf_read;
     state->buf_read += sizeof(*item) + name_size;
+}
+
+int storage_read_dir(storage_session_t session,
+                     struct storage_open_dir_state* state,
+                     uint8_t* flags,
+                     char* name,
+                     size_t name_out_size) {
+    int ret;
+    size_t name_size;
+    struct storage_file_list_resp* item;
+
+    ret = _peek_dir_item(session, state, &item, &name_size);
+    if (ret) {
+        return ret;
+    }
+
+    *flags = item->flags;
+    if (name_size) {
+        if (name_size >= name_out_size) {
+            return ERR_NOT_ENOUGH_BUFFER;
+        }
+        strcpy(name, item->name);
+    }
 
+    _consume_dir_item(state, item, name_size);
     return 0;
 }
 
+int storage_read_dir_entries(storage_session_t session,
+                             struct storage_open_dir_state* state,
+                             struct storage_dir_entry* entries,
+                             size_t max_entries) {
+    int ret;
+    size_t count = 0;
+    size_t name_size;
+    struct storage_file_list_resp* item;
+
+    while (count < max_entries && state->buf_size) {
+        ret = _peek_dir_item(session, state, &item, &name_size);
+        if (ret) {
+            return ret;
+        }
+        if (!name_size) {
+            _consume_dir_item(state, item, name_size);
+            break;
+        }
+        if (name_size > sizeof(entries[count].name)) {
+            return ERR_NOT_ENOUGH_BUFFER;
+        }
+        entries[count].flags = item->flags;
+        memcpy(entries[count].name, item->name, name_size);
+        count++;
+        _consume_dir_item(state, item, name_size);
+    }
+    return count;
+}
+
 static ssize_t _read_chunk(file_handle_t fh,
                            storage_off_t off,
                            void* buf,
@@ -482,13 +1293,80 @@ static ssize_t _read_chunk(file_handle_t fh,
     };
 
     ssize_t rc = send_reqv(_to_session(fh), tx, 2, rx, 2);
-    return check_response(&msg, rc);
+    return storage_check_response(&msg, rc);
 }
 
-ssize_t storage_read(file_handle_t fh,
-                     storage_off_t off,
-                     void* buf,
-                     size_t size) {
+/*
+ * Number of caller buffers mapped onto the iovecs of a single request or
+ * response read, which are kept on the stack.
+ */
+#define STORAGE_MSG_MAX_IOV 8
+
+/*
+ * Fill @out with the parts of @iov, starting @pos bytes into @iov[*@idx_p],
+ * that make up the next request of at most @max bytes, and advance the
+ * position past them.
+ *
+ * Return: the number of iovecs stored in @out.
+ */
+static size_t _iov_slice(const struct iovec* iov,
+                         size_t iovcnt,
+                         size_t* idx_p,
+                         size_t* pos_p,
+                         struct iovec* out,
+                         size_t max) {
+    size_t count = 0;
+    size_t len;
+
+    while (*idx_p < iovcnt && max && count < STORAGE_MSG_MAX_IOV) {
+        len = MIN(iov[*idx_p].iov_len - *pos_p, max);
+        if (len) {
+            out[count].iov_base = (uint8_t*)iov[*idx_p].iov_base + *pos_p;
+            out[count].iov_len = len;
+            count++;
+            max -= len;
+        }
+        *pos_p += len;
+        if (*pos_p == iov[*idx_p].iov_len) {
+            (*idx_p)++;
+            *pos_p = 0;
+        }
+    }
+    return count;
+}
+
+static size_t _iov_total(const struct iovec* iov, size_t iovcnt) {
+    size_t total = 0;
+
+    for (size_t i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/*
+ * Find the position @bytes into @iov, as used by _iov_slice(), and store it in
+ * @idx_p and @pos_p.
+ */
+static void _iov_seek(const struct iovec* iov,
+                      size_t iovcnt,
+                      size_t bytes,
+                      size_t* idx_p,
+                      size_t* pos_p) {
+    size_t idx = 0;
+
+    while (idx < iovcnt && bytes >= iov[idx].iov_len) {
+        bytes -= iov[idx].iov_len;
+        idx++;
+    }
+    *idx_p = idx;
+    *pos_p = idx < iovcnt ? bytes : 0;
+}
+
+static ssize_t _read_serial(file_handle_t fh,
+                            storage_off_t off,
+                            void* buf,
+                            size_t size) {
     ssize_t rc;
     size_t bytes_read = 0;
     size_t chunk = MAX_CHUNK_SIZE;
@@ -510,6 +1388,338 @@ ssize_t storage_read(file_handle_t fh,
     return bytes_read;
 }
 
+static inline size_t _chunk_size(size_t size, uint32_t idx) {
+    return MIN(size - (size_t)idx * MAX_CHUNK_SIZE, (size_t)MAX_CHUNK_SIZE);
+}
+
+/*
+ * Send a read request for chunk @idx of a pipelined read without waiting for
+ * the response. The chunk index is carried in @op_id so the response can be
+ * matched to the offset it was requested for. If @may_block is false and the
+ * server's queue is full, ERR_NOT_ENOUGH_BUFFER is returned and the caller is
+ * expected to collect an outstanding response first.
+ */
+static int _send_read_req(file_handle_t fh,
+                          uint32_t idx,
+                          storage_off_t off,
+                          size_t size,
+                          bool may_block) {
+    struct storage_msg msg = {
+            .cmd = STORAGE_FILE_READ,
+            .op_id = idx,
+    };
+    struct storage_file_read_req req = {
+            .handle = _to_handle(fh),
+            .size = _chunk_size(size, idx),
+            .offset = off + (storage_off_t)idx * MAX_CHUNK_SIZE,
+    };
+    struct iovec tx[2] = {
+            {&msg, sizeof(msg)},
+            {&req, sizeof(req)},
+    };
+    struct ipc_msg tx_msg = {
+            .iov = tx,
+            .num_iov = 2,
+    };
+
+    int rc = send_msg(_to_session(fh), &tx_msg);
+    if (rc == ERR_NOT_ENOUGH_BUFFER && may_block) {
+        rc = wait_to_send(_to_session(fh), &tx_msg);
+    }
+    return rc < 0 ? rc : NO_ERROR;
+}
+
+/**
+ * struct storage_read_dst - destination of a pipelined read
+ * @iov:    the caller's buffers
+ * @iovcnt: number of entries in @iov
+ * @size:   number of bytes to read
+ */
+struct storage_read_dst {
+    const struct iovec* iov;
+    size_t iovcnt;
+    size_t size;
+};
+
+/*
+ * Receive one response of a pipelined read. The header is read first to find
+ * out which chunk it belongs to, then the payload is read straight into that
+ * chunk's part of @dst.
+ *
+ * Return: NO_ERROR if a response was received, in which case the chunk index
+ * is stored in @idx_p and the server's result for it (bytes read or error
+ * code) in @result_p. A malformed response is consumed as well and reported
+ * with @result_p set to ERR_IO, and @idx_p set to @last if the chunk it
+ * belongs to is unknown. An error code < 0 is returned if no response could
+ * be received because the channel failed.
+ */
+static int _get_read_resp(storage_session_t session,
+                          uint32_t first,
+                          uint32_t last,
+                          const struct storage_read_dst* dst,
+                          uint32_t* idx_p,
+                          ssize_t* result_p) {
+    uevent_t ev;
+    struct ipc_msg_info mi;
+    struct storage_msg msg;
+    struct iovec data[STORAGE_MSG_MAX_IOV];
+    struct iovec iov = {&msg, sizeof(msg)};
+    struct ipc_msg rx_msg = {
+            .iov = &iov,
+            .num_iov = 1,
+    };
+    size_t data_len;
+    size_t done;
+    size_t idx;
+    size_t pos;
+    ssize_t rc;
+
+    *idx_p = last;
+    *result_p = ERR_IO;
+
+    /* a send-unblocked event for an earlier request is not a response */
+    do {
+        rc = wait_infinite_logged(session, &ev, __func__);
+        if (rc != NO_ERROR) {
+            TLOGE("%s: interrupted waiting for response", __func__);
+            return rc;
+        }
+    } while (!(ev.event & (IPC_HANDLE_POLL_MSG | IPC_HANDLE_POLL_HUP)));
+
+    rc = get_msg(session, &mi);
+    if (rc != NO_ERROR) {
+        TLOGE("%s: failed to get_msg (%d)\n", __func__, (int)rc);
+        return rc;
+    }
+
+    rc = read_msg(session, mi.id, 0, &rx_msg);
+    if (rc < 0) {
+        TLOGE("%s: failed to read msg (%d)\n", __func__, (int)rc);
+        goto out;
+    }
+    if ((size_t)rc != sizeof(msg)) {
+        TLOGE("%s: invalid msg length (%zd < %zd)\n", __func__,
+              (size_t)mi.len, sizeof(msg));
+        goto out;
+    }
+    if (msg.op_id < first || msg.op_id >= last) {
+        TLOGE("%s: unexpected response for chunk %u (expected %u..%u)\n",
+              __func__, msg.op_id, first, last - 1);
+        goto out;
+    }
+    *idx_p = msg.op_id;
+
+    data_len = mi.len - sizeof(msg);
+    if (data_len > _chunk_size(dst->size, msg.op_id)) {
+        TLOGE("%s: response too long (%zd > %zd)\n", __func__, data_len,
+              _chunk_size(dst->size, msg.op_id));
+        goto out;
+    }
+
+    /* the chunk may span more caller buffers than fit in one read */
+    _iov_seek(dst->iov, dst->iovcnt, (size_t)msg.op_id * MAX_CHUNK_SIZE, &idx,
+              &pos);
+    rx_msg.iov = data;
+    for (done = 0; done < data_len; done += rc) {
+        rx_msg.num_iov = _iov_slice(dst->iov, dst->iovcnt, &idx, &pos, data,
+                                    data_len - done);
+        rc = read_msg(session, mi.id, sizeof(msg) + done, &rx_msg);
+        if (rc < 0) {
+            TLOGE("%s: failed to read msg (%d)\n", __func__, (int)rc);
+            goto out;
+        }
+        if ((size_t)rc != _iov_total(data, rx_msg.num_iov)) {
+            TLOGE("%s: partial message read (%zd vs. %zd)\n", __func__,
+                  (size_t)rc, _iov_total(data, rx_msg.num_iov));
+            goto out;
+        }
+    }
+    *result_p = storage_check_response(&msg, mi.len);
+
+out:
+    put_msg(session, mi.id);
+    return NO_ERROR;
+}
+
+/*
+ * Read @size bytes into @iov with up to STORAGE_READ_QUEUE_DEPTH chunk
+ * requests in flight. Requests are only issued while the server's queue has
+ * room, and chunks are retired in offset order as their responses arrive. The
+ * read stops at the first chunk that comes back short, and whatever the
+ * requests in flight past it returned is discarded, so fewer bytes than
+ * requested may be returned even if the file extends further.
+ *
+ * Every request that was sent has its response collected before returning,
+ * even after an error, so the next request on the session does not pick up a
+ * stale response.
+ *
+ * Return: the number of bytes read, or an error code < 0.
+ */
+static ssize_t _read_pipelined(file_handle_t fh,
+                               storage_off_t off,
+                               const struct iovec* iov,
+                               size_t iovcnt,
+                               size_t size) {
+    const struct storage_read_dst dst = {
+            .iov = iov,
+            .iovcnt = iovcnt,
+            .size = size,
+    };
+    ssize_t res[STORAGE_READ_QUEUE_DEPTH];
+    bool done[STORAGE_READ_QUEUE_DEPTH];
+    uint32_t chunk_count = (size + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE;
+    uint32_t head = 0; /* oldest chunk that has not been retired */
+    uint32_t next = 0; /* next chunk to request */
+    uint32_t in_flight = 0; /* requests without a response */
+    uint32_t idx;
+    size_t bytes_read = 0;
+    ssize_t err = 0;
+    bool short_read = false;
+    ssize_t result;
+    ssize_t rc;
+
+    for (;;) {
+        while (!err && !short_read && next < chunk_count &&
+               next - head < STORAGE_READ_QUEUE_DEPTH) {
+            rc = _send_read_req(fh, next, off, size, !in_flight);
+            if (rc == ERR_NOT_ENOUGH_BUFFER) {
+                break;
+            }
+            if (rc < 0) {
+                TLOGE("%s: failed (%d) to send_msg\n", __func__, (int)rc);
+                err = rc;
+                break;
+            }
+            done[next % STORAGE_READ_QUEUE_DEPTH] = false;
+            next++;
+            in_flight++;
+        }
+
+        if (!in_flight) {
+            break;
+        }
+
+        rc = _get_read_resp(_to_session(fh), head, next, &dst, &idx, &result);
+        if (rc < 0) {
+            /* the channel failed, no more responses will arrive on it */
+            return rc;
+        }
+        in_flight--;
+        if (idx == next) {
+            /* malformed response, the chunk it was for never completes */
+            if (!err) {
+                err = result;
+            }
+            continue;
+        }
+        res[idx % STORAGE_READ_QUEUE_DEPTH] = result;
+        done[idx % STORAGE_READ_QUEUE_DEPTH] = true;
+
+        /* anything after an error or a short chunk is discarded */
+        while (head < next && done[head % STORAGE_READ_QUEUE_DEPTH]) {
+            idx = head++;
+            rc = res[idx % STORAGE_READ_QUEUE_DEPTH];
+            if (err || short_read) {
+                continue;
+            }
+            if (rc < 0) {
+                err = rc;
+            } else {
+                short_read = (size_t)rc != _chunk_size(size, idx);
+                bytes_read += rc;
+            }
+        }
+    }
+
+    if (err) {
+        return err;
+    }
+    return bytes_read;
+}
+
+/*
+ * Read through the session's shared memory region, copying each part the
+ * server has read into the region out to @buf before requesting the next one.
+ */
+static ssize_t _read_shm(file_handle_t fh,
+                         struct storage_session_state* state,
+                         storage_off_t off,
+                         void* buf,
+                         size_t size) {
+    struct storage_msg msg;
+    struct storage_file_read_shm_req req = {.handle = _to_handle(fh)};
+    struct storage_file_read_shm_resp rsp;
+    struct iovec tx[2] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}};
+    struct iovec rx[2] = {{&msg, sizeof(msg)}, {&rsp, sizeof(rsp)}};
+    size_t bytes_read = 0;
+    uint8_t* ptr = buf;
+    ssize_t rc;
+
+    while (size) {
+        msg = (struct storage_msg){.cmd = STORAGE_FILE_READ_SHM};
+        req.offset = off;
+        req.size = MIN(size, state->shm_size);
+
+        rc = send_reqv(_to_session(fh), tx, 2, rx, 2);
+        rc = storage_check_response(&msg, rc);
+        if (rc < 0)
+            return rc;
+        if ((size_t)rc != sizeof(rsp) || rsp.size > req.size) {
+            TLOGE("%s: invalid response (%zd, %u > %u)\n", __func__,
+                  (size_t)rc, rsp.size, req.size);
+            return ERR_IO;
+        }
+        if (rsp.size == 0)
+            break;
+
+        memcpy(ptr, state->shm_base, rsp.size);
+        off += rsp.size;
+        ptr += rsp.size;
+        bytes_read += rsp.size;
+        size -= rsp.size;
+    }
+    return bytes_read;
+}
+
+ssize_t storage_read_direct(file_handle_t fh,
+                            storage_off_t off,
+                            void* buf,
+                            size_t size) {
+    struct storage_session_state* state;
+
+    if (size >= STORAGE_SHM_THRESHOLD) {
+        state = _get_shm(_to_session(fh));
+        if (state) {
+            return _read_shm(fh, state, off, buf, size);
+        }
+    }
+    if (STORAGE_READ_QUEUE_DEPTH > 1 && size > MAX_CHUNK_SIZE) {
+        return _read_pipelined(fh, off, &(struct iovec){buf, size}, 1, size);
+    }
+    return _read_serial(fh, off, buf, size);
+}
+
+ssize_t storage_read(file_handle_t fh,
+                     storage_off_t off,
+                     void* buf,
+                     size_t size) {
+    struct storage_cache* cache = _get_cache(_to_session(fh));
+    int64_t start = storage_stats_start();
+    ssize_t rc;
+
+    /* another handle may have buffered writes to the same file */
+    rc = storage_wb_flush_all(_get_wb(_to_session(fh)), 0);
+    if (rc >= 0) {
+        if (cache) {
+            rc = storage_cache_read(cache, fh, off, buf, size);
+        } else {
+            rc = storage_read_direct(fh, off, buf, size);
+        }
+    }
+    storage_stats_record(STORAGE_STATS_OP_READ, start, rc);
+    return rc;
+}
+
 static ssize_t _write_req(file_handle_t fh,
                           storage_off_t off,
                           const void* buf,
@@ -528,40 +1738,399 @@ static ssize_t _write_req(file_handle_t fh,
     struct iovec rx[1] = {{&msg, sizeof(msg)}};
 
     ssize_t rc = send_reqv(_to_session(fh), tx, 3, rx, 1);
-    rc = check_response(&msg, rc);
+    rc = storage_check_response(&msg, rc);
     return rc < 0 ? rc : (ssize_t)size;
 }
 
+/*
+ * Send chunk @idx of a batched write, made up of the @count buffers in @data,
+ * to @off without waiting for a response. The chunk index is carried in
+ * @op_id so responses can be matched to their chunk.
+ */
+static int _send_write_chunk(file_handle_t fh,
+                             storage_off_t off,
+                             const struct iovec* data,
+                             size_t count,
+                             uint32_t idx,
+                             uint32_t msg_flags) {
+    struct storage_msg msg = {
+            .cmd = STORAGE_FILE_WRITE,
+            .op_id = idx,
+            .flags = msg_flags,
+    };
+    struct storage_file_write_req req = {
+            .handle = _to_handle(fh),
+            .offset = off,
+    };
+    struct iovec tx[2 + STORAGE_MSG_MAX_IOV] = {
+            {&msg, sizeof(msg)},
+            {&req, sizeof(req)},
+    };
+    struct ipc_msg tx_msg = {
+            .iov = tx,
+            .num_iov = 2 + count,
+    };
+
+    memcpy(&tx[2], data, count * sizeof(*data));
+
+    ssize_t rc = send_msg(_to_session(fh), &tx_msg);
+    return rc < 0 ? (int)rc : NO_ERROR;
+}
+
+/*
+ * Receive one response of a batched write.
+ *
+ * Return: NO_ERROR if a response was received, in which case the chunk index
+ * is stored in @idx_p and the server's result in @result_p, or an error code
+ * < 0 if no response could be received.
+ */
+static int _get_write_resp(storage_session_t session,
+                           uint32_t sent,
+                           uint32_t* idx_p,
+                           ssize_t* result_p) {
+    struct storage_msg msg;
+    struct iovec rx = {&msg, sizeof(msg)};
+
+    ssize_t rc = get_response(session, &rx, 1, NULL);
+    if (rc < 0) {
+        return rc;
+    }
+    if (msg.op_id >= sent) {
+        TLOGE("%s: unexpected response for chunk %u (sent %u)\n", __func__,
+              msg.op_id, sent);
+        return ERR_IO;
+    }
+
+    *idx_p = msg.op_id;
+    *result_p = storage_check_response(&msg, rc);
+    return NO_ERROR;
+}
+
+/*
+ * Number of chunks in flight to a server that has not shown yet whether it
+ * supports batched writes, see _write_batched().
+ */
+#define WRITE_PROBE_CHUNKS MIN(2, STORAGE_QUEUE_DEPTH)
+
+/*
+ * Number of chunks a write of @iov is split into, each of at most
+ * MAX_CHUNK_SIZE bytes and STORAGE_MSG_MAX_IOV buffers.
+ */
+static uint32_t _iov_chunk_count(const struct iovec* iov, size_t iovcnt) {
+    struct iovec data[STORAGE_MSG_MAX_IOV];
+    uint32_t count = 0;
+    size_t idx = 0;
+    size_t pos = 0;
+
+    while (_iov_slice(iov, iovcnt, &idx, &pos, data, MAX_CHUNK_SIZE)) {
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Stream all chunks of a write and collect a single cumulative result.
+ *
+ * Every chunk but the last of a batch is sent with STORAGE_MSG_FLAG_BATCH, so
+ * a server that supports batching on client ports only answers the last one.
+ * Servers that predate this answer every chunk, and their responses must not
+ * overflow the receive queue. Until the server of a session has shown which
+ * kind it is, chunks are therefore sent in batches of WRITE_PROBE_CHUNKS, each
+ * of which is answered before the next one is sent. A response to a chunk
+ * sent with STORAGE_MSG_FLAG_BATCH means the server answers every chunk, and
+ * no more than STORAGE_QUEUE_DEPTH chunks are then left unacknowledged. A
+ * single response to a batch of several chunks means it supports batching,
+ * and the remaining chunks are streamed as a single batch.
+ *
+ * The @size bytes of @iov are sent in order, so a chunk may span several
+ * caller buffers.
+ */
+static ssize_t _write_batched(file_handle_t fh,
+                              storage_off_t off,
+                              const struct iovec* iov,
+                              size_t iovcnt,
+                              size_t size,
+                              uint32_t opflags) {
+    storage_session_t session = _to_session(fh);
+    struct storage_session_state* state = _get_session(session);
+    enum storage_batching batching =
+            state ? state->batching : STORAGE_BATCHING_UNKNOWN;
+    struct iovec data[STORAGE_MSG_MAX_IOV];
+    size_t iov_idx = 0; /* position in @iov of the next chunk */
+    size_t iov_pos = 0;
+    size_t sent = 0; /* bytes sent so far */
+    size_t slice_idx;
+    size_t slice_pos;
+    size_t count;
+    uint32_t last = _iov_chunk_count(iov, iovcnt) - 1;
+    uint32_t next = 0;         /* next chunk to send */
+    uint32_t acked = 0;        /* chunks up to here have been answered */
+    uint32_t batch_end = last; /* last chunk of the current batch */
+    uint32_t msg_flags;
+    ssize_t err = 0;
+    ssize_t result;
+    uint32_t idx;
+    uevent_t ev;
+    int rc;
+
+    for (;;) {
+        if (batching == STORAGE_BATCHING_UNKNOWN && next == acked) {
+            batch_end = MIN(next + WRITE_PROBE_CHUNKS - 1, last);
+        }
+        if (!err && next <= batch_end &&
+            (batching != STORAGE_BATCHING_UNSUPPORTED ||
+             next - acked < STORAGE_QUEUE_DEPTH)) {
+            if (next == last) {
+                msg_flags = _to_msg_flags(opflags);
+            } else if (next == batch_end) {
+                msg_flags = 0;
+            } else {
+                msg_flags = STORAGE_MSG_FLAG_BATCH;
+            }
+            slice_idx = iov_idx;
+            slice_pos = iov_pos;
+            count = _iov_slice(iov, iovcnt, &slice_idx, &slice_pos, data,
+                               MAX_CHUNK_SIZE);
+            rc = _send_write_chunk(fh, off + sent, data, count, next,
+                                   msg_flags);
+            if (rc == NO_ERROR) {
+                iov_idx = slice_idx;
+                iov_pos = slice_pos;
+                sent += _iov_total(data, count);
+                next++;
+                /* pick up any response that is already waiting */
+                rc = wait(session, &ev, 0);
+                if (rc == ERR_TIMED_OUT) {
+                    continue;
+                }
+            } else if (rc == ERR_NOT_ENOUGH_BUFFER) {
+                rc = wait_infinite_logged(session, &ev, __func__);
+            }
+        } else {
+            rc = wait_infinite_logged(session, &ev, __func__);
+        }
+        if (rc < 0) {
+            TLOGE("%s: failed (%d) to send chunk %u\n", __func__, rc, next);
+            return rc;
+        }
+
+        if (ev.event & IPC_HANDLE_POLL_MSG) {
+            rc = _get_write_resp(session, next, &idx, &result);
+            if (rc < 0) {
+                return rc;
+            }
+            if (result < 0 && !err) {
+                err = result;
+            }
+            if (batching == STORAGE_BATCHING_UNKNOWN && idx < batch_end) {
+                batching = STORAGE_BATCHING_UNSUPPORTED;
+            } else if (batching == STORAGE_BATCHING_UNKNOWN && idx > acked) {
+                batching = STORAGE_BATCHING_SUPPORTED;
+            }
+            if (batching != STORAGE_BATCHING_UNKNOWN) {
+                batch_end = last;
+                if (state) {
+                    state->batching = batching;
+                }
+            }
+            if (idx == last) {
+                break;
+            }
+            acked = idx + 1;
+            if (err && acked == next) {
+                /* chunks after a failed one are never sent */
+                break;
+            }
+        } else if (ev.event & IPC_HANDLE_POLL_HUP) {
+            return ERR_CHANNEL_CLOSED;
+        }
+    }
+
+    return err ? err : (ssize_t)size;
+}
+
+/*
+ * Write through the session's shared memory region, copying one part of @buf
+ * into the region per request. Only the request carrying the last byte of the
+ * write commits the transaction if asked to.
+ */
+static ssize_t _write_shm(file_handle_t fh,
+                          struct storage_session_state* state,
+                          storage_off_t off,
+                          const void* buf,
+                          size_t size,
+                          uint32_t opflags) {
+    struct storage_msg msg;
+    struct storage_file_write_shm_req req = {.handle = _to_handle(fh)};
+    struct iovec tx[2] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}};
+    struct iovec rx[1] = {{&msg, sizeof(msg)}};
+    size_t bytes_written = 0;
+    const uint8_t* ptr = buf;
+    uint32_t flags;
+    ssize_t rc;
+
+    while (size) {
+        req.offset = off;
+        req.size = MIN(size, state->shm_size);
+        flags = req.size == size ? opflags : opflags & ~STORAGE_OP_COMPLETE;
+        msg = (struct storage_msg){
+                .cmd = STORAGE_FILE_WRITE_SHM,
+                .flags = _to_msg_flags(flags),
+        };
+        memcpy(state->shm_base, ptr, req.size);
+
+        rc = send_reqv(_to_session(fh), tx, 2, rx, 1);
+        rc = storage_check_response(&msg, rc);
+        if (rc < 0)
+            return rc;
+
+        off += req.size;
+        ptr += req.size;
+        bytes_written += req.size;
+        size -= req.size;
+    }
+    return bytes_written;
+}
+
+static ssize_t _write(file_handle_t fh,
+                      storage_off_t off,
+                      const void* buf,
+                      size_t size,
+                      uint32_t opflags) {
+    struct storage_session_state* state;
+    ssize_t rc;
+
+    if (size >= STORAGE_SHM_THRESHOLD) {
+        state = _get_shm(_to_session(fh));
+        if (state) {
+            return _write_shm(fh, state, off, buf, size, opflags);
+        }
+    }
+
+    if (size > MAX_CHUNK_SIZE) {
+        return _write_batched(fh, off, &(struct iovec){(void*)buf, size}, 1,
+                              size, opflags);
+    }
+    if (!size) {
+        return 0;
+    }
+
+    rc = _write_req(fh, off, buf, size, _to_msg_flags(opflags));
+    if (rc >= 0 && (size_t)rc != size) {
+        TLOGE("got partial write (%d)\n", (int)rc);
+        return ERR_IO;
+    }
+    return rc;
+}
+
+ssize_t storage_write_direct(file_handle_t fh,
+                             storage_off_t off,
+                             const void* buf,
+                             size_t size,
+                             uint32_t opflags) {
+    struct storage_cache* cache = _get_cache(_to_session(fh));
+
+    storage_cache_invalidate_range(cache, fh, off, size);
+    ssize_t rc = _write(fh, off, buf, size, opflags);
+    if (rc < 0) {
+        /* a failed commit discards earlier changes that may be cached */
+        storage_cache_clear(cache);
+    }
+    return rc;
+}
+
+static inline enum storage_stats_op _write_stats_op(uint32_t opflags) {
+    return (opflags & STORAGE_OP_COMPLETE) ? STORAGE_STATS_OP_COMMIT
+                                           : STORAGE_STATS_OP_WRITE;
+}
+
 ssize_t storage_write(file_handle_t fh,
                       storage_off_t off,
                       const void* buf,
                       size_t size,
                       uint32_t opflags) {
+    struct storage_write_back* wb = _get_wb(_to_session(fh));
+    int64_t start = storage_stats_start();
     ssize_t rc;
-    size_t bytes_written = 0;
-    size_t chunk = MAX_CHUNK_SIZE;
-    const uint8_t* ptr = buf;
-    uint32_t msg_flags = _to_msg_flags(opflags & ~STORAGE_OP_COMPLETE);
 
-    while (size) {
-        if (chunk >= size) {
-            /* last chunk in sequence */
-            chunk = size;
-            msg_flags = _to_msg_flags(opflags);
+    if (!wb) {
+        rc = storage_write_direct(fh, off, buf, size, opflags);
+    } else {
+        rc = storage_wb_add(wb, fh, off, buf, size);
+        if (rc == NO_ERROR && (opflags & STORAGE_OP_COMPLETE)) {
+            rc = storage_wb_flush_all(wb, opflags);
         }
-        rc = _write_req(fh, off, ptr, chunk, msg_flags);
-        if (rc < 0)
-            return rc;
-        if ((size_t)rc != chunk) {
-            TLOGE("got partial write (%d)\n", (int)rc);
-            return ERR_IO;
+        if (rc >= 0) {
+            rc = size;
         }
-        off += chunk;
-        ptr += chunk;
-        bytes_written += chunk;
-        size -= chunk;
     }
-    return bytes_written;
+    storage_stats_record(_write_stats_op(opflags), start, rc);
+    return rc;
+}
+
+static ssize_t _readv(file_handle_t fh,
+                      storage_off_t off,
+                      const struct iovec* iov,
+                      size_t iovcnt) {
+    size_t total = _iov_total(iov, iovcnt);
+    ssize_t rc;
+
+    rc = storage_wb_flush_all(_get_wb(_to_session(fh)), 0);
+    if (rc < 0)
+        return rc;
+    if (!total)
+        return 0;
+
+    return _read_pipelined(fh, off, iov, iovcnt, total);
+}
+
+ssize_t storage_readv(file_handle_t fh,
+                      storage_off_t off,
+                      const struct iovec* iov,
+                      size_t iovcnt) {
+    int64_t start = storage_stats_start();
+    ssize_t rc = _readv(fh, off, iov, iovcnt);
+
+    storage_stats_record(STORAGE_STATS_OP_READ, start, rc);
+    return rc;
+}
+
+static ssize_t _writev(file_handle_t fh,
+                       storage_off_t off,
+                       const struct iovec* iov,
+                       size_t iovcnt,
+                       uint32_t opflags) {
+    storage_session_t session = _to_session(fh);
+    size_t total = _iov_total(iov, iovcnt);
+    ssize_t rc;
+
+    if (!total)
+        return 0;
+
+    /* keep buffered writes, to any file, ordered before this one */
+    rc = storage_wb_flush_all(_get_wb(session), 0);
+    if (rc < 0)
+        return rc;
+
+    storage_cache_invalidate_range(_get_cache(session), fh, off, total);
+    rc = _write_batched(fh, off, iov, iovcnt, total, opflags);
+    if (rc < 0) {
+        /* a failed commit discards earlier changes that may be cached */
+        storage_cache_clear(_get_cache(session));
+    }
+    return rc;
+}
+
+ssize_t storage_writev(file_handle_t fh,
+                       storage_off_t off,
+                       const struct iovec* iov,
+                       size_t iovcnt,
+                       uint32_t opflags) {
+    int64_t start = storage_stats_start();
+    ssize_t rc = _writev(fh, off, iov, iovcnt, opflags);
+
+    storage_stats_record(_write_stats_op(opflags), start, rc);
+    return rc;
 }
 
 int storage_set_file_size(file_handle_t fh,
@@ -576,8 +2145,23 @@ int storage_set_file_size(file_handle_t fh,
     struct iovec tx[2] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}};
     struct iovec rx[1] = {{&msg, sizeof(msg)}};
 
-    ssize_t rc = send_reqv(_to_session(fh), tx, 2, rx, 1);
-    return (int)check_response(&msg, rc);
+    struct storage_cache* cache = _get_cache(_to_session(fh));
+    struct storage_write_back* wb = _get_wb(_to_session(fh));
+    ssize_t rc;
+
+    /* buffered writes to any file may be part of a commit or this file */
+    rc = storage_wb_flush_all(wb, 0);
+    if (rc < 0)
+        return rc;
+
+    storage_cache_invalidate_file(cache, fh);
+
+    rc = send_reqv(_to_session(fh), tx, 2, rx, 1);
+    rc = storage_check_response(&msg, rc);
+    if (rc < 0) {
+        storage_cache_clear(cache);
+    }
+    return (int)rc;
 }
 
 int storage_get_file_size(file_handle_t fh, storage_off_t* size_p) {
@@ -589,8 +2173,12 @@ int storage_get_file_size(file_handle_t fh, storage_off_t* size_p) {
     struct storage_file_get_size_resp rsp;
     struct iovec rx[2] = {{&msg, sizeof(msg)}, {&rsp, sizeof(rsp)}};
 
-    ssize_t rc = send_reqv(_to_session(fh), tx, 2, rx, 2);
-    rc = check_response(&msg, rc);
+    ssize_t rc = storage_wb_flush_all(_get_wb(_to_session(fh)), 0);
+    if (rc < 0)
+        return rc;
+
+    rc = send_reqv(_to_session(fh), tx, 2, rx, 2);
+    rc = storage_check_response(&msg, rc);
     if (rc < 0)
         return rc;
 
@@ -604,13 +2192,160 @@ int storage_get_file_size(file_handle_t fh, storage_off_t* size_p) {
     return NO_ERROR;
 }
 
-int storage_end_transaction(storage_session_t session, bool complete) {
+/*
+ * Read a whole file into a page-aligned heap buffer, bypassing the read cache
+ * which it would only flush
+ */
+static int _map_file_copy(file_handle_t fh, struct storage_file_map* map) {
+    storage_off_t size;
+    void* buf = NULL;
+    ssize_t rc;
+
+    rc = storage_get_file_size(fh, &size);
+    if (rc < 0)
+        return rc;
+    if (size > SIZE_MAX - PAGE_SIZE)
+        return ERR_TOO_BIG;
+
+    if (size) {
+        buf = memalign(PAGE_SIZE, round_up(size, PAGE_SIZE));
+        if (!buf)
+            return ERR_NO_MEMORY;
+        rc = storage_read_direct(fh, 0, buf, size);
+        if (rc >= 0 && (size_t)rc != size)
+            rc = ERR_IO;
+        if (rc < 0) {
+            free(buf);
+            return rc;
+        }
+    }
+
+    map->addr = buf;
+    map->size = size;
+    map->map_size = 0;
+    return NO_ERROR;
+}
+
+static int _map_file(file_handle_t fh, struct storage_file_map* map) {
+    storage_session_t session = _to_session(fh);
+    struct storage_msg msg = {.cmd = STORAGE_FILE_MAP};
+    struct storage_file_map_req req = {.handle = _to_handle(fh)};
+    struct iovec tx[2] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}};
+    struct storage_file_map_resp rsp;
+    struct iovec rx[2] = {{&msg, sizeof(msg)}, {&rsp, sizeof(rsp)}};
+    struct ipc_msg tx_msg = {
+            .iov = tx,
+            .num_iov = 2,
+    };
+    handle_t memref;
+    size_t map_size;
+    void* addr;
+    ssize_t rc;
+
+    rc = storage_wb_flush_all(_get_wb(session), 0);
+    if (rc < 0)
+        return rc;
+
+    rc = send_msg(session, &tx_msg);
+    if (rc == ERR_NOT_ENOUGH_BUFFER) {
+        rc = wait_to_send(session, &tx_msg);
+    }
+    if (rc < 0) {
+        TLOGE("%s: failed (%d) to send_msg\n", __func__, (int)rc);
+        return rc;
+    }
+
+    rc = get_response(session, rx, 2, &memref);
+    rc = storage_check_response(&msg, rc);
+    if (rc == ERR_NOT_IMPLEMENTED) {
+        rc = _map_file_copy(fh, map);
+        goto out;
+    }
+    if (rc < 0)
+        goto out;
+
+    if ((size_t)rc != sizeof(rsp) || rsp.size > SIZE_MAX - PAGE_SIZE ||
+        (rsp.size && memref == INVALID_IPC_HANDLE)) {
+        TLOGE("%s: invalid response\n", __func__);
+        rc = ERR_IO;
+        goto out;
+    }
+
+    addr = NULL;
+    map_size = 0;
+    if (rsp.size) {
+        map_size = round_up(rsp.size, PAGE_SIZE);
+        addr = mmap(NULL, map_size, PROT_READ, 0, memref, 0);
+        if (addr == MAP_FAILED) {
+            TLOGE("%s: failed to mmap file\n", __func__);
+            rc = ERR_BAD_HANDLE;
+            goto out;
+        }
+    }
+    map->addr = addr;
+    map->size = rsp.size;
+    map->map_size = map_size;
+    rc = NO_ERROR;
+
+out:
+    /* the mapping holds its own reference to the memory */
+    if (memref != INVALID_IPC_HANDLE)
+        close(memref);
+    return rc;
+}
+
+int storage_map_file(file_handle_t fh, struct storage_file_map* map) {
+    int64_t start = storage_stats_start();
+    int rc = _map_file(fh, map);
+
+    storage_stats_record(STORAGE_STATS_OP_READ, start,
+                         rc < 0 ? rc : (ssize_t)map->size);
+    return rc;
+}
+
+void storage_unmap_file(struct storage_file_map* map) {
+    if (map->map_size)
+        munmap((void*)map->addr, map->map_size);
+    else
+        free((void*)map->addr);
+    map->addr = NULL;
+    map->size = 0;
+    map->map_size = 0;
+}
+
+static int _end_transaction(storage_session_t session, bool complete) {
     struct storage_msg msg = {
             .cmd = STORAGE_END_TRANSACTION,
             .flags = complete ? STORAGE_MSG_FLAG_TRANSACT_COMPLETE : 0,
     };
     struct iovec iov = {&msg, sizeof(msg)};
+    ssize_t rc;
+
+    if (complete) {
+        rc = storage_wb_flush_all(_get_wb(session), 0);
+        if (rc < 0)
+            return rc;
+    } else {
+        storage_wb_discard(_get_wb(session));
+    }
 
-    ssize_t rc = send_reqv(session, &iov, 1, &iov, 1);
-    return (int)check_response(&msg, rc);
+    rc = send_reqv(session, &iov, 1, &iov, 1);
+    rc = storage_check_response(&msg, rc);
+    if (!complete || rc < 0) {
+        /* cached blocks may hold changes that were just discarded */
+        storage_cache_clear(_get_cache(session));
+        /* files created by the transaction may be gone */
+        storage_fhc_clear(_get_fhc(session));
+    }
+    return (int)rc;
+}
+
+int storage_end_transaction(storage_session_t session, bool complete) {
+    int64_t start = storage_stats_start();
+    int rc = _end_transaction(session, complete);
+
+    if (complete) {
+        storage_stats_record(STORAGE_STATS_OP_COMMIT, start, MIN(rc, 0));
+    }
+    return rc;
 }
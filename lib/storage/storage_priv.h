@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <lib/storage/stats.h>
+#include <lib/storage/storage.h>
+
+#define MAX_CHUNK_SIZE 4040
+
+/*
+ * Maximum number of chunk requests storage_read() keeps in flight. Responses
+ * to all of them must fit in the receive queue of the session channel, so this
+ * must not exceed the number of message buffers of the storage server's client
+ * ports. Set to 1 to read one chunk per round-trip.
+ */
+#ifndef STORAGE_READ_QUEUE_DEPTH
+#define STORAGE_READ_QUEUE_DEPTH 4
+#endif
+
+/*
+ * Maximum number of other requests, such as the chunks of a storage_write()
+ * to a server that answers each of them, kept in flight while waiting for
+ * their responses. The same limit as for STORAGE_READ_QUEUE_DEPTH applies.
+ */
+#ifndef STORAGE_QUEUE_DEPTH
+#define STORAGE_QUEUE_DEPTH 4
+#endif
+
+/*
+ * Whether to keep statistics of storage operations, which costs reading the
+ * clock twice per operation.
+ */
+#ifndef STORAGE_STATS_ENABLED
+#define STORAGE_STATS_ENABLED 1
+#endif
+
+__BEGIN_CDECLS
+
+static inline file_handle_t make_file_handle(storage_session_t s,
+                                             uint32_t fid) {
+    return ((uint64_t)s << 32) | fid;
+}
+
+static inline storage_session_t _to_session(file_handle_t fh) {
+    return (storage_session_t)(fh >> 32);
+}
+
+static inline uint32_t _to_handle(file_handle_t fh) {
+    return (uint32_t)fh;
+}
+
+/**
+ * storage_check_response() - Check the result of a storage server response
+ * @msg: the response header
+ * @res: number of bytes received for the response, or a negative error code
+ *       if receiving it failed
+ *
+ * Return: the number of payload bytes following @msg if the server reported
+ * success, or a negative error code.
+ */
+ssize_t storage_check_response(struct storage_msg* msg, ssize_t res);
+
+#if STORAGE_STATS_ENABLED
+/**
+ * storage_stats_start() - Get the start time of an operation
+ *
+ * Return: the time to pass to storage_stats_record().
+ */
+int64_t storage_stats_start(void);
+
+/**
+ * storage_stats_record() - Account a completed operation
+ * @op:    the type of operation
+ * @start: the value storage_stats_start() returned before the operation
+ * @rc:    the number of bytes transferred, or an error code < 0 on failure
+ */
+void storage_stats_record(enum storage_stats_op op, int64_t start, ssize_t rc);
+#else
+static inline int64_t storage_stats_start(void) {
+    return 0;
+}
+
+static inline void storage_stats_record(enum storage_stats_op op,
+                                        int64_t start,
+                                        ssize_t rc) {}
+#endif
+
+/**
+ * storage_read_direct() - Read from a file, bypassing the session's cache
+ * @fh:   the file_handle_t retrieved from storage_open_file
+ * @off:  the start offset from whence to read in the file
+ * @buf:  the buffer in which to write the data read
+ * @size: the size of buf and number of bytes to read
+ *
+ * Return: the number of bytes read on success, negative error code on failure
+ */
+ssize_t storage_read_direct(file_handle_t fh,
+                            storage_off_t off,
+                            void* buf,
+                            size_t size);
+
+/**
+ * storage_write_direct() - Write to a file, bypassing write-back buffering
+ * @fh:      the file_handle_t retrieved from storage_open_file
+ * @off:     the start offset from whence to write in the file
+ * @buf:     the buffer containing the data to write
+ * @size:    the size of buf and number of bytes to write
+ * @opflags: a combination of @storage_op_flags
+ *
+ * Return: the number of bytes written on success, negative error code on
+ * failure
+ */
+ssize_t storage_write_direct(file_handle_t fh,
+                             storage_off_t off,
+                             const void* buf,
+                             size_t size,
+                             uint32_t opflags);
+
+struct storage_cache;
+
+/**
+ * storage_cache_create() - Create a read cache
+ * @max_bytes: maximum number of bytes of file data to cache
+ *
+ * Return: the new cache, or %NULL if @max_bytes is too small to hold a single
+ * block or there is not enough memory.
+ */
+struct storage_cache* storage_cache_create(size_t max_bytes);
+
+/**
+ * storage_cache_destroy() - Free a read cache and all blocks it holds
+ * @cache: the cache to free, may be %NULL
+ */
+void storage_cache_destroy(struct storage_cache* cache);
+
+/**
+ * storage_cache_read() - Read from a file through a read cache
+ * @cache: the cache of the session @fh belongs to
+ * @fh:    the file_handle_t retrieved from storage_open_file
+ * @off:   the start offset from whence to read in the file
+ * @buf:   the buffer in which to write the data read
+ * @size:  the size of buf and number of bytes to read
+ *
+ * Return: the number of bytes read on success, negative error code on failure.
+ * If reading from the file fails after some data was copied from the cache,
+ * that data is returned as a short read.
+ */
+ssize_t storage_cache_read(struct storage_cache* cache,
+                           file_handle_t fh,
+                           storage_off_t off,
+                           void* buf,
+                           size_t size);
+
+/**
+ * storage_cache_add() - Add data read from a file to a read cache
+ * @cache: the cache of the session @fh belongs to
+ * @fh:    the file the data was read from
+ * @off:   offset of the data in the file, a multiple of the cache block size
+ * @buf:   the data read
+ * @len:   the number of bytes in @buf
+ * @eof:   whether the read that returned the data hit the end of the file
+ *
+ * Only whole blocks are cached, plus the block holding the end of the file if
+ * @eof is set.
+ */
+void storage_cache_add(struct storage_cache* cache,
+                       file_handle_t fh,
+                       storage_off_t off,
+                       const void* buf,
+                       size_t len,
+                       bool eof);
+
+/**
+ * storage_cache_invalidate_range() - Drop cached data about to be modified
+ * @cache: the cache to update, may be %NULL
+ * @fh:    the file being written to
+ * @off:   start offset of the modified range
+ * @size:  size of the modified range
+ *
+ * Besides all blocks overlapping the range, this drops the block holding the
+ * end of the file, as writing past it changes the file size.
+ */
+void storage_cache_invalidate_range(struct storage_cache* cache,
+                                    file_handle_t fh,
+                                    storage_off_t off,
+                                    size_t size);
+
+/**
+ * storage_cache_invalidate_file() - Drop all cached data of a file
+ * @cache: the cache to update, may be %NULL
+ * @fh:    the file to drop
+ */
+void storage_cache_invalidate_file(struct storage_cache* cache,
+                                   file_handle_t fh);
+
+/**
+ * storage_cache_clear() - Drop all cached data
+ * @cache: the cache to clear, may be %NULL
+ */
+void storage_cache_clear(struct storage_cache* cache);
+
+struct storage_write_back;
+
+/**
+ * storage_wb_create() - Create write-back state for a session
+ * @max_bytes: number of dirty bytes above which all of them are written out
+ *
+ * Return: the new state, or %NULL if there is not enough memory.
+ */
+struct storage_write_back* storage_wb_create(size_t max_bytes);
+
+/**
+ * storage_wb_destroy() - Free write-back state, discarding all dirty data
+ * @wb: the state to free, may be %NULL
+ */
+void storage_wb_destroy(struct storage_write_back* wb);
+
+/**
+ * storage_wb_add() - Buffer a write
+ * @wb:   the write-back state of the session @fh belongs to
+ * @fh:   the file being written to
+ * @off:  the start offset from whence to write in the file
+ * @buf:  the buffer containing the data to write
+ * @size: the size of buf and number of bytes to write
+ *
+ * Return: NO_ERROR on success, or an error code < 0 if the write could not be
+ * buffered or writing out buffered data failed.
+ */
+int storage_wb_add(struct storage_write_back* wb,
+                   file_handle_t fh,
+                   storage_off_t off,
+                   const void* buf,
+                   size_t size);
+
+/**
+ * storage_wb_flush() - Write out the dirty data of a file handle
+ * @wb: the write-back state of the session @fh belongs to, may be %NULL
+ * @fh: the file handle to write out
+ *
+ * Other handles may refer to the same file, so this is only enough before
+ * closing @fh. Operations on the file use storage_wb_flush_all().
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure, in which case
+ * all dirty data of the session has been discarded.
+ */
+int storage_wb_flush(struct storage_write_back* wb, file_handle_t fh);
+
+/**
+ * storage_wb_flush_all() - Write out all dirty data
+ * @wb:      the write-back state to flush, may be %NULL
+ * @opflags: a combination of @storage_op_flags to apply to the last write
+ *
+ * Return: NO_ERROR on success, or an error code < 0 on failure, in which case
+ * all dirty data of the session has been discarded.
+ */
+int storage_wb_flush_all(struct storage_write_back* wb, uint32_t opflags);
+
+/**
+ * storage_wb_discard() - Discard all dirty data
+ * @wb: the write-back state to clear, may be %NULL
+ */
+void storage_wb_discard(struct storage_write_back* wb);
+
+/**
+ * storage_close_file_direct() - Close a file, bypassing the file handle cache
+ * @fh: the file_handle_t retrieved from storage_open_file
+ */
+void storage_close_file_direct(file_handle_t fh);
+
+struct storage_fh_cache;
+
+/**
+ * storage_fhc_create() - Create an open file handle cache
+ * @max_files: number of cached handles above which idle ones are closed
+ *
+ * Return: the new cache, or %NULL if there is not enough memory.
+ */
+struct storage_fh_cache* storage_fhc_create(size_t max_files);
+
+/**
+ * storage_fhc_destroy() - Free a file handle cache without closing its handles
+ * @fhc: the cache to free, may be %NULL
+ */
+void storage_fhc_destroy(struct storage_fh_cache* fhc);
+
+/**
+ * storage_fhc_get() - Look up and take a reference to an open file
+ * @fhc:  the cache of the session to open the file on
+ * @name: the name of the file
+ * @fh_p: pointer to location in which to store the file handle
+ *
+ * Return: NO_ERROR on success, or ERR_NOT_FOUND if @name is not cached.
+ */
+int storage_fhc_get(struct storage_fh_cache* fhc,
+                    const char* name,
+                    file_handle_t* fh_p);
+
+/**
+ * storage_fhc_add() - Cache a file that was just opened
+ * @fhc:  the cache of the session @fh belongs to
+ * @name: the name @fh was opened by
+ * @fh:   the new file handle, referenced by its opener
+ */
+void storage_fhc_add(struct storage_fh_cache* fhc,
+                     const char* name,
+                     file_handle_t fh);
+
+/**
+ * storage_fhc_put() - Drop a reference to a file handle
+ * @fhc: the cache of the session @fh belongs to, may be %NULL
+ * @fh:  the file handle being closed
+ *
+ * Return: %true if @fh is owned by the cache, or %false if the caller must
+ * close it.
+ */
+bool storage_fhc_put(struct storage_fh_cache* fhc, file_handle_t fh);
+
+/**
+ * storage_fhc_forget() - Stop handing out the cached handle of a file
+ * @fhc:  the cache to update, may be %NULL
+ * @name: the name of a file about to be moved, deleted or replaced
+ */
+void storage_fhc_forget(struct storage_fh_cache* fhc, const char* name);
+
+/**
+ * storage_fhc_clear() - Stop handing out all cached handles
+ * @fhc: the cache to clear, may be %NULL
+ *
+ * Idle handles are closed now, the others when their last user closes them.
+ */
+void storage_fhc_clear(struct storage_fh_cache* fhc);
+
+/**
+ * storage_fhc_resize() - Change the number of cached files
+ * @fhc:       the cache to resize
+ * @max_files: number of cached handles above which idle ones are closed, or
+ *             zero to stop caching files
+ *
+ * Idle handles above the new limit are closed now. Handles in use stay with
+ * the cache and are closed when their last user closes them.
+ */
+void storage_fhc_resize(struct storage_fh_cache* fhc, size_t max_files);
+
+/**
+ * storage_fhc_enabled() - Check whether a cache hands out file handles
+ * @fhc: the cache to check, may be %NULL
+ *
+ * Return: %true if @fhc caches files, or %false if it is %NULL or was resized
+ * to zero files.
+ */
+bool storage_fhc_enabled(const struct storage_fh_cache* fhc);
+
+__END_CDECLS
@@ -0,0 +1,1118 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Tests of the storage client library against the in-memory server of the
+ * storage benchmark, and of the libraries built on it.
+ */
+
+#define TLOG_TAG "storage-client-test"
+
+#include <lib/storage/async.h>
+#include <lib/storage/compress.h>
+#include <lib/storage/kv.h>
+#include <lib/storage/stats.h>
+#include <lib/storage/storage.h>
+#include <lib/tipc/tipc.h>
+#include <lib/unittest/unittest.h>
+#include <lk/err_ptr.h>
+#include <lk/macros.h>
+#include <stdio.h>
+#include <string.h>
+#include <trusty_unittest.h>
+#include <uapi/err.h>
+
+#include <storage_fake_consts.h>
+
+#define SHARED_FILE_NAME "storage_client_test.shared"
+#define OTHER_FILE_NAME "storage_client_test.other"
+#define TEST_FILE_NAME "storage_client_test.file"
+
+/* Larger than several read and write chunks of the client library */
+#define TEST_BUF_SIZE (16 * 1024)
+
+static uint8_t test_data[TEST_BUF_SIZE];
+static uint8_t test_buf[TEST_BUF_SIZE];
+
+static void fill_test_data(uint8_t seed) {
+    for (size_t i = 0; i < sizeof(test_data); i++) {
+        test_data[i] = (uint8_t)(i * 7 + seed);
+    }
+}
+
+/* Larger than the shared memory region of a session */
+#define SHM_TEST_SIZE (80 * 1024)
+
+static uint8_t shm_test_buf[SHM_TEST_SIZE];
+
+static uint8_t shm_test_byte(size_t i) {
+    return (uint8_t)(i * 13 + (i >> 10));
+}
+
+/* Number of bytes of shm_test_buf that differ from the file at @off */
+static size_t shm_test_mismatches(size_t off, size_t size) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        count += shm_test_buf[i] != shm_test_byte(off + i);
+    }
+    return count;
+}
+
+typedef struct {
+    storage_session_t session;
+} file_cache_t;
+
+TEST_F_SETUP(file_cache) {
+    int rc;
+
+    rc = storage_open_session(&_state->session, STORAGE_FAKE_PORT);
+    ASSERT_EQ(rc, 0);
+
+test_abort:;
+}
+
+TEST_F_TEARDOWN(file_cache) {
+    storage_delete_file(_state->session, SHARED_FILE_NAME, 0);
+    storage_delete_file(_state->session, OTHER_FILE_NAME, STORAGE_OP_COMPLETE);
+    storage_close_session(_state->session);
+}
+
+/*
+ * Open a file twice through the cache, resize the cache to @max_files and
+ * check that the handle stays open until both openers have closed it.
+ */
+static void resize_with_shared_handle(storage_session_t session,
+                                      size_t max_files) {
+    int rc;
+    file_handle_t first;
+    file_handle_t second;
+    file_handle_t other;
+    const char data[] = "data";
+    char buf[sizeof(data)];
+
+    rc = storage_set_file_cache_size(session, 4);
+    ASSERT_EQ(rc, 0);
+
+    rc = storage_open_file(session, &first, SHARED_FILE_NAME,
+                           STORAGE_FILE_OPEN_CREATE, STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, 0);
+    rc = storage_open_file(session, &second, SHARED_FILE_NAME, 0, 0);
+    ASSERT_EQ(rc, 0);
+    EXPECT_EQ(first, second);
+
+    rc = storage_set_file_cache_size(session, max_files);
+    EXPECT_EQ(rc, 0);
+    storage_close_file(first);
+
+    rc = storage_write(second, 0, data, sizeof(data), STORAGE_OP_COMPLETE);
+    EXPECT_EQ(rc, (int)sizeof(data));
+    rc = storage_read(second, 0, buf, sizeof(buf));
+    EXPECT_EQ(rc, (int)sizeof(buf));
+
+    /* a handle closed twice would close this file on the server */
+    rc = storage_open_file(session, &other, OTHER_FILE_NAME,
+                           STORAGE_FILE_OPEN_CREATE, STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, 0);
+    storage_close_file(second);
+    rc = storage_write(other, 0, data, sizeof(data), STORAGE_OP_COMPLETE);
+    EXPECT_EQ(rc, (int)sizeof(data));
+    storage_close_file(other);
+
+test_abort:;
+}
+
+TEST_F(file_cache, shrink_with_shared_handle) {
+    resize_with_shared_handle(_state->session, 1);
+}
+
+TEST_F(file_cache, disable_with_shared_handle) {
+    resize_with_shared_handle(_state->session, 0);
+}
+
+/* Prefetched files are kept open in the cache, so there is none to fill */
+TEST_F(file_cache, prefetch_disabled) {
+    const char* const names[] = {SHARED_FILE_NAME, OTHER_FILE_NAME};
+    int rc;
+
+    rc = storage_set_file_cache_size(_state->session, 0);
+    ASSERT_EQ(rc, 0);
+    rc = storage_prefetch(_state->session, names, countof(names));
+    EXPECT_EQ(rc, ERR_NOT_SUPPORTED);
+
+    rc = storage_set_file_cache_size(_state->session, 4);
+    ASSERT_EQ(rc, 0);
+    rc = storage_prefetch(_state->session, names, countof(names));
+    EXPECT_EQ(rc, 0);
+
+test_abort:;
+}
+
+typedef struct {
+    storage_session_t session;
+    file_handle_t file;
+} client_file_t;
+
+TEST_F_SETUP(client_file) {
+    int rc;
+
+    rc = storage_open_session(&_state->session, STORAGE_FAKE_PORT);
+    ASSERT_EQ(rc, 0);
+    rc = storage_open_file(_state->session, &_state->file, TEST_FILE_NAME,
+                           STORAGE_FILE_OPEN_CREATE |
+                                   STORAGE_FILE_OPEN_TRUNCATE,
+                           STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, 0);
+
+test_abort:;
+}
+
+TEST_F_TEARDOWN(client_file) {
+    storage_close_file(_state->file);
+    storage_delete_file(_state->session, TEST_FILE_NAME, STORAGE_OP_COMPLETE);
+    storage_close_session(_state->session);
+}
+
+/*
+ * The file ends in the middle of the read requests the client keeps in flight,
+ * so one chunk comes back short and the ones after it come back empty.
+ */
+TEST_F(client_file, read_short_chunk_in_pipeline) {
+    const size_t file_size = 10000;
+    storage_off_t size;
+    int rc;
+
+    fill_test_data(1);
+    rc = storage_write(_state->file, 0, test_data, file_size,
+                       STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, (int)file_size);
+
+    memset(test_buf, 0, sizeof(test_buf));
+    rc = storage_read(_state->file, 0, test_buf, sizeof(test_buf));
+    ASSERT_EQ(rc, (int)file_size);
+    EXPECT_EQ(memcmp(test_buf, test_data, file_size), 0);
+
+    /* no response to the read is left for the next request to pick up */
+    rc = storage_get_file_size(_state->file, &size);
+    ASSERT_EQ(rc, 0);
+    EXPECT_EQ(size, file_size);
+
+    rc = storage_read(_state->file, 100, test_buf, sizeof(test_buf));
+    ASSERT_EQ(rc, (int)file_size - 100);
+    EXPECT_EQ(memcmp(test_buf, test_data + 100, file_size - 100), 0);
+
+test_abort:;
+}
+
+/*
+ * Transfers this large go through the shared memory region of the session and
+ * take more than one request.
+ */
+TEST_F(client_file, shm_write_read) {
+    storage_off_t size;
+    int rc;
+
+    for (size_t i = 0; i < SHM_TEST_SIZE; i++) {
+        shm_test_buf[i] = shm_test_byte(i);
+    }
+    rc = storage_write(_state->file, 0, shm_test_buf, SHM_TEST_SIZE,
+                       STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, SHM_TEST_SIZE);
+    rc = storage_get_file_size(_state->file, &size);
+    ASSERT_EQ(rc, 0);
+    EXPECT_EQ(size, SHM_TEST_SIZE);
+
+    memset(shm_test_buf, 0, sizeof(shm_test_buf));
+    rc = storage_read(_state->file, 0, shm_test_buf, SHM_TEST_SIZE);
+    ASSERT_EQ(rc, SHM_TEST_SIZE);
+    EXPECT_EQ(shm_test_mismatches(0, SHM_TEST_SIZE), 0);
+
+    /* the read ends at the end of the file */
+    memset(shm_test_buf, 0, sizeof(shm_test_buf));
+    rc = storage_read(_state->file, 1000, shm_test_buf, SHM_TEST_SIZE);
+    ASSERT_EQ(rc, SHM_TEST_SIZE - 1000);
+    EXPECT_EQ(shm_test_mismatches(1000, SHM_TEST_SIZE - 1000), 0);
+
+test_abort:;
+}
+
+/* Offset the in-memory server rejects writes to */
+#define BAD_WRITE_OFFSET (1ULL << 62)
+
+/*
+ * With write-back buffering, a write succeeds before it reaches the server and
+ * its error is returned by the commit.
+ */
+TEST_F(client_file, write_back_defers_errors) {
+    const char data[] = "data";
+    char buf[sizeof(data)];
+    int rc;
+
+    rc = storage_set_write_back(_state->session, 4096);
+    ASSERT_EQ(rc, 0);
+
+    rc = storage_write(_state->file, BAD_WRITE_OFFSET, data, sizeof(data), 0);
+    EXPECT_EQ(rc, (int)sizeof(data));
+    rc = storage_end_transaction(_state->session, true);
+    EXPECT_LT(rc, 0);
+    rc = storage_end_transaction(_state->session, false);
+    EXPECT_EQ(rc, 0);
+
+    /* the failed write was dropped, so it does not fail the next commit */
+    rc = storage_write(_state->file, 0, data, sizeof(data), 0);
+    EXPECT_EQ(rc, (int)sizeof(data));
+    rc = storage_end_transaction(_state->session, true);
+    EXPECT_EQ(rc, 0);
+    rc = storage_read(_state->file, 0, buf, sizeof(buf));
+    ASSERT_EQ(rc, (int)sizeof(buf));
+    EXPECT_EQ(memcmp(buf, data, sizeof(data)), 0);
+
+test_abort:
+    storage_set_write_back(_state->session, 0);
+}
+
+/*
+ * A file opened twice without the file handle cache has two handles, and
+ * reading or querying it through one of them must see the writes buffered
+ * for the other.
+ */
+TEST_F(client_file, write_back_visible_to_other_handle) {
+    const char data[] = "data";
+    char buf[sizeof(data)];
+    file_handle_t other;
+    storage_off_t size;
+    int rc;
+
+    rc = storage_set_file_cache_size(_state->session, 0);
+    ASSERT_EQ(rc, 0);
+    rc = storage_set_write_back(_state->session, 4096);
+    ASSERT_EQ(rc, 0);
+    rc = storage_open_file(_state->session, &other, TEST_FILE_NAME, 0, 0);
+    ASSERT_EQ(rc, 0);
+    EXPECT_NE(other, _state->file);
+
+    rc = storage_write(_state->file, 100, data, sizeof(data), 0);
+    EXPECT_EQ(rc, (int)sizeof(data));
+
+    rc = storage_get_file_size(other, &size);
+    EXPECT_EQ(rc, 0);
+    EXPECT_EQ(size, 100 + sizeof(data));
+    rc = storage_read(other, 100, buf, sizeof(buf));
+    EXPECT_EQ(rc, (int)sizeof(buf));
+    EXPECT_EQ(memcmp(buf, data, sizeof(data)), 0);
+
+    storage_close_file(other);
+
+test_abort:
+    storage_set_write_back(_state->session, 0);
+}
+
+/*
+ * The metrics service lists this app as one allowed to report its storage
+ * statistics, so the report must get through.
+ */
+TEST_F(client_file, report_stats) {
+    const char data[] = "data";
+    int rc;
+
+    rc = storage_write(_state->file, 0, data, sizeof(data),
+                       STORAGE_OP_COMPLETE);
+    EXPECT_EQ(rc, (int)sizeof(data));
+    rc = storage_report_stats();
+    EXPECT_EQ(rc, 0);
+}
+
+#define KV_NAME "storage_client_test.kv"
+
+/* More segment files than any of the tests below creates */
+#define KV_MAX_SEGMENTS 8
+
+typedef struct {
+    storage_session_t session;
+    struct storage_kv* kv;
+} kv_t;
+
+TEST_F_SETUP(kv) {
+    int rc;
+
+    rc = storage_open_session(&_state->session, STORAGE_FAKE_PORT);
+    ASSERT_EQ(rc, 0);
+    rc = storage_kv_open(_state->session, KV_NAME, &_state->kv);
+    ASSERT_EQ(rc, 0);
+
+test_abort:;
+}
+
+TEST_F_TEARDOWN(kv) {
+    char name[STORAGE_MAX_NAME_LENGTH_BYTES];
+
+    storage_kv_close(_state->kv);
+    storage_delete_file(_state->session, KV_NAME ".meta", 0);
+    for (unsigned int i = 0; i < KV_MAX_SEGMENTS; i++) {
+        snprintf(name, sizeof(name), "%s.%u", KV_NAME, i);
+        storage_delete_file(_state->session, name, 0);
+    }
+    storage_end_transaction(_state->session, true);
+    storage_close_session(_state->session);
+}
+
+/* Close and reopen the store, which rebuilds its index from the segments */
+static int kv_reopen(kv_t* state) {
+    storage_kv_close(state->kv);
+    state->kv = NULL;
+    return storage_kv_open(state->session, KV_NAME, &state->kv);
+}
+
+/* Check that @key holds test_data as filled by fill_test_data(@seed) */
+static void expect_kv_value(struct storage_kv* kv,
+                            const char* key,
+                            uint8_t seed,
+                            size_t size) {
+    size_t value_len;
+    int rc;
+
+    fill_test_data(seed);
+    memset(test_buf, 0, sizeof(test_buf));
+    rc = storage_kv_get(kv, key, strlen(key), test_buf, sizeof(test_buf),
+                        &value_len);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(value_len, size);
+    EXPECT_EQ(memcmp(test_buf, test_data, size), 0);
+
+test_abort:;
+}
+
+static int kv_put_test_data(struct storage_kv* kv,
+                            const char* key,
+                            uint8_t seed,
+                            size_t size) {
+    fill_test_data(seed);
+    return storage_kv_put(kv, key, strlen(key), test_data, size);
+}
+
+TEST_F(kv, put_get_delete) {
+    size_t value_len;
+    int rc;
+
+    rc = kv_put_test_data(_state->kv, "a", 1, 100);
+    ASSERT_EQ(rc, 0);
+    rc = kv_put_test_data(_state->kv, "b", 2, 200);
+    ASSERT_EQ(rc, 0);
+
+    /* staged changes are visible before the commit */
+    expect_kv_value(_state->kv, "a", 1, 100);
+    rc = storage_kv_commit(_state->kv);
+    ASSERT_EQ(rc, 0);
+    expect_kv_value(_state->kv, "a", 1, 100);
+    expect_kv_value(_state->kv, "b", 2, 200);
+
+    rc = storage_kv_get(_state->kv, "a", 1, test_buf, 10, &value_len);
+    EXPECT_EQ(rc, ERR_NOT_ENOUGH_BUFFER);
+    EXPECT_EQ(value_len, 100);
+
+    rc = storage_kv_delete(_state->kv, "a", 1);
+    ASSERT_EQ(rc, 0);
+    rc = storage_kv_delete(_state->kv, "c", 1);
+    EXPECT_EQ(rc, ERR_NOT_FOUND);
+    rc = storage_kv_commit(_state->kv);
+    ASSERT_EQ(rc, 0);
+    rc = storage_kv_get(_state->kv, "a", 1, test_buf, sizeof(test_buf),
+                        &value_len);
+    EXPECT_EQ(rc, ERR_NOT_FOUND);
+
+    /* aborted changes are dropped */
+    rc = kv_put_test_data(_state->kv, "b", 3, 300);
+    ASSERT_EQ(rc, 0);
+    storage_kv_abort(_state->kv);
+    expect_kv_value(_state->kv, "b", 2, 200);
+
+    rc = kv_reopen(_state);
+    ASSERT_EQ(rc, 0);
+    rc = storage_kv_get(_state->kv, "a", 1, test_buf, sizeof(test_buf),
+                        &value_len);
+    EXPECT_EQ(rc, ERR_NOT_FOUND);
+    expect_kv_value(_state->kv, "b", 2, 200);
+
+test_abort:;
+}
+
+/*
+ * The second commit does not fit in what is left of the first segment, so it
+ * goes into a new one.
+ */
+TEST_F(kv, commit_across_segments) {
+    int rc;
+
+    rc = kv_put_test_data(_state->kv, "a", 1, TEST_BUF_SIZE);
+    ASSERT_EQ(rc, 0);
+    rc = storage_kv_commit(_state->kv);
+    ASSERT_EQ(rc, 0);
+
+    rc = kv_put_test_data(_state->kv, "b", 2, TEST_BUF_SIZE);
+    ASSERT_EQ(rc, 0);
+    rc = kv_put_test_data(_state->kv, "c", 3, TEST_BUF_SIZE);
+    ASSERT_EQ(rc, 0);
+    rc = storage_kv_commit(_state->kv);
+    ASSERT_EQ(rc, 0);
+
+    expect_kv_value(_state->kv, "a", 1, TEST_BUF_SIZE);
+    expect_kv_value(_state->kv, "b", 2, TEST_BUF_SIZE);
+    expect_kv_value(_state->kv, "c", 3, TEST_BUF_SIZE);
+    EXPECT_EQ(storage_kv_garbage(_state->kv), 0);
+
+    rc = kv_reopen(_state);
+    ASSERT_EQ(rc, 0);
+    expect_kv_value(_state->kv, "a", 1, TEST_BUF_SIZE);
+    expect_kv_value(_state->kv, "b", 2, TEST_BUF_SIZE);
+    expect_kv_value(_state->kv, "c", 3, TEST_BUF_SIZE);
+
+test_abort:;
+}
+
+TEST_F(kv, compact_and_reopen) {
+    size_t value_len;
+    int rc;
+
+    rc = kv_put_test_data(_state->kv, "a", 1, TEST_BUF_SIZE);
+    ASSERT_EQ(rc, 0);
+    rc = kv_put_test_data(_state->kv, "b", 2, 100);
+    ASSERT_EQ(rc, 0);
+    rc = storage_kv_commit(_state->kv);
+    ASSERT_EQ(rc, 0);
+
+    rc = kv_put_test_data(_state->kv, "a", 3, TEST_BUF_SIZE);
+    ASSERT_EQ(rc, 0);
+    rc = storage_kv_delete(_state->kv, "b", 1);
+    ASSERT_EQ(rc, 0);
+    rc = storage_kv_compact(_state->kv);
+    EXPECT_EQ(rc, ERR_BUSY);
+    rc = storage_kv_commit(_state->kv);
+    ASSERT_EQ(rc, 0);
+    EXPECT_GT(storage_kv_garbage(_state->kv), TEST_BUF_SIZE);
+
+    for (int i = 0; i < KV_MAX_SEGMENTS && storage_kv_garbage(_state->kv);
+         i++) {
+        rc = storage_kv_compact(_state->kv);
+        ASSERT_EQ(rc, 0);
+    }
+    EXPECT_LT(storage_kv_garbage(_state->kv), TEST_BUF_SIZE);
+    expect_kv_value(_state->kv, "a", 3, TEST_BUF_SIZE);
+
+    rc = kv_reopen(_state);
+    ASSERT_EQ(rc, 0);
+    expect_kv_value(_state->kv, "a", 3, TEST_BUF_SIZE);
+    rc = storage_kv_get(_state->kv, "b", 1, test_buf, sizeof(test_buf),
+                        &value_len);
+    EXPECT_EQ(rc, ERR_NOT_FOUND);
+
+test_abort:;
+}
+
+/*
+ * A record claiming a value far larger than its segment must be rejected when
+ * the store is opened. The value length follows the 32-bit magic and the 16-bit
+ * key length and flags of the record header.
+ */
+TEST_F(kv, corrupt_value_len) {
+    const uint32_t value_len = UINT32_MAX - 8;
+    file_handle_t seg;
+    int rc;
+
+    rc = kv_put_test_data(_state->kv, "a", 1, 100);
+    ASSERT_EQ(rc, 0);
+    rc = storage_kv_commit(_state->kv);
+    ASSERT_EQ(rc, 0);
+    storage_kv_close(_state->kv);
+    _state->kv = NULL;
+
+    rc = storage_open_file(_state->session, &seg, KV_NAME ".0", 0, 0);
+    ASSERT_EQ(rc, 0);
+    rc = storage_write(seg, 8, &value_len, sizeof(value_len),
+                       STORAGE_OP_COMPLETE);
+    storage_close_file(seg);
+    ASSERT_EQ(rc, (int)sizeof(value_len));
+
+    rc = storage_kv_open(_state->session, KV_NAME, &_state->kv);
+    EXPECT_EQ(rc, ERR_NOT_VALID);
+
+test_abort:;
+}
+
+#define ASYNC_FILE_NAME "storage_client_test.async"
+
+/* Largest file the in-memory server accepts */
+#define FAKE_MAX_FILE_SIZE (1024 * 1024)
+
+/**
+ * struct async_result - outcome of an async operation
+ * @done:   the completion callback has been called
+ * @token:  token passed to the callback
+ * @result: result passed to the callback
+ * @order:  number of operations that completed before this one
+ */
+struct async_result {
+    bool done;
+    uint32_t token;
+    ssize_t result;
+    unsigned int order;
+};
+
+static struct tipc_hset* async_hset;
+static unsigned int async_completions;
+
+static void async_cb(void* priv, uint32_t token, ssize_t result) {
+    struct async_result* res = priv;
+
+    res->done = true;
+    res->token = token;
+    res->result = result;
+    res->order = async_completions++;
+}
+
+/*
+ * Run the event loop until the operation of @res has completed. A lost
+ * response hangs the test rather than leaving the operation to complete into
+ * a result that is gone.
+ */
+static int async_wait(struct async_result* res) {
+    int rc;
+
+    while (!res->done) {
+        rc = tipc_handle_event(async_hset, INFINITE_TIME);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return NO_ERROR;
+}
+
+static int async_open_file(struct storage_async_session* session,
+                           file_handle_t* fh_p,
+                           uint32_t flags,
+                           struct async_result* res) {
+    int rc;
+
+    rc = storage_async_open_file(session, fh_p, ASYNC_FILE_NAME, flags,
+                                 STORAGE_OP_COMPLETE, async_cb, res, NULL);
+    if (rc < 0) {
+        return rc;
+    }
+    rc = async_wait(res);
+    return rc < 0 ? rc : res->result;
+}
+
+/*
+ * The results live in the fixture, because operations a failed test leaves
+ * behind complete when the teardown closes the session.
+ */
+typedef struct {
+    struct storage_async_session* session;
+    file_handle_t file;
+    struct async_result res[12];
+} async_file_t;
+
+TEST_F_SETUP(async_file) {
+    struct tipc_hset* hset;
+    int rc;
+
+    if (!async_hset) {
+        hset = tipc_hset_create();
+        ASSERT_EQ(IS_ERR(hset), false);
+        async_hset = hset;
+    }
+
+    rc = storage_async_open_session(async_hset, STORAGE_FAKE_PORT,
+                                    &_state->session);
+    ASSERT_EQ(rc, 0);
+    rc = async_open_file(_state->session, &_state->file,
+                         STORAGE_FILE_OPEN_CREATE | STORAGE_FILE_OPEN_TRUNCATE,
+                         &_state->res[countof(_state->res) - 1]);
+    ASSERT_EQ(rc, 0);
+
+test_abort:;
+}
+
+TEST_F_TEARDOWN(async_file) {
+    storage_session_t session;
+
+    /* the server closes the file along with the channel */
+    if (_state->session) {
+        storage_async_close_session(_state->session);
+    }
+    if (storage_open_session(&session, STORAGE_FAKE_PORT) == NO_ERROR) {
+        storage_delete_file(session, ASYNC_FILE_NAME, STORAGE_OP_COMPLETE);
+        storage_close_session(session);
+    }
+}
+
+/*
+ * Operations larger than a message are split into several requests, and
+ * operations submitted together complete in order.
+ */
+TEST_F(async_file, chunked_write_read) {
+    struct async_result* write_res = &_state->res[0];
+    struct async_result* read_res = &_state->res[1];
+    struct async_result* size_res = &_state->res[2];
+    storage_off_t size = 0;
+    int rc;
+
+    fill_test_data(1);
+    memset(test_buf, 0, sizeof(test_buf));
+    rc = storage_async_write(_state->session, _state->file, 0, test_data,
+                             TEST_BUF_SIZE, STORAGE_OP_COMPLETE, async_cb,
+                             write_res, NULL);
+    ASSERT_EQ(rc, 0);
+    rc = storage_async_read(_state->session, _state->file, 0, test_buf,
+                            TEST_BUF_SIZE, async_cb, read_res, NULL);
+    ASSERT_EQ(rc, 0);
+    rc = storage_async_get_file_size(_state->session, _state->file, &size,
+                                     async_cb, size_res, NULL);
+    ASSERT_EQ(rc, 0);
+
+    rc = async_wait(size_res);
+    ASSERT_EQ(rc, 0);
+    EXPECT_EQ(write_res->result, TEST_BUF_SIZE);
+    EXPECT_EQ(read_res->result, TEST_BUF_SIZE);
+    EXPECT_EQ(size_res->result, 0);
+    EXPECT_EQ(size, TEST_BUF_SIZE);
+    EXPECT_EQ(memcmp(test_buf, test_data, TEST_BUF_SIZE), 0);
+
+    EXPECT_EQ(read_res->order, write_res->order + 1);
+    EXPECT_EQ(size_res->order, write_res->order + 2);
+    EXPECT_NE(write_res->token, read_res->token);
+
+test_abort:;
+}
+
+/*
+ * The file ends in the middle of the read requests in flight. The responses
+ * to the requests past the end must not be taken for responses to the
+ * operation submitted after the read.
+ */
+TEST_F(async_file, short_read_at_eof) {
+    const size_t file_size = 10000;
+    struct async_result* write_res = &_state->res[0];
+    struct async_result* read_res = &_state->res[1];
+    struct async_result* size_res = &_state->res[2];
+    storage_off_t size = 0;
+    int rc;
+
+    fill_test_data(2);
+    rc = storage_async_write(_state->session, _state->file, 0, test_data,
+                             file_size, STORAGE_OP_COMPLETE, async_cb,
+                             write_res, NULL);
+    ASSERT_EQ(rc, 0);
+    rc = async_wait(write_res);
+    ASSERT_EQ(rc, 0);
+    ASSERT_EQ(write_res->result, (ssize_t)file_size);
+
+    memset(test_buf, 0, sizeof(test_buf));
+    rc = storage_async_read(_state->session, _state->file, 100, test_buf,
+                            TEST_BUF_SIZE, async_cb, read_res, NULL);
+    ASSERT_EQ(rc, 0);
+    rc = storage_async_get_file_size(_state->session, _state->file, &size,
+                                     async_cb, size_res, NULL);
+    ASSERT_EQ(rc, 0);
+
+    rc = async_wait(size_res);
+    ASSERT_EQ(rc, 0);
+    EXPECT_EQ(read_res->result, (ssize_t)file_size - 100);
+    EXPECT_EQ(memcmp(test_buf, test_data + 100, file_size - 100), 0);
+    EXPECT_EQ(size_res->result, 0);
+    EXPECT_EQ(size, file_size);
+
+test_abort:;
+}
+
+/*
+ * A server port that queues a single request makes the session wait for
+ * IPC_HANDLE_POLL_SEND_UNBLOCKED between requests. Every operation must still
+ * be sent and completed in order once the queue has room again.
+ */
+TEST_F(async_file, send_unblocked) {
+    const size_t count = 8;
+    const size_t part = TEST_BUF_SIZE / count;
+    struct async_result* write_res = &_state->res[0];
+    struct async_result* read_res = &_state->res[count];
+    struct storage_async_session* session = NULL;
+    file_handle_t fh;
+    int rc;
+
+    rc = storage_async_open_session(async_hset, STORAGE_FAKE_SMALL_QUEUE_PORT,
+                                    &session);
+    ASSERT_EQ(rc, 0);
+    rc = async_open_file(session, &fh, 0, &_state->res[count + 1]);
+    ASSERT_EQ(rc, 0);
+
+    fill_test_data(3);
+    memset(test_buf, 0, sizeof(test_buf));
+    for (size_t i = 0; i < count; i++) {
+        rc = storage_async_write(session, fh, i * part, test_data + i * part,
+                                 part, i + 1 == count ? STORAGE_OP_COMPLETE : 0,
+                                 async_cb, &write_res[i], NULL);
+        ASSERT_EQ(rc, 0);
+    }
+    rc = storage_async_read(session, fh, 0, test_buf, TEST_BUF_SIZE, async_cb,
+                            read_res, NULL);
+    ASSERT_EQ(rc, 0);
+
+    rc = async_wait(read_res);
+    ASSERT_EQ(rc, 0);
+    for (size_t i = 0; i < count; i++) {
+        EXPECT_EQ(write_res[i].result, (ssize_t)part);
+        EXPECT_EQ(write_res[i].order, write_res[0].order + i);
+    }
+    EXPECT_EQ(read_res->result, TEST_BUF_SIZE);
+    EXPECT_EQ(memcmp(test_buf, test_data, TEST_BUF_SIZE), 0);
+
+test_abort:
+    if (session) {
+        storage_async_close_session(session);
+    }
+}
+
+/*
+ * The server rejects the second request of a write. The write fails, the
+ * responses to its requests already in flight are dropped, and the session
+ * keeps working.
+ */
+TEST_F(async_file, fail_part_way) {
+    const storage_off_t off = FAKE_MAX_FILE_SIZE - 5000;
+    const char data[] = "data";
+    char buf[sizeof(data)];
+    struct async_result* bad_res = &_state->res[0];
+    struct async_result* write_res = &_state->res[1];
+    struct async_result* read_res = &_state->res[2];
+    int rc;
+
+    fill_test_data(4);
+    rc = storage_async_write(_state->session, _state->file, off, test_data,
+                             TEST_BUF_SIZE, STORAGE_OP_COMPLETE, async_cb,
+                             bad_res, NULL);
+    ASSERT_EQ(rc, 0);
+    rc = storage_async_write(_state->session, _state->file, 0, data,
+                             sizeof(data), STORAGE_OP_COMPLETE, async_cb,
+                             write_res, NULL);
+    ASSERT_EQ(rc, 0);
+    rc = storage_async_read(_state->session, _state->file, 0, buf, sizeof(buf),
+                            async_cb, read_res, NULL);
+    ASSERT_EQ(rc, 0);
+
+    rc = async_wait(read_res);
+    ASSERT_EQ(rc, 0);
+    EXPECT_LT(bad_res->result, 0);
+    EXPECT_EQ(write_res->order, bad_res->order + 1);
+    EXPECT_EQ(write_res->result, (ssize_t)sizeof(data));
+    EXPECT_EQ(read_res->result, (ssize_t)sizeof(buf));
+    EXPECT_EQ(memcmp(buf, data, sizeof(data)), 0);
+
+test_abort:;
+}
+
+#define CFILE_NAME "storage_client_test.cfile"
+#define CFILE_BLOCK_SIZE STORAGE_CFILE_BLOCK_SIZE
+
+/* Several blocks and a partial one */
+#define CFILE_TEST_SIZE (3 * CFILE_BLOCK_SIZE + 100)
+
+/* Size of the header of a compressed file, followed by 32-bit block ends */
+#define CFILE_HEADER_SIZE 24
+
+static uint8_t cfile_data[CFILE_TEST_SIZE];
+static uint8_t cfile_buf[CFILE_TEST_SIZE];
+
+/* Pseudo-random bytes, which do not compress */
+static void fill_cfile_random(void) {
+    uint32_t x = 0x12345678;
+
+    for (size_t i = 0; i < sizeof(cfile_data); i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        cfile_data[i] = x >> 24;
+    }
+}
+
+/* Short runs with some variation, which compress well */
+static void fill_cfile_text(void) {
+    for (size_t i = 0; i < sizeof(cfile_data); i++) {
+        cfile_data[i] = "storage"[i % 7] + (i / 4096) % 3;
+    }
+}
+
+typedef struct {
+    storage_session_t session;
+} cfile_t;
+
+TEST_F_SETUP(cfile) {
+    int rc;
+
+    rc = storage_open_session(&_state->session, STORAGE_FAKE_PORT);
+    ASSERT_EQ(rc, 0);
+
+test_abort:;
+}
+
+TEST_F_TEARDOWN(cfile) {
+    storage_delete_file(_state->session, CFILE_NAME, STORAGE_OP_COMPLETE);
+    storage_close_session(_state->session);
+}
+
+/* Size of the compressed file */
+static storage_off_t cfile_stored_size(storage_session_t session) {
+    file_handle_t fh;
+    storage_off_t size = 0;
+
+    if (storage_open_file(session, &fh, CFILE_NAME, 0, 0) == NO_ERROR) {
+        storage_get_file_size(fh, &size);
+        storage_close_file(fh);
+    }
+    return size;
+}
+
+/* Write the first @size bytes of cfile_data and read them back */
+static void check_cfile_round_trip(storage_session_t session, size_t size) {
+    struct storage_cfile* cfile = NULL;
+    storage_off_t file_size;
+    int rc;
+
+    rc = storage_cfile_write(session, CFILE_NAME, cfile_data, size,
+                             STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, 0);
+    rc = storage_cfile_open(session, CFILE_NAME, &cfile);
+    ASSERT_EQ(rc, 0);
+    storage_cfile_get_size(cfile, &file_size);
+    EXPECT_EQ(file_size, size);
+
+    memset(cfile_buf, 0, sizeof(cfile_buf));
+    rc = storage_cfile_read(cfile, 0, cfile_buf, sizeof(cfile_buf));
+    EXPECT_EQ(rc, (int)size);
+    EXPECT_EQ(memcmp(cfile_buf, cfile_data, size), 0);
+    rc = storage_cfile_read(cfile, size, cfile_buf, 1);
+    EXPECT_EQ(rc, 0);
+
+test_abort:
+    storage_cfile_close(cfile);
+}
+
+static const size_t cfile_sizes[] = {
+        0,
+        1,
+        CFILE_BLOCK_SIZE - 1,
+        CFILE_BLOCK_SIZE,
+        CFILE_BLOCK_SIZE + 1,
+        CFILE_TEST_SIZE,
+};
+
+TEST_F(cfile, round_trip_incompressible) {
+    fill_cfile_random();
+    for (size_t i = 0; i < countof(cfile_sizes); i++) {
+        check_cfile_round_trip(_state->session, cfile_sizes[i]);
+    }
+    /* blocks that do not shrink are stored as they are */
+    EXPECT_GT(cfile_stored_size(_state->session), CFILE_TEST_SIZE);
+}
+
+TEST_F(cfile, round_trip_one_byte) {
+    memset(cfile_data, 0xa5, sizeof(cfile_data));
+    for (size_t i = 0; i < countof(cfile_sizes); i++) {
+        check_cfile_round_trip(_state->session, cfile_sizes[i]);
+    }
+    EXPECT_LT(cfile_stored_size(_state->session), CFILE_TEST_SIZE / 16);
+}
+
+/* Reads that start and end inside blocks, many of them across a boundary */
+TEST_F(cfile, unaligned_reads) {
+    const size_t steps[] = {1, 7, 1000, CFILE_BLOCK_SIZE - 1,
+                            CFILE_BLOCK_SIZE + 3};
+    struct storage_cfile* cfile = NULL;
+    size_t off;
+    size_t len;
+    int rc;
+
+    fill_cfile_text();
+    rc = storage_cfile_write(_state->session, CFILE_NAME, cfile_data,
+                             CFILE_TEST_SIZE, STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, 0);
+    rc = storage_cfile_open(_state->session, CFILE_NAME, &cfile);
+    ASSERT_EQ(rc, 0);
+
+    for (size_t i = 0; i < countof(steps); i++) {
+        memset(cfile_buf, 0, sizeof(cfile_buf));
+        for (off = 3; off < CFILE_TEST_SIZE; off += len) {
+            len = MIN(steps[i], CFILE_TEST_SIZE - off);
+            rc = storage_cfile_read(cfile, off, cfile_buf + off, steps[i]);
+            ASSERT_EQ(rc, (int)len);
+        }
+        EXPECT_EQ(memcmp(cfile_buf + 3, cfile_data + 3, CFILE_TEST_SIZE - 3),
+                  0);
+    }
+
+    /* backwards across a block boundary, so the cached block changes */
+    memset(cfile_buf, 0, sizeof(cfile_buf));
+    off = 2 * CFILE_BLOCK_SIZE - 10;
+    rc = storage_cfile_read(cfile, off, cfile_buf, 20);
+    EXPECT_EQ(rc, 20);
+    rc = storage_cfile_read(cfile, CFILE_BLOCK_SIZE - 10, cfile_buf + 20, 20);
+    EXPECT_EQ(rc, 20);
+    EXPECT_EQ(memcmp(cfile_buf, cfile_data + off, 20), 0);
+    EXPECT_EQ(memcmp(cfile_buf + 20, cfile_data + CFILE_BLOCK_SIZE - 10, 20),
+              0);
+
+test_abort:
+    storage_cfile_close(cfile);
+}
+
+/*
+ * Write a compressed file of CFILE_TEST_SIZE bytes of text and get the end of
+ * its first stored block.
+ */
+static int write_cfile_text(storage_session_t session,
+                            file_handle_t* fh_p,
+                            uint32_t* end_p) {
+    int rc;
+
+    fill_cfile_text();
+    rc = storage_cfile_write(session, CFILE_NAME, cfile_data, CFILE_TEST_SIZE,
+                             STORAGE_OP_COMPLETE);
+    if (rc < 0) {
+        return rc;
+    }
+    rc = storage_open_file(session, fh_p, CFILE_NAME, 0, 0);
+    if (rc < 0) {
+        return rc;
+    }
+    rc = storage_read(*fh_p, CFILE_HEADER_SIZE, end_p, sizeof(*end_p));
+    return rc == sizeof(*end_p) ? NO_ERROR : ERR_IO;
+}
+
+static int cfile_open_result(storage_session_t session) {
+    struct storage_cfile* cfile = NULL;
+    int rc;
+
+    rc = storage_cfile_open(session, CFILE_NAME, &cfile);
+    storage_cfile_close(cfile);
+    return rc;
+}
+
+TEST_F(cfile, truncated) {
+    const storage_off_t data_off = CFILE_HEADER_SIZE + 4 * sizeof(uint32_t);
+    file_handle_t fh;
+    bool fh_open = false;
+    storage_off_t size;
+    uint32_t end;
+    int rc;
+
+    rc = write_cfile_text(_state->session, &fh, &end);
+    ASSERT_EQ(rc, 0);
+    fh_open = true;
+    rc = storage_get_file_size(fh, &size);
+    ASSERT_EQ(rc, 0);
+
+    /* the last stored block is cut short */
+    rc = storage_set_file_size(fh, size - 1, STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, 0);
+    EXPECT_EQ(cfile_open_result(_state->session), ERR_NOT_VALID);
+
+    /* the index is cut short */
+    rc = storage_set_file_size(fh, data_off - 1, STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, 0);
+    EXPECT_EQ(cfile_open_result(_state->session), ERR_NOT_VALID);
+
+    /* the header is cut short */
+    rc = storage_set_file_size(fh, CFILE_HEADER_SIZE - 1, STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, 0);
+    EXPECT_EQ(cfile_open_result(_state->session), ERR_NOT_VALID);
+
+test_abort:
+    if (fh_open) {
+        storage_close_file(fh);
+    }
+}
+
+TEST_F(cfile, corrupt_index) {
+    const uint32_t bad_end = CFILE_BLOCK_SIZE + 1;
+    file_handle_t fh;
+    bool fh_open = false;
+    uint32_t end;
+    int rc;
+
+    rc = write_cfile_text(_state->session, &fh, &end);
+    ASSERT_EQ(rc, 0);
+    fh_open = true;
+
+    /* a block larger than its uncompressed size */
+    rc = storage_write(fh, CFILE_HEADER_SIZE, &bad_end, sizeof(bad_end),
+                       STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, (int)sizeof(bad_end));
+    EXPECT_EQ(cfile_open_result(_state->session), ERR_NOT_VALID);
+
+    /* a block ending before the previous one */
+    rc = storage_write(fh, CFILE_HEADER_SIZE, &end, sizeof(end), 0);
+    ASSERT_EQ(rc, (int)sizeof(end));
+    end--;
+    rc = storage_write(fh, CFILE_HEADER_SIZE + sizeof(end), &end, sizeof(end),
+                       STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, (int)sizeof(end));
+    EXPECT_EQ(cfile_open_result(_state->session), ERR_NOT_VALID);
+
+test_abort:
+    if (fh_open) {
+        storage_close_file(fh);
+    }
+}
+
+/*
+ * A compressed block of 0xff bytes claims a literal run longer than the
+ * block, which must fail the read rather than return garbage.
+ */
+TEST_F(cfile, corrupt_block) {
+    const storage_off_t data_off = CFILE_HEADER_SIZE + 4 * sizeof(uint32_t);
+    struct storage_cfile* cfile = NULL;
+    file_handle_t fh;
+    bool fh_open = false;
+    uint32_t end;
+    int rc;
+
+    rc = write_cfile_text(_state->session, &fh, &end);
+    ASSERT_EQ(rc, 0);
+    fh_open = true;
+    ASSERT_LT(end, CFILE_BLOCK_SIZE);
+
+    memset(cfile_buf, 0xff, end);
+    rc = storage_write(fh, data_off, cfile_buf, end, STORAGE_OP_COMPLETE);
+    ASSERT_EQ(rc, (int)end);
+
+    rc = storage_cfile_open(_state->session, CFILE_NAME, &cfile);
+    ASSERT_EQ(rc, 0);
+    rc = storage_cfile_read(cfile, 10, cfile_buf, 10);
+    EXPECT_EQ(rc, ERR_NOT_VALID);
+    rc = storage_cfile_read(cfile, 0, cfile_buf, CFILE_TEST_SIZE);
+    EXPECT_EQ(rc, ERR_NOT_VALID);
+
+    /* the other blocks are still readable */
+    rc = storage_cfile_read(cfile, CFILE_BLOCK_SIZE, cfile_buf, 10);
+    EXPECT_EQ(rc, 10);
+    EXPECT_EQ(memcmp(cfile_buf, cfile_data + CFILE_BLOCK_SIZE, 10), 0);
+
+test_abort:
+    storage_cfile_close(cfile);
+    if (fh_open) {
+        storage_close_file(fh);
+    }
+}
+
+PORT_TEST(storage_client, "com.android.trusty.storage.client.test");
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <stddef.h>
+
+#include <lib/storage/storage.h>
+
+/*
+ * Recorded storage transactions.
+ *
+ * A &struct storage_txn collects changes to files by name without sending
+ * anything to the storage server. storage_txn_commit() applies them all in
+ * one server transaction, committed by the last change. If the server
+ * reports a conflict with a transaction committed through another session,
+ * the changes are discarded and applied again after a short, growing delay,
+ * so callers get the retry loop the storage protocol requires for free.
+ *
+ * The session of a transaction must not have uncommitted changes of its own
+ * when the transaction is committed, as those would be committed with it or
+ * discarded on a retry.
+ */
+
+__BEGIN_CDECLS
+
+struct storage_txn;
+
+/**
+ * storage_txn_create() - Create an empty transaction
+ * @session: the storage_session_t the transaction will be committed through
+ * @txn_p:   pointer to location in which to store the transaction
+ *
+ * Return: NO_ERROR on success, or ERR_NO_MEMORY.
+ */
+int storage_txn_create(storage_session_t session, struct storage_txn** txn_p);
+
+/**
+ * storage_txn_destroy() - Free a transaction, dropping uncommitted changes
+ * @txn: the transaction to free, may be %NULL
+ */
+void storage_txn_destroy(struct storage_txn* txn);
+
+/**
+ * storage_txn_write() - Record writing to a file
+ * @txn:  the transaction to add to
+ * @name: the name of the file, which is created if it does not exist
+ * @off:  the start offset from whence to write in the file
+ * @buf:  the data to write, copied by this call
+ * @size: the number of bytes to write
+ *
+ * Return: NO_ERROR on success, or ERR_NO_MEMORY.
+ */
+int storage_txn_write(struct storage_txn* txn,
+                      const char* name,
+                      storage_off_t off,
+                      const void* buf,
+                      size_t size);
+
+/**
+ * storage_txn_set_file_size() - Record setting the size of a file
+ * @txn:       the transaction to add to
+ * @name:      the name of the file, which is created if it does not exist
+ * @file_size: the new size of the file
+ *
+ * Return: NO_ERROR on success, or ERR_NO_MEMORY.
+ */
+int storage_txn_set_file_size(struct storage_txn* txn,
+                              const char* name,
+                              storage_off_t file_size);
+
+/**
+ * storage_txn_delete() - Record deleting a file
+ * @txn:  the transaction to add to
+ * @name: the name of the file, which must exist when the change is applied
+ *
+ * Return: NO_ERROR on success, or ERR_NO_MEMORY.
+ */
+int storage_txn_delete(struct storage_txn* txn, const char* name);
+
+/**
+ * storage_txn_commit() - Apply and commit all recorded changes
+ * @txn: the transaction to commit
+ *
+ * Changes are applied in the order they were recorded. If applying or
+ * committing them fails with ERR_BUSY because another session committed a
+ * conflicting transaction, they are discarded and applied again, up to
+ * STORAGE_TXN_MAX_ATTEMPTS times in all. The recorded changes are dropped
+ * once this returns, so @txn can be reused for the next transaction.
+ *
+ * Return: NO_ERROR if all changes were committed, or an error code < 0 if
+ * none were, including ERR_BUSY if the last attempt still conflicted.
+ */
+int storage_txn_commit(struct storage_txn* txn);
+
+__END_CDECLS
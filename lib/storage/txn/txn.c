@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Recorded storage transactions.
+ *
+ * Changes are kept as a list of operations holding copies of their data.
+ * Committing opens each file the first time an operation refers to it,
+ * applies the operations with STORAGE_OP_COMPLETE on the last one, or ends
+ * the transaction separately if the last one writes nothing, and closes the
+ * files again. A conflict discards the server transaction, and the whole
+ * list is applied again after an exponentially growing delay.
+ */
+
+#include <lk/list.h>
+#include <lk/macros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trusty/time.h>
+#include <uapi/err.h>
+
+#include <lib/storage/txn.h>
+
+/* Maximum number of times storage_txn_commit() applies a transaction */
+#ifndef STORAGE_TXN_MAX_ATTEMPTS
+#define STORAGE_TXN_MAX_ATTEMPTS 5
+#endif
+
+/* Delay before the first retry, doubled for each further one up to the max */
+#ifndef STORAGE_TXN_BACKOFF_MIN_MSEC
+#define STORAGE_TXN_BACKOFF_MIN_MSEC 2
+#endif
+
+#ifndef STORAGE_TXN_BACKOFF_MAX_MSEC
+#define STORAGE_TXN_BACKOFF_MAX_MSEC 64
+#endif
+
+enum storage_txn_op_type {
+    STORAGE_TXN_OP_WRITE,
+    STORAGE_TXN_OP_SET_SIZE,
+    STORAGE_TXN_OP_DELETE,
+};
+
+/**
+ * struct storage_txn_op - a recorded change
+ * @node: list node in &storage_txn->ops
+ * @type: the kind of change
+ * @off:  offset to write at, or the new file size
+ * @size: number of bytes to write
+ * @name: the name of the file to change, stored after the data to write
+ * @data: the data to write
+ */
+struct storage_txn_op {
+    struct list_node node;
+    enum storage_txn_op_type type;
+    storage_off_t off;
+    size_t size;
+    const char* name;
+    uint8_t data[];
+};
+
+/**
+ * struct storage_txn_file - a file opened while committing
+ * @node: list node in the list of open files
+ * @fh:   the open file handle
+ * @name: the name the file was opened by
+ */
+struct storage_txn_file {
+    struct list_node node;
+    file_handle_t fh;
+    const char* name;
+};
+
+/**
+ * struct storage_txn - a recorded transaction
+ * @session: the session to commit through
+ * @ops:     recorded changes, oldest first
+ */
+struct storage_txn {
+    storage_session_t session;
+    struct list_node ops;
+};
+
+int storage_txn_create(storage_session_t session, struct storage_txn** txn_p) {
+    struct storage_txn* txn = calloc(1, sizeof(*txn));
+
+    if (!txn) {
+        return ERR_NO_MEMORY;
+    }
+    txn->session = session;
+    list_initialize(&txn->ops);
+    *txn_p = txn;
+    return NO_ERROR;
+}
+
+static void drop_ops(struct storage_txn* txn) {
+    struct storage_txn_op* op;
+
+    while ((op = list_remove_head_type(&txn->ops, struct storage_txn_op,
+                                       node))) {
+        free(op);
+    }
+}
+
+void storage_txn_destroy(struct storage_txn* txn) {
+    if (!txn) {
+        return;
+    }
+    drop_ops(txn);
+    free(txn);
+}
+
+static int add_op(struct storage_txn* txn,
+                  enum storage_txn_op_type type,
+                  const char* name,
+                  storage_off_t off,
+                  const void* buf,
+                  size_t size) {
+    size_t name_size = strlen(name) + 1;
+    struct storage_txn_op* op;
+    char* op_name;
+
+    op = malloc(sizeof(*op) + size + name_size);
+    if (!op) {
+        return ERR_NO_MEMORY;
+    }
+    op->type = type;
+    op->off = off;
+    op->size = size;
+    if (size) {
+        memcpy(op->data, buf, size);
+    }
+    op_name = (char*)op->data + size;
+    memcpy(op_name, name, name_size);
+    op->name = op_name;
+    list_add_tail(&txn->ops, &op->node);
+    return NO_ERROR;
+}
+
+int storage_txn_write(struct storage_txn* txn,
+                      const char* name,
+                      storage_off_t off,
+                      const void* buf,
+                      size_t size) {
+    return add_op(txn, STORAGE_TXN_OP_WRITE, name, off, buf, size);
+}
+
+int storage_txn_set_file_size(struct storage_txn* txn,
+                              const char* name,
+                              storage_off_t file_size) {
+    return add_op(txn, STORAGE_TXN_OP_SET_SIZE, name, file_size, NULL, 0);
+}
+
+int storage_txn_delete(struct storage_txn* txn, const char* name) {
+    return add_op(txn, STORAGE_TXN_OP_DELETE, name, 0, NULL, 0);
+}
+
+static struct storage_txn_file* find_file(struct list_node* files,
+                                          const char* name) {
+    struct storage_txn_file* file;
+
+    list_for_every_entry(files, file, struct storage_txn_file, node) {
+        if (!strcmp(file->name, name)) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+static int get_file(struct storage_txn* txn,
+                    struct list_node* files,
+                    const char* name,
+                    file_handle_t* fh_p) {
+    struct storage_txn_file* file = find_file(files, name);
+    int rc;
+
+    if (file) {
+        *fh_p = file->fh;
+        return NO_ERROR;
+    }
+    file = malloc(sizeof(*file));
+    if (!file) {
+        return ERR_NO_MEMORY;
+    }
+    rc = storage_open_file(txn->session, &file->fh, name,
+                           STORAGE_FILE_OPEN_CREATE, 0);
+    if (rc < 0) {
+        free(file);
+        return rc;
+    }
+    /* @name belongs to an operation, which outlives the open file */
+    file->name = name;
+    list_add_tail(files, &file->node);
+    *fh_p = file->fh;
+    return NO_ERROR;
+}
+
+static void close_file(struct storage_txn_file* file) {
+    list_delete(&file->node);
+    storage_close_file(file->fh);
+    free(file);
+}
+
+static int apply_op(struct storage_txn* txn,
+                    struct list_node* files,
+                    struct storage_txn_op* op,
+                    uint32_t opflags) {
+    struct storage_txn_file* file;
+    file_handle_t fh;
+    ssize_t rc;
+
+    if (op->type == STORAGE_TXN_OP_DELETE) {
+        file = find_file(files, op->name);
+        if (file) {
+            close_file(file);
+        }
+        return storage_delete_file(txn->session, op->name, opflags);
+    }
+
+    rc = get_file(txn, files, op->name, &fh);
+    if (rc < 0) {
+        return rc;
+    }
+    if (op->type == STORAGE_TXN_OP_SET_SIZE) {
+        return storage_set_file_size(fh, op->off, opflags);
+    }
+    rc = storage_write(fh, op->off, op->data, op->size, opflags);
+    if (rc < 0) {
+        return rc;
+    }
+    return (size_t)rc == op->size ? NO_ERROR : ERR_IO;
+}
+
+/* Apply all operations and commit them, or discard them on failure */
+static int apply(struct storage_txn* txn) {
+    struct list_node files = LIST_INITIAL_VALUE(files);
+    struct storage_txn_file* file;
+    struct storage_txn_op* last;
+    struct storage_txn_op* op;
+    bool commit_last;
+    int rc = NO_ERROR;
+
+    last = list_peek_tail_type(&txn->ops, struct storage_txn_op, node);
+    /* writing nothing sends no request that could carry the commit */
+    commit_last = last && (last->type != STORAGE_TXN_OP_WRITE || last->size);
+    list_for_every_entry(&txn->ops, op, struct storage_txn_op, node) {
+        rc = apply_op(txn, &files, op,
+                      op == last && commit_last ? STORAGE_OP_COMPLETE : 0);
+        if (rc < 0) {
+            break;
+        }
+    }
+    if (rc >= 0 && last && !commit_last) {
+        rc = storage_end_transaction(txn->session, true);
+    }
+
+    while ((file = list_peek_head_type(&files, struct storage_txn_file,
+                                       node))) {
+        close_file(file);
+    }
+    if (rc < 0) {
+        storage_end_transaction(txn->session, false);
+    }
+    return rc;
+}
+
+int storage_txn_commit(struct storage_txn* txn) {
+    uint64_t delay_msec = STORAGE_TXN_BACKOFF_MIN_MSEC;
+    int attempt;
+    int rc;
+
+    for (attempt = 1;; attempt++) {
+        rc = apply(txn);
+        if (rc != ERR_BUSY || attempt >= STORAGE_TXN_MAX_ATTEMPTS) {
+            break;
+        }
+        trusty_nanosleep(0, 0, delay_msec * 1000 * 1000);
+        delay_msec = MIN(delay_msec * 2, STORAGE_TXN_BACKOFF_MAX_MSEC);
+    }
+
+    drop_ops(txn);
+    return rc;
+}
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Write-back buffering of uncommitted writes.
+ *
+ * Writes are kept as dirty extents, sorted by offset, per file handle. A write
+ * that overlaps or touches existing extents of the same file is merged with
+ * them into a single extent, with the newest data winning. Extents are written
+ * out in offset order, one storage_write_direct() call each, when the session
+ * commits, when an operation depends on them, or when more than the configured
+ * number of dirty bytes is buffered. Handles opened separately may refer to
+ * the same file, so operations that read or change a file write out the dirty
+ * extents of all files, and only closing a handle writes out just its own.
+ */
+
+#include <lk/list.h>
+#include <lk/macros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uapi/err.h>
+
+#include "storage_priv.h"
+
+/**
+ * struct storage_wb_extent - a dirty range of a file
+ * @node: list node in &storage_wb_file->extents
+ * @off:  offset of the range in the file
+ * @len:  length of the range
+ * @data: the data to write
+ */
+struct storage_wb_extent {
+    struct list_node node;
+    storage_off_t off;
+    size_t len;
+    uint8_t data[];
+};
+
+/**
+ * struct storage_wb_file - dirty extents of a file
+ * @node:    list node in &storage_write_back->files
+ * @fh:      the file handle the extents are written through
+ * @extents: dirty extents sorted by offset, never overlapping or touching.
+ *           Files without extents are removed, so storage_wb_flush_all()
+ *           always has a write to carry its flags.
+ */
+struct storage_wb_file {
+    struct list_node node;
+    file_handle_t fh;
+    struct list_node extents;
+};
+
+/**
+ * struct storage_write_back - write-back state of a session
+ * @max_bytes:   number of dirty bytes above which everything is written out
+ * @dirty_bytes: number of bytes in all dirty extents
+ * @files:       files with dirty extents
+ */
+struct storage_write_back {
+    size_t max_bytes;
+    size_t dirty_bytes;
+    struct list_node files;
+};
+
+struct storage_write_back* storage_wb_create(size_t max_bytes) {
+    struct storage_write_back* wb = calloc(1, sizeof(*wb));
+
+    if (!wb) {
+        return NULL;
+    }
+    wb->max_bytes = max_bytes;
+    list_initialize(&wb->files);
+    return wb;
+}
+
+static void free_file(struct storage_write_back* wb,
+                      struct storage_wb_file* file) {
+    struct storage_wb_extent* ext;
+
+    while ((ext = list_remove_head_type(&file->extents,
+                                        struct storage_wb_extent, node))) {
+        wb->dirty_bytes -= ext->len;
+        free(ext);
+    }
+    list_delete(&file->node);
+    free(file);
+}
+
+void storage_wb_discard(struct storage_write_back* wb) {
+    struct storage_wb_file* file;
+
+    if (!wb) {
+        return;
+    }
+    while ((file = list_peek_head_type(&wb->files, struct storage_wb_file,
+                                       node))) {
+        free_file(wb, file);
+    }
+}
+
+void storage_wb_destroy(struct storage_write_back* wb) {
+    storage_wb_discard(wb);
+    free(wb);
+}
+
+static struct storage_wb_file* find_file(struct storage_write_back* wb,
+                                         file_handle_t fh) {
+    struct storage_wb_file* file;
+
+    list_for_every_entry(&wb->files, file, struct storage_wb_file, node) {
+        if (file->fh == fh) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Write out the extents of @file, applying @opflags to the last one, and free
+ * it. On failure all dirty data of the session is discarded, as the server has
+ * put the transaction in an error state that only ending it can clear.
+ */
+static int flush_file(struct storage_write_back* wb,
+                      struct storage_wb_file* file,
+                      uint32_t opflags) {
+    struct storage_wb_extent* ext;
+    ssize_t rc;
+
+    while ((ext = list_remove_head_type(&file->extents,
+                                        struct storage_wb_extent, node))) {
+        rc = storage_write_direct(
+                file->fh, ext->off, ext->data, ext->len,
+                list_is_empty(&file->extents) ? opflags : 0);
+        wb->dirty_bytes -= ext->len;
+        free(ext);
+        if (rc < 0) {
+            free_file(wb, file);
+            storage_wb_discard(wb);
+            return rc;
+        }
+    }
+    free_file(wb, file);
+    return NO_ERROR;
+}
+
+int storage_wb_flush(struct storage_write_back* wb, file_handle_t fh) {
+    struct storage_wb_file* file;
+
+    if (!wb) {
+        return NO_ERROR;
+    }
+    file = find_file(wb, fh);
+    return file ? flush_file(wb, file, 0) : NO_ERROR;
+}
+
+int storage_wb_flush_all(struct storage_write_back* wb, uint32_t opflags) {
+    struct storage_wb_file* file;
+    int rc;
+
+    if (!wb) {
+        return NO_ERROR;
+    }
+    while ((file = list_peek_head_type(&wb->files, struct storage_wb_file,
+                                       node))) {
+        rc = flush_file(wb, file,
+                        file->node.next == &wb->files ? opflags : 0);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return NO_ERROR;
+}
+
+int storage_wb_add(struct storage_write_back* wb,
+                   file_handle_t fh,
+                   storage_off_t off,
+                   const void* buf,
+                   size_t size) {
+    struct storage_wb_file* file;
+    struct storage_wb_extent* ext;
+    struct storage_wb_extent* tmp;
+    struct storage_wb_extent* merged;
+    struct list_node* insert_before;
+    storage_off_t start = off;
+    storage_off_t end = off + size;
+
+    if (!size) {
+        return NO_ERROR;
+    }
+
+    file = find_file(wb, fh);
+    if (!file) {
+        file = calloc(1, sizeof(*file));
+        if (!file) {
+            return ERR_NO_MEMORY;
+        }
+        file->fh = fh;
+        list_initialize(&file->extents);
+        list_add_tail(&wb->files, &file->node);
+    }
+
+    /* grow the range over every extent it overlaps or touches */
+    list_for_every_entry(&file->extents, ext, struct storage_wb_extent, node) {
+        if (ext->off > end) {
+            break;
+        }
+        if (ext->off + ext->len >= start) {
+            start = MIN(start, ext->off);
+            end = MAX(end, ext->off + ext->len);
+        }
+    }
+
+    merged = malloc(sizeof(*merged) + (end - start));
+    if (!merged) {
+        /* don't leave a file without extents behind */
+        if (list_is_empty(&file->extents)) {
+            free_file(wb, file);
+        }
+        return ERR_NO_MEMORY;
+    }
+    merged->off = start;
+    merged->len = end - start;
+
+    insert_before = &file->extents;
+    list_for_every_entry_safe(&file->extents, ext, tmp,
+                              struct storage_wb_extent, node) {
+        if (ext->off > end) {
+            insert_before = &ext->node;
+            break;
+        }
+        if (ext->off + ext->len >= start) {
+            memcpy(merged->data + (ext->off - start), ext->data, ext->len);
+            list_delete(&ext->node);
+            wb->dirty_bytes -= ext->len;
+            free(ext);
+        }
+    }
+    memcpy(merged->data + (off - start), buf, size);
+    list_add_before(insert_before, &merged->node);
+    wb->dirty_bytes += merged->len;
+
+    if (wb->dirty_bytes > wb->max_bytes) {
+        return storage_wb_flush_all(wb, 0);
+    }
+    return NO_ERROR;
+}
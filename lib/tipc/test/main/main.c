@@ -2537,11 +2537,11 @@ static bool run_test(struct unittest* test) {
     handle_base = (handle_t)USER_BASE_HANDLE;
 
     /*
-     * HACK: We know a connection was made after _port_handle was created to
-     * trigger the test, so we need to add two to _port_handle to get the first
-     * free handle index.
+     * HACK: We know a connection was made after _ext_port_handle, the last
+     * port of the test, was created to trigger the test, so we need to add two
+     * to _ext_port_handle to get the first free handle index.
      */
-    first_free_handle_index = test->_port_handle + 2 - handle_base;
+    first_free_handle_index = test->_ext_port_handle + 2 - handle_base;
     TLOGI("first_free_handle_index: %d\n", first_free_handle_index);
 
     kernel_wait_any_bug_workaround();
@@ -21,9 +21,12 @@
 #![no_std]
 
 use log::{Level, LevelFilter, Log, Metadata, Record};
-use trusty_std::io::{stderr, Write};
+use trusty_std::io::{stderr, LineWriter, Write};
 use trusty_std::write;
 
+/// Records up to this length are written to stderr with a single syscall.
+const LOG_LINE_CAPACITY: usize = 256;
+
 pub struct TrustyLogger;
 
 impl Log for TrustyLogger {
@@ -33,7 +36,8 @@ impl Log for TrustyLogger {
 
     fn log(&self, record: &Record) {
         if self.enabled(record.metadata()) {
-            let _ = write!(stderr(), "{} - {}\n", record.level(), record.args());
+            let mut out = LineWriter::<_, LOG_LINE_CAPACITY>::new(stderr());
+            let _ = write!(out, "{} - {}\n", record.level(), record.args());
         }
     }
 
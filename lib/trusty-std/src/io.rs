@@ -44,6 +44,84 @@ impl Write for Stderr {
     }
 }
 
+/// Buffers output to `W` and writes it out in a single call once a full line
+/// has been written.
+///
+/// Formatting macros like `write!` call [`Write::write_str`] once for every
+/// piece of the formatted output. Wrapping an unbuffered writer like
+/// [`Stderr`] in a `LineWriter` turns these into a single write per line. The
+/// buffer has a fixed capacity of `N` bytes; output that does not fit is
+/// written out as soon as the buffer fills up.
+///
+/// Any buffered output is written out when the `LineWriter` is dropped.
+///
+/// # Examples
+///
+/// ```
+/// use trusty_std::io::{stderr, LineWriter, Write};
+///
+/// let mut out = LineWriter::<_, 256>::new(stderr());
+/// writeln!(out, "{} - {}", "INFO", "one writev for this line").unwrap();
+/// ```
+pub struct LineWriter<W: Write, const N: usize> {
+    inner: W,
+    len: usize,
+    buf: [u8; N],
+}
+
+impl<W: Write, const N: usize> LineWriter<W, N> {
+    /// Creates a new `LineWriter` writing to `inner`.
+    pub fn new(inner: W) -> Self {
+        Self { inner, len: 0, buf: [0; N] }
+    }
+
+    /// Writes out any buffered output.
+    pub fn flush(&mut self) -> fmt::Result {
+        if self.len == 0 {
+            return Ok(());
+        }
+        // SAFETY: buf only ever contains whole strs and prefixes of strs that
+        // end on a char boundary, so it is valid UTF-8.
+        let buffered = unsafe { core::str::from_utf8_unchecked(&self.buf[..self.len]) };
+        let ret = self.inner.write_str(buffered);
+        self.len = 0;
+        ret
+    }
+}
+
+impl<W: Write, const N: usize> Write for LineWriter<W, N> {
+    fn write_str(&mut self, mut s: &str) -> fmt::Result {
+        while !s.is_empty() {
+            let mut n = s.len().min(N - self.len);
+            while !s.is_char_boundary(n) {
+                n -= 1;
+            }
+            if n == 0 {
+                if self.len == 0 {
+                    // The buffer cannot hold even a single char of s.
+                    return self.inner.write_str(s);
+                }
+                self.flush()?;
+                continue;
+            }
+            let (head, tail) = s.split_at(n);
+            self.buf[self.len..self.len + n].copy_from_slice(head.as_bytes());
+            self.len += n;
+            if self.len == N || head.contains('\n') {
+                self.flush()?;
+            }
+            s = tail;
+        }
+        Ok(())
+    }
+}
+
+impl<W: Write, const N: usize> Drop for LineWriter<W, N> {
+    fn drop(&mut self) {
+        let _ = self.flush();
+    }
+}
+
 pub(crate) fn panic_output() -> Option<impl Write> {
     Some(stderr())
 }
@@ -1,2 +1,212 @@
-/// Placeholder struct because we don't support benchmarking (yet).
-pub struct Bencher;
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Benchmarking support for `#[bench]` functions.
+//!
+//! A benchmark is first warmed up, then the number of iterations per sample is
+//! calibrated so that a single sample takes roughly [`TARGET_SAMPLE_NS`]. The
+//! benchmark then collects up to [`SAMPLE_COUNT`] samples, bounded by
+//! [`MAX_BENCH_NS`] of total run time, and reports the per-iteration
+//! statistics of those samples.
+
+use core::fmt;
+
+pub use core::hint::black_box;
+
+use super::options::BenchMode;
+
+/// Number of timed samples collected for each benchmark.
+pub const SAMPLE_COUNT: usize = 50;
+
+/// Time spent running the benchmark before any measurements are taken.
+pub const WARMUP_NS: u64 = 10_000_000;
+
+/// Target duration of a single sample during iteration calibration.
+pub const TARGET_SAMPLE_NS: u64 = 1_000_000;
+
+/// Upper bound on the time spent collecting samples for one benchmark.
+pub const MAX_BENCH_NS: u64 = 3_000_000_000;
+
+/// Upper bound on the number of iterations in a single sample.
+const MAX_ITERS_PER_SAMPLE: u64 = 1 << 24;
+
+/// Returns the current monotonic time in nanoseconds.
+pub fn now_ns() -> u64 {
+    let mut time: i64 = 0;
+    // SAFETY: syscall, time is borrowed mutably and outlives the call. Clock 0
+    // is the monotonic clock used by trusty_gettime() callers.
+    let rc = unsafe { trusty_sys::gettime(0, 0, &mut time) };
+    if rc != 0 || time < 0 {
+        panic!("gettime failed: {}", rc);
+    }
+    time as u64
+}
+
+/// Per-iteration statistics of a benchmark, in nanoseconds.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct Summary {
+    pub min: u64,
+    pub median: u64,
+    pub p99: u64,
+    pub max: u64,
+    pub mean: u64,
+    /// Number of iterations timed in each sample.
+    pub iters_per_sample: u64,
+    /// Number of samples the statistics were computed over.
+    pub samples: usize,
+}
+
+impl Summary {
+    /// Compute the statistics of `samples` (ns per iteration), sorting the
+    /// slice in place.
+    pub fn new(samples: &mut [u64], iters_per_sample: u64) -> Summary {
+        if samples.is_empty() {
+            return Summary { iters_per_sample, ..Default::default() };
+        }
+        samples.sort_unstable();
+        let sum: u128 = samples.iter().map(|&s| s as u128).sum();
+        Summary {
+            min: samples[0],
+            median: percentile(samples, 50),
+            p99: percentile(samples, 99),
+            max: samples[samples.len() - 1],
+            mean: (sum / samples.len() as u128) as u64,
+            iters_per_sample,
+            samples: samples.len(),
+        }
+    }
+}
+
+/// Nearest-rank percentile of a sorted, non-empty slice.
+fn percentile(sorted: &[u64], pct: usize) -> u64 {
+    let rank = (sorted.len() * pct + 99) / 100;
+    sorted[rank.saturating_sub(1).min(sorted.len() - 1)]
+}
+
+/// Manager of the benchmarking runs.
+///
+/// This is fed into functions marked with `#[bench]` to allow for
+/// set-up & tear-down before running a piece of code repeatedly via a
+/// call to `iter`.
+pub struct Bencher {
+    mode: BenchMode,
+    summary: Option<Summary>,
+    /// Number of bytes processed by one iteration, used to report throughput.
+    pub bytes: u64,
+}
+
+impl Bencher {
+    pub(crate) fn new(mode: BenchMode) -> Bencher {
+        Bencher { mode, summary: None, bytes: 0 }
+    }
+
+    /// Callback for benchmark functions to run in their body.
+    pub fn iter<T, F>(&mut self, mut inner: F)
+    where
+        F: FnMut() -> T,
+    {
+        if self.mode == BenchMode::Single {
+            time_iters(&mut inner, 1);
+            return;
+        }
+        self.summary = Some(measure(&mut inner));
+    }
+
+    /// Run `f` with this bencher and return the collected statistics, if `f`
+    /// called [`Bencher::iter`].
+    pub fn bench<F>(&mut self, mut f: F) -> Option<Summary>
+    where
+        F: FnMut(&mut Bencher),
+    {
+        f(self);
+        self.summary
+    }
+}
+
+/// Run `inner` `iters` times and return the elapsed time in nanoseconds.
+fn time_iters<T, F>(inner: &mut F, iters: u64) -> u64
+where
+    F: FnMut() -> T,
+{
+    let start = now_ns();
+    for _ in 0..iters {
+        black_box(inner());
+    }
+    now_ns().saturating_sub(start)
+}
+
+fn measure<T, F>(inner: &mut F) -> Summary
+where
+    F: FnMut() -> T,
+{
+    let warmup_start = now_ns();
+    loop {
+        black_box(inner());
+        if now_ns().saturating_sub(warmup_start) >= WARMUP_NS {
+            break;
+        }
+    }
+
+    let mut iters = 1u64;
+    while iters < MAX_ITERS_PER_SAMPLE && time_iters(inner, iters) < TARGET_SAMPLE_NS {
+        iters *= 2;
+    }
+
+    let mut samples = [0u64; SAMPLE_COUNT];
+    let mut count = 0;
+    let bench_start = now_ns();
+    while count < SAMPLE_COUNT {
+        samples[count] = time_iters(inner, iters) / iters;
+        count += 1;
+        if now_ns().saturating_sub(bench_start) >= MAX_BENCH_NS {
+            break;
+        }
+    }
+
+    Summary::new(&mut samples[..count], iters)
+}
+
+/// Run a single benchmark function and return its statistics.
+pub(crate) fn run_bench<F>(mode: BenchMode, f: F) -> (Option<Summary>, u64)
+where
+    F: FnMut(&mut Bencher),
+{
+    let mut bencher = Bencher::new(mode);
+    let summary = bencher.bench(f);
+    (summary, bencher.bytes)
+}
+
+/// Formats benchmark results as a single report line body.
+pub(crate) struct BenchResult {
+    pub summary: Summary,
+    pub bytes: u64,
+}
+
+impl fmt::Display for BenchResult {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let s = &self.summary;
+        write!(
+            f,
+            "{} ns/iter (min {}, p99 {}, max {}) {} x {} iters",
+            s.median, s.min, s.p99, s.max, s.samples, s.iters_per_sample
+        )?;
+        if self.bytes != 0 && s.median != 0 {
+            // bytes per ns * 1000 == MB/s
+            write!(f, " = {} MB/s", self.bytes.saturating_mul(1000) / s.median)?;
+        }
+        Ok(())
+    }
+}
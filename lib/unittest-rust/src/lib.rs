@@ -32,25 +32,55 @@
 //! # Trusty Rust Testing Framework
 
 #![no_std]
+#![feature(bench_black_box)]
 
-use log::info;
 use trusty_std::alloc::Vec;
+use trusty_std::ffi::CString;
 
 // Public reexports
-pub use self::bench::Bencher;
+pub use self::bench::{black_box, Bencher, Summary};
 pub use self::options::{ColorConfig, Options, OutputFormat, RunIgnored, ShouldPanic};
 pub use self::types::TestName::*;
 pub use self::types::*;
 
 mod bench;
 mod options;
+mod service;
 mod types;
 
+use bench::BenchResult;
+use options::BenchMode;
+
+/// Print a line to stderr and to the connected test client, if any.
+macro_rules! test_println {
+    ($($arg:tt)*) => {
+        $crate::service::print(format_args!("{}\n", format_args!($($arg)*)))
+    };
+}
+
+extern "Rust" {
+    /// Name of the test port, defined by the crate under test with [`init!`].
+    static TRUSTY_TEST_PORT: &'static str;
+}
+
+/// Set the name of the port the test service for this crate listens on.
+///
+/// Test crates must invoke this macro exactly once at the crate root, e.g.
+/// `test::init!("com.android.trusty.rust.tipc.test");`.
+#[macro_export]
+macro_rules! init {
+    ($port_str:expr) => {
+        #[no_mangle]
+        pub static TRUSTY_TEST_PORT: &'static str = $port_str;
+    };
+}
+
 /// A variant optimized for invocation with a static test vector.
 /// This will panic (intentionally) when fed any dynamic tests.
 ///
-/// Runs tests in panic=abort mode, which involves spawning subprocesses for
-/// tests.
+/// Runs tests in panic=abort mode. A failing test aborts the app, which closes
+/// the connection to the test client without a result and is reported as a
+/// failure by the host.
 ///
 /// This is the entry point for the main function generated by `rustc --test`
 /// when panic=abort.
@@ -59,9 +89,47 @@ pub fn test_main_static_abort(tests: &[&TestDescAndFn]) {
 
     let owned_tests: Vec<_> = tests.iter().map(make_owned_test).collect();
 
-    // TODO: instantiate test service
+    // SAFETY: This static is defined by the init! macro in the crate being
+    // tested and is never mutated.
+    let port_str = unsafe { TRUSTY_TEST_PORT };
+    let port = CString::try_new(port_str).expect("Could not allocate test port name");
+
+    let rc = service::serve(port.as_c_str(), || run_tests(&owned_tests));
+    panic!("test service for {} exited: {}", port_str, rc);
+}
+
+/// Run every test and benchmark in `tests`, returning whether they all passed.
+fn run_tests(tests: &[TestDescAndFn]) -> bool {
+    let mut skipped = 0;
+
+    test_println!("[==========] Running {} tests", tests.len());
+    for test in tests {
+        let name = test.desc.name.as_slice();
+
+        if test.desc.ignore || test.desc.should_panic != ShouldPanic::No {
+            // should_panic tests cannot run in panic=abort mode
+            test_println!("[  SKIPPED ] {}", name);
+            skipped += 1;
+            continue;
+        }
+
+        test_println!("[ RUN      ] {}", name);
+        match test.testfn {
+            StaticTestFn(f) => f(),
+            StaticBenchFn(f) => match bench::run_bench(BenchMode::Auto, f) {
+                (Some(summary), bytes) => {
+                    test_println!("[    BENCH ] {} {}", name, BenchResult { summary, bytes })
+                }
+                (None, _) => test_println!("[    BENCH ] {} did not call Bencher::iter", name),
+            },
+            _ => unreachable!("non-static tests are rejected by make_owned_test"),
+        }
+        test_println!("[       OK ] {}", name);
+    }
+    test_println!("[==========] Done, {} passed, {} skipped", tests.len() - skipped, skipped);
 
-    for test in owned_tests {}
+    // Failing tests abort, so reaching this point means all tests passed
+    true
 }
 
 /// Clones static values for putting into a dynamic vector, which test_main()
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Test port service.
+//!
+//! Speaks the same protocol as the C unittest library (lib/unittest): each
+//! connection to the test port runs the whole test suite, streams
+//! `TEST_MESSAGE` log lines back to the client and finishes with a single
+//! `TEST_PASSED` or `TEST_FAILED` byte.
+
+use core::fmt::{self, Write};
+use core::mem::MaybeUninit;
+use core::sync::atomic::{AtomicI32, Ordering};
+use trusty_std::ffi::CStr;
+use trusty_sys::{c_long, handle_t};
+
+// Keep in sync with trusty_ipc.h and uapi/err.h
+const INFINITE_TIME: u32 = u32::MAX;
+const IPC_PORT_ALLOW_TA_CONNECT: u32 = 1;
+const IPC_PORT_ALLOW_NS_CONNECT: u32 = 2;
+const IPC_HANDLE_POLL_READY: u32 = 1;
+const IPC_HANDLE_POLL_SEND_UNBLOCKED: u32 = 16;
+const ERR_NOT_ENOUGH_BUFFER: c_long = -9;
+
+const MAX_PORT_BUF_SIZE: u32 = 4096;
+const MAX_MESSAGE_SIZE: usize = 256;
+
+#[repr(u8)]
+#[derive(Clone, Copy)]
+enum TestMessageHeader {
+    Passed = 0,
+    Failed = 1,
+    Message = 2,
+}
+
+const INVALID_HANDLE: handle_t = -1;
+
+/// Channel of the client whose test run is in progress, if any.
+static CURRENT_CHANNEL: AtomicI32 = AtomicI32::new(INVALID_HANDLE);
+
+fn wait_handle(handle: handle_t) -> Result<trusty_sys::uevent, c_long> {
+    let mut uevent = MaybeUninit::zeroed();
+    // SAFETY: syscall, uevent is borrowed mutably and outlives the call
+    let rc = unsafe { trusty_sys::wait(handle, uevent.as_mut_ptr(), INFINITE_TIME) };
+    if rc < 0 {
+        Err(rc)
+    } else {
+        // SAFETY: the wait call succeeded, so uevent has been initialized.
+        Ok(unsafe { uevent.assume_init() })
+    }
+}
+
+fn send_raw(handle: handle_t, buf: &[u8]) -> c_long {
+    let iov = trusty_sys::iovec { iov_base: buf.as_ptr().cast(), iov_len: buf.len() };
+    let mut msg =
+        trusty_sys::ipc_msg { num_iov: 1, iov: &iov, num_handles: 0, handles: core::ptr::null_mut() };
+    // SAFETY: syscall, msg and the buffer it refers to outlive the call
+    unsafe { trusty_sys::send_msg(handle, &mut msg) }
+}
+
+/// Send `buf`, waiting once for the queue to drain if it is full.
+fn send_msg_wait(handle: handle_t, buf: &[u8]) -> Result<(), c_long> {
+    let rc = send_raw(handle, buf);
+    if rc != ERR_NOT_ENOUGH_BUFFER {
+        return if rc < 0 { Err(rc) } else { Ok(()) };
+    }
+    let ev = wait_handle(handle)?;
+    if ev.event & IPC_HANDLE_POLL_SEND_UNBLOCKED == 0 {
+        return Err(rc);
+    }
+    let rc = send_raw(handle, buf);
+    if rc < 0 {
+        Err(rc)
+    } else {
+        Ok(())
+    }
+}
+
+/// Formatting buffer for a single `TEST_MESSAGE`. Output that does not fit is
+/// truncated.
+struct MessageBuf {
+    buf: [u8; MAX_MESSAGE_SIZE],
+    len: usize,
+}
+
+impl MessageBuf {
+    fn new() -> Self {
+        let mut buf = [0u8; MAX_MESSAGE_SIZE];
+        buf[0] = TestMessageHeader::Message as u8;
+        Self { buf, len: 1 }
+    }
+}
+
+impl Write for MessageBuf {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        let n = s.len().min(self.buf.len() - self.len);
+        self.buf[self.len..self.len + n].copy_from_slice(&s.as_bytes()[..n]);
+        self.len += n;
+        Ok(())
+    }
+}
+
+/// Print a line to stderr and, if a client is connected, to the test port.
+pub(crate) fn print(args: fmt::Arguments<'_>) {
+    let _ = trusty_std::io::stderr().write_fmt(args);
+
+    let chan = CURRENT_CHANNEL.load(Ordering::Relaxed);
+    if chan == INVALID_HANDLE {
+        return;
+    }
+    let mut msg = MessageBuf::new();
+    let _ = msg.write_fmt(args);
+    let _ = send_msg_wait(chan, &msg.buf[..msg.len]);
+}
+
+/// Create the test port `port` and run `run_tests` for every connection.
+///
+/// Only returns if the port could not be created or waiting on it failed.
+pub(crate) fn serve<F>(port: &CStr, mut run_tests: F) -> c_long
+where
+    F: FnMut() -> bool,
+{
+    // SAFETY: syscall, port is a valid null-terminated string
+    let rc = unsafe {
+        trusty_sys::port_create(
+            port.as_ptr(),
+            1,
+            MAX_PORT_BUF_SIZE,
+            IPC_PORT_ALLOW_NS_CONNECT | IPC_PORT_ALLOW_TA_CONNECT,
+        )
+    };
+    if rc < 0 {
+        return rc;
+    }
+    let port_handle = rc as handle_t;
+
+    loop {
+        let ev = match wait_handle(port_handle) {
+            Ok(ev) => ev,
+            Err(rc) => return rc,
+        };
+        if ev.event & IPC_HANDLE_POLL_READY == 0 {
+            continue;
+        }
+
+        let mut peer = MaybeUninit::<trusty_sys::uuid>::uninit();
+        // SAFETY: syscall, peer is borrowed mutably and outlives the call
+        let rc = unsafe { trusty_sys::accept(port_handle, peer.as_mut_ptr()) };
+        if rc < 0 {
+            continue;
+        }
+        let chan = rc as handle_t;
+
+        CURRENT_CHANNEL.store(chan, Ordering::Relaxed);
+        let passed = run_tests();
+        CURRENT_CHANNEL.store(INVALID_HANDLE, Ordering::Relaxed);
+
+        let result = if passed { TestMessageHeader::Passed } else { TestMessageHeader::Failed };
+        let _ = send_msg_wait(chan, &[result as u8]);
+
+        // SAFETY: syscall, chan is owned by this function
+        unsafe {
+            trusty_sys::close(chan);
+        }
+    }
+}
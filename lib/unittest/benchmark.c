@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <lib/unittest/benchmark.h>
+
+#include <inttypes.h>
+#include <lib/unittest/unittest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <trusty/time.h>
+#include <trusty_log.h>
+#include <uapi/err.h>
+
+/* untimed runs before each measurement, as a fraction of the timed runs */
+#define BENCH_WARMUP_DIVISOR 10
+
+/*
+ * Each sample times a batch of body runs calibrated to take about this long,
+ * so that the cost of reading the clock does not dominate short bodies.
+ */
+#define BENCH_TARGET_SAMPLE_NS 1000000
+#define BENCH_MAX_ITERS_PER_SAMPLE (1U << 24)
+
+static struct bench* bench_list;
+
+void bench_register(struct bench* bench) {
+    struct bench** tail = &bench_list;
+
+    /* keep registration order so results are reported in source order */
+    while (*tail) {
+        tail = &(*tail)->_next;
+    }
+    bench->_next = NULL;
+    *tail = bench;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t isqrt64(uint64_t n) {
+    uint64_t lo = 0;
+    uint64_t hi = MIN(n, UINT32_MAX) + 1;
+
+    /* largest x such that x * x <= n */
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (mid * mid <= n) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* nearest-rank percentile of a sorted, non-empty array */
+static uint64_t percentile(const uint64_t* sorted, size_t count, size_t pct) {
+    size_t rank = (count * pct + 99) / 100;
+
+    return sorted[rank ? MIN(rank, count) - 1 : 0];
+}
+
+void bench_compute_stats(uint64_t* samples,
+                         size_t count,
+                         struct bench_stats* stats) {
+    uint64_t sum = 0;
+    double var_sum = 0;
+
+    *stats = (struct bench_stats){0};
+    if (!count) {
+        return;
+    }
+
+    qsort(samples, count, sizeof(*samples), compare_u64);
+    for (size_t i = 0; i < count; i++) {
+        sum += samples[i];
+    }
+
+    stats->runs = count;
+    stats->min = samples[0];
+    stats->max = samples[count - 1];
+    stats->avg = sum / count;
+    stats->p50 = percentile(samples, count, 50);
+    stats->p99 = percentile(samples, count, 99);
+
+    /* accumulate in double so long runs cannot overflow the sum */
+    for (size_t i = 0; i < count; i++) {
+        double d = (double)samples[i] - (double)stats->avg;
+        var_sum += d * d;
+    }
+    stats->stddev = isqrt64((uint64_t)(var_sum / count));
+}
+
+static int64_t bench_now_ns(void) {
+    int64_t t = 0;
+
+    trusty_gettime(0, &t);
+    return t;
+}
+
+/*
+ * Run the body of @bench @iters times and store the elapsed time in @ns_p.
+ * Returns the error of the first failing run.
+ */
+static int bench_time_iters(struct bench* bench,
+                            uint64_t param,
+                            size_t iters,
+                            uint64_t* ns_p) {
+    int rc;
+    int64_t start = bench_now_ns();
+
+    for (size_t i = 0; i < iters; i++) {
+        rc = bench->body(param);
+        if (rc != NO_ERROR) {
+            return rc;
+        }
+    }
+    *ns_p = (uint64_t)(bench_now_ns() - start);
+    return NO_ERROR;
+}
+
+/*
+ * Find the number of body runs per sample, doubling it until a batch takes
+ * at least BENCH_TARGET_SAMPLE_NS.
+ */
+static int bench_calibrate(struct bench* bench,
+                           uint64_t param,
+                           size_t* iters_p) {
+    int rc;
+    size_t iters = 1;
+    uint64_t ns;
+
+    for (;;) {
+        rc = bench_time_iters(bench, param, iters, &ns);
+        if (rc != NO_ERROR) {
+            return rc;
+        }
+        if (ns >= BENCH_TARGET_SAMPLE_NS ||
+            iters >= BENCH_MAX_ITERS_PER_SAMPLE) {
+            break;
+        }
+        iters *= 2;
+    }
+    *iters_p = iters;
+    return NO_ERROR;
+}
+
+static bool bench_run_param(struct bench* bench,
+                            uint64_t param,
+                            uint64_t* samples) {
+    int rc;
+    size_t i;
+    size_t warmup = MAX(bench->runs / BENCH_WARMUP_DIVISOR, 1U);
+    size_t iters = 1;
+    struct bench_stats stats;
+
+    rc = bench->setup(param);
+    if (rc != NO_ERROR) {
+        _tlog("[   FAILED ] %s.%s/%" PRIu64 ": setup failed (%d)\n",
+              bench->suite, bench->name, param, rc);
+        return false;
+    }
+
+    for (i = 0; i < warmup; i++) {
+        rc = bench->body(param);
+        if (rc != NO_ERROR) {
+            goto err_run;
+        }
+    }
+
+    i = 0;
+    rc = bench_calibrate(bench, param, &iters);
+    if (rc != NO_ERROR) {
+        goto err_run;
+    }
+
+    for (i = 0; i < bench->runs; i++) {
+        rc = bench_time_iters(bench, param, iters, &samples[i]);
+        if (rc != NO_ERROR) {
+            goto err_run;
+        }
+        samples[i] /= iters;
+    }
+
+    bench->teardown(param);
+
+    bench_compute_stats(samples, bench->runs, &stats);
+    _tlog("[    BENCH ] %s.%s/%" PRIu64 ": avg %" PRIu64 " ns, min %" PRIu64
+          " ns, p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, stddev %" PRIu64
+          " ns (%zu runs x %zu iters)\n",
+          bench->suite, bench->name, param, stats.avg, stats.min, stats.p50,
+          stats.p99, stats.stddev, stats.runs, iters);
+    _tlog("BENCH_RESULT {\"suite\": \"%s\", \"name\": \"%s\", \"param\": "
+          "%" PRIu64 ", \"runs\": %zu, \"iters\": %zu, \"min\": %" PRIu64
+          ", \"avg\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p99\": %" PRIu64
+          ", \"max\": %" PRIu64 ", \"stddev\": %" PRIu64 "}\n",
+          bench->suite, bench->name, param, stats.runs, iters, stats.min,
+          stats.avg, stats.p50, stats.p99, stats.max, stats.stddev);
+    return true;
+
+err_run:
+    bench->teardown(param);
+    _tlog("[   FAILED ] %s.%s/%" PRIu64 ": run %zu failed (%d)\n", bench->suite,
+          bench->name, param, i, rc);
+    return false;
+}
+
+bool unittest_run_benchmarks(void) {
+    bool passed = true;
+    struct bench* bench;
+    uint64_t* samples;
+    char name[128];
+
+    for (bench = bench_list; bench; bench = bench->_next) {
+        snprintf(name, sizeof(name), "%s.%s", bench->suite, bench->name);
+        if (!bench->runs || !unittest_should_run(name)) {
+            continue;
+        }
+        samples = calloc(bench->runs, sizeof(*samples));
+        if (!samples) {
+            _tlog("[   FAILED ] %s.%s: out of memory\n", bench->suite,
+                  bench->name);
+            passed = false;
+            continue;
+        }
+        if (!bench->param_count) {
+            passed &= bench_run_param(bench, 0, samples);
+        }
+        for (size_t i = 0; i < bench->param_count; i++) {
+            passed &= bench_run_param(bench, bench->params[i], samples);
+        }
+        free(samples);
+    }
+
+    return passed;
+}
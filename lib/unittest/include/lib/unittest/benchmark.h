@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <lk/macros.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Microbenchmarks for unittest apps.
+ *
+ * Every suite defines a setup and a teardown function, which run around each
+ * parameter value of every benchmark in the suite:
+ *
+ *   static uint8_t* buf;
+ *
+ *   BENCH_SETUP(memcpy) {
+ *       buf = malloc(2 * param);
+ *       return buf ? NO_ERROR : ERR_NO_MEMORY;
+ *   }
+ *
+ *   BENCH_TEARDOWN(memcpy) {
+ *       free(buf);
+ *   }
+ *
+ *   BENCH(memcpy, copy, 100, 16, 256, 4096) {
+ *       memcpy(buf, buf + param, param);
+ *       return NO_ERROR;
+ *   }
+ *
+ * The body of BENCH(suite, name, runs, params...) is sampled @runs times for
+ * each of the optional integer @params (or once with @param == 0 if there are
+ * none), after an untimed warmup. Each sample times a batch of body runs, as
+ * many as it takes for a batch to last about a millisecond, and records the
+ * time per run, so bodies much faster than the clock can still be measured.
+ * A benchmark fails if setup or any run returns an error.
+ *
+ * Benchmarks only run when a client asks for them with UNITTEST_RUN_BENCHMARKS
+ * on the extended port of a PORT_TEST / PORT_GTEST app, see unittest.h, and
+ * then run instead of the tests. The filter and shard of the request select
+ * benchmarks by their "suite.name". Each result is logged as a human readable
+ * line followed by a machine readable TEST_MESSAGE line of the form:
+ *
+ *   BENCH_RESULT {"suite": "memcpy", "name": "copy", "param": 16, ...}
+ *
+ * carrying the sample count, the runs per sample and the min, avg, p50, p99,
+ * max and stddev of the time per run in ns.
+ */
+
+__BEGIN_CDECLS
+
+struct bench {
+    const char* suite;
+    const char* name;
+    size_t runs;
+    const uint64_t* params;
+    size_t param_count;
+    int (*setup)(uint64_t param);
+    int (*body)(uint64_t param);
+    void (*teardown)(uint64_t param);
+    struct bench* _next;
+};
+
+/**
+ * struct bench_stats - statistics of one benchmark run, all times in ns
+ * @runs:   number of samples
+ * @min:    fastest sample
+ * @max:    slowest sample
+ * @avg:    arithmetic mean of all samples
+ * @p50:    median sample
+ * @p99:    99th percentile sample
+ * @stddev: standard deviation of all samples
+ */
+struct bench_stats {
+    size_t runs;
+    uint64_t min;
+    uint64_t max;
+    uint64_t avg;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t stddev;
+};
+
+void bench_register(struct bench* bench);
+
+/**
+ * bench_compute_stats() - compute statistics of a set of samples
+ * @samples: times per run in ns, sorted in place
+ * @count:   number of entries in @samples
+ * @stats:   pointer to &struct bench_stats to fill in
+ */
+void bench_compute_stats(uint64_t* samples,
+                         size_t count,
+                         struct bench_stats* stats);
+
+/**
+ * unittest_run_benchmarks() - run the registered benchmarks selected by the
+ *                             test client
+ *
+ * Return: true if all selected benchmarks succeeded, false otherwise.
+ */
+bool unittest_run_benchmarks(void);
+
+__END_CDECLS
+
+#define BENCH_SETUP(suite_name) static int bench_setup_##suite_name(uint64_t param)
+
+#define BENCH_TEARDOWN(suite_name) \
+    static void bench_teardown_##suite_name(uint64_t param)
+
+/*
+ * The parameter array starts with a dummy element so that it is never empty
+ * when no parameters are passed.
+ */
+#define BENCH(suite_name, bench_name, run_count, ...)                        \
+    static int bench_##suite_name##_##bench_name(uint64_t param);            \
+    static const uint64_t bench_##suite_name##_##bench_name##_params[] = {   \
+            0, ##__VA_ARGS__};                                               \
+    static struct bench bench_##suite_name##_##bench_name##_desc = {         \
+            .suite = #suite_name,                                            \
+            .name = #bench_name,                                             \
+            .runs = (run_count),                                             \
+            .params = bench_##suite_name##_##bench_name##_params + 1,        \
+            .param_count =                                                   \
+                    countof(bench_##suite_name##_##bench_name##_params) - 1, \
+            .setup = bench_setup_##suite_name,                               \
+            .body = bench_##suite_name##_##bench_name,                       \
+            .teardown = bench_teardown_##suite_name,                         \
+    };                                                                       \
+    __attribute__((constructor)) static void                                 \
+            bench_##suite_name##_##bench_name##_register(void) {             \
+        bench_register(&bench_##suite_name##_##bench_name##_desc);           \
+    }                                                                        \
+    static int bench_##suite_name##_##bench_name(uint64_t param)
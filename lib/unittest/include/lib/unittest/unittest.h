@@ -16,8 +16,10 @@
 
 #pragma once
 
+#include <lib/unittest/benchmark.h>
 #include <lk/compiler.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <trusty_ipc.h>
 
 #define PORT_TEST(suite_name, port_name_string)           \
@@ -38,12 +40,119 @@
 
 __BEGIN_CDECLS
 
+/*
+ * Test port protocol
+ *
+ * A client connecting to a test port immediately starts a run of the whole
+ * suite. The app sends the log output of the run as TEST_MESSAGE messages
+ * followed by a single TEST_PASSED or TEST_FAILED byte. Messages sent by the
+ * app are at most 256 bytes long, including the header byte.
+ *
+ * A client connecting to the extended port (the test port name followed by
+ * UNITTEST_EXT_PORT_SUFFIX) must first send a &struct unittest_run_req to
+ * select the tests to run. In addition to the messages above, the app then
+ * sends a TEST_RESULT message carrying a &struct unittest_test_result after
+ * each test that reported its result.
+ *
+ * If the &struct unittest_run_req sets UNITTEST_RUN_BENCHMARKS, the app runs
+ * its benchmarks, see benchmark.h, instead of its tests. The final byte then
+ * tells whether all selected benchmarks succeeded. Benchmarks never run on the
+ * regular test port.
+ */
+
+#define UNITTEST_EXT_PORT_SUFFIX ".ext"
+
+enum test_message_header {
+    TEST_PASSED = 0,
+    TEST_FAILED = 1,
+    TEST_MESSAGE = 2,
+    TEST_RESULT = 3,
+    TEST_MESSAGE_HEADER_COUNT = 4,
+};
+
+enum unittest_run_flags {
+    UNITTEST_RUN_BENCHMARKS = 1U << 0,
+};
+
+/**
+ * struct unittest_run_req - test selection sent on the extended port
+ * @flags:       &enum unittest_run_flags of the run
+ * @shard_index: index of the shard to run, less than @shard_count
+ * @shard_count: number of shards the selected tests are split into, 0 or 1 to
+ *               run all selected tests
+ * @filter:      gtest style filter: ':' separated list of positive patterns,
+ *               optionally followed by '-' and a list of negative patterns.
+ *               '*' and '?' are wildcards. The filter extends to the end of
+ *               the message and is not null-terminated. An empty filter
+ *               selects all tests.
+ */
+struct unittest_run_req {
+    uint32_t flags;
+    uint32_t shard_index;
+    uint32_t shard_count;
+    char filter[];
+};
+
+/**
+ * struct unittest_test_result - payload of a TEST_RESULT message
+ * @duration_ns: run time of the test
+ * @passed:      1 if the test passed, 0 otherwise
+ * @name:        full name of the test, extends to the end of the message and
+ *               is not null-terminated
+ */
+struct unittest_test_result {
+    uint64_t duration_ns;
+    uint32_t passed;
+    char name[];
+};
+
 struct unittest {
     const char* port_name;
     bool (*run_test)(struct unittest* test);
     handle_t _port_handle;
+    handle_t _ext_port_handle;
 };
 
 int unittest_main(struct unittest** tests, size_t test_count);
 
+/**
+ * unittest_flush_log() - send buffered log output to the test client
+ *
+ * Log lines are buffered and sent in batches. This is done automatically
+ * when the buffer fills up and when a test run completes, but tests that want
+ * their output to reach the client before a potential crash can flush it
+ * explicitly.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+int unittest_flush_log(void);
+
+/**
+ * unittest_should_run() - check whether a test is selected by the client
+ * @name: full name of the test, e.g. "suite.test"
+ *
+ * Test frameworks must call this once for every test, in a deterministic
+ * order, so that shards of the same suite select disjoint sets of tests.
+ * The TEST macros from trusty_unittest.h do so when a test is started.
+ * Suites whose framework does not call this always run all tests, and the
+ * client is told so.
+ *
+ * Return: true if the test matches the filter of the current run and belongs
+ * to the requested shard, or if the client did not select any tests.
+ */
+bool unittest_should_run(const char* name);
+
+/**
+ * unittest_report_result() - report the result of a single test
+ * @name:        full name of the test
+ * @passed:      whether the test passed
+ * @duration_ns: run time of the test
+ *
+ * Results are only sent to clients using the extended protocol. Tests using
+ * the TEST macros from trusty_unittest.h report their results automatically.
+ */
+void unittest_report_result(const char* name,
+                            bool passed,
+                            uint64_t duration_ns);
+
 __END_CDECLS
@@ -18,7 +18,8 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS := \
-	$(LOCAL_DIR)/unittest.c
+	$(LOCAL_DIR)/benchmark.c \
+	$(LOCAL_DIR)/unittest.c \
 
 MODULE_EXPORT_INCLUDES += $(LOCAL_DIR)/include/
 
@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TLOG_TAG "unittest-test"
+
+#include <lib/tipc/tipc.h>
+#include <lib/unittest/unittest.h>
+#include <lk/macros.h>
+#include <stdint.h>
+#include <string.h>
+#include <trusty_ipc.h>
+#include <trusty_unittest.h>
+#include <uapi/err.h>
+
+#include <unittest_test_consts.h>
+
+#define SUITE_EXT_PORT UNITTEST_TEST_SUITE_PORT UNITTEST_EXT_PORT_SUFFIX
+
+/* Enabled tests of suite/suite.c, in definition order */
+static const char* suite_tests[] = {
+        "suite.test0", "suite.test1",   "suite.test2",
+        "suite.test3", "fixture.test0", "fixture.test1",
+};
+
+#define ALL_SUITE_TESTS ((1U << countof(suite_tests)) - 1)
+
+static uint8_t msg_buf[4096];
+
+static int suite_test_index(const char* name, size_t len) {
+    for (size_t i = 0; i < countof(suite_tests); i++) {
+        if (strlen(suite_tests[i]) == len &&
+            !memcmp(suite_tests[i], name, len)) {
+            return i;
+        }
+    }
+    return ERR_NOT_FOUND;
+}
+
+/*
+ * Run the tests of the suite selected by @filter, @shard_index and
+ * @shard_count and return the tests that passed as a bitmask of indices into
+ * suite_tests in @passed.
+ */
+static int run_suite_flags(uint32_t flags,
+                           const char* filter,
+                           uint32_t shard_index,
+                           uint32_t shard_count,
+                           uint32_t* passed) {
+    int ret;
+    int index;
+    handle_t chan;
+    struct uevent evt;
+    struct unittest_test_result result;
+    struct unittest_run_req req = {
+            .flags = flags,
+            .shard_index = shard_index,
+            .shard_count = shard_count,
+    };
+
+    *passed = 0;
+    ret = tipc_connect(&chan, SUITE_EXT_PORT);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = tipc_send2(chan, &req, sizeof(req), filter, strlen(filter));
+    if (ret < 0) {
+        goto err;
+    }
+
+    for (;;) {
+        ret = wait(chan, &evt, INFINITE_TIME);
+        if (ret < 0) {
+            goto err;
+        }
+        if (!(evt.event & IPC_HANDLE_POLL_MSG)) {
+            ret = ERR_CHANNEL_CLOSED;
+            goto err;
+        }
+
+        ret = tipc_recv1(chan, 1, msg_buf, sizeof(msg_buf));
+        if (ret < 0) {
+            goto err;
+        }
+
+        switch (msg_buf[0]) {
+        case TEST_PASSED:
+            ret = 0;
+            goto err;
+        case TEST_FAILED:
+            ret = ERR_GENERIC;
+            goto err;
+        case TEST_RESULT:
+            if ((size_t)ret < 1 + sizeof(result)) {
+                ret = ERR_BAD_LEN;
+                goto err;
+            }
+            memcpy(&result, msg_buf + 1, sizeof(result));
+            index = suite_test_index((char*)msg_buf + 1 + sizeof(result),
+                                     ret - 1 - sizeof(result));
+            if (index < 0 || !result.passed || (*passed & (1U << index))) {
+                ret = ERR_INVALID_ARGS;
+                goto err;
+            }
+            *passed |= 1U << index;
+            break;
+        default:
+            break;
+        }
+    }
+
+err:
+    close(chan);
+    return ret;
+}
+
+static int run_suite(const char* filter,
+                     uint32_t shard_index,
+                     uint32_t shard_count,
+                     uint32_t* passed) {
+    return run_suite_flags(0, filter, shard_index, shard_count, passed);
+}
+
+TEST(unittest, RunAll) {
+    uint32_t passed;
+
+    ASSERT_EQ(run_suite("", 0, 0, &passed), 0);
+    EXPECT_EQ(passed, ALL_SUITE_TESTS);
+
+test_abort:;
+}
+
+TEST(unittest, ShardsAreDisjointAndComplete) {
+    uint32_t passed;
+    uint32_t all;
+
+    for (uint32_t count = 2; count <= countof(suite_tests); count++) {
+        all = 0;
+        for (uint32_t index = 0; index < count; index++) {
+            ASSERT_EQ(run_suite("", index, count, &passed), 0,
+                      "shard %u/%u", index, count);
+            EXPECT_NE(passed, 0, "shard %u/%u", index, count);
+            EXPECT_EQ(all & passed, 0, "shard %u/%u", index, count);
+            all |= passed;
+        }
+        EXPECT_EQ(all, ALL_SUITE_TESTS, "%u shards", count);
+    }
+
+test_abort:;
+}
+
+TEST(unittest, Filter) {
+    uint32_t passed;
+
+    ASSERT_EQ(run_suite("suite.test1:fixture.*", 0, 0, &passed), 0);
+    EXPECT_EQ(passed, (1U << 1) | (1U << 4) | (1U << 5));
+
+    ASSERT_EQ(run_suite("*-suite.*", 0, 0, &passed), 0);
+    EXPECT_EQ(passed, (1U << 4) | (1U << 5));
+
+test_abort:;
+}
+
+TEST(unittest, FilterAndShard) {
+    uint32_t passed;
+    uint32_t all = 0;
+
+    for (uint32_t index = 0; index < 2; index++) {
+        ASSERT_EQ(run_suite("suite.*", index, 2, &passed), 0);
+        EXPECT_EQ(passed, index ? 0xaU : 0x5U);
+        all |= passed;
+    }
+    EXPECT_EQ(all, 0xfU);
+
+test_abort:;
+}
+
+/* The suite has a failing benchmark, which only runs when asked for */
+TEST(unittest, BenchmarksAreOptIn) {
+    uint32_t passed;
+
+    EXPECT_EQ(run_suite_flags(UNITTEST_RUN_BENCHMARKS, "", 0, 0, &passed),
+              ERR_GENERIC);
+    EXPECT_EQ(passed, 0);
+
+    EXPECT_EQ(run_suite_flags(UNITTEST_RUN_BENCHMARKS, "-suite.fails", 0, 0,
+                              &passed),
+              0);
+    EXPECT_EQ(passed, 0);
+}
+
+PORT_TEST(unittest, "com.android.trusty.unittest.test");
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Suite run by the unittest test app to check test selection of suites using
+ * the TEST macros. The test names must match the list in ../main.c. Its only
+ * benchmark fails, to check that it does not run with the tests.
+ */
+
+#define TLOG_TAG "unittest-test-suite"
+
+#include <lib/unittest/unittest.h>
+#include <trusty_unittest.h>
+#include <uapi/err.h>
+
+#include <unittest_test_consts.h>
+
+TEST(suite, test0) {
+    EXPECT_EQ(0, 0);
+}
+
+TEST(suite, test1) {
+    EXPECT_EQ(1, 1);
+}
+
+TEST(suite, test2) {
+    EXPECT_EQ(2, 2);
+}
+
+TEST(suite, test3) {
+    EXPECT_EQ(3, 3);
+}
+
+TEST(suite, DISABLED_test4) {
+    EXPECT_EQ(4, 0);
+}
+
+typedef struct fixture {
+    int value;
+} fixture_t;
+
+TEST_F_SETUP(fixture) {
+    _state->value = 1;
+}
+
+TEST_F_TEARDOWN(fixture) {}
+
+TEST_F(fixture, test0) {
+    EXPECT_EQ(_state->value, 1);
+}
+
+TEST_F(fixture, test1) {
+    EXPECT_EQ(_state->value, 1);
+}
+
+BENCH_SETUP(suite) {
+    return NO_ERROR;
+}
+
+BENCH_TEARDOWN(suite) {}
+
+BENCH(suite, fails, 1) {
+    return ERR_GENERIC;
+}
+
+PORT_TEST(suite, UNITTEST_TEST_SUITE_PORT);
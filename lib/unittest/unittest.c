@@ -22,7 +22,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <trusty/time.h>
 #include <trusty_ipc.h>
 #include <uapi/err.h>
 
@@ -31,6 +30,11 @@
 #include <lk/trace.h>
 
 #define MAX_PORT_BUF_SIZE 4096 /* max size of per port buffer    */
+#define MAX_SEND_MSG_SIZE 256  /* max size of a message to clients */
+#define MAX_PORT_NAME_SIZE 64  /* max size of a port name         */
+
+/* time to wait for the test selection on the extended port */
+#define RUN_REQ_TIMEOUT_MSECS 5000
 
 /*
  * We can't use the normal TLOG functions because they send data through the
@@ -73,20 +77,172 @@ static int send_msg_wait(handle_t handle, struct ipc_msg* msg) {
     return ret;
 }
 
-enum test_message_header {
-    TEST_PASSED = 0,
-    TEST_FAILED = 1,
-    TEST_MESSAGE = 2,
-    TEST_MESSAGE_HEADER_COUNT = 3,
-};
+/*
+ * Log output sent over IPC is accumulated here and sent as a single
+ * TEST_MESSAGE once the buffer is full, when the test run completes or when
+ * unittest_flush_log() is called. Host test runners read messages into
+ * MAX_SEND_MSG_SIZE byte buffers, so a TEST_MESSAGE must not be any larger.
+ */
+static char log_buf[MAX_SEND_MSG_SIZE - 1];
+static size_t log_len;
+
+/*
+ * Test selection of the current run on the extended port. run_req is NULL for
+ * runs started on the regular test port.
+ */
+static struct unittest_run_req* run_req;
+static size_t run_req_filter_len;
+static size_t run_selected_count;
+static bool run_selection_used;
+
+static int send_test_message(const char* data, size_t len) {
+    uint8_t header = TEST_MESSAGE;
+    struct iovec tx_iov[2] = {
+            {&header, sizeof(header)},
+            {(void*)data, len},
+    };
+    ipc_msg_t tx_msg = {countof(tx_iov), tx_iov, 0, NULL};
+
+    return send_msg_wait(ipc_printf_handle, &tx_msg);
+}
+
+int unittest_flush_log(void) {
+    int ret;
+
+    if (!log_len || ipc_printf_handle == INVALID_IPC_HANDLE) {
+        log_len = 0;
+        return 0;
+    }
+
+    ret = send_test_message(log_buf, log_len);
+    log_len = 0;
+    return ret < 0 ? ret : 0;
+}
+
+/* Send a line that is too long for log_buf in multiple messages */
+static int send_long_line(const char* fmt, va_list ap, size_t len) {
+    int ret = 0;
+    char* line = malloc(len + 1);
+
+    if (!line) {
+        return ERR_NO_MEMORY;
+    }
+    vsnprintf(line, len + 1, fmt, ap);
+
+    for (size_t pos = 0; pos < len; pos += sizeof(log_buf)) {
+        ret = send_test_message(line + pos, MIN(len - pos, sizeof(log_buf)));
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    free(line);
+    return ret < 0 ? ret : 0;
+}
+
+static bool glob_match(const char* pattern, size_t len, const char* str) {
+    size_t p = 0;
+    size_t star = SIZE_MAX;
+    const char* star_str = NULL;
+
+    while (*str) {
+        if (p < len && (pattern[p] == '?' || pattern[p] == *str)) {
+            p++;
+            str++;
+        } else if (p < len && pattern[p] == '*') {
+            star = p++;
+            star_str = str;
+        } else if (star != SIZE_MAX) {
+            /* let the last '*' consume one more character */
+            p = star + 1;
+            str = ++star_str;
+        } else {
+            return false;
+        }
+    }
+    while (p < len && pattern[p] == '*') {
+        p++;
+    }
+    return p == len;
+}
+
+/* match @name against a ':' separated list of patterns */
+static bool pattern_list_match(const char* list, size_t len, const char* name) {
+    const char* end = list + len;
+    const char* sep;
+
+    for (;;) {
+        sep = memchr(list, ':', end - list);
+        if (glob_match(list, (sep ? sep : end) - list, name)) {
+            return true;
+        }
+        if (!sep) {
+            return false;
+        }
+        list = sep + 1;
+    }
+}
+
+static bool filter_match(const char* filter, size_t len, const char* name) {
+    const char* negative = memchr(filter, '-', len);
+    size_t positive_len = negative ? (size_t)(negative - filter) : len;
+
+    if (positive_len && !pattern_list_match(filter, positive_len, name)) {
+        return false;
+    }
+    if (negative && pattern_list_match(negative + 1,
+                                       filter + len - (negative + 1), name)) {
+        return false;
+    }
+    return true;
+}
+
+bool unittest_should_run(const char* name) {
+    size_t index;
+
+    if (!run_req) {
+        return true;
+    }
+    run_selection_used = true;
+
+    if (!filter_match(run_req->filter, run_req_filter_len, name)) {
+        return false;
+    }
+    index = run_selected_count++;
+    return run_req->shard_count <= 1 ||
+           index % run_req->shard_count == run_req->shard_index;
+}
+
+void unittest_report_result(const char* name,
+                            bool passed,
+                            uint64_t duration_ns) {
+    uint8_t header = TEST_RESULT;
+    struct unittest_test_result result = {
+            .duration_ns = duration_ns,
+            .passed = passed,
+    };
+    struct iovec tx_iov[3] = {
+            {&header, sizeof(header)},
+            {&result, sizeof(result)},
+            {(void*)name, strnlen(name, sizeof(log_buf) - sizeof(result))},
+    };
+    ipc_msg_t tx_msg = {countof(tx_iov), tx_iov, 0, NULL};
+
+    if (!run_req || ipc_printf_handle == INVALID_IPC_HANDLE) {
+        return;
+    }
+
+    /* keep the result ordered after the log output of the test */
+    if (unittest_flush_log() < 0) {
+        return;
+    }
+    send_msg_wait(ipc_printf_handle, &tx_msg);
+}
 
 int _tlog(const char* fmt, ...) {
-    char buf[256];
-    struct iovec tx_iov = {buf, 1};
-    ipc_msg_t tx_msg = {1, &tx_iov, 0, NULL};
     va_list ap;
     int ret;
-    int slen;
+    size_t len;
 
     /* Print to stderr as normal */
     va_start(ap, fmt);
@@ -102,22 +258,149 @@ int _tlog(const char* fmt, ...) {
     }
 
     va_start(ap, fmt);
-    ret = vsnprintf(buf + 1, sizeof(buf) - 1, fmt, ap);
+    ret = vsnprintf(log_buf + log_len, sizeof(log_buf) - log_len, fmt, ap);
     va_end(ap);
+    if (ret < 0) {
+        return ret;
+    }
+    len = ret;
+
+    /* Note that vsnprintf needs room for the terminating '\0' */
+    if (len < sizeof(log_buf) - log_len) {
+        log_len += len;
+        return ret;
+    }
+
+    ret = unittest_flush_log();
+    if (ret < 0) {
+        return ret;
+    }
+
+    va_start(ap, fmt);
+    if (len < sizeof(log_buf)) {
+        vsnprintf(log_buf, sizeof(log_buf), fmt, ap);
+        log_len = len;
+    } else {
+        ret = send_long_line(fmt, ap, len);
+    }
+    va_end(ap);
+
+    return ret < 0 ? ret : (int)len;
+}
+
+/*
+ * Receive the test selection a client sends after connecting to the extended
+ * port.
+ */
+static int read_run_req(handle_t chan) {
+    /* aligned so the buffer can be accessed as a struct unittest_run_req */
+    static uint8_t req_buf[MAX_PORT_BUF_SIZE] __attribute__((aligned(8)));
+    struct iovec rx_iov = {req_buf, sizeof(req_buf)};
+    ipc_msg_t rx_msg = {1, &rx_iov, 0, NULL};
+    struct unittest_run_req* req = (struct unittest_run_req*)req_buf;
+    ipc_msg_info_t msg_info;
+    uevent_t evt;
+    int ret;
 
+    ret = wait(chan, &evt, RUN_REQ_TIMEOUT_MSECS);
     if (ret < 0) {
         return ret;
     }
-    slen = MIN(ret, (int)sizeof(buf) - 1 - 1);
+    if (!(evt.event & IPC_HANDLE_POLL_MSG)) {
+        return ERR_CHANNEL_CLOSED;
+    }
 
-    buf[0] = TEST_MESSAGE;
-    tx_iov.iov_len = 1 + ret;
-    ret = send_msg_wait(ipc_printf_handle, &tx_msg);
+    ret = get_msg(chan, &msg_info);
     if (ret < 0) {
         return ret;
     }
+    if (msg_info.len < sizeof(*req) || msg_info.len > sizeof(req_buf)) {
+        ret = ERR_BAD_LEN;
+        goto err_put_msg;
+    }
+    ret = read_msg(chan, msg_info.id, 0, &rx_msg);
+    if (ret < 0) {
+        goto err_put_msg;
+    }
+    put_msg(chan, msg_info.id);
+
+    if (req->shard_count > 1 && req->shard_index >= req->shard_count) {
+        return ERR_INVALID_ARGS;
+    }
+
+    run_req = req;
+    run_req_filter_len = msg_info.len - sizeof(*req);
+    run_selected_count = 0;
+    run_selection_used = false;
+    return 0;
+
+err_put_msg:
+    put_msg(chan, msg_info.id);
+    return ret;
+}
+
+static void run_test(struct unittest* test, handle_t chan, bool ext) {
+    int ret;
+    bool passed;
+    char tx_buffer[1];
+    struct iovec tx_iov = {
+            tx_buffer,
+            sizeof(tx_buffer),
+    };
+    ipc_msg_t tx_msg = {1, &tx_iov, 0, NULL};
+
+    if (ext) {
+        ret = read_run_req(chan);
+        if (ret < 0) {
+            TLOGI("failed to read test selection: %d\n", ret);
+            return;
+        }
+    }
+
+    /* then run unittest test, or its benchmarks if the client asked for them */
+    ipc_printf_handle = chan;
+    if (run_req && (run_req->flags & UNITTEST_RUN_BENCHMARKS)) {
+        passed = unittest_run_benchmarks();
+    } else {
+        passed = test->run_test(test);
+    }
+    tx_buffer[0] = passed ? TEST_PASSED : TEST_FAILED;
+    if (run_req && (run_req_filter_len || run_req->shard_count > 1) &&
+        !run_selection_used) {
+        _tlog("%s: test selection is not supported, ran all tests\n",
+              test->port_name);
+    }
+    unittest_flush_log();
+    ipc_printf_handle = INVALID_IPC_HANDLE;
+    run_req = NULL;
+
+    send_msg_wait(chan, &tx_msg);
+}
+
+static int add_port(handle_t hset,
+                    struct unittest* test,
+                    const char* port_name,
+                    handle_t* port_handle) {
+    int ret;
+    uevent_t evt = {
+            .event = ~0U,
+            .cookie = test,
+    };
 
-    return slen;
+    ret = port_create(port_name, 1, MAX_PORT_BUF_SIZE,
+                      IPC_PORT_ALLOW_NS_CONNECT | IPC_PORT_ALLOW_TA_CONNECT);
+    if (ret < 0) {
+        TLOGI("failed to create port %s: %d\n", port_name, ret);
+        return ret;
+    }
+    *port_handle = (handle_t)ret;
+    evt.handle = *port_handle;
+    ret = handle_set_ctrl(hset, HSET_ADD, &evt);
+    if (ret < 0) {
+        TLOGI("failed to add %s to handle set: %d\n", port_name, ret);
+        return ret;
+    }
+    return 0;
 }
 
 /*
@@ -126,11 +409,10 @@ int _tlog(const char* fmt, ...) {
 int unittest_main(struct unittest** tests, size_t test_count) {
     int ret;
     handle_t hset;
-    uevent_t evt = {
-            .event = ~0U,
-    };
+    uevent_t evt;
     struct unittest* test;
     uuid_t unused_uuid;
+    char ext_port_name[MAX_PORT_NAME_SIZE];
 
     ret = handle_set_create();
     if (ret < 0) {
@@ -139,21 +421,22 @@ int unittest_main(struct unittest** tests, size_t test_count) {
     }
     hset = ret;
 
-    /* create control port and just wait on it */
+    /* create control ports and just wait on them */
     for (; test_count; test_count--) {
         test = *tests++;
-        ret = port_create(test->port_name, 1, MAX_PORT_BUF_SIZE,
-                          IPC_PORT_ALLOW_NS_CONNECT | IPC_PORT_ALLOW_TA_CONNECT);
+        ret = add_port(hset, test, test->port_name, &test->_port_handle);
         if (ret < 0) {
-            TLOGI("failed to create port %s: %d\n", test->port_name, ret);
             return ret;
         }
-        test->_port_handle = (handle_t)ret;
-        evt.handle = test->_port_handle;
-        evt.cookie = test;
-        ret = handle_set_ctrl(hset, HSET_ADD, &evt);
+
+        ret = snprintf(ext_port_name, sizeof(ext_port_name), "%s%s",
+                       test->port_name, UNITTEST_EXT_PORT_SUFFIX);
+        if (ret < 0 || (size_t)ret >= sizeof(ext_port_name)) {
+            TLOGI("port name %s is too long\n", test->port_name);
+            return ERR_TOO_BIG;
+        }
+        ret = add_port(hset, test, ext_port_name, &test->_ext_port_handle);
         if (ret < 0) {
-            TLOGI("failed to add %s to handle set: %d\n", test->port_name, ret);
             return ret;
         }
     }
@@ -171,19 +454,7 @@ int unittest_main(struct unittest** tests, size_t test_count) {
             ret = accept(evt.handle, &unused_uuid);
             TLOGI("accept returned %d\n", ret);
             if (ret >= 0) {
-                char tx_buffer[1];
-                struct iovec tx_iov = {
-                        tx_buffer,
-                        sizeof(tx_buffer),
-                };
-                ipc_msg_t tx_msg = {1, &tx_iov, 0, NULL};
-
-                /* then run unittest test */
-                ipc_printf_handle = ret;
-                tx_buffer[0] = test->run_test(test) ? TEST_PASSED : TEST_FAILED;
-                ipc_printf_handle = INVALID_IPC_HANDLE;
-
-                send_msg_wait(ret, &tx_msg);
+                run_test(test, ret, evt.handle == test->_ext_port_handle);
 
                 /* and close it */
                 close(ret);
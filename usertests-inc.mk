@@ -23,16 +23,22 @@ TRUSTY_USER_TESTS += \
 	trusty/user/base/app/crash-test \
 	trusty/user/base/app/crash-test/crasher \
 	trusty/user/base/app/metrics/test/crasher \
+	trusty/user/base/app/metrics/test/storage-report \
 	trusty/user/base/app/hwaes-unittest \
+	trusty/user/base/app/storage-bench \
+	trusty/user/base/app/storage-bench/fake-server \
 	trusty/user/base/lib/hwbcc/test \
 	trusty/user/base/lib/keymaster/test \
 	trusty/user/base/lib/libc-trusty/test \
 	trusty/user/base/lib/libstdc++-trusty/test \
 	trusty/user/base/lib/secure_fb/test \
 	trusty/user/base/lib/smc/tests \
+	trusty/user/base/lib/storage/test \
 	trusty/user/base/lib/tipc/test/main \
 	trusty/user/base/lib/tipc/test/srv \
 	trusty/user/base/lib/uirq/test \
+	trusty/user/base/lib/unittest/test \
+	trusty/user/base/lib/unittest/test/suite \
 
 ifeq (true,$(call TOBOOL,$(USER_COVERAGE_ENABLED)))
 TRUSTY_USER_TESTS += \